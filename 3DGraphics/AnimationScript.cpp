@@ -0,0 +1,133 @@
+#include "AnimationScript.h"
+#include "Transforms.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+
+// Index of the last key at or before time, or 0 before the first
+template <typename Key>
+static size_t findKey(const std::vector<Key>& keys, double time) {
+    auto after = std::upper_bound(keys.begin(), keys.end(), time, [](double t, const Key& key) { return t < key.time; });
+    return after == keys.begin() ? 0 : static_cast<size_t>(after - keys.begin()) - 1;
+}
+
+// How far time is from keys[index] towards the next key, 0 to 1
+template <typename Key>
+static float keyBlend(const std::vector<Key>& keys, size_t index, double time) {
+    if (index + 1 >= keys.size() || time <= keys[index].time)
+        return 0.0f;
+    double span = keys[index + 1].time - keys[index].time;
+    return span > 0.0 ? static_cast<float>(std::min(1.0, (time - keys[index].time) / span)) : 1.0f;
+}
+
+template <typename Key>
+static void sortKeys(std::vector<Key>& keys) {
+    std::stable_sort(keys.begin(), keys.end(), [](const Key& a, const Key& b) { return a.time < b.time; });
+}
+
+bool loadAnimationScript(const char* path, AnimationScript& script, std::string& error) {
+    std::ifstream file(path);
+    if (!file) {
+        error = std::string("cannot open ") + path;
+        return false;
+    }
+
+    script = AnimationScript();
+    bool hasFrameCount = false;
+    float lastTime = 0.0f;
+    std::string line;
+    size_t lineNumber = 0;
+    while (std::getline(file, line)) {
+        ++lineNumber;
+        line = line.substr(0, line.find('#'));
+        std::istringstream fields(line);
+        std::string statement;
+        if (!(fields >> statement))
+            continue;
+
+        bool valid;
+        if (statement == "fps") {
+            valid = (fields >> script.fps) && script.fps > 0.0f;
+        } else if (statement == "frames") {
+            valid = (fields >> script.frameCount) && script.frameCount > 0;
+            hasFrameCount = true;
+        } else if (statement == "camera") {
+            CameraKey key;
+            valid = (fields >> key.time >> key.distance >> key.angleX >> key.angleY) && key.time >= 0.0f;
+            if (valid) {
+                script.camera.push_back(key);
+                lastTime = std::max(lastTime, key.time);
+            }
+        } else if (statement == "instance") {
+            uint32_t instance;
+            InstanceKey key;
+            valid = (fields >> instance >> key.time >> key.position.x >> key.position.y >> key.position.z >> key.angleY >> key.scale) &&
+                    key.time >= 0.0f;
+            if (valid) {
+                auto track = std::find_if(script.tracks.begin(), script.tracks.end(), [&](const InstanceTrack& t) { return t.instance == instance; });
+                if (track == script.tracks.end())
+                    track = script.tracks.insert(script.tracks.end(), InstanceTrack{ instance, {} });
+                track->keys.push_back(key);
+                lastTime = std::max(lastTime, key.time);
+            }
+        } else {
+            error = "line " + std::to_string(lineNumber) + ": unknown statement " + statement;
+            return false;
+        }
+
+        std::string extra;
+        if (!valid || (fields >> extra)) {
+            error = "line " + std::to_string(lineNumber) + ": invalid " + statement;
+            return false;
+        }
+    }
+
+    sortKeys(script.camera);
+    for (InstanceTrack& track : script.tracks)
+        sortKeys(track.keys);
+    // Up to and including the frame at the last key
+    if (!hasFrameCount)
+        script.frameCount = static_cast<int>(std::floor(lastTime * script.fps + 1e-3f)) + 1;
+    return true;
+}
+
+CameraKey evaluateCamera(const AnimationScript& script, double time) {
+    const std::vector<CameraKey>& keys = script.camera;
+    size_t index = findKey(keys, time);
+    float blend = keyBlend(keys, index, time);
+    const CameraKey& a = keys[index];
+    const CameraKey& b = keys[std::min(index + 1, keys.size() - 1)];
+
+    CameraKey pose;
+    pose.time = static_cast<float>(time);
+    pose.distance = a.distance + (b.distance - a.distance) * blend;
+    pose.angleX = a.angleX + (b.angleX - a.angleX) * blend;
+    pose.angleY = a.angleY + (b.angleY - a.angleY) * blend;
+    return pose;
+}
+
+void applyInstanceTracks(const AnimationScript& script, double time, InstanceBuffer& instances) {
+    for (const InstanceTrack& track : script.tracks) {
+        if (track.instance >= instances.size())
+            continue;
+
+        size_t index = findKey(track.keys, time);
+        float blend = keyBlend(track.keys, index, time);
+        const InstanceKey& a = track.keys[index];
+        const InstanceKey& b = track.keys[std::min(index + 1, track.keys.size() - 1)];
+
+        glm::vec3 position = a.position + (b.position - a.position) * blend;
+        float angle = a.angleY + (b.angleY - a.angleY) * blend;
+        float scale = a.scale + (b.scale - a.scale) * blend;
+        glm::mat4 transform = rotateMatrix(translateMatrix(glm::mat4(1.0f), position), glm::radians(angle), glm::vec3(0.0f, 1.0f, 0.0f));
+        transform[0] *= scale;
+        transform[1] *= scale;
+        transform[2] *= scale;
+
+        // Unchanged instances stay out of the change list, so still ones cost no redraw
+        if (transform != instances.transforms[track.instance])
+            instances.set(track.instance, transform, instances.colors[track.instance]);
+    }
+}
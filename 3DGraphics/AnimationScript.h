@@ -0,0 +1,59 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "Instancing.h"
+
+// Camera pose in the app's terms: distance along the view axis and rotation
+// angles in degrees, as given to calculateViewMatrix
+struct CameraKey {
+    float time;
+    float distance;
+    float angleX;
+    float angleY;
+};
+
+// World transform of one instance: translation, turn about the vertical axis
+// in degrees and uniform scale
+struct InstanceKey {
+    float time;
+    glm::vec3 position;
+    float angleY;
+    float scale;
+};
+
+struct InstanceTrack {
+    uint32_t instance;
+    std::vector<InstanceKey> keys;    // sorted by time
+};
+
+// Keyframed camera and instance animation for batch rendering. Values are
+// interpolated linearly between keys and held before the first and after the
+// last one, so any frame can be evaluated on its own, in any order.
+struct AnimationScript {
+    float fps = 30.0f;
+    int frameCount = 0;
+    std::vector<CameraKey> camera;    // sorted by time, empty keeps the app's camera
+    std::vector<InstanceTrack> tracks;
+
+    double frameTime(int frame) const { return frame / static_cast<double>(fps); }
+};
+
+// Reads a script with one statement per line; '#' starts a comment:
+//
+//   fps 30                              frames per second of the sequence
+//   frames 240                          length, by default up to the last key
+//   camera T DISTANCE ANGLE_X ANGLE_Y   camera key at T seconds
+//   instance N T X Y Z ANGLE_Y SCALE    key of instance N at T seconds
+//
+// Keys may be listed in any order. On failure returns false and describes the
+// problem in error.
+bool loadAnimationScript(const char* path, AnimationScript& script, std::string& error);
+
+// Camera pose at time; the script needs at least one camera key
+CameraKey evaluateCamera(const AnimationScript& script, double time);
+// Moves every animated instance of instances to its place at time; tracks of
+// instances the buffer does not have are ignored
+void applyInstanceTracks(const AnimationScript& script, double time, InstanceBuffer& instances);
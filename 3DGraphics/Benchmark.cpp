@@ -0,0 +1,1112 @@
+// Microbenchmarks for the renderer's hot paths, built by CMakeLists.txt next to
+// this file. Kernels are timed one at a time on a single thread, whole frames
+// of synthetic scenes once per thread count, so the results show both
+// per-kernel regressions and how well frames scale across cores.
+//
+//   3DGraphicsBenchmark [--filter TEXT] [--threads 1,2,4] [--size WxH] [--min-time S] [--json FILE]
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "DeferredLighting.h"
+#include "Framebuffer.h"
+#include "Instancing.h"
+#include "Mesh.h"
+#include "MeshSimplify.h"
+#include "Rasterizer.h"
+#include "RayTracer.h"
+#include "SceneGraph.h"
+#include "ShaderKernels.h"
+#include "Shaders.h"
+#include "ThreadPool.h"
+#include "Transforms.h"
+#include "VertexStage.h"
+
+struct BenchmarkOptions {
+    std::string filter;
+    std::vector<unsigned> threads;
+    int width = 1920;
+    int height = 1080;
+    double minTime = 0.25;      // seconds measured per benchmark
+    const char* jsonPath = nullptr;
+};
+
+// One line of the report. Times are per operation: one call for kernels, one frame for scenes.
+struct BenchmarkResult {
+    std::string name;
+    unsigned threads = 1;
+    double itemsPerOperation = 1.0;
+    std::string itemName;       // what the items are: pixels, triangles, matrices
+    size_t samples = 0;
+    double medianNs = 0.0;
+    double minNs = 0.0;
+    // Against the same scene on one thread; zero for kernels
+    double speedup = 0.0;
+    double efficiency = 0.0;
+};
+
+// Results are folded into this so the compiler cannot drop the work
+volatile float benchmarkSink;
+
+bool selected(const BenchmarkOptions& options, const std::string& name) {
+    return name.find(options.filter) != std::string::npos;
+}
+
+// Runs operation(iterations) with a growing count until one sample takes a
+// tenth of the minimum time, then keeps sampling at that count until the
+// minimum time is used up. Reports the median and fastest sample per operation.
+BenchmarkResult measure(const std::string& name, double itemsPerOperation, const char* itemName, const BenchmarkOptions& options,
+                        const std::function<void(size_t)>& operation) {
+    typedef std::chrono::steady_clock Clock;
+    auto run = [&](size_t iterations) {
+        Clock::time_point start = Clock::now();
+        operation(iterations);
+        return std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+    };
+
+    size_t iterations = 1;
+    double sampleNs = run(iterations);
+    while (sampleNs < options.minTime * 1e8 && iterations < (size_t(1) << 40)) {
+        iterations *= sampleNs > 0.0 ? std::max<size_t>(2, std::min<size_t>(100, static_cast<size_t>(options.minTime * 1e8 / sampleNs))) : 100;
+        sampleNs = run(iterations);
+    }
+
+    std::vector<double> perOperation;
+    double totalNs = 0.0;
+    while (perOperation.size() < 5 || totalNs < options.minTime * 1e9) {
+        double ns = run(iterations);
+        perOperation.push_back(ns / iterations);
+        totalNs += ns;
+    }
+    std::sort(perOperation.begin(), perOperation.end());
+
+    BenchmarkResult result;
+    result.name = name;
+    result.itemsPerOperation = itemsPerOperation;
+    result.itemName = itemName;
+    result.samples = perOperation.size();
+    result.medianNs = perOperation[perOperation.size() / 2];
+    result.minNs = perOperation.front();
+    return result;
+}
+
+void printResult(const BenchmarkResult& result) {
+    std::ostringstream line;
+    line << std::left << std::setw(44) << result.name << std::right << std::setw(4) << result.threads
+         << std::fixed << std::setprecision(1);
+    if (result.medianNs >= 1e6)
+        line << std::setw(12) << result.medianNs / 1e6 << " ms ";
+    else
+        line << std::setw(12) << result.medianNs << " ns ";
+    double perSecond = result.itemsPerOperation / (result.medianNs * 1e-9);
+    const char* prefix = perSecond >= 1e6 ? "M" : (perSecond >= 1e3 ? "k" : "");
+    double scale = perSecond >= 1e6 ? 1e6 : (perSecond >= 1e3 ? 1e3 : 1.0);
+    line << std::setw(10) << std::setprecision(2) << perSecond / scale << " " << prefix << result.itemName << "/s";
+    if (result.speedup > 0.0)
+        line << "  speedup " << result.speedup << "x, efficiency " << std::setprecision(0) << result.efficiency * 100.0 << "%";
+    std::cout << line.str() << std::endl;
+}
+
+bool writeJson(const char* path, const std::vector<BenchmarkResult>& results, const BenchmarkOptions& options) {
+    std::ofstream out(path);
+    if (!out)
+        return false;
+
+    out << std::setprecision(6);
+    out << "{\n  \"instructionSet\": \"" << instructionSetName(detectInstructionSet()) << "\",\n"
+        << "  \"hardwareThreads\": " << std::thread::hardware_concurrency() << ",\n"
+        << "  \"width\": " << options.width << ",\n  \"height\": " << options.height << ",\n"
+        << "  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const BenchmarkResult& result = results[i];
+        out << "    {\"name\": \"" << result.name << "\", \"threads\": " << result.threads
+            << ", \"samples\": " << result.samples << ", \"medianNs\": " << result.medianNs << ", \"minNs\": " << result.minNs
+            << ", \"items\": \"" << result.itemName << "\", \"itemsPerOperation\": " << result.itemsPerOperation
+            << ", \"itemsPerSecond\": " << result.itemsPerOperation / (result.medianNs * 1e-9);
+        if (result.speedup > 0.0)
+            out << ", \"speedup\": " << result.speedup << ", \"efficiency\": " << result.efficiency;
+        out << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+    return static_cast<bool>(out);
+}
+
+// Kernels
+
+void benchmarkMath(const BenchmarkOptions& options, std::vector<BenchmarkResult>& results) {
+    const size_t COUNT = 1024;
+    std::mt19937 random(1);
+    std::uniform_real_distribution<float> value(-1.0f, 1.0f);
+    std::vector<glm::mat4> matrices(COUNT);
+    std::vector<glm::vec3> vectors(COUNT);
+    std::vector<glm::quat> quaternions(COUNT);
+    std::vector<float> angles(COUNT);
+    for (size_t i = 0; i < COUNT; ++i) {
+        for (int c = 0; c < 4; ++c)
+            matrices[i][c] = glm::vec4(value(random), value(random), value(random), value(random));
+        vectors[i] = glm::normalize(glm::vec3(value(random), value(random), value(random)) + glm::vec3(0.0f, 0.0f, 2.0f));
+        angles[i] = value(random) * 3.14159f;
+        quaternions[i] = axisAngleToQuaternion(angles[i], vectors[i]);
+    }
+    std::vector<glm::mat4> output(COUNT);
+
+    auto finish = [&]() {
+        float sum = 0.0f;
+        for (const glm::mat4& matrix : output)
+            sum += matrix[3][0] + matrix[0][1];
+        benchmarkSink = sum;
+    };
+
+    if (selected(options, "math/translateMatrix"))
+        results.push_back(measure("math/translateMatrix", 1.0, "matrices", options, [&](size_t iterations) {
+            for (size_t i = 0; i < iterations; ++i)
+                output[i % COUNT] = translateMatrix(matrices[i % COUNT], vectors[i % COUNT]);
+            finish();
+        }));
+    if (selected(options, "math/rotateMatrix"))
+        results.push_back(measure("math/rotateMatrix", 1.0, "matrices", options, [&](size_t iterations) {
+            for (size_t i = 0; i < iterations; ++i)
+                output[i % COUNT] = rotateMatrix(matrices[i % COUNT], angles[i % COUNT], vectors[i % COUNT]);
+            finish();
+        }));
+    if (selected(options, "math/quaternionToMatrix"))
+        results.push_back(measure("math/quaternionToMatrix", 1.0, "matrices", options, [&](size_t iterations) {
+            for (size_t i = 0; i < iterations; ++i)
+                output[i % COUNT] = quaternionToMatrix(quaternions[i % COUNT]);
+            finish();
+        }));
+
+    if (selected(options, "math/multiplyMatrices"))
+        results.push_back(measure("math/multiplyMatrices", 1.0, "matrices", options, [&](size_t iterations) {
+            for (size_t i = 0; i < iterations; ++i)
+                multiplyMatrices(matrices[i % COUNT], matrices[(i + 1) % COUNT], output[i % COUNT]);
+            finish();
+        }));
+    // The scene graph's batched translation * rotation * scale, over the whole array per call
+    if (selected(options, "math/composeTransforms")) {
+        std::vector<float> components[10];
+        for (std::vector<float>& component : components)
+            component.resize(COUNT);
+        for (size_t i = 0; i < COUNT; ++i) {
+            components[0][i] = vectors[i].x;
+            components[1][i] = vectors[i].y;
+            components[2][i] = vectors[i].z;
+            components[3][i] = quaternions[i].x;
+            components[4][i] = quaternions[i].y;
+            components[5][i] = quaternions[i].z;
+            components[6][i] = quaternions[i].w;
+            components[7][i] = components[8][i] = components[9][i] = 1.0f + 0.5f * value(random);
+        }
+        results.push_back(measure("math/composeTransforms", static_cast<double>(COUNT), "matrices", options, [&](size_t iterations) {
+            for (size_t i = 0; i < iterations; ++i)
+                composeTransforms(components[0].data(), components[1].data(), components[2].data(), components[3].data(), components[4].data(),
+                                  components[5].data(), components[6].data(), components[7].data(), components[8].data(), components[9].data(),
+                                  COUNT, output.data());
+            finish();
+        }));
+    }
+
+    // The vertex stage's position transform, over one cube field instance's worth of vertices at a time
+    if (selected(options, "math/transformPositions")) {
+        std::vector<glm::vec3> positions(COUNT);
+        for (glm::vec3& position : positions)
+            position = glm::vec3(value(random), value(random), value(random));
+        ClipSpaceVertices clip;
+        clip.resize(COUNT);
+        results.push_back(measure("math/transformPositions", static_cast<double>(COUNT), "vertices", options, [&](size_t iterations) {
+            for (size_t i = 0; i < iterations; ++i)
+                transformPositions(positions.data(), 0, COUNT, matrices[i % COUNT], clip);
+            benchmarkSink = clip.x[0] + clip.w[COUNT - 1];
+        }));
+    }
+}
+
+// Articulated hierarchy: ARM_COUNT arms of JOINT_COUNT joints, each joint a
+// child of the one before. Rotations come from a small table so the timings
+// show the hierarchy update and not sin and cos.
+void benchmarkSceneGraph(const BenchmarkOptions& options, std::vector<BenchmarkResult>& results) {
+    const int ARM_COUNT = 1024;
+    const int JOINT_COUNT = 32;
+    const int NODE_COUNT = ARM_COUNT * JOINT_COUNT;
+    const int POSE_COUNT = 64;
+
+    glm::quat poses[POSE_COUNT];
+    for (int i = 0; i < POSE_COUNT; ++i)
+        poses[i] = axisAngleToQuaternion(i * 0.01f, glm::normalize(glm::vec3(0.3f, 1.0f, 0.2f)));
+    const glm::vec3 jointOffset(0.0f, 0.5f, 0.0f);
+
+    SceneGraph graph;
+    std::vector<NodeId> joints;
+    joints.reserve(NODE_COUNT);
+    for (int arm = 0; arm < ARM_COUNT; ++arm) {
+        NodeId parent = NO_NODE;
+        for (int joint = 0; joint < JOINT_COUNT; ++joint) {
+            NodeTransform local;
+            local.translation = joint == 0 ? glm::vec3(static_cast<float>(arm % 32), 0.0f, static_cast<float>(arm / 32)) : jointOffset;
+            parent = graph.createNode(parent, local);
+            joints.push_back(parent);
+        }
+    }
+    graph.update();
+    auto finish = [&]() {
+        benchmarkSink = graph.getWorld(joints.back())[3][1];
+    };
+
+    // What the scene did before the graph: every matrix built from scratch
+    // with the scalar helpers and multiplied onto its parent's, every frame
+    if (selected(options, "scenegraph/rebuild-scalar")) {
+        std::vector<glm::mat4> world(NODE_COUNT);
+        results.push_back(measure("scenegraph/rebuild-scalar", NODE_COUNT, "nodes", options, [&](size_t iterations) {
+            for (size_t i = 0; i < iterations; ++i) {
+                for (int node = 0; node < NODE_COUNT; ++node) {
+                    int joint = node % JOINT_COUNT;
+                    glm::vec3 translation = joint == 0 ? glm::vec3(static_cast<float>(node / JOINT_COUNT % 32), 0.0f, 0.0f) : jointOffset;
+                    glm::mat4 local = translateMatrix(glm::mat4(1.0f), translation) * quaternionToMatrix(poses[(i + node) % POSE_COUNT]);
+                    world[node] = joint == 0 ? local : world[node - 1] * local;
+                }
+            }
+            benchmarkSink = world.back()[3][1];
+        }));
+    }
+    // Every joint moves
+    if (selected(options, "scenegraph/update-all"))
+        results.push_back(measure("scenegraph/update-all", NODE_COUNT, "nodes", options, [&](size_t iterations) {
+            for (size_t i = 0; i < iterations; ++i) {
+                for (int node = 0; node < NODE_COUNT; ++node)
+                    graph.setRotation(joints[node], poses[(i + node) % POSE_COUNT]);
+                graph.update();
+            }
+            finish();
+        }));
+    // The shoulder of one arm in 64 moves, taking its whole arm along
+    if (selected(options, "scenegraph/update-sparse"))
+        results.push_back(measure("scenegraph/update-sparse", NODE_COUNT, "nodes", options, [&](size_t iterations) {
+            for (size_t i = 0; i < iterations; ++i) {
+                for (int arm = 0; arm < ARM_COUNT; arm += 64)
+                    graph.setRotation(joints[arm * JOINT_COUNT], poses[(i + arm) % POSE_COUNT]);
+                graph.update();
+            }
+            finish();
+        }));
+    // Nothing moves
+    if (selected(options, "scenegraph/update-clean"))
+        results.push_back(measure("scenegraph/update-clean", NODE_COUNT, "nodes", options, [&](size_t iterations) {
+            for (size_t i = 0; i < iterations; ++i)
+                graph.update();
+            finish();
+        }));
+}
+
+// Triangle setup replaced the per-pixel barycentric and point-in-triangle
+// tests; it computes the edge equations and depth plane once per triangle
+void benchmarkSetup(const BenchmarkOptions& options, std::vector<BenchmarkResult>& results) {
+    const size_t COUNT = 4096;
+    std::mt19937 random(2);
+    std::uniform_real_distribution<float> position(-1.0f, 1.0f);
+    std::uniform_real_distribution<float> offset(-0.02f, 0.02f);
+
+    std::vector<RasterTriangle> flat(COUNT), shaded(COUNT);
+    for (size_t i = 0; i < COUNT; ++i) {
+        glm::vec3 center(position(random), position(random), position(random) * 0.5f + 0.5f);
+        flat[i].v0 = center + glm::vec3(offset(random), offset(random), 0.0f);
+        flat[i].v1 = center + glm::vec3(offset(random), offset(random), 0.01f);
+        flat[i].v2 = center + glm::vec3(offset(random), offset(random), -0.01f);
+        flat[i].color = 0xFFFFFFFFu;
+        shaded[i] = flat[i];
+        shaded[i].program = 1;
+    }
+
+    TriangleSetup setup;
+    auto run = [&](const std::vector<RasterTriangle>& triangles, size_t iterations) {
+        int drawn = 0;
+        for (size_t i = 0; i < iterations; ++i)
+            drawn += setupTriangle(triangles[i % COUNT], options.width, options.height, setup);
+        benchmarkSink = static_cast<float>(drawn) + setup.dzdx;
+    };
+
+    if (selected(options, "setup/flat"))
+        results.push_back(measure("setup/flat", 1.0, "triangles", options, [&](size_t iterations) { run(flat, iterations); }));
+    if (selected(options, "setup/shaded"))
+        results.push_back(measure("setup/shaded", 1.0, "triangles", options, [&](size_t iterations) { run(shaded, iterations); }));
+}
+
+// One DEPTH_TILE_SIZE region through every raster kernel this CPU runs and
+// through the shader pixel loops. Coverage, depth interpolation and the depth
+// test are what the old pointInTriangle, barycentric and interpolateDepth did per pixel.
+void benchmarkKernels(const BenchmarkOptions& options, std::vector<BenchmarkResult>& results) {
+    const int SIZE = DEPTH_TILE_SIZE;
+    const float FAR = std::numeric_limits<float>::infinity();
+    std::vector<uint32_t> pixels(renderTargetSize(SIZE, SIZE), 0);
+    std::vector<float> depth(renderTargetSize(SIZE, SIZE), FAR);
+    RenderTarget target = { pixels.data(), depth.data(), SIZE, SIZE };
+    // Only the region's rows, which lie a tile's width apart
+    auto fillDepth = [&](float value) {
+        for (int y = 0; y < SIZE; ++y)
+            std::fill_n(depth.data() + pixelIndex(target, 0, y), SIZE, value);
+    };
+    size_t lastPixel = pixelIndex(target, SIZE - 1, SIZE - 1);
+
+    // A triangle far larger than the region covers it fully, the diagonal one only half
+    RasterTriangle covering;
+    covering.v0 = glm::vec3(-1.0f, -1.0f, 0.5f);
+    covering.v1 = glm::vec3(10.0f, -1.0f, 0.4f);
+    covering.v2 = glm::vec3(-1.0f, 10.0f, 0.6f);
+    covering.color = 0xFF00FF00u;
+    RasterTriangle diagonal = covering;
+    diagonal.v1 = glm::vec3(1.0f, -1.0f, 0.4f);
+    diagonal.v2 = glm::vec3(-1.0f, 1.0f, 0.6f);
+
+    struct Case {
+        const char* name;
+        const RasterTriangle* triangle;
+        bool clearDepth;    // every pixel passes; the 64-float reset is part of the time
+    };
+    const Case cases[] = {
+        { "covered", &covering, true },
+        { "edge", &diagonal, true },
+        { "occluded", &covering, false },
+    };
+
+    InstructionSet supported = detectInstructionSet();
+    const InstructionSet instructionSets[] = { InstructionSet::Scalar, InstructionSet::SSE41, InstructionSet::AVX2 };
+    for (InstructionSet instructionSet : instructionSets) {
+        if (static_cast<int>(instructionSet) > static_cast<int>(supported))
+            continue;
+        RasterKernel kernel = getRasterKernel(instructionSet);
+
+        for (const Case& testCase : cases) {
+            std::string name = std::string("kernel/") + instructionSetName(instructionSet) + "/" + testCase.name;
+            if (!selected(options, name))
+                continue;
+
+            TriangleSetup setup;
+            setupTriangle(*testCase.triangle, SIZE, SIZE, setup);
+            RasterRegion region = makeRegion(setup, 0, 0, SIZE, SIZE);
+            // Occluded regions test against a depth buffer that is in front everywhere
+            fillDepth(testCase.clearDepth ? FAR : 0.0f);
+
+            results.push_back(measure(name, SIZE * SIZE, "pixels", options, [&](size_t iterations) {
+                for (size_t i = 0; i < iterations; ++i) {
+                    if (testCase.clearDepth)
+                        fillDepth(FAR);
+                    kernel(region, target);
+                }
+                benchmarkSink = static_cast<float>(pixels[lastPixel]);
+            }));
+        }
+    }
+
+    // Perspective-correct varyings and a fragment shader call per pixel
+    Texture texture = createCheckerTexture(256, 32);
+    GouraudShader gouraud;
+    TexturedShader textured = { &texture, 2.0f };
+    LitShader lit = { glm::normalize(glm::vec3(0.4f, 0.8f, 0.6f)), 0.25f };
+    auto shade = [&](const char* shaderName, const ShaderProgram& program, int vertexSize) {
+        std::string name = std::string("kernel/shade/") + shaderName;
+        if (!selected(options, name))
+            return;
+
+        RasterTriangle triangle = covering;
+        triangle.program = 1;
+        TriangleSetup setup;
+        setupTriangle(triangle, SIZE, SIZE, setup);
+        RasterRegion region = makeRegion(setup, 0, 0, SIZE, SIZE);
+
+        // 1/w, then varyings over w, for each of the three vertices
+        std::vector<float> vertexData(vertexSize * 3);
+        for (int v = 0; v < 3; ++v) {
+            vertexData[v * vertexSize] = 1.0f / (1.0f + v);
+            for (int n = 1; n < vertexSize; ++n)
+                vertexData[v * vertexSize + n] = (0.25f * n + 0.1f * v) * vertexData[v * vertexSize];
+        }
+
+        results.push_back(measure(name, SIZE * SIZE, "pixels", options, [&](size_t iterations) {
+            for (size_t i = 0; i < iterations; ++i) {
+                fillDepth(FAR);
+                program.kernel(region, setup, vertexData.data(), program.shader, target);
+            }
+            benchmarkSink = static_cast<float>(pixels[lastPixel]);
+        }));
+    };
+    shade("gouraud", makeShaderProgram(gouraud), ShaderTraits<GouraudShader>::VERTEX_SIZE);
+    shade("textured", makeShaderProgram(textured), ShaderTraits<TexturedShader>::VERTEX_SIZE);
+    shade("lit", makeShaderProgram(lit), ShaderTraits<LitShader>::VERTEX_SIZE);
+}
+
+// Scenes
+
+// Two triangles covering the screen at one depth
+void addQuad(std::vector<RasterTriangle>& triangles, float depth, uint32_t color) {
+    RasterTriangle triangle;
+    triangle.color = color;
+    triangle.v0 = glm::vec3(-1.0f, -1.0f, depth);
+    triangle.v1 = glm::vec3(1.0f, -1.0f, depth);
+    triangle.v2 = glm::vec3(1.0f, 1.0f, depth);
+    triangles.push_back(triangle);
+    triangle.v1 = glm::vec3(1.0f, 1.0f, depth);
+    triangle.v2 = glm::vec3(-1.0f, 1.0f, depth);
+    triangles.push_back(triangle);
+}
+
+// Triangles of about pixelSize x pixelSize pixels spread over the screen at random depths
+std::vector<RasterTriangle> createScatteredTriangles(size_t count, float pixelSize, const BenchmarkOptions& options, unsigned seed) {
+    std::mt19937 random(seed);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    float sizeX = 2.0f * pixelSize / options.width;
+    float sizeY = 2.0f * pixelSize / options.height;
+
+    std::vector<RasterTriangle> triangles(count);
+    for (RasterTriangle& triangle : triangles) {
+        glm::vec3 corner(unit(random) * 2.0f - 1.0f, unit(random) * 2.0f - 1.0f, unit(random));
+        triangle.v0 = corner;
+        triangle.v1 = corner + glm::vec3(sizeX * (0.5f + unit(random)), 0.0f, 0.0f);
+        triangle.v2 = corner + glm::vec3(0.0f, sizeY * (0.5f + unit(random)), 0.0f);
+        triangle.color = packColor(glm::vec3(unit(random), unit(random), unit(random)));
+    }
+    return triangles;
+}
+
+// Unit cube with one color per face, counter-clockwise seen from outside
+Mesh createCube() {
+    std::vector<float> vertices, colors;
+    for (int face = 0; face < 6; ++face) {
+        int axis = face / 2;
+        glm::vec3 normal(0.0f), u(0.0f), v(0.0f);
+        normal[axis] = face % 2 ? 0.5f : -0.5f;
+        u[(axis + 1) % 3] = 0.5f;
+        v[(axis + 2) % 3] = 0.5f;
+        if (face % 2 == 0)
+            std::swap(u, v);
+
+        glm::vec3 corners[4] = { normal - u - v, normal + u - v, normal + u + v, normal - u + v };
+        const int ORDER[6] = { 0, 1, 2, 0, 2, 3 };
+        glm::vec3 color(face & 1 ? 1.0f : 0.3f, face & 2 ? 1.0f : 0.3f, face & 4 ? 1.0f : 0.3f);
+        for (int corner : ORDER) {
+            for (int c = 0; c < 3; ++c) {
+                vertices.push_back(corners[corner][c]);
+                colors.push_back(color[c]);
+            }
+        }
+    }
+    return createIndexedMesh(vertices.data(), colors.data(), static_cast<int>(vertices.size() / 3));
+}
+
+// Unit sphere of rings x segments quads, with one vertex at each pole and the
+// seam's vertices shared, so that simplification can remove any of them.
+// Colored by position.
+Mesh createSphere(int segments, int rings) {
+    const float PI = 3.14159265358979f;
+    auto point = [&](int ring, int segment) {
+        if (ring == 0 || ring == rings)
+            return glm::vec3(0.0f, ring == 0 ? 0.5f : -0.5f, 0.0f);
+        float polar = PI * ring / rings;
+        float azimuth = 2.0f * PI * (segment % segments) / segments;
+        return 0.5f * glm::vec3(std::sin(polar) * std::cos(azimuth), std::cos(polar), std::sin(polar) * std::sin(azimuth));
+    };
+
+    std::vector<float> vertices, colors;
+    auto addTriangle = [&](glm::vec3 a, glm::vec3 b, glm::vec3 c) {
+        for (const glm::vec3& corner : { a, b, c }) {
+            for (int i = 0; i < 3; ++i) {
+                vertices.push_back(corner[i]);
+                colors.push_back(corner[i] + 0.5f);
+            }
+        }
+    };
+    for (int ring = 0; ring < rings; ++ring) {
+        for (int segment = 0; segment < segments; ++segment) {
+            glm::vec3 a = point(ring, segment), b = point(ring, segment + 1);
+            glm::vec3 c = point(ring + 1, segment), d = point(ring + 1, segment + 1);
+            if (ring > 0)
+                addTriangle(a, b, c);
+            if (ring < rings - 1)
+                addTriangle(b, d, c);
+        }
+    }
+    return createIndexedMesh(vertices.data(), colors.data(), static_cast<int>(vertices.size() / 3));
+}
+
+// Screen-sized quad facing the camera, for drawing layers through the vertex stage
+Mesh createLayerQuad() {
+    float vertices[] = { -1.0f, -1.0f, 0.0f, -1.0f, 1.0f, 0.0f, 1.0f, 1.0f, 0.0f,
+                         -1.0f, -1.0f, 0.0f, 1.0f, 1.0f, 0.0f, 1.0f, -1.0f, 0.0f };
+    float colors[18];
+    std::fill(colors, colors + 18, 0.8f);
+    return createIndexedMesh(vertices, colors, 6);
+}
+
+// Forward shading with point lights: every fragment loops over every light,
+// including the fragments later layers draw over again
+struct ForwardPointLightShader {
+    const std::vector<PointLight>* lights;
+
+    struct Varyings {
+        glm::vec3 position;
+        glm::vec3 normal;
+        glm::vec3 color;
+    };
+
+    Varyings vertex(const MeshView& mesh, uint32_t index, const ShaderInstance& instance) const {
+        Varyings out;
+        out.position = glm::vec3(instance.model * glm::vec4(mesh.positions[index], 1.0f));
+        out.normal = glm::vec3(instance.model * glm::vec4(mesh.normals[index], 0.0f));
+        out.color = mesh.colors[index] * instance.tint;
+        return out;
+    }
+
+    glm::vec3 fragment(const Varyings& in) const {
+        glm::vec3 normal = glm::normalize(in.normal);
+        glm::vec3 color = in.color * 0.1f;
+        for (const PointLight& light : *lights) {
+            glm::vec3 toLight = light.position - in.position;
+            float distanceSquared = glm::dot(toLight, toLight);
+            float radiusSquared = light.radius * light.radius;
+            if (distanceSquared >= radiusSquared)
+                continue;
+            float diffuse = glm::dot(normal, toLight / std::sqrt(distanceSquared));
+            if (diffuse <= 0.0f)
+                continue;
+            float falloff = 1.0f - distanceSquared / radiusSquared;
+            color += light.color * in.color * diffuse * falloff * falloff;
+        }
+        return color;
+    }
+};
+
+// The app's cube field and camera: 320 x 320 small cubes seen from low above
+void createCubeField(InstanceBuffer& instances, glm::mat4& viewProjection, const BenchmarkOptions& options) {
+    const int COUNT = 320;
+    const float SPACING = 0.3f;
+    for (int z = 0; z < COUNT; ++z) {
+        for (int x = 0; x < COUNT; ++x) {
+            glm::mat4 model = translateMatrix(glm::mat4(1.0f), glm::vec3((x - COUNT * 0.5f) * SPACING, -1.0f, (z - COUNT * 0.5f) * SPACING));
+            model[0] *= 0.1f;
+            model[1] *= 0.1f;
+            model[2] *= 0.1f;
+            instances.add(model, glm::vec3(static_cast<float>(x) / COUNT, 0.5f, static_cast<float>(z) / COUNT));
+        }
+    }
+
+    float aspectRatio = static_cast<float>(options.width) / options.height;
+    viewProjection = calculateProjectionMatrix(aspectRatio, glm::radians(45.0f), 0.1f, 100.0f) * calculateViewMatrix(-5.0f, -25.0f, 30.0f);
+}
+
+// 96 x 96 detailed spheres under the cube field's camera, most of them a few
+// pixels across
+void createSphereField(InstanceBuffer& instances, glm::mat4& viewProjection, float& pixelScale, const BenchmarkOptions& options) {
+    const int COUNT = 96;
+    const float SPACING = 0.9f;
+    for (int z = 0; z < COUNT; ++z) {
+        for (int x = 0; x < COUNT; ++x) {
+            glm::mat4 model = translateMatrix(glm::mat4(1.0f), glm::vec3((x - COUNT * 0.5f) * SPACING, -1.0f, (z - COUNT * 0.5f) * SPACING));
+            model[0] *= 0.3f;
+            model[1] *= 0.3f;
+            model[2] *= 0.3f;
+            instances.add(model);
+        }
+    }
+
+    float aspectRatio = static_cast<float>(options.width) / options.height;
+    glm::mat4 projection = calculateProjectionMatrix(aspectRatio, glm::radians(45.0f), 0.1f, 100.0f);
+    viewProjection = projection * calculateViewMatrix(-5.0f, -25.0f, 30.0f);
+    pixelScale = lodPixelScale(projection, options.height);
+}
+
+// Camera rays through both fields on one thread with each packet kernel the
+// CPU supports, i.e. rays per second per core
+void benchmarkRays(const BenchmarkOptions& options, std::vector<BenchmarkResult>& results) {
+    const char* SCENES[] = { "cube-field", "sphere-field" };
+    InstructionSet supported = detectInstructionSet();
+    const InstructionSet instructionSets[] = { InstructionSet::Scalar, InstructionSet::SSE41, InstructionSet::AVX2 };
+    for (int scene = 0; scene < 2; ++scene) {
+        std::vector<std::string> names;
+        for (InstructionSet instructionSet : instructionSets)
+            if (static_cast<int>(instructionSet) <= static_cast<int>(supported))
+                names.push_back(std::string("ray/") + instructionSetName(instructionSet) + "/" + SCENES[scene]);
+        bool wanted = false;
+        for (const std::string& name : names)
+            wanted = wanted || selected(options, name);
+        if (!wanted)
+            continue;
+
+        Mesh mesh;
+        InstanceBuffer instances;
+        glm::mat4 viewProjection;
+        float pixelScale;
+        if (scene == 0) {
+            mesh = createCube();
+            createCubeField(instances, viewProjection, options);
+        } else {
+            mesh = createSphere(64, 32);
+            createSphereField(instances, viewProjection, pixelScale, options);
+        }
+
+        ThreadPool pool(1);
+        Rasterizer rasterizer(pool);
+        RayTracer tracer(pool);
+        Framebuffer framebuffer;
+        framebuffer.resize(options.width, options.height);
+        tracer.update(MeshView(mesh), instances);
+        for (size_t i = 0; i < names.size(); ++i) {
+            if (!selected(options, names[i]))
+                continue;
+            tracer.setInstructionSet(instructionSets[i]);
+            results.push_back(measure(names[i], static_cast<double>(options.width) * options.height, "rays", options, [&](size_t iterations) {
+                for (size_t iteration = 0; iteration < iterations; ++iteration) {
+                    rasterizer.beginFrame(framebuffer.getRenderTarget());
+                    rasterizer.endFrame();
+                    tracer.render(rasterizer, viewProjection);
+                }
+                benchmarkSink = static_cast<float>(framebuffer.getPixels()[0]);
+            }));
+        }
+    }
+}
+
+// Every scene is drawn as whole frames, once per thread count, each on a fresh pool
+void benchmarkScenes(const BenchmarkOptions& options, std::vector<BenchmarkResult>& results) {
+    struct TriangleScene {
+        const char* name;
+        std::vector<RasterTriangle> triangles;
+    };
+    std::vector<TriangleScene> scenes;
+    auto wanted = [&](const char* name) { return selected(options, std::string("frame/") + name); };
+
+    // Millions of triangles smaller than a pixel, where setup and binning dominate
+    if (wanted("tiny"))
+        scenes.push_back({ "tiny", createScatteredTriangles(size_t(1) << 21, 1.0f, options, 3) });
+    if (wanted("small"))
+        scenes.push_back({ "small", createScatteredTriangles(size_t(1) << 16, 16.0f, options, 4) });
+    // A few triangles covering everything, where the pixel kernels dominate
+    if (wanted("fullscreen")) {
+        TriangleScene scene = { "fullscreen", {} };
+        addQuad(scene.triangles, 0.5f, 0xFF804020u);
+        addQuad(scene.triangles, 0.25f, 0xFF204080u);
+        scenes.push_back(scene);
+    }
+    // 32 screen-sized layers: back to front every layer passes the depth test,
+    // front to back the coarse depth rejects all but the first
+    if (wanted("overdraw-back-to-front")) {
+        TriangleScene scene = { "overdraw-back-to-front", {} };
+        for (int layer = 0; layer < 32; ++layer)
+            addQuad(scene.triangles, 0.9f - layer * 0.025f, packColor(glm::vec3(layer / 32.0f)));
+        scenes.push_back(scene);
+    }
+    if (wanted("overdraw-front-to-back")) {
+        TriangleScene scene = { "overdraw-front-to-back", {} };
+        for (int layer = 31; layer >= 0; --layer)
+            addQuad(scene.triangles, 0.9f - layer * 0.025f, packColor(glm::vec3(layer / 32.0f)));
+        scenes.push_back(scene);
+    }
+
+    // 32 lit layers drawn back to front with the identity as view-projection,
+    // so world space is NDC: forward shading lights every layer, deferred
+    // shading only the front one, with and without per-tile light culling.
+    // Forward shading again with 4x multisampling and 4x supersampling: the
+    // layers are nearly all interior pixels under a costly shader, the case
+    // multisampling is for, where the cube field is nearly all edges.
+    struct LightCase {
+        const char* name;
+        bool deferred;
+        bool tileCulling;
+        int samples;
+        int scale;
+    };
+    const LightCase LIGHT_CASES[] = {
+        { "overdraw-forward-lights", false, false, 1, 1 },
+        { "overdraw-deferred-lights", true, true, 1, 1 },
+        { "overdraw-deferred-lights-untiled", true, false, 1, 1 },
+        { "overdraw-forward-lights-msaa4", false, false, 4, 1 },
+        { "overdraw-forward-lights-ssaa4", false, false, 1, 2 },
+    };
+    bool drawLightScenes = false;
+    for (const LightCase& lightCase : LIGHT_CASES)
+        drawLightScenes = drawLightScenes || wanted(lightCase.name);
+    Mesh layerQuad = createLayerQuad();
+    InstanceBuffer layers;
+    std::vector<PointLight> lights;
+    if (drawLightScenes) {
+        for (int layer = 0; layer < 32; ++layer)
+            layers.add(translateMatrix(glm::mat4(1.0f), glm::vec3(0.0f, 0.0f, 0.9f - layer * 0.025f)));
+        for (int y = 0; y < 8; ++y) {
+            for (int x = 0; x < 8; ++x) {
+                PointLight light;
+                light.position = glm::vec3(-0.875f + x * 0.25f, -0.875f + y * 0.25f, 0.0f);
+                light.color = glm::vec3(0.5f + (x & 1) * 0.5f, 0.5f + (y & 1) * 0.5f, 1.0f);
+                light.radius = 0.35f;
+                lights.push_back(light);
+            }
+        }
+    }
+
+    // The cube field plain, with 4x and 8x multisampling, and with 4x
+    // supersampling, i.e. at twice the width and height
+    struct FieldCase {
+        const char* name;
+        bool shaded;
+        int samples;
+        int scale;
+    };
+    const FieldCase FIELD_CASES[] = {
+        { "cube-field-flat", false, 1, 1 },
+        { "cube-field-gouraud", true, 1, 1 },
+        { "cube-field-flat-msaa4", false, 4, 1 },
+        { "cube-field-flat-msaa8", false, 8, 1 },
+        { "cube-field-gouraud-msaa4", true, 4, 1 },
+        { "cube-field-flat-ssaa4", false, 1, 2 },
+        { "cube-field-gouraud-ssaa4", true, 1, 2 },
+    };
+    bool drawField = false;
+    for (const FieldCase& fieldCase : FIELD_CASES)
+        drawField = drawField || wanted(fieldCase.name);
+    // The same field ray cast, and the hierarchies under it built and refit
+    bool castField = wanted("raycast-cube-field") || selected(options, "bvh/build-instances") || selected(options, "bvh/refit-instances");
+    Mesh cube = createCube();
+    InstanceBuffer field;
+    glm::mat4 viewProjection;
+    if (drawField || castField)
+        createCubeField(field, viewProjection, options);
+
+    // The sphere field at full detail and with levels of detail chosen for at
+    // most a pixel of error
+    const char* SPHERE_CASES[] = { "sphere-field", "sphere-field-lod" };
+    bool drawSpheres = wanted(SPHERE_CASES[0]) || wanted(SPHERE_CASES[1]);
+    bool castSpheres = wanted("raycast-sphere-field");
+    Mesh sphere;
+    InstanceBuffer sphereField;
+    glm::mat4 sphereViewProjection;
+    float spherePixelScale = 0.0f;
+    if (drawSpheres || castSpheres) {
+        sphere = createSphere(64, 32);
+        generateLods(sphere);
+        createSphereField(sphereField, sphereViewProjection, spherePixelScale, options);
+    }
+
+    // A patch of the cube field from VIEW_COUNT cameras around it, each
+    // VIEW_SIZE pixels square: one frame per camera, or all cameras in one
+    // frame into a grid of viewports
+    const int VIEW_COUNT = 64;
+    const int VIEW_SIZE = 64;
+    const int VIEW_GRID_SIZE = 8 * VIEW_SIZE;
+    bool drawViews = wanted("views-separate") || wanted("views-batched");
+    InstanceBuffer viewPatch;
+    std::vector<RenderView> views;
+    if (drawViews) {
+        const int COUNT = 32;
+        for (int z = 0; z < COUNT; ++z) {
+            for (int x = 0; x < COUNT; ++x) {
+                glm::mat4 model = translateMatrix(glm::mat4(1.0f), glm::vec3((x - COUNT * 0.5f) * 0.3f, -1.0f, (z - COUNT * 0.5f) * 0.3f));
+                model[0] *= 0.1f;
+                model[1] *= 0.1f;
+                model[2] *= 0.1f;
+                viewPatch.add(model, glm::vec3(static_cast<float>(x) / COUNT, 0.5f, static_cast<float>(z) / COUNT));
+            }
+        }
+        glm::mat4 projection = calculateProjectionMatrix(1.0f, glm::radians(45.0f), 0.1f, 100.0f);
+        for (int i = 0; i < VIEW_COUNT; ++i) {
+            RenderView view;
+            view.viewProjection = projection * calculateViewMatrix(-8.0f, -30.0f, 360.0f * i / VIEW_COUNT);
+            view.viewport = gridViewport(i, VIEW_COUNT, VIEW_GRID_SIZE, VIEW_GRID_SIZE);
+            views.push_back(view);
+        }
+    }
+
+    Framebuffer framebuffer;
+    framebuffer.resize(options.width, options.height);
+    size_t firstResult = results.size();
+
+    // Scaling is relative to the single-threaded run of the same scene, if there was one
+    auto record = [&](BenchmarkResult result, unsigned threads) {
+        result.threads = threads;
+        for (size_t i = firstResult; i < results.size(); ++i) {
+            if (results[i].name == result.name && results[i].threads == 1 && threads > 1) {
+                result.speedup = results[i].medianNs / result.medianNs;
+                result.efficiency = result.speedup / threads;
+            }
+        }
+        results.push_back(result);
+        printResult(result);
+    };
+
+    // What presenting or saving a frame adds: its colors from tiles back to linear rows
+    if (wanted("resolve")) {
+        std::vector<uint32_t> image;
+        framebuffer.resolve(image);
+        PixelRect whole = { 0, 0, options.width, options.height };
+        BenchmarkResult result = measure("frame/resolve", static_cast<double>(image.size()), "pixels", options, [&](size_t iterations) {
+            for (size_t i = 0; i < iterations; ++i)
+                framebuffer.resolve(whole, image.data(), options.width);
+            benchmarkSink = static_cast<float>(image[0]);
+        });
+        record(result, 1);
+    }
+
+    for (unsigned threads : options.threads) {
+        ThreadPool pool(threads);
+        Rasterizer rasterizer(pool);
+        VertexStage vertexStage(pool);
+
+        for (const TriangleScene& scene : scenes) {
+            BenchmarkResult result = measure(std::string("frame/") + scene.name, static_cast<double>(scene.triangles.size()), "triangles", options,
+                                             [&](size_t iterations) {
+                for (size_t i = 0; i < iterations; ++i) {
+                    rasterizer.beginFrame(framebuffer.getRenderTarget());
+                    rasterizer.submitTriangles(scene.triangles.data(), scene.triangles.size());
+                    rasterizer.endFrame();
+                }
+                benchmarkSink = static_cast<float>(framebuffer.getPixels()[0]);
+            });
+            record(result, threads);
+        }
+
+        // Whole frames through the vertex stage as well, flat and with a shader
+        if (drawField) {
+            MeshView mesh(cube);
+            GouraudShader gouraud;
+            for (const FieldCase& fieldCase : FIELD_CASES) {
+                if (!wanted(fieldCase.name))
+                    continue;
+                framebuffer.resize(options.width * fieldCase.scale, options.height * fieldCase.scale, fieldCase.samples);
+                BenchmarkResult result = measure(std::string("frame/") + fieldCase.name, static_cast<double>(field.size()), "instances", options,
+                                                 [&](size_t iterations) {
+                    for (size_t i = 0; i < iterations; ++i) {
+                        rasterizer.beginFrame(framebuffer.getRenderTarget());
+                        if (fieldCase.shaded)
+                            vertexStage.drawInstances(mesh, field, viewProjection, gouraud, rasterizer);
+                        else
+                            vertexStage.drawInstances(mesh, field, viewProjection, rasterizer);
+                        rasterizer.endFrame();
+                    }
+                    benchmarkSink = static_cast<float>(framebuffer.getPixels()[0]);
+                });
+                record(result, threads);
+            }
+            framebuffer.resize(options.width, options.height);
+        }
+
+        if (drawSpheres) {
+            MeshView mesh(sphere);
+            for (int lod = 0; lod < 2; ++lod) {
+                if (!wanted(SPHERE_CASES[lod]))
+                    continue;
+                LodSelection lods;
+                lods.pixelScale = lod ? spherePixelScale : 0.0f;
+                BenchmarkResult result = measure(std::string("frame/") + SPHERE_CASES[lod], static_cast<double>(sphereField.size()), "instances",
+                                                 options, [&](size_t iterations) {
+                    for (size_t i = 0; i < iterations; ++i) {
+                        rasterizer.beginFrame(framebuffer.getRenderTarget());
+                        vertexStage.drawInstances(mesh, sphereField, sphereViewProjection, rasterizer, &lods);
+                        rasterizer.endFrame();
+                    }
+                    benchmarkSink = static_cast<float>(framebuffer.getPixels()[0]);
+                });
+                record(result, threads);
+            }
+        }
+
+        if (drawViews) {
+            MeshView mesh(cube);
+            if (wanted("views-separate")) {
+                framebuffer.resize(VIEW_SIZE, VIEW_SIZE);
+                BenchmarkResult result = measure("frame/views-separate", VIEW_COUNT, "views", options, [&](size_t iterations) {
+                    for (size_t i = 0; i < iterations; ++i) {
+                        for (const RenderView& view : views) {
+                            rasterizer.beginFrame(framebuffer.getRenderTarget());
+                            vertexStage.drawInstances(mesh, viewPatch, view.viewProjection, rasterizer);
+                            rasterizer.endFrame();
+                        }
+                    }
+                    benchmarkSink = static_cast<float>(framebuffer.getPixels()[0]);
+                });
+                record(result, threads);
+            }
+            if (wanted("views-batched")) {
+                framebuffer.resize(VIEW_GRID_SIZE, VIEW_GRID_SIZE);
+                BenchmarkResult result = measure("frame/views-batched", VIEW_COUNT, "views", options, [&](size_t iterations) {
+                    for (size_t i = 0; i < iterations; ++i) {
+                        rasterizer.beginFrame(framebuffer.getRenderTarget());
+                        vertexStage.drawViews(mesh, viewPatch, views.data(), views.size(), rasterizer);
+                        rasterizer.endFrame();
+                    }
+                    benchmarkSink = static_cast<float>(framebuffer.getPixels()[0]);
+                });
+                record(result, threads);
+            }
+            framebuffer.resize(options.width, options.height);
+        }
+
+        // One ray per pixel through every tile, against the full-detail meshes
+        if (castField || castSpheres) {
+            RayTracer tracer(pool);
+            const double rays = static_cast<double>(options.width) * options.height;
+            auto cast = [&](const char* name, const MeshView& mesh, const InstanceBuffer& instances, const glm::mat4& castViewProjection) {
+                if (!wanted(name))
+                    return;
+                tracer.update(mesh, instances);
+                BenchmarkResult result = measure(std::string("frame/") + name, rays, "rays", options, [&](size_t iterations) {
+                    for (size_t i = 0; i < iterations; ++i) {
+                        rasterizer.beginFrame(framebuffer.getRenderTarget());
+                        rasterizer.endFrame();
+                        tracer.render(rasterizer, castViewProjection);
+                    }
+                    benchmarkSink = static_cast<float>(framebuffer.getPixels()[0]);
+                });
+                record(result, threads);
+            };
+            cast("raycast-cube-field", MeshView(cube), field, viewProjection);
+            cast("raycast-sphere-field", MeshView(sphere), sphereField, sphereViewProjection);
+
+            // Building the instance hierarchy from scratch, and refitting it
+            // after every instance moved a little
+            MeshView cubeView(cube);
+            if (selected(options, "bvh/build-instances")) {
+                BenchmarkResult result = measure("bvh/build-instances", static_cast<double>(field.size()), "instances", options, [&](size_t iterations) {
+                    for (size_t i = 0; i < iterations; ++i) {
+                        RayTracer fresh(pool);
+                        fresh.update(cubeView, field);
+                    }
+                });
+                record(result, threads);
+            }
+            if (selected(options, "bvh/refit-instances")) {
+                InstanceBuffer moving = field;
+                tracer.update(cubeView, moving);
+                BenchmarkResult result = measure("bvh/refit-instances", static_cast<double>(moving.size()), "instances", options, [&](size_t iterations) {
+                    for (size_t i = 0; i < iterations; ++i) {
+                        // Back and forth, so the tree never loosens enough to be rebuilt
+                        float offset = (i & 1) ? 0.01f : -0.01f;
+                        for (glm::mat4& transform : moving.transforms)
+                            transform[3].y += offset;
+                        ++moving.version;
+                        tracer.update(cubeView, moving);
+                    }
+                });
+                record(result, threads);
+            }
+        }
+
+        if (drawLightScenes) {
+            MeshView mesh(layerQuad);
+            DeferredLighting lighting(pool);
+            ForwardPointLightShader forwardShader = { &lights };
+            DeferredShader deferredShader = { 0 };
+            glm::mat4 identity(1.0f);
+            vertexStage.setCullMode(CullMode::None);
+            for (const LightCase& lightCase : LIGHT_CASES) {
+                if (!wanted(lightCase.name))
+                    continue;
+                framebuffer.resize(options.width * lightCase.scale, options.height * lightCase.scale, lightCase.samples);
+                lighting.setTileCulling(lightCase.tileCulling);
+                BenchmarkResult result = measure(std::string("frame/") + lightCase.name, static_cast<double>(layers.size()), "layers", options,
+                                                 [&](size_t iterations) {
+                    for (size_t i = 0; i < iterations; ++i) {
+                        RenderTarget target = framebuffer.getRenderTarget();
+                        if (!lightCase.deferred) {
+                            rasterizer.beginFrame(target);
+                            vertexStage.drawInstances(mesh, layers, identity, forwardShader, rasterizer);
+                            rasterizer.endFrame();
+                        } else {
+                            lighting.bindGBuffer(target);
+                            rasterizer.beginFrame(target);
+                            vertexStage.drawInstances(mesh, layers, identity, deferredShader, rasterizer);
+                            rasterizer.endFrame();
+                            lighting.shade(rasterizer, identity, lights);
+                        }
+                    }
+                    benchmarkSink = static_cast<float>(framebuffer.getPixels()[0]);
+                });
+                record(result, threads);
+            }
+            framebuffer.resize(options.width, options.height);
+            vertexStage.setCullMode(CullMode::Back);
+        }
+    }
+}
+
+bool parseArguments(int argc, char** argv, BenchmarkOptions& options) {
+    for (int i = 1; i < argc; ++i) {
+        std::string argument = argv[i];
+        bool hasValue = i + 1 < argc;
+
+        if (argument == "--filter" && hasValue) {
+            options.filter = argv[++i];
+        } else if (argument == "--threads" && hasValue) {
+            options.threads.clear();
+            std::stringstream list(argv[++i]);
+            std::string count;
+            while (std::getline(list, count, ','))
+                if (std::atoi(count.c_str()) > 0)
+                    options.threads.push_back(static_cast<unsigned>(std::atoi(count.c_str())));
+            if (options.threads.empty())
+                return false;
+        } else if (argument == "--size" && hasValue) {
+            if (std::sscanf(argv[++i], "%dx%d", &options.width, &options.height) != 2 || options.width <= 0 || options.height <= 0)
+                return false;
+        } else if (argument == "--min-time" && hasValue) {
+            options.minTime = std::atof(argv[++i]);
+        } else if (argument == "--json" && hasValue) {
+            options.jsonPath = argv[++i];
+        } else {
+            return false;
+        }
+    }
+
+    // 1, 2, 4, ... up to every hardware thread
+    if (options.threads.empty()) {
+        unsigned hardwareThreads = std::max(1u, std::thread::hardware_concurrency());
+        for (unsigned threads = 1; threads < hardwareThreads; threads *= 2)
+            options.threads.push_back(threads);
+        options.threads.push_back(hardwareThreads);
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    BenchmarkOptions options;
+    if (!parseArguments(argc, argv, options)) {
+        std::cout << "Usage: 3DGraphicsBenchmark [options]\n"
+                  << "  --filter TEXT       only benchmarks whose name contains TEXT\n"
+                  << "  --threads 1,2,4     thread counts for the frame benchmarks (default powers of two up to all)\n"
+                  << "  --size WxH          frame size (default 1920x1080)\n"
+                  << "  --min-time S        seconds to measure each benchmark (default 0.25)\n"
+                  << "  --json FILE         also write the results as JSON" << std::endl;
+        return -1;
+    }
+
+    std::cout << instructionSetName(detectInstructionSet()) << ", " << std::thread::hardware_concurrency() << " hardware threads, "
+              << options.width << "x" << options.height << std::endl;
+
+    std::vector<BenchmarkResult> results;
+    benchmarkMath(options, results);
+    benchmarkSceneGraph(options, results);
+    benchmarkSetup(options, results);
+    benchmarkKernels(options, results);
+    benchmarkRays(options, results);
+    for (const BenchmarkResult& result : results)
+        printResult(result);
+    // Frames are printed as they finish, they take a while
+    benchmarkScenes(options, results);
+
+    if (options.jsonPath) {
+        if (!writeJson(options.jsonPath, results, options)) {
+            std::cerr << "Failed to write " << options.jsonPath << std::endl;
+            return -1;
+        }
+        std::cout << "Wrote " << options.jsonPath << std::endl;
+    }
+    return 0;
+}
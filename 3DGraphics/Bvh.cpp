@@ -0,0 +1,370 @@
+#include "Bvh.h"
+
+#include <algorithm>
+#include <limits>
+
+// Centroid bins per axis the heuristic chooses splits between. Nodes with
+// fewer primitives use one bin per primitive, or the fixed cost of clearing
+// and sweeping the bins would dominate the bottom levels.
+static const int BVH_BINS = 16;
+// Nodes with more primitives than this are binned in chunks across the pool,
+// smaller ones become subtrees built by a single job
+static const uint32_t PARALLEL_SPLIT_SIZE = 16384;
+static const uint32_t BIN_CHUNK_SIZE = 4096;
+// Cost of visiting a node, relative to testing one primitive
+static const float TRAVERSAL_COST = 1.0f;
+
+struct Bin {
+    BvhBox bounds;
+    uint32_t count;
+};
+
+// The bins of all three axes
+struct BinSet {
+    Bin bins[3][BVH_BINS];
+};
+
+// A node whose primitives [begin, end) still have to be split or made a leaf
+struct BuildTask {
+    uint32_t node;
+    uint32_t begin, end;
+    uint32_t depth;
+};
+
+// The cheapest split found: primitives in bins below bin go left
+struct Split {
+    int axis;
+    int bin;
+    float cost;
+};
+
+// A primitive as the build sorts it. Box and centroid travel with the index,
+// so every level reads its primitives in order instead of gathering them.
+struct BuildReference {
+    BvhBox box;
+    glm::vec3 centroid;
+    uint32_t primitive;
+};
+
+struct BuildContext {
+    std::vector<BuildReference>& references;
+    uint32_t maxLeafSize;
+};
+
+static BvhBox emptyBox() {
+    float infinity = std::numeric_limits<float>::infinity();
+    BvhBox box = { glm::vec3(infinity), glm::vec3(-infinity) };
+    return box;
+}
+
+static inline void growBox(BvhBox& box, const BvhBox& other) {
+    box.boundsMin = glm::min(box.boundsMin, other.boundsMin);
+    box.boundsMax = glm::max(box.boundsMax, other.boundsMax);
+}
+
+static inline void growBox(BvhBox& box, const glm::vec3& point) {
+    box.boundsMin = glm::min(box.boundsMin, point);
+    box.boundsMax = glm::max(box.boundsMax, point);
+}
+
+float halfArea(const glm::vec3& boundsMin, const glm::vec3& boundsMax) {
+    glm::vec3 extent = glm::max(boundsMax - boundsMin, glm::vec3(0.0f));
+    return extent.x * extent.y + extent.y * extent.z + extent.z * extent.x;
+}
+
+static void clearBins(BinSet& set, int binCount) {
+    for (int axis = 0; axis < 3; ++axis) {
+        for (int bin = 0; bin < binCount; ++bin) {
+            set.bins[axis][bin].bounds = emptyBox();
+            set.bins[axis][bin].count = 0;
+        }
+    }
+}
+
+// Maps centroids to bins along one axis. Axes along which all centroids are
+// equal put everything into bin 0 and offer no split.
+struct BinMapping {
+    glm::vec3 origin;
+    glm::vec3 scale;
+    int binCount;
+
+    BinMapping(const BvhBox& centroidBounds, uint32_t count) {
+        binCount = static_cast<int>(std::min<uint32_t>(std::max<uint32_t>(count, 2), BVH_BINS));
+        origin = centroidBounds.boundsMin;
+        glm::vec3 extent = centroidBounds.boundsMax - centroidBounds.boundsMin;
+        for (int axis = 0; axis < 3; ++axis)
+            scale[axis] = extent[axis] > 0.0f ? binCount * 0.9999f / extent[axis] : 0.0f;
+    }
+
+    int bin(const glm::vec3& centroid, int axis) const {
+        int index = static_cast<int>((centroid[axis] - origin[axis]) * scale[axis]);
+        return std::min(std::max(index, 0), binCount - 1);
+    }
+};
+
+// Bounds of the primitives [begin, end) and of their centroids
+static void measureRange(const BuildContext& context, uint32_t begin, uint32_t end, BvhBox& bounds, BvhBox& centroidBounds) {
+    // Locals, which the compiler can keep in registers
+    BvhBox rangeBounds = emptyBox();
+    BvhBox rangeCentroids = emptyBox();
+    for (uint32_t i = begin; i < end; ++i) {
+        const BuildReference& reference = context.references[i];
+        growBox(rangeBounds, reference.box);
+        growBox(rangeCentroids, reference.centroid);
+    }
+    bounds = rangeBounds;
+    centroidBounds = rangeCentroids;
+}
+
+// Axes without extent offer no split and are left empty
+static void binRange(const BuildContext& context, uint32_t begin, uint32_t end, const BinMapping& mapping, BinSet& set) {
+    for (uint32_t i = begin; i < end; ++i) {
+        const BuildReference& reference = context.references[i];
+        for (int axis = 0; axis < 3; ++axis) {
+            if (mapping.scale[axis] == 0.0f)
+                continue;
+            Bin& bin = set.bins[axis][mapping.bin(reference.centroid, axis)];
+            growBox(bin.bounds, reference.box);
+            ++bin.count;
+        }
+    }
+}
+
+// Sweeps every axis from both ends; the cost of a split is the area of each
+// side times the primitives in it
+static Split findSplit(const BinSet& set, const BinMapping& mapping) {
+    Split best = { -1, 0, std::numeric_limits<float>::infinity() };
+    for (int axis = 0; axis < 3; ++axis) {
+        if (mapping.scale[axis] == 0.0f)
+            continue;
+
+        float leftCost[BVH_BINS];
+        uint32_t leftCount[BVH_BINS];
+        BvhBox left = emptyBox();
+        uint32_t count = 0;
+        for (int bin = 0; bin < mapping.binCount - 1; ++bin) {
+            const Bin& current = set.bins[axis][bin];
+            growBox(left, current.bounds);
+            count += current.count;
+            leftCount[bin] = count;
+            leftCost[bin] = count ? halfArea(left.boundsMin, left.boundsMax) * count : 0.0f;
+        }
+
+        BvhBox right = emptyBox();
+        count = 0;
+        for (int bin = mapping.binCount - 1; bin > 0; --bin) {
+            const Bin& current = set.bins[axis][bin];
+            growBox(right, current.bounds);
+            count += current.count;
+            if (count == 0 || leftCount[bin - 1] == 0)
+                continue;
+            float cost = leftCost[bin - 1] + halfArea(right.boundsMin, right.boundsMax) * count;
+            if (cost < best.cost) {
+                best.axis = axis;
+                best.bin = bin;
+                best.cost = cost;
+            }
+        }
+    }
+    return best;
+}
+
+// Decides whether [begin, end) becomes a leaf and otherwise partitions it,
+// returning where the right child's primitives start
+static bool splitRange(const BuildContext& context, const BuildTask& task, const BvhBox& bounds, const BinMapping& mapping,
+                       const BinSet& set, uint32_t& middle) {
+    uint32_t begin = task.begin;
+    uint32_t end = task.end;
+    uint32_t count = end - begin;
+    if (count <= 1 || task.depth + 1 >= BVH_MAX_DEPTH)
+        return false;
+
+    Split split = findSplit(set, mapping);
+    float area = halfArea(bounds.boundsMin, bounds.boundsMax);
+    if (count <= context.maxLeafSize && (split.axis < 0 || TRAVERSAL_COST * area + split.cost >= area * count))
+        return false;
+
+    // All centroids in one point: any split is as good as another
+    if (split.axis < 0) {
+        middle = begin + count / 2;
+        return true;
+    }
+
+    BuildReference* first = context.references.data() + begin;
+    BuildReference* last = context.references.data() + end;
+    middle = static_cast<uint32_t>(std::partition(first, last, [&](const BuildReference& reference) {
+        return mapping.bin(reference.centroid, split.axis) < split.bin;
+    }) - context.references.data());
+    return true;
+}
+
+static BvhNode makeNode(const BvhBox& bounds) {
+    BvhNode node;
+    node.boundsMin = bounds.boundsMin;
+    node.boundsMax = bounds.boundsMax;
+    node.first = 0;
+    node.count = 0;
+    return node;
+}
+
+// Builds the subtree of [begin, end) on one thread, its root at nodes[0]
+static void buildSubtree(const BuildContext& context, uint32_t begin, uint32_t end, uint32_t depth, std::vector<BvhNode>& nodes) {
+    nodes.clear();
+    nodes.push_back(BvhNode());
+    std::vector<BuildTask> stack(1, BuildTask{ 0, begin, end, depth });
+    BinSet set;
+    while (!stack.empty()) {
+        BuildTask task = stack.back();
+        stack.pop_back();
+
+        BvhBox bounds, centroidBounds;
+        measureRange(context, task.begin, task.end, bounds, centroidBounds);
+        BinMapping mapping(centroidBounds, task.end - task.begin);
+        clearBins(set, mapping.binCount);
+        binRange(context, task.begin, task.end, mapping, set);
+
+        BvhNode node = makeNode(bounds);
+        uint32_t middle;
+        if (splitRange(context, task, bounds, mapping, set, middle)) {
+            node.first = static_cast<uint32_t>(nodes.size());
+            nodes.push_back(BvhNode());
+            nodes.push_back(BvhNode());
+            stack.push_back(BuildTask{ node.first, task.begin, middle, task.depth + 1 });
+            stack.push_back(BuildTask{ node.first + 1, middle, task.end, task.depth + 1 });
+        } else {
+            node.first = task.begin;
+            node.count = task.end - task.begin;
+        }
+        nodes[task.node] = node;
+    }
+}
+
+void Bvh::build(ThreadPool& pool, const std::vector<BvhBox>& boxes, uint32_t maxLeafSize) {
+    nodes.clear();
+    uint32_t count = static_cast<uint32_t>(boxes.size());
+    primitives.resize(count);
+    area = builtArea = 0.0f;
+    if (count == 0)
+        return;
+
+    std::vector<BuildReference> references(count);
+    int chunkCount = static_cast<int>((count + BIN_CHUNK_SIZE - 1) / BIN_CHUNK_SIZE);
+    pool.parallelFor(chunkCount, [&](int chunk, unsigned) {
+        uint32_t end = std::min(count, (chunk + 1) * BIN_CHUNK_SIZE);
+        for (uint32_t i = chunk * BIN_CHUNK_SIZE; i < end; ++i)
+            references[i] = BuildReference{ boxes[i], (boxes[i].boundsMin + boxes[i].boundsMax) * 0.5f, i };
+    });
+    BuildContext context = { references, std::max(maxLeafSize, 1u) };
+
+    // Top levels: every split bins its primitives in chunks across the pool
+    nodes.push_back(BvhNode());
+    std::vector<BuildTask> pending(1, BuildTask{ 0, 0, count, 0 });
+    std::vector<BuildTask> subtrees;
+    std::vector<BvhBox> chunkBounds, chunkCentroids;
+    std::vector<BinSet> chunkBins;
+    while (!pending.empty()) {
+        BuildTask task = pending.back();
+        pending.pop_back();
+        uint32_t taskSize = task.end - task.begin;
+        if (taskSize <= PARALLEL_SPLIT_SIZE || pool.size() == 1) {
+            subtrees.push_back(task);
+            continue;
+        }
+
+        int taskChunks = static_cast<int>((taskSize + BIN_CHUNK_SIZE - 1) / BIN_CHUNK_SIZE);
+        chunkBounds.resize(taskChunks);
+        chunkCentroids.resize(taskChunks);
+        chunkBins.resize(taskChunks);
+        auto chunkRange = [&](int chunk, uint32_t& begin, uint32_t& end) {
+            begin = task.begin + chunk * BIN_CHUNK_SIZE;
+            end = std::min(task.end, begin + BIN_CHUNK_SIZE);
+        };
+        pool.parallelFor(taskChunks, [&](int chunk, unsigned) {
+            uint32_t begin, end;
+            chunkRange(chunk, begin, end);
+            measureRange(context, begin, end, chunkBounds[chunk], chunkCentroids[chunk]);
+        });
+        BvhBox bounds = emptyBox();
+        BvhBox centroidBounds = emptyBox();
+        for (int chunk = 0; chunk < taskChunks; ++chunk) {
+            growBox(bounds, chunkBounds[chunk]);
+            growBox(centroidBounds, chunkCentroids[chunk]);
+        }
+
+        BinMapping mapping(centroidBounds, taskSize);
+        pool.parallelFor(taskChunks, [&](int chunk, unsigned) {
+            uint32_t begin, end;
+            chunkRange(chunk, begin, end);
+            clearBins(chunkBins[chunk], mapping.binCount);
+            binRange(context, begin, end, mapping, chunkBins[chunk]);
+        });
+        BinSet set = chunkBins[0];
+        for (int chunk = 1; chunk < taskChunks; ++chunk) {
+            for (int axis = 0; axis < 3; ++axis) {
+                for (int bin = 0; bin < mapping.binCount; ++bin) {
+                    growBox(set.bins[axis][bin].bounds, chunkBins[chunk].bins[axis][bin].bounds);
+                    set.bins[axis][bin].count += chunkBins[chunk].bins[axis][bin].count;
+                }
+            }
+        }
+
+        BvhNode node = makeNode(bounds);
+        uint32_t middle;
+        if (splitRange(context, task, bounds, mapping, set, middle)) {
+            node.first = static_cast<uint32_t>(nodes.size());
+            nodes.push_back(BvhNode());
+            nodes.push_back(BvhNode());
+            pending.push_back(BuildTask{ node.first, task.begin, middle, task.depth + 1 });
+            pending.push_back(BuildTask{ node.first + 1, middle, task.end, task.depth + 1 });
+        } else {
+            node.first = task.begin;
+            node.count = taskSize;
+        }
+        nodes[task.node] = node;
+    }
+
+    // Then whole subtrees, one per job
+    std::vector<std::vector<BvhNode>> subtreeNodes(subtrees.size());
+    pool.parallelFor(static_cast<int>(subtrees.size()), [&](int subtree, unsigned) {
+        const BuildTask& task = subtrees[subtree];
+        buildSubtree(context, task.begin, task.end, task.depth, subtreeNodes[subtree]);
+    });
+
+    // Each subtree's root replaces its placeholder, the rest is appended with
+    // child indices moved from the subtree's numbering to the tree's
+    for (size_t subtree = 0; subtree < subtrees.size(); ++subtree) {
+        std::vector<BvhNode>& local = subtreeNodes[subtree];
+        uint32_t base = static_cast<uint32_t>(nodes.size()) - 1;
+        for (BvhNode& node : local)
+            if (node.count == 0)
+                node.first += base;
+        nodes[subtrees[subtree].node] = local[0];
+        nodes.insert(nodes.end(), local.begin() + 1, local.end());
+    }
+
+    for (uint32_t i = 0; i < count; ++i)
+        primitives[i] = references[i].primitive;
+    for (const BvhNode& node : nodes)
+        area += halfArea(node.boundsMin, node.boundsMax);
+    builtArea = area;
+}
+
+void Bvh::refit(const std::vector<BvhBox>& boxes) {
+    area = 0.0f;
+    for (size_t i = nodes.size(); i-- > 0;) {
+        BvhNode& node = nodes[i];
+        BvhBox bounds = emptyBox();
+        if (node.count > 0) {
+            for (uint32_t k = node.first; k < node.first + node.count; ++k)
+                growBox(bounds, boxes[primitives[k]]);
+        } else {
+            const BvhNode& left = nodes[node.first];
+            const BvhNode& right = nodes[node.first + 1];
+            growBox(bounds, BvhBox{ left.boundsMin, left.boundsMax });
+            growBox(bounds, BvhBox{ right.boundsMin, right.boundsMax });
+        }
+        node.boundsMin = bounds.boundsMin;
+        node.boundsMax = bounds.boundsMax;
+        area += halfArea(bounds.boundsMin, bounds.boundsMax);
+    }
+}
@@ -0,0 +1,61 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <vector>
+
+#include "ThreadPool.h"
+
+// Deepest a Bvh gets; nodes that deep become leaves however many primitives
+// they hold, so traversal stacks of this size never overflow
+#define BVH_MAX_DEPTH 64
+
+// Axis-aligned box of one primitive, the input of a Bvh
+struct BvhBox {
+    glm::vec3 boundsMin;
+    glm::vec3 boundsMax;
+};
+
+// One node of a Bvh, 32 bytes. The two children of an inner node are stored
+// next to each other, so one index reaches both.
+struct BvhNode {
+    glm::vec3 boundsMin;
+    uint32_t first;       // inner nodes: the first child; leaves: the first entry of getPrimitives()
+    glm::vec3 boundsMax;
+    uint32_t count;       // primitives of a leaf, 0 for inner nodes
+};
+
+// Bounding volume hierarchy over a set of primitive boxes, built top-down with
+// the surface area heuristic evaluated over a few bins per axis.
+//
+// Splitting the top levels touches every primitive, so their binning runs in
+// chunks across the pool; once a node holds few enough primitives, whole
+// subtrees are built one per job. Children always come after their parent,
+// which lets refit walk the nodes backwards.
+class Bvh {
+public:
+    // Leaves hold at most maxLeafSize primitives, fewer where the heuristic
+    // finds splitting cheaper than testing them all
+    void build(ThreadPool& pool, const std::vector<BvhBox>& boxes, uint32_t maxLeafSize);
+    // Updates every node's box from the primitives' new boxes, keeping the
+    // tree. Cheap, but the tree gets looser the further primitives move.
+    void refit(const std::vector<BvhBox>& boxes);
+
+    bool isEmpty() const { return nodes.empty(); }
+    const std::vector<BvhNode>& getNodes() const { return nodes; }
+    // Primitive indices in leaf order
+    const std::vector<uint32_t>& getPrimitives() const { return primitives; }
+    // Summed surface area of all nodes, which the cost of tracing a ray grows
+    // with, now and right after building; their ratio tells how far refitting
+    // has loosened the tree
+    float getArea() const { return area; }
+    float getBuiltArea() const { return builtArea; }
+
+private:
+    std::vector<BvhNode> nodes;
+    std::vector<uint32_t> primitives;
+    float area = 0.0f;
+    float builtArea = 0.0f;
+};
+
+// Half the surface area of a box, which is all the heuristic compares
+float halfArea(const glm::vec3& boundsMin, const glm::vec3& boundsMax);
@@ -0,0 +1,64 @@
+#include "ChangeTracker.h"
+
+#include <algorithm>
+#include <cstring>
+
+// Beyond this share of the screen a partial redraw saves too little to be worth it
+static const float MAX_PARTIAL_AREA = 0.5f;
+
+RedrawKind ChangeTracker::update(const MeshView& mesh, InstanceBuffer& instances, const glm::mat4& viewProjection,
+                                 int width, int height, std::vector<PixelRect>& dirtyRects) {
+    dirtyRects.clear();
+
+    bool sameInputs = valid && mesh.positions == meshPositions && mesh.indexCount == meshIndexCount &&
+                      &instances == instanceBuffer && instances.size() == instanceCount &&
+                      width == this->width && height == this->height &&
+                      std::memcmp(&viewProjection, &this->viewProjection, sizeof(glm::mat4)) == 0;
+
+    // Every set() adds one change and one version, anything else only a version
+    bool onlyMoves = instances.version - instanceVersion == instances.changes.size();
+
+    RedrawKind kind = RedrawKind::Full;
+    if (sameInputs && onlyMoves) {
+        kind = instances.changes.empty() ? RedrawKind::None : RedrawKind::Partial;
+
+        size_t dirtyArea = 0;
+        for (const InstanceChange& change : instances.changes) {
+            const glm::mat4* models[2] = { &change.previousTransform, &instances.transforms[change.index] };
+            for (const glm::mat4* model : models) {
+                PixelRect rect;
+                float minZ;
+                // Crossing the near plane, the instance could cover any part of the screen
+                if (!projectBox(viewProjection * *model, mesh.boundsMin, mesh.boundsMax, width, height, rect, minZ)) {
+                    kind = RedrawKind::Full;
+                    break;
+                }
+                dirtyRects.push_back(rect);
+                int visibleWidth = std::min(rect.maxX, width) - std::max(rect.minX, 0);
+                int visibleHeight = std::min(rect.maxY, height) - std::max(rect.minY, 0);
+                if (visibleWidth > 0 && visibleHeight > 0)
+                    dirtyArea += static_cast<size_t>(visibleWidth) * visibleHeight;
+            }
+            if (kind == RedrawKind::Full)
+                break;
+        }
+
+        if (dirtyArea > MAX_PARTIAL_AREA * width * height)
+            kind = RedrawKind::Full;
+    }
+
+    if (kind == RedrawKind::Full)
+        dirtyRects.clear();
+
+    valid = true;
+    meshPositions = mesh.positions;
+    meshIndexCount = mesh.indexCount;
+    instanceBuffer = &instances;
+    instanceCount = instances.size();
+    instanceVersion = instances.version;
+    this->viewProjection = viewProjection;
+    this->width = width;
+    this->height = height;
+    instances.clearChanges();
+    return kind;
+}
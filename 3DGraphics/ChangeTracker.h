@@ -0,0 +1,41 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <vector>
+
+#include "Instancing.h"
+#include "Mesh.h"
+#include "Rasterizer.h"
+
+enum class RedrawKind {
+    None,     // nothing changed, the last image is still valid
+    Partial,  // only the returned rectangles need to be redrawn
+    Full
+};
+
+// Compares the inputs of a draw (mesh, instances, camera and target size) with
+// those of the previous frame to find out how much of the image is out of date.
+// Instance moves are cheap to track because InstanceBuffer records them; the
+// screen rectangles of the changed instances, before and after, are all that
+// needs to be redrawn as long as the camera stays put.
+class ChangeTracker {
+public:
+    // Consumes the change list of instances. For partial redraws dirtyRects
+    // receives the screen rectangles to redraw.
+    RedrawKind update(const MeshView& mesh, InstanceBuffer& instances, const glm::mat4& viewProjection,
+                      int width, int height, std::vector<PixelRect>& dirtyRects);
+
+    // Makes the next update redraw everything
+    void invalidate() { valid = false; }
+
+private:
+    bool valid = false;
+    const glm::vec3* meshPositions = nullptr;
+    size_t meshIndexCount = 0;
+    const InstanceBuffer* instanceBuffer = nullptr;
+    size_t instanceCount = 0;
+    uint64_t instanceVersion = 0;
+    glm::mat4 viewProjection = glm::mat4(1.0f);
+    int width = 0;
+    int height = 0;
+};
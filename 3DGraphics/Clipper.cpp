@@ -0,0 +1,79 @@
+#include "Clipper.h"
+
+#include <utility>
+
+// Signed distance to a clip plane, the inside is >= 0
+typedef float (*PlaneDistance)(const glm::vec4& p);
+
+static float nearDistance(const glm::vec4& p) { return p.z + p.w; }
+static float farDistance(const glm::vec4& p) { return p.w - p.z; }
+static float guardLeftDistance(const glm::vec4& p) { return GUARD_BAND_SCALE * p.w + p.x; }
+static float guardRightDistance(const glm::vec4& p) { return GUARD_BAND_SCALE * p.w - p.x; }
+static float guardBottomDistance(const glm::vec4& p) { return GUARD_BAND_SCALE * p.w + p.y; }
+static float guardTopDistance(const glm::vec4& p) { return GUARD_BAND_SCALE * p.w - p.y; }
+
+// Sutherland-Hodgman against one plane
+static int clipPolygon(const ClipVertex* in, int count, PlaneDistance distance, ClipVertex* out) {
+    int outCount = 0;
+
+    for (int i = 0; i < count; ++i) {
+        const ClipVertex& current = in[i];
+        const ClipVertex& next = in[(i + 1) % count];
+        float currentDistance = distance(current.position);
+        float nextDistance = distance(next.position);
+
+        if (currentDistance >= 0.0f)
+            out[outCount++] = current;
+
+        // The edge crosses the plane: add the intersection
+        if ((currentDistance >= 0.0f) != (nextDistance >= 0.0f)) {
+            float t = currentDistance / (currentDistance - nextDistance);
+            out[outCount].position = current.position + (next.position - current.position) * t;
+            out[outCount].weights = current.weights + (next.weights - current.weights) * t;
+            ++outCount;
+        }
+    }
+
+    return outCount;
+}
+
+int clipTriangle(const glm::vec4& p0, const glm::vec4& p1, const glm::vec4& p2, uint8_t clipPlanes, ClipVertex* out) {
+    ClipVertex buffer[MAX_CLIP_VERTICES];
+    ClipVertex* polygon = out;
+    ClipVertex* scratch = buffer;
+
+    polygon[0] = { p0, glm::vec3(1.0f, 0.0f, 0.0f) };
+    polygon[1] = { p1, glm::vec3(0.0f, 1.0f, 0.0f) };
+    polygon[2] = { p2, glm::vec3(0.0f, 0.0f, 1.0f) };
+    int count = 3;
+
+    struct Plane {
+        uint8_t bit;
+        PlaneDistance distance;
+    };
+    static const Plane planes[] = {
+        { CLIP_NEAR, nearDistance },
+        { CLIP_FAR, farDistance },
+        { CLIP_GUARD_BAND_X, guardLeftDistance },
+        { CLIP_GUARD_BAND_X, guardRightDistance },
+        { CLIP_GUARD_BAND_Y, guardBottomDistance },
+        { CLIP_GUARD_BAND_Y, guardTopDistance },
+    };
+
+    for (const Plane& plane : planes) {
+        if (!(clipPlanes & plane.bit))
+            continue;
+
+        count = clipPolygon(polygon, count, plane.distance, scratch);
+        std::swap(polygon, scratch);
+        if (count < 3)
+            return 0;
+    }
+
+    // The result has to end up in out
+    if (polygon != out)
+        for (int i = 0; i < count; ++i)
+            out[i] = polygon[i];
+
+    return count;
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <cstdint>
+
+// Outcode bits of a clip-space vertex. The first six are the view frustum,
+// the guard-band bits mark vertices too far outside for the rasterizer's
+// fixed-point range.
+enum ClipOutcode : uint8_t {
+    CLIP_LEFT = 1 << 0,
+    CLIP_RIGHT = 1 << 1,
+    CLIP_BOTTOM = 1 << 2,
+    CLIP_TOP = 1 << 3,
+    CLIP_NEAR = 1 << 4,
+    CLIP_FAR = 1 << 5,
+    CLIP_GUARD_BAND_X = 1 << 6,
+    CLIP_GUARD_BAND_Y = 1 << 7
+};
+
+// Any of these set on all three vertices: the triangle is entirely outside
+const uint8_t CLIP_FRUSTUM = CLIP_LEFT | CLIP_RIGHT | CLIP_BOTTOM | CLIP_TOP | CLIP_NEAR | CLIP_FAR;
+// Any of these set on one vertex: the triangle has to be clipped geometrically.
+// The side planes are left to the rasterizer's scissoring inside the guard band.
+const uint8_t CLIP_NEEDS_CLIPPING = CLIP_NEAR | CLIP_FAR | CLIP_GUARD_BAND_X | CLIP_GUARD_BAND_Y;
+
+// How far the guard band reaches, in multiples of the viewport half-size
+#define GUARD_BAND_SCALE 64.0f
+
+// A triangle clipped against n planes has at most 3 + n vertices
+#define MAX_CLIP_VERTICES 9
+
+inline uint8_t computeOutcode(float x, float y, float z, float w) {
+    uint8_t code = 0;
+    if (x < -w) code |= CLIP_LEFT;
+    if (x > w) code |= CLIP_RIGHT;
+    if (y < -w) code |= CLIP_BOTTOM;
+    if (y > w) code |= CLIP_TOP;
+    if (z < -w) code |= CLIP_NEAR;
+    if (z > w) code |= CLIP_FAR;
+    if (x < -GUARD_BAND_SCALE * w || x > GUARD_BAND_SCALE * w) code |= CLIP_GUARD_BAND_X;
+    if (y < -GUARD_BAND_SCALE * w || y > GUARD_BAND_SCALE * w) code |= CLIP_GUARD_BAND_Y;
+    return code;
+}
+
+// Vertex of a clipped polygon. The weights say how much of each original
+// triangle vertex it is made of, so any vertex attribute can be rebuilt later.
+struct ClipVertex {
+    glm::vec4 position;
+    glm::vec3 weights;
+};
+
+// Clips a triangle in homogeneous clip space against the planes named by
+// clipPlanes (CLIP_NEAR, CLIP_FAR and the guard-band bits). Writes the convex
+// polygon that remains to out and returns its vertex count, 0 if nothing is left.
+int clipTriangle(const glm::vec4& p0, const glm::vec4& p1, const glm::vec4& p2, uint8_t clipPlanes, ClipVertex* out);
@@ -0,0 +1,176 @@
+#include "DeferredLighting.h"
+
+#include <limits>
+
+#include "Profiler.h"
+
+DeferredLighting::DeferredLighting(ThreadPool& pool) : pool(pool), inverseViewProjection(1.0f), eyePosition(0.0f) {
+    scratches.resize(pool.size());
+    for (TileScratch& scratch : scratches)
+        scratch.positions.resize(TILE_SIZE * TILE_SIZE);
+}
+
+void DeferredLighting::bindGBuffer(RenderTarget& target) {
+    if (target.width != width || target.height != height) {
+        width = target.width;
+        height = target.height;
+        normals.assign(renderTargetSize(width, height), 0);
+        surfaces.assign(renderTargetSize(width, height), 0);
+    }
+    target.normals = normals.data();
+    target.surfaces = surfaces.data();
+}
+
+// Screen rectangle of a light's bounding box, like projectBox. A box reaching
+// behind the camera could light anything on screen.
+static PixelRect projectLight(const glm::mat4& viewProjection, const PointLight& light, int width, int height) {
+    glm::vec3 ndcMin(std::numeric_limits<float>::infinity());
+    glm::vec3 ndcMax(-std::numeric_limits<float>::infinity());
+
+    for (int corner = 0; corner < 8; ++corner) {
+        glm::vec3 offset((corner & 1) ? light.radius : -light.radius, (corner & 2) ? light.radius : -light.radius,
+                         (corner & 4) ? light.radius : -light.radius);
+        glm::vec4 clip = viewProjection * glm::vec4(light.position + offset, 1.0f);
+        if (clip.w <= 0.0f)
+            return PixelRect{ 0, 0, width, height };
+
+        glm::vec3 ndc = glm::vec3(clip) / clip.w;
+        ndcMin = glm::min(ndcMin, ndc);
+        ndcMax = glm::max(ndcMax, ndc);
+    }
+
+    ndcMin = glm::clamp(ndcMin, -2.0f, 2.0f);
+    ndcMax = glm::clamp(ndcMax, -2.0f, 2.0f);
+    PixelRect rect;
+    rect.minX = static_cast<int>(std::floor((ndcMin.x + 1.0f) * 0.5f * width));
+    rect.minY = static_cast<int>(std::floor((ndcMin.y + 1.0f) * 0.5f * height));
+    rect.maxX = static_cast<int>(std::ceil((ndcMax.x + 1.0f) * 0.5f * width)) + 1;
+    rect.maxY = static_cast<int>(std::ceil((ndcMax.y + 1.0f) * 0.5f * height)) + 1;
+    return rect;
+}
+
+void DeferredLighting::shade(const Rasterizer& rasterizer, const glm::mat4& viewProjection, const std::vector<PointLight>& lights) {
+    const RenderTarget& target = rasterizer.getTarget();
+    inverseViewProjection = glm::inverse(viewProjection);
+    // The projection sends the eye to infinity, so it is the point that comes
+    // back from the direction (0, 0, 1, 0)
+    glm::vec4 eye = inverseViewProjection[2];
+    eyePosition = glm::vec3(eye) / eye.w;
+
+    screenRects.resize(lights.size());
+    for (size_t i = 0; i < lights.size(); ++i)
+        screenRects[i] = projectLight(viewProjection, lights[i], target.width, target.height);
+
+    int tilesX = (target.width + TILE_SIZE - 1) / TILE_SIZE;
+    int tilesY = (target.height + TILE_SIZE - 1) / TILE_SIZE;
+    pool.parallelFor(tilesX * tilesY, [&](int tileIndex, unsigned worker) {
+        shadeTile(tileIndex, worker, rasterizer, lights);
+    });
+}
+
+void DeferredLighting::shadeTile(int tileIndex, unsigned worker, const Rasterizer& rasterizer, const std::vector<PointLight>& lights) {
+    const RenderTarget& target = rasterizer.getTarget();
+    int tilesX = (target.width + TILE_SIZE - 1) / TILE_SIZE;
+    PixelRect tile;
+    tile.minX = (tileIndex % tilesX) * TILE_SIZE;
+    tile.minY = (tileIndex / tilesX) * TILE_SIZE;
+    tile.maxX = std::min(tile.minX + TILE_SIZE, target.width);
+    tile.maxY = std::min(tile.minY + TILE_SIZE, target.height);
+    if (!rasterizer.isRectDirty(tile))
+        return;
+
+    PROFILE_SCOPE(ProfileStage::Lighting, "Lighting");
+    const float NOTHING_DRAWN = std::numeric_limits<float>::infinity();
+    // The tile's planes are one block of TILE_SIZE rows, its scratch uses the same layout
+    size_t tileStart = static_cast<size_t>(tileIndex) * TILE_SIZE * TILE_SIZE;
+    int tileWidth = tile.maxX - tile.minX;
+    TileScratch& scratch = scratches[worker];
+
+    // World positions come back from depth: the inverse view-projection of
+    // (ndcX, ndcY, depth, 1) is linear in each, so only the x and depth terms
+    // change along a row. Their bounds are what the lights are culled against.
+    glm::vec3 boundsMin(std::numeric_limits<float>::infinity());
+    glm::vec3 boundsMax(-std::numeric_limits<float>::infinity());
+    for (int y = tile.minY; y < tile.maxY; ++y) {
+        size_t rowStart = (y - tile.minY) * TILE_SIZE;
+        const float* depthRow = target.depth + tileStart + rowStart;
+        glm::vec3* positionRow = scratch.positions.data() + rowStart;
+        float ndcY = (y + 0.5f) * 2.0f / target.height - 1.0f;
+        glm::vec4 rowBase = inverseViewProjection[1] * ndcY + inverseViewProjection[3];
+
+        for (int x = 0; x < tileWidth; ++x) {
+            if (!(depthRow[x] < NOTHING_DRAWN))
+                continue;
+            float ndcX = (tile.minX + x + 0.5f) * 2.0f / target.width - 1.0f;
+            glm::vec4 homogeneous = rowBase + inverseViewProjection[0] * ndcX + inverseViewProjection[2] * depthRow[x];
+            positionRow[x] = glm::vec3(homogeneous) / homogeneous.w;
+            boundsMin = glm::min(boundsMin, positionRow[x]);
+            boundsMax = glm::max(boundsMax, positionRow[x]);
+        }
+    }
+    if (boundsMin.x > boundsMax.x)
+        return;
+
+    // Lights on screen over the tile whose sphere touches the box around its surfaces
+    scratch.lights.clear();
+    for (uint32_t i = 0; i < static_cast<uint32_t>(lights.size()); ++i) {
+        const PixelRect& rect = screenRects[i];
+        const PointLight& light = lights[i];
+        glm::vec3 outside = glm::max(glm::max(boundsMin - light.position, light.position - boundsMax), glm::vec3(0.0f));
+        bool reaches = rect.minX < tile.maxX && rect.maxX > tile.minX && rect.minY < tile.maxY && rect.maxY > tile.minY &&
+                       glm::dot(outside, outside) < light.radius * light.radius;
+        if (reaches || !tileCulling)
+            scratch.lights.push_back(i);
+    }
+    PROFILE_ONLY(uint64_t lightTests = 0);
+
+    for (int y = tile.minY; y < tile.maxY; ++y) {
+        size_t rowStart = (y - tile.minY) * TILE_SIZE;
+        const float* depthRow = target.depth + tileStart + rowStart;
+        const glm::vec3* positionRow = scratch.positions.data() + rowStart;
+
+        for (int x = 0; x < tileWidth; ++x) {
+            if (!(depthRow[x] < NOTHING_DRAWN))
+                continue;
+
+            size_t pixel = tileStart + rowStart + x;
+            const glm::vec3& position = positionRow[x];
+            glm::vec3 normal = decodeNormal(target.normals[pixel]);
+            uint32_t surface = target.surfaces[pixel];
+            glm::vec3 albedo(static_cast<float>(surface & 0xFF), static_cast<float>((surface >> 8) & 0xFF),
+                             static_cast<float>((surface >> 16) & 0xFF));
+            albedo *= 1.0f / 255.0f;
+            const Material& material = materials[surface >> 24];
+
+            glm::vec3 color = albedo * material.ambient;
+            for (uint32_t index : scratch.lights) {
+                const PointLight& light = lights[index];
+                glm::vec3 toLight = light.position - position;
+                float distanceSquared = glm::dot(toLight, toLight);
+                float radiusSquared = light.radius * light.radius;
+                if (distanceSquared >= radiusSquared)
+                    continue;
+
+                glm::vec3 direction = toLight / std::sqrt(distanceSquared);
+                float diffuse = glm::dot(normal, direction);
+                if (diffuse <= 0.0f)
+                    continue;
+
+                // Smooth falloff that reaches zero exactly at the radius
+                float falloff = 1.0f - distanceSquared / radiusSquared;
+                falloff *= falloff;
+                glm::vec3 lit = albedo * diffuse;
+                if (material.specular > 0.0f) {
+                    glm::vec3 toEye = glm::normalize(eyePosition - position);
+                    float halfway = std::max(glm::dot(normal, glm::normalize(direction + toEye)), 0.0f);
+                    lit += glm::vec3(material.specular * std::pow(halfway, material.shininess));
+                }
+                color += light.color * lit * falloff;
+            }
+            PROFILE_ONLY(lightTests += scratch.lights.size());
+            target.pixels[pixel] = packColor(color);
+        }
+    }
+
+    PROFILE_COUNT(ProfileCounter::LightTests, lightTests);
+}
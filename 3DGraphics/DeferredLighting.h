@@ -0,0 +1,118 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "Rasterizer.h"
+#include "ThreadPool.h"
+
+// Material ids are one byte of the G-buffer
+#define MAX_MATERIALS 256
+
+// What a deferred fragment shader returns instead of a color: everything the
+// lighting pass needs to light the pixel once it is known to be visible
+struct SurfaceSample {
+    glm::vec3 normal;       // world space, unit length
+    glm::vec3 albedo;
+    uint8_t material;
+};
+
+// Unit normal as two 16-bit octahedral coordinates: the normal is projected
+// onto an octahedron and its lower half folded over the upper, which spreads
+// the precision evenly over all directions
+inline uint32_t encodeNormal(const glm::vec3& normal) {
+    float sum = std::fabs(normal.x) + std::fabs(normal.y) + std::fabs(normal.z);
+    if (sum <= 0.0f)
+        return 0x80008000u;
+    float u = normal.x / sum;
+    float v = normal.y / sum;
+    if (normal.z < 0.0f) {
+        float foldedU = (1.0f - std::fabs(v)) * (u >= 0.0f ? 1.0f : -1.0f);
+        float foldedV = (1.0f - std::fabs(u)) * (v >= 0.0f ? 1.0f : -1.0f);
+        u = foldedU;
+        v = foldedV;
+    }
+    uint32_t x = static_cast<uint32_t>((std::min(std::max(u, -1.0f), 1.0f) * 0.5f + 0.5f) * 65535.0f + 0.5f);
+    uint32_t y = static_cast<uint32_t>((std::min(std::max(v, -1.0f), 1.0f) * 0.5f + 0.5f) * 65535.0f + 0.5f);
+    return x | (y << 16);
+}
+
+inline glm::vec3 decodeNormal(uint32_t encoded) {
+    float u = (encoded & 0xFFFF) * (2.0f / 65535.0f) - 1.0f;
+    float v = (encoded >> 16) * (2.0f / 65535.0f) - 1.0f;
+    glm::vec3 normal(u, v, 1.0f - std::fabs(u) - std::fabs(v));
+    float fold = std::max(-normal.z, 0.0f);
+    normal.x += normal.x >= 0.0f ? -fold : fold;
+    normal.y += normal.y >= 0.0f ? -fold : fold;
+    return glm::normalize(normal);
+}
+
+// Albedo in the color bytes, the material id where packColor puts alpha
+inline uint32_t packSurface(const glm::vec3& albedo, uint8_t material) {
+    return (packColor(albedo) & 0x00FFFFFFu) | (static_cast<uint32_t>(material) << 24);
+}
+
+struct PointLight {
+    glm::vec3 position;
+    glm::vec3 color;
+    float radius;           // the light fades to nothing at this distance
+};
+
+// How a surface responds to light: ambient and Lambert diffuse scaled by the
+// albedo, plus Blinn-Phong specular in the light's color
+struct Material {
+    float ambient = 0.1f;
+    float specular = 0.0f;
+    float shininess = 16.0f;
+};
+
+// Second half of deferred shading. The raster pass only fills depth and the
+// G-buffer, through shaders whose fragment() returns a SurfaceSample; this
+// pass then lights each visible pixel exactly once, however many triangles
+// were drawn over it.
+//
+// Lighting runs per screen tile on the pool. Each tile first rebuilds the world
+// positions of its pixels from depth and gathers the lights whose sphere
+// touches their bounding box, so pixels only loop over lights that can reach
+// them. Tiles the rasterizer kept from the last frame are skipped.
+class DeferredLighting {
+public:
+    explicit DeferredLighting(ThreadPool& pool);
+
+    // Points the G-buffer planes of target at buffers of its size. The planes
+    // only hold valid data for pixels drawn this frame.
+    void bindGBuffer(RenderTarget& target);
+    void setMaterial(uint8_t id, const Material& material) { materials[id] = material; }
+    // Without culling every pixel loops over every light, for comparison
+    void setTileCulling(bool enabled) { tileCulling = enabled; }
+
+    // Lights what the rasterizer drew this frame and writes the result to its
+    // target's colors. Pixels nothing was drawn to keep the clear color. The
+    // target has to have one sample per pixel, like the G-buffer.
+    void shade(const Rasterizer& rasterizer, const glm::mat4& viewProjection, const std::vector<PointLight>& lights);
+
+private:
+    // Working memory of one worker for the tile it is lighting
+    struct TileScratch {
+        std::vector<glm::vec3> positions;   // world position of every pixel
+        std::vector<uint32_t> lights;       // lights that can reach the tile
+    };
+
+    void shadeTile(int tileIndex, unsigned worker, const Rasterizer& rasterizer, const std::vector<PointLight>& lights);
+
+    ThreadPool& pool;
+    Material materials[MAX_MATERIALS];
+    bool tileCulling = true;
+    int width = 0;
+    int height = 0;
+    std::vector<uint32_t> normals;
+    std::vector<uint32_t> surfaces;
+
+    // Per frame
+    std::vector<PixelRect> screenRects;
+    glm::mat4 inverseViewProjection;
+    glm::vec3 eyePosition;
+    std::vector<TileScratch> scratches;
+};
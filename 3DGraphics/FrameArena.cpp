@@ -0,0 +1,42 @@
+#include "FrameArena.h"
+
+#include <cstdint>
+
+// Every allocation starts on its own cache line, which also keeps SIMD loads
+// aligned and stops workers writing neighbouring allocations from false sharing
+static const size_t CACHE_LINE_SIZE = 64;
+
+static unsigned char* alignToCacheLine(unsigned char* pointer) {
+    uintptr_t address = reinterpret_cast<uintptr_t>(pointer);
+    return reinterpret_cast<unsigned char*>((address + CACHE_LINE_SIZE - 1) & ~uintptr_t(CACHE_LINE_SIZE - 1));
+}
+
+FrameArena::FrameArena(size_t initialCapacity)
+    : block(new unsigned char[initialCapacity + CACHE_LINE_SIZE]), blockSize(initialCapacity) {
+    blockBase = alignToCacheLine(block.get());
+}
+
+void FrameArena::reset() {
+    if (!overflowBlocks.empty()) {
+        // Size the main block for the high-water mark of the previous frame
+        blockSize = (offset + overflowBytes) * 3 / 2;
+        block.reset(new unsigned char[blockSize + CACHE_LINE_SIZE]);
+        blockBase = alignToCacheLine(block.get());
+        overflowBlocks.clear();
+        overflowBytes = 0;
+    }
+    offset = 0;
+}
+
+void* FrameArena::allocateBytes(size_t size) {
+    size_t start = (offset + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1);
+    if (start + size <= blockSize) {
+        offset = start + size;
+        return blockBase + start;
+    }
+
+    // Out of space: serve this request from its own block until the next reset
+    overflowBlocks.emplace_back(new unsigned char[size + CACHE_LINE_SIZE]);
+    overflowBytes += size + CACHE_LINE_SIZE;
+    return alignToCacheLine(overflowBlocks.back().get());
+}
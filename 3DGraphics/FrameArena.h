@@ -0,0 +1,37 @@
+#pragma once
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+// Bump allocator for data that lives for a single frame. Memory is handed out
+// uninitialized and released all at once by reset(). If a frame needs more than
+// the current capacity the extra requests are served from overflow blocks, and
+// the next reset() grows the main block so later frames stop allocating.
+class FrameArena {
+public:
+    explicit FrameArena(size_t initialCapacity = 1 << 20);
+
+    FrameArena(const FrameArena&) = delete;
+    FrameArena& operator=(const FrameArena&) = delete;
+
+    // Allocations are cache-line aligned, which covers any type used with the arena
+    template <typename T>
+    T* allocate(size_t count) {
+        return static_cast<T*>(allocateBytes(count * sizeof(T)));
+    }
+
+    void reset();
+
+    size_t capacity() const { return blockSize; }
+
+private:
+    void* allocateBytes(size_t size);
+
+    std::unique_ptr<unsigned char[]> block;
+    unsigned char* blockBase;
+    size_t blockSize;
+    size_t offset = 0;
+
+    std::vector<std::unique_ptr<unsigned char[]>> overflowBlocks;
+    size_t overflowBytes = 0;
+};
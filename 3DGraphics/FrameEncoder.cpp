@@ -0,0 +1,137 @@
+#include "FrameEncoder.h"
+
+#include <algorithm>
+#include <chrono>
+
+FrameEncoder::~FrameEncoder() {
+    finish();
+}
+
+bool FrameEncoder::start(const char* path, int width, int height, float fps, int queueDepth, int threadCount, std::string& error) {
+    if (hasExtension(path, ".png")) {
+        format = FrameFormat::Png;
+    } else if (hasExtension(path, ".ppm")) {
+        format = FrameFormat::Ppm;
+    } else if (hasExtension(path, ".y4m")) {
+        format = FrameFormat::Y4m;
+    } else {
+        error = std::string("unknown frame format: ") + path;
+        return false;
+    }
+
+    pattern = path;
+    this->width = width;
+    this->height = height;
+    if (format == FrameFormat::Y4m) {
+        if (!video.open(path, width, height, fps)) {
+            error = std::string("cannot open ") + path;
+            return false;
+        }
+        threadCount = 1;
+    } else if (pattern.find('#') == std::string::npos) {
+        error = std::string("one file per frame needs a # in the name for the frame number: ") + path;
+        return false;
+    }
+
+    slots.resize(std::max(1, queueDepth));
+    for (size_t i = 0; i < slots.size(); ++i) {
+        slots[i].pixels.resize(static_cast<size_t>(width) * height);
+        freeSlots.push_back(i);
+    }
+    stopping = false;
+    stats = EncoderStats();
+    for (int i = 0; i < std::max(1, threadCount); ++i)
+        threads.emplace_back(&FrameEncoder::encodeLoop, this);
+    return true;
+}
+
+std::vector<uint32_t>& FrameEncoder::acquire() {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (freeSlots.empty()) {
+        auto waitStart = std::chrono::steady_clock::now();
+        freeCondition.wait(lock, [this] { return !freeSlots.empty(); });
+        ++stats.stalls;
+        stats.stallSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - waitStart).count();
+    }
+
+    acquiredSlot = freeSlots.back();
+    freeSlots.pop_back();
+    return slots[acquiredSlot].pixels;
+}
+
+void FrameEncoder::submit(int frame) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        slots[acquiredSlot].frame = frame;
+        queuedSlots.push_back(acquiredSlot);
+        stats.maxQueued = std::max(stats.maxQueued, queuedSlots.size());
+    }
+    queuedCondition.notify_one();
+}
+
+bool FrameEncoder::finish() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    queuedCondition.notify_all();
+    for (std::thread& thread : threads)
+        thread.join();
+    threads.clear();
+
+    bool closed = format != FrameFormat::Y4m || video.close();
+    std::lock_guard<std::mutex> lock(mutex);
+    return closed && stats.writeFailures == 0;
+}
+
+EncoderStats FrameEncoder::getStats() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return stats;
+}
+
+void FrameEncoder::encodeLoop() {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+        // Everything queued is still written after finish
+        queuedCondition.wait(lock, [this] { return stopping || !queuedSlots.empty(); });
+        if (queuedSlots.empty())
+            return;
+
+        size_t slot = queuedSlots.front();
+        queuedSlots.pop_front();
+        lock.unlock();
+
+        auto encodeStart = std::chrono::steady_clock::now();
+        bool written = encode(slots[slot]);
+        double encodeTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - encodeStart).count();
+
+        lock.lock();
+        stats.encodeSeconds += encodeTime;
+        if (written)
+            ++stats.framesWritten;
+        else
+            ++stats.writeFailures;
+        freeSlots.push_back(slot);
+        freeCondition.notify_one();
+    }
+}
+
+bool FrameEncoder::encode(const Slot& slot) {
+    if (format == FrameFormat::Y4m)
+        return video.writeFrame(slot.pixels.data());
+    return writeImage(framePath(pattern, slot.frame).c_str(), width, height, slot.pixels.data());
+}
+
+std::string framePath(const std::string& pattern, int frame) {
+    size_t start = pattern.find('#');
+    if (start == std::string::npos)
+        return pattern;
+    size_t end = pattern.find_first_not_of('#', start);
+    if (end == std::string::npos)
+        end = pattern.size();
+
+    std::string number = std::to_string(frame);
+    if (number.size() < end - start)
+        number.insert(0, end - start - number.size(), '0');
+    return pattern.substr(0, start) + number + pattern.substr(end);
+}
@@ -0,0 +1,91 @@
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Image.h"
+
+// Frames that can be waiting for or being written by the encoder at once
+#define DEFAULT_ENCODER_QUEUE_DEPTH 4
+
+enum class FrameFormat {
+    Png,
+    Ppm,
+    Y4m
+};
+
+// What the encoder wrote, and how often the render thread had to wait for it
+struct EncoderStats {
+    uint64_t framesWritten = 0;
+    uint64_t writeFailures = 0;
+    uint64_t stalls = 0;          // frames that found every buffer still queued
+    double stallSeconds = 0.0;    // render thread time spent waiting for a free buffer
+    double encodeSeconds = 0.0;   // encoding and writing, summed over the encoder threads
+    size_t maxQueued = 0;         // most frames waiting at once
+};
+
+// Bounded queue of finished frames that background threads write to disk, so
+// compression and file I/O overlap rendering instead of stalling it. Buffers
+// cycle free -> filled by the render thread -> queued -> written -> free; once
+// every buffer is queued the render thread waits, which is the backpressure
+// the stats report.
+//
+// PNG and PPM write one file per frame, named after a pattern whose run of '#'
+// becomes the zero-padded frame number, and may use several threads. Y4M
+// appends every frame to one stream in order, so it always uses one thread.
+class FrameEncoder {
+public:
+    FrameEncoder() = default;
+    FrameEncoder(const FrameEncoder&) = delete;
+    FrameEncoder& operator=(const FrameEncoder&) = delete;
+    ~FrameEncoder();
+
+    // The format comes from the extension of path. Returns false and describes
+    // the problem in error if path is not usable.
+    bool start(const char* path, int width, int height, float fps, int queueDepth, int threadCount, std::string& error);
+    // A free buffer for the next frame, width * height pixels bottom row first.
+    // Waits while every buffer is queued.
+    std::vector<uint32_t>& acquire();
+    // Queues the buffer from the last acquire as the given frame
+    void submit(int frame);
+    // Writes everything queued, then stops the threads. Returns false if any
+    // frame failed to write.
+    bool finish();
+
+    FrameFormat getFormat() const { return format; }
+    EncoderStats getStats();
+
+private:
+    struct Slot {
+        std::vector<uint32_t> pixels;
+        int frame = 0;
+    };
+
+    void encodeLoop();
+    bool encode(const Slot& slot);
+
+    FrameFormat format = FrameFormat::Png;
+    std::string pattern;
+    int width = 0;
+    int height = 0;
+    Y4mWriter video;
+
+    std::vector<Slot> slots;
+    std::vector<size_t> freeSlots;
+    std::deque<size_t> queuedSlots;
+    size_t acquiredSlot = 0;
+    std::vector<std::thread> threads;
+
+    std::mutex mutex;
+    std::condition_variable freeCondition;
+    std::condition_variable queuedCondition;
+    bool stopping = false;
+    EncoderStats stats;
+};
+
+// pattern with its first run of '#' replaced by frame, zero-padded to the run's length
+std::string framePath(const std::string& pattern, int frame);
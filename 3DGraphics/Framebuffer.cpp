@@ -0,0 +1,40 @@
+#include "Framebuffer.h"
+
+void Framebuffer::resize(int width, int height, int samples) {
+    if (width == this->width && height == this->height && samples == this->samples)
+        return;
+
+    this->width = width;
+    this->height = height;
+    this->samples = samples;
+    size_t count = renderTargetSize(width, height);
+    pixels.assign(count, packColor(glm::vec3(0.0f)));
+    depth.assign(count * samples, 0.0f);
+
+    // Tiles clear their slots and lists themselves; the lists keep their
+    // capacity from frame to frame, so edges only allocate while it grows
+    size_t tileCount = count / (TILE_SIZE * TILE_SIZE);
+    sampleSlots.assign(samples > 1 ? count : 0, 0);
+    sampleColors.assign(samples > 1 ? tileCount : 0, std::vector<uint32_t>());
+}
+
+void Framebuffer::resolve(const PixelRect& rect, uint32_t* destination, size_t destinationStride) const {
+    // Resolving only reads the target
+    RenderTarget target = const_cast<Framebuffer*>(this)->getRenderTarget();
+    resolvePixels(target, rect, destination, destinationStride);
+}
+
+void Framebuffer::resolve(std::vector<uint32_t>& image) const {
+    image.resize(static_cast<size_t>(width) * height);
+    resolve(PixelRect{ 0, 0, width, height }, image.data(), width);
+}
+
+RenderTarget Framebuffer::getRenderTarget() {
+    RenderTarget target = { pixels.data(), depth.data(), width, height };
+    if (samples > 1) {
+        target.samples = samples;
+        target.sampleSlots = sampleSlots.data();
+        target.sampleColors = sampleColors.data();
+    }
+    return target;
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+#include "Rasterizer.h"
+
+// Color and depth buffers of the size of the window. Colors are packed RGBA8,
+// a quarter of the memory and upload bandwidth of float RGB. Both are stored in
+// the tiled layout of RenderTarget; resolve produces linear rows. With more
+// than one sample per pixel, depth is per sample and edge pixels keep sample
+// colors as described in Multisample.h.
+class Framebuffer {
+public:
+    // Reallocates only when the size or sample count actually changes; the
+    // contents are undefined afterwards. samples is 1, 4 or 8.
+    void resize(int width, int height, int samples = 1);
+
+    int getWidth() const { return width; }
+    int getHeight() const { return height; }
+    int getSamples() const { return samples; }
+    // Tiled, see RenderTarget
+    const uint32_t* getPixels() const { return pixels.data(); }
+    size_t getSizeInBytes() const { return pixels.size() * sizeof(uint32_t); }
+
+    // Copies the colors of rect into rows of destinationStride pixels,
+    // averaging the samples of multisampled pixels
+    void resolve(const PixelRect& rect, uint32_t* destination, size_t destinationStride) const;
+    // The whole image as width * height linear rows
+    void resolve(std::vector<uint32_t>& image) const;
+
+    RenderTarget getRenderTarget();
+
+private:
+    int width = 0;
+    int height = 0;
+    int samples = 1;
+    std::vector<uint32_t> pixels;
+    std::vector<float> depth;
+    std::vector<uint16_t> sampleSlots;
+    std::vector<std::vector<uint32_t>> sampleColors;
+};
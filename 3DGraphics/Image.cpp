@@ -0,0 +1,203 @@
+#include "Image.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <numeric>
+#include <string>
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+
+bool hasExtension(const char* path, const char* extension) {
+    size_t pathLength = std::strlen(path);
+    size_t extensionLength = std::strlen(extension);
+    if (pathLength < extensionLength)
+        return false;
+
+    for (size_t i = 0; i < extensionLength; ++i) {
+        char c = path[pathLength - extensionLength + i];
+        if (c >= 'A' && c <= 'Z')
+            c = c - 'A' + 'a';
+        if (c != extension[i])
+            return false;
+    }
+    return true;
+}
+
+static bool writePpm(const char* path, int width, int height, const uint32_t* pixels) {
+    FILE* file = std::fopen(path, "wb");
+    if (!file)
+        return false;
+
+    std::fprintf(file, "P6\n%d %d\n255\n", width, height);
+    std::vector<unsigned char> row(width * 3);
+    bool written = true;
+    for (int y = height - 1; y >= 0 && written; --y) {
+        const uint32_t* source = pixels + static_cast<size_t>(y) * width;
+        for (int x = 0; x < width; ++x) {
+            row[x * 3] = static_cast<unsigned char>(source[x]);
+            row[x * 3 + 1] = static_cast<unsigned char>(source[x] >> 8);
+            row[x * 3 + 2] = static_cast<unsigned char>(source[x] >> 16);
+        }
+        written = std::fwrite(row.data(), 1, row.size(), file) == row.size();
+    }
+
+    return std::fclose(file) == 0 && written;
+}
+
+bool writeImage(const char* path, int width, int height, const uint32_t* pixels) {
+    if (hasExtension(path, ".ppm"))
+        return writePpm(path, width, height, pixels);
+
+    // RGBA8 words are R, G, B, A in memory, which is what stb expects. The
+    // flip is a global of stb's, set once so concurrent writers never race on it.
+    static const bool flipped = (stbi_flip_vertically_on_write(1), true);
+    (void)flipped;
+    return stbi_write_png(path, width, height, 4, pixels, width * 4) != 0;
+}
+
+bool Y4mWriter::open(const char* path, int width, int height, float fps) {
+    close();
+    file = std::fopen(path, "wb");
+    if (!file)
+        return false;
+
+    this->width = width;
+    this->height = height;
+    failed = false;
+    planes.resize(static_cast<size_t>(width) * height + 2 * static_cast<size_t>((width + 1) / 2) * ((height + 1) / 2));
+
+    // The rate is a ratio of integers; thousandths cover 29.97 and friends
+    long long numerator = std::llround(fps * 1000.0);
+    long long denominator = 1000;
+    long long divisor = std::gcd(numerator, denominator);
+    failed = std::fprintf(file, "YUV4MPEG2 W%d H%d F%lld:%lld Ip A1:1 C420jpeg\n", width, height, numerator / divisor, denominator / divisor) < 0;
+    return !failed;
+}
+
+bool Y4mWriter::writeFrame(const uint32_t* pixels) {
+    if (!file)
+        return false;
+
+    unsigned char* lumaPlane = planes.data();
+    int chromaWidth = (width + 1) / 2;
+    int chromaHeight = (height + 1) / 2;
+    unsigned char* bluePlane = lumaPlane + static_cast<size_t>(width) * height;
+    unsigned char* redPlane = bluePlane + static_cast<size_t>(chromaWidth) * chromaHeight;
+
+    // Rows go top first, so row y of the file is row height - 1 - y of the pixels
+    for (int y = 0; y < height; ++y) {
+        const uint32_t* source = pixels + static_cast<size_t>(height - 1 - y) * width;
+        unsigned char* luma = lumaPlane + static_cast<size_t>(y) * width;
+        for (int x = 0; x < width; ++x) {
+            int r = source[x] & 0xFF, g = (source[x] >> 8) & 0xFF, b = (source[x] >> 16) & 0xFF;
+            luma[x] = static_cast<unsigned char>((77 * r + 150 * g + 29 * b + 128) >> 8);
+        }
+    }
+
+    // Chroma from the average of each 2 x 2 block, repeating the last row and
+    // column of odd sizes
+    for (int y = 0; y < chromaHeight; ++y) {
+        const uint32_t* rows[2] = { pixels + static_cast<size_t>(height - 1 - 2 * y) * width,
+                                    pixels + static_cast<size_t>(std::max(height - 2 - 2 * y, 0)) * width };
+        for (int x = 0; x < chromaWidth; ++x) {
+            int columns[2] = { 2 * x, std::min(2 * x + 1, width - 1) };
+            int r = 0, g = 0, b = 0;
+            for (const uint32_t* row : rows) {
+                for (int column : columns) {
+                    r += row[column] & 0xFF;
+                    g += (row[column] >> 8) & 0xFF;
+                    b += (row[column] >> 16) & 0xFF;
+                }
+            }
+            // Sums of four pixels, so the weights carry two more bits of scale;
+            // pure blue and red round up to 256
+            size_t index = static_cast<size_t>(y) * chromaWidth + x;
+            bluePlane[index] = static_cast<unsigned char>(std::min((-43 * r - 85 * g + 128 * b + (128 << 10) + 512) >> 10, 255));
+            redPlane[index] = static_cast<unsigned char>(std::min((128 * r - 107 * g - 21 * b + (128 << 10) + 512) >> 10, 255));
+        }
+    }
+
+    bool written = std::fputs("FRAME\n", file) >= 0 && std::fwrite(planes.data(), 1, planes.size(), file) == planes.size();
+    failed = failed || !written;
+    return written;
+}
+
+bool Y4mWriter::close() {
+    if (!file)
+        return !failed;
+    failed = std::fclose(file) != 0 || failed;
+    file = nullptr;
+    return !failed;
+}
+
+// Next number of a PPM header, skipping whitespace and comments
+static bool readPpmNumber(FILE* file, int& value) {
+    int c = std::fgetc(file);
+    for (;;) {
+        while (c == ' ' || c == '\t' || c == '\n' || c == '\r')
+            c = std::fgetc(file);
+        if (c != '#')
+            break;
+        while (c != '\n' && c != EOF)
+            c = std::fgetc(file);
+    }
+
+    if (c < '0' || c > '9')
+        return false;
+    value = 0;
+    while (c >= '0' && c <= '9') {
+        value = value * 10 + (c - '0');
+        if (value > (1 << 16))
+            return false;
+        c = std::fgetc(file);
+    }
+    // Exactly one whitespace character ends the number; for maxval it is the last header byte
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+bool readPpm(const char* path, int& width, int& height, std::vector<uint32_t>& pixels) {
+    FILE* file = std::fopen(path, "rb");
+    if (!file)
+        return false;
+
+    char magic[2];
+    int maxValue;
+    bool valid = std::fread(magic, 1, 2, file) == 2 && magic[0] == 'P' && magic[1] == '6' &&
+                 readPpmNumber(file, width) && readPpmNumber(file, height) && readPpmNumber(file, maxValue) &&
+                 maxValue == 255 && width > 0 && height > 0;
+
+    if (valid) {
+        pixels.resize(static_cast<size_t>(width) * height);
+        std::vector<unsigned char> row(width * 3);
+        for (int y = height - 1; y >= 0 && valid; --y) {
+            valid = std::fread(row.data(), 1, row.size(), file) == row.size();
+            uint32_t* target = pixels.data() + static_cast<size_t>(y) * width;
+            for (int x = 0; x < width && valid; ++x)
+                target[x] = row[x * 3] | (row[x * 3 + 1] << 8) | (row[x * 3 + 2] << 16) | 0xFF000000u;
+        }
+    }
+
+    std::fclose(file);
+    return valid;
+}
+
+ImageComparison compareImages(const uint32_t* pixels, const uint32_t* reference, size_t count, int tolerance) {
+    ImageComparison result;
+    for (size_t i = 0; i < count; ++i) {
+        int difference = 0;
+        for (int shift = 0; shift < 24; shift += 8) {
+            int a = (pixels[i] >> shift) & 0xFF;
+            int b = (reference[i] >> shift) & 0xFF;
+            difference = std::max(difference, std::abs(a - b));
+        }
+
+        result.maxDifference = std::max(result.maxDifference, difference);
+        if (difference > tolerance)
+            ++result.differingPixels;
+    }
+    return result;
+}
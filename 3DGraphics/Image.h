@@ -0,0 +1,48 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+// Image files for packed RGBA8 pixels stored the way the rasterizer keeps
+// them: bottom row first. Files are written top row first as usual.
+
+// Whether path ends in extension, which has to be lowercase; case is ignored
+bool hasExtension(const char* path, const char* extension);
+// Writes a PNG or a binary PPM, chosen by the extension of path. Safe to call
+// from several threads at once.
+bool writeImage(const char* path, int width, int height, const uint32_t* pixels);
+// Reads a binary PPM (P6, 8 bits per channel), as written by writeImage
+bool readPpm(const char* path, int& width, int& height, std::vector<uint32_t>& pixels);
+
+struct ImageComparison {
+    size_t differingPixels = 0; // pixels with a channel off by more than the tolerance
+    int maxDifference = 0;      // largest difference of any channel
+};
+
+// Compares the color channels of two images of the same size, alpha is ignored
+ImageComparison compareImages(const uint32_t* pixels, const uint32_t* reference, size_t count, int tolerance);
+
+// Raw video as a YUV4MPEG2 stream of 4:2:0 frames in full-range BT.601, the
+// C420jpeg layout ffmpeg and most players read directly
+class Y4mWriter {
+public:
+    Y4mWriter() = default;
+    Y4mWriter(const Y4mWriter&) = delete;
+    Y4mWriter& operator=(const Y4mWriter&) = delete;
+    ~Y4mWriter() { close(); }
+
+    bool open(const char* path, int width, int height, float fps);
+    // width x height pixels, bottom row first like writeImage
+    bool writeFrame(const uint32_t* pixels);
+    // Returns false if anything written since open failed
+    bool close();
+
+private:
+    FILE* file = nullptr;
+    int width = 0;
+    int height = 0;
+    bool failed = false;
+    // The Y, Cb and Cr planes of one frame
+    std::vector<unsigned char> planes;
+};
@@ -0,0 +1,162 @@
+#include "Instancing.h"
+#include "Profiler.h"
+#include "Rasterizer.h"
+
+#include <algorithm>
+#include <cmath>
+
+// Instances tested per job
+static const size_t CULL_BATCH_SIZE = 1024;
+
+void InstanceBuffer::clear() {
+    transforms.clear();
+    colors.clear();
+    changes.clear();
+    ++version;
+}
+
+void InstanceBuffer::add(const glm::mat4& transform, const glm::vec3& color) {
+    transforms.push_back(transform);
+    colors.push_back(color);
+    ++version;
+}
+
+void InstanceBuffer::set(uint32_t index, const glm::mat4& transform, const glm::vec3& color) {
+    changes.push_back(InstanceChange{ index, transforms[index] });
+    transforms[index] = transform;
+    colors[index] = color;
+    ++version;
+}
+
+float lodPixelScale(const glm::mat4& projection, int height) {
+    // projection[1][1] is 1 / tan(fov / 2): how many half-heights one unit at distance one spans
+    return projection[1][1] * height * 0.5f;
+}
+
+// Keeps the current level while its error fits, moves to finer levels while it
+// does not, and to coarser ones only while they fit with the hysteresis to spare
+static uint8_t selectLevel(const MeshView& mesh, uint8_t current, float pixelsPerUnit, float pixelError) {
+    size_t level = std::min<size_t>(current, mesh.levelCount() - 1);
+    while (level > 0 && mesh.levelError(level) * pixelsPerUnit > pixelError)
+        --level;
+    while (level + 1 < mesh.levelCount() && mesh.levelError(level + 1) * pixelsPerUnit <= pixelError * LOD_HYSTERESIS)
+        ++level;
+    return static_cast<uint8_t>(level);
+}
+
+Frustum extractFrustum(const glm::mat4& viewProjection) {
+    // Rows of the matrix; glm stores it column-major
+    glm::vec4 rows[4];
+    for (int i = 0; i < 4; ++i)
+        rows[i] = glm::vec4(viewProjection[0][i], viewProjection[1][i], viewProjection[2][i], viewProjection[3][i]);
+
+    Frustum frustum;
+    frustum.planes[0] = rows[3] + rows[0]; // left
+    frustum.planes[1] = rows[3] - rows[0]; // right
+    frustum.planes[2] = rows[3] + rows[1]; // bottom
+    frustum.planes[3] = rows[3] - rows[1]; // top
+    frustum.planes[4] = rows[3] + rows[2]; // near
+    frustum.planes[5] = rows[3] - rows[2]; // far
+
+    for (glm::vec4& plane : frustum.planes)
+        plane /= glm::length(glm::vec3(plane));
+
+    return frustum;
+}
+
+bool isSphereInFrustum(const Frustum& frustum, const glm::vec3& center, float radius) {
+    for (const glm::vec4& plane : frustum.planes)
+        if (glm::dot(glm::vec3(plane), center) + plane.w < -radius)
+            return false;
+    return true;
+}
+
+// Each instance's bounding sphere is computed once and tested against every
+// view, the survivors of view v go to visible[v]. Occlusion is only tested
+// with a single view, whose viewport is the rasterizer's whole target.
+// views holds viewCount entries of scratch, so nothing is allocated per call.
+static void cullViews(ThreadPool& pool, const MeshView& mesh, const InstanceBuffer& instances, const glm::mat4* viewProjections, size_t viewCount,
+                      CullView* views, const Rasterizer* rasterizer, LodSelection* lods, std::vector<uint32_t>* visible) {
+    size_t instanceCount = instances.size();
+    for (size_t v = 0; v < viewCount; ++v) {
+        const glm::mat4& viewProjection = viewProjections[v];
+        CullView& view = views[v];
+        view.viewProjection = viewProjection;
+        view.frustum = extractFrustum(viewProjection);
+        view.depthRow = glm::vec4(viewProjection[0][3], viewProjection[1][3], viewProjection[2][3], viewProjection[3][3]);
+        view.lods = lods ? &lods[v] : nullptr;
+        view.selectLevels = lods && lods[v].pixelScale > 0.0f && mesh.levelCount() > 1;
+        if (lods)
+            lods[v].levels.resize(instanceCount, 0);
+        visible[v].resize(instanceCount);
+    }
+
+    // Sphere around the mesh's bounding box, in object space
+    glm::vec3 center = (mesh.boundsMin + mesh.boundsMax) * 0.5f;
+    float radius = glm::length(mesh.boundsMax - mesh.boundsMin) * 0.5f;
+
+    // Each job marks its own range, the survivors are gathered afterwards so the
+    // order does not depend on which worker ran which batch
+    int width = rasterizer ? rasterizer->getTarget().width : 0;
+    int height = rasterizer ? rasterizer->getTarget().height : 0;
+
+    int batchCount = static_cast<int>((instanceCount + CULL_BATCH_SIZE - 1) / CULL_BATCH_SIZE);
+    pool.parallelFor(batchCount, [&](int batch, unsigned) {
+        PROFILE_SCOPE(ProfileStage::Cull, "Cull");
+        size_t begin = batch * CULL_BATCH_SIZE;
+        size_t end = std::min(begin + CULL_BATCH_SIZE, instanceCount);
+
+        for (size_t i = begin; i < end; ++i) {
+            const glm::mat4& model = instances.transforms[i];
+            glm::vec3 worldCenter = glm::vec3(model * glm::vec4(center, 1.0f));
+            // The largest axis scale keeps the sphere conservative under non-uniform scaling
+            float scale = std::max(std::max(glm::length(glm::vec3(model[0])), glm::length(glm::vec3(model[1]))), glm::length(glm::vec3(model[2])));
+
+            for (size_t v = 0; v < viewCount; ++v) {
+                const CullView& view = views[v];
+                bool keep = isSphereInFrustum(view.frustum, worldCenter, radius * scale);
+                if (keep && rasterizer) {
+                    // Boxes crossing the near plane have no usable screen rect and are always kept
+                    PixelRect rect;
+                    float minZ;
+                    if (projectBox(view.viewProjection * model, mesh.boundsMin, mesh.boundsMax, width, height, rect, minZ))
+                        keep = rasterizer->isRectDirty(rect) && !rasterizer->isOccluded(rect, minZ);
+                }
+
+                // Sized by the nearest point of the sphere; from inside it everything is near
+                if (keep && view.lods) {
+                    uint8_t& level = view.lods->levels[i];
+                    float distance = glm::dot(view.depthRow, glm::vec4(worldCenter, 1.0f)) - radius * scale;
+                    if (view.selectLevels && distance > 0.0f)
+                        level = selectLevel(mesh, level, scale * view.lods->pixelScale / distance, view.lods->pixelError);
+                    else
+                        level = 0;
+                }
+
+                visible[v][i] = keep ? 1u : 0u;
+            }
+        }
+    });
+
+    for (size_t v = 0; v < viewCount; ++v) {
+        std::vector<uint32_t>& survivors = visible[v];
+        size_t visibleCount = 0;
+        for (size_t i = 0; i < instanceCount; ++i)
+            if (survivors[i])
+                survivors[visibleCount++] = static_cast<uint32_t>(i);
+        survivors.resize(visibleCount);
+    }
+}
+
+void cullInstances(ThreadPool& pool, const MeshView& mesh, const InstanceBuffer& instances, const glm::mat4& viewProjection,
+                   const Rasterizer* rasterizer, LodSelection* lods, std::vector<uint32_t>& visible) {
+    CullView view;
+    cullViews(pool, mesh, instances, &viewProjection, 1, &view, rasterizer, lods, &visible);
+}
+
+void cullInstances(ThreadPool& pool, const MeshView& mesh, const InstanceBuffer& instances, const glm::mat4* viewProjections, size_t viewCount,
+                   LodSelection* lods, std::vector<uint32_t>* visible, std::vector<CullView>& views) {
+    if (views.size() < viewCount)
+        views.resize(viewCount);
+    cullViews(pool, mesh, instances, viewProjections, viewCount, views.data(), nullptr, lods, visible);
+}
@@ -0,0 +1,86 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <vector>
+
+#include "Mesh.h"
+#include "ThreadPool.h"
+
+class Rasterizer;
+
+// An instance changed through InstanceBuffer::set, with its transform from before
+struct InstanceChange {
+    uint32_t index;
+    glm::mat4 previousTransform;
+};
+
+// Per-instance data for drawing one mesh many times: instance i uses
+// transforms[i] as its model matrix and multiplies the mesh colors by colors[i].
+//
+// Changes made through the methods are tracked so a renderer can tell whether
+// anything moved since it last looked: version counts every change, and
+// changes lists the instances modified by set() since clearChanges().
+struct InstanceBuffer {
+    std::vector<glm::mat4> transforms;
+    std::vector<glm::vec3> colors;
+    std::vector<InstanceChange> changes;
+    uint64_t version = 0;
+
+    size_t size() const { return transforms.size(); }
+    void clear();
+    void add(const glm::mat4& transform, const glm::vec3& color = glm::vec3(1.0f));
+    void set(uint32_t index, const glm::mat4& transform, const glm::vec3& color);
+    void clearChanges() { changes.clear(); }
+};
+
+// An instance only moves to a coarser level of detail once that level's error
+// is below this fraction of the allowed error, so an instance right at a
+// threshold does not switch back and forth between two levels every frame
+#define LOD_HYSTERESIS 0.75f
+
+// Level of detail per instance, chosen by cullInstances from how large the
+// error of each level of the mesh would appear on screen. Levels are kept from
+// frame to frame for the hysteresis.
+struct LodSelection {
+    float pixelScale = 0.0f;        // see lodPixelScale; 0 keeps every instance at full detail
+    float pixelError = 1.0f;        // largest error a level may show, in pixels
+    std::vector<uint8_t> levels;    // per instance, valid for the visible ones
+};
+
+// Pixels covered by one unit at distance one from the camera, for a projection
+// from calculateProjectionMatrix and a target height pixels high
+float lodPixelScale(const glm::mat4& projection, int height);
+
+// The six planes of a view frustum in world space, normalized so that
+// dot(xyz, p) + w is the signed distance of p, positive inside
+struct Frustum {
+    glm::vec4 planes[6];
+};
+
+Frustum extractFrustum(const glm::mat4& viewProjection);
+bool isSphereInFrustum(const Frustum& frustum, const glm::vec3& center, float radius);
+
+// What culling needs to know about one view
+struct CullView {
+    glm::mat4 viewProjection;
+    Frustum frustum;
+    // The clip-space w of a point is its distance in front of the camera
+    glm::vec4 depthRow;
+    LodSelection* lods;
+    bool selectLevels;
+};
+
+// Tests every instance's bounding sphere against the view frustum in batches on
+// the pool and writes the indices of the survivors to visible, in buffer order.
+// With a rasterizer, instances hidden behind what it has already flushed, or
+// lying entirely in tiles it keeps from the last frame, are dropped as well.
+// With lods, the level of detail of every survivor is picked along the way.
+void cullInstances(ThreadPool& pool, const MeshView& mesh, const InstanceBuffer& instances, const glm::mat4& viewProjection,
+                   const Rasterizer* rasterizer, LodSelection* lods, std::vector<uint32_t>& visible);
+// The same for several views in one pass, which computes each instance's
+// bounding sphere once for all of them. The survivors of view v go to
+// visible[v]; lods is null or holds one selection per view. Nothing is culled
+// by occlusion. views is the caller's scratch, grown to viewCount and kept so
+// the frame loop does not allocate.
+void cullInstances(ThreadPool& pool, const MeshView& mesh, const InstanceBuffer& instances, const glm::mat4* viewProjections, size_t viewCount,
+                   LodSelection* lods, std::vector<uint32_t>* visible, std::vector<CullView>& views);
@@ -0,0 +1,82 @@
+#include "Mesh.h"
+
+#include <array>
+#include <map>
+
+MeshView::MeshView(const Mesh& mesh)
+    : positions(mesh.positions.data()), colors(mesh.colors.data()), normals(mesh.normals.data()), indices(mesh.indices.data()),
+      positionCount(mesh.positions.size()), indexCount(mesh.indices.size()),
+      boundsMin(mesh.boundsMin), boundsMax(mesh.boundsMax),
+      lods(mesh.lods.data()), lodIndices(mesh.lodIndices.data()), lodCount(mesh.lods.size()) {
+}
+
+MeshView MeshView::level(size_t level) const {
+    if (level == 0)
+        return *this;
+
+    const MeshLod& lod = lods[level - 1];
+    MeshView view = *this;
+    view.indices = lodIndices + lod.indexOffset;
+    view.positionCount = lod.vertexCount;
+    view.indexCount = static_cast<size_t>(lod.indexCount);
+    view.lods = nullptr;
+    view.lodIndices = nullptr;
+    view.lodCount = 0;
+    return view;
+}
+
+Mesh createIndexedMesh(const float* vertices, const float* colors, int vertexCount) {
+    Mesh mesh;
+    mesh.indices.reserve(vertexCount);
+
+    std::map<std::array<float, 6>, uint32_t> uniqueVertices;
+    for (int i = 0; i < vertexCount; ++i) {
+        std::array<float, 6> key = {
+            vertices[i * 3], vertices[i * 3 + 1], vertices[i * 3 + 2],
+            colors[i * 3], colors[i * 3 + 1], colors[i * 3 + 2]
+        };
+
+        auto inserted = uniqueVertices.emplace(key, static_cast<uint32_t>(mesh.positions.size()));
+        if (inserted.second) {
+            mesh.positions.emplace_back(key[0], key[1], key[2]);
+            mesh.colors.emplace_back(key[3], key[4], key[5]);
+        }
+        mesh.indices.push_back(inserted.first->second);
+    }
+
+    computeBounds(mesh);
+    computeNormals(mesh);
+    return mesh;
+}
+
+void computeBounds(Mesh& mesh) {
+    if (mesh.positions.empty()) {
+        mesh.boundsMin = mesh.boundsMax = glm::vec3(0.0f);
+        return;
+    }
+
+    mesh.boundsMin = mesh.boundsMax = mesh.positions[0];
+    for (const glm::vec3& position : mesh.positions) {
+        mesh.boundsMin = glm::min(mesh.boundsMin, position);
+        mesh.boundsMax = glm::max(mesh.boundsMax, position);
+    }
+}
+
+void computeNormals(Mesh& mesh) {
+    mesh.normals.assign(mesh.positions.size(), glm::vec3(0.0f));
+
+    // The cross product's length is twice the triangle's area, which is the weight
+    for (size_t i = 0; i + 2 < mesh.indices.size(); i += 3) {
+        uint32_t i0 = mesh.indices[i], i1 = mesh.indices[i + 1], i2 = mesh.indices[i + 2];
+        glm::vec3 faceNormal = glm::cross(mesh.positions[i1] - mesh.positions[i0], mesh.positions[i2] - mesh.positions[i0]);
+        mesh.normals[i0] += faceNormal;
+        mesh.normals[i1] += faceNormal;
+        mesh.normals[i2] += faceNormal;
+    }
+
+    for (glm::vec3& normal : mesh.normals) {
+        float length = glm::length(normal);
+        // Vertices of degenerate triangles only, any direction will do
+        normal = length > 0.0f ? normal / length : glm::vec3(0.0f, 0.0f, 1.0f);
+    }
+}
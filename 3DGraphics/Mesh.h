@@ -0,0 +1,73 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <vector>
+
+// Levels of detail of one mesh at most, the full mesh included
+#define MAX_MESH_LEVELS 8
+
+// A simplified version of a mesh, see MeshSimplify.h. Its indices only refer
+// to the first vertexCount vertices: the vertices are ordered so that those of
+// every coarser level come first.
+struct MeshLod {
+    uint64_t indexOffset;   // into the mesh's lodIndices
+    uint64_t indexCount;
+    uint32_t vertexCount;
+    float error;            // how far the simplified surface is from the full one, in model units
+};
+
+// Indexed triangle mesh: every unique vertex is stored once and the index
+// buffer holds three entries per triangle
+struct Mesh {
+    std::vector<glm::vec3> positions;
+    std::vector<glm::vec3> colors;
+    // Unit length, one per vertex, see computeNormals
+    std::vector<glm::vec3> normals;
+    std::vector<uint32_t> indices;
+    glm::vec3 boundsMin = glm::vec3(0.0f);
+    glm::vec3 boundsMax = glm::vec3(0.0f);
+    // Coarser levels of detail, finest first; their indices one list after the other
+    std::vector<MeshLod> lods;
+    std::vector<uint32_t> lodIndices;
+
+    size_t vertexCount() const { return positions.size(); }
+    size_t triangleCount() const { return indices.size() / 3; }
+};
+
+// Read-only view of indexed mesh data that lives elsewhere, either in a Mesh
+// or in a memory-mapped mesh cache. The rendering stages only read meshes
+// through views, so mapped files are drawn without being copied.
+struct MeshView {
+    const glm::vec3* positions = nullptr;
+    const glm::vec3* colors = nullptr;
+    const glm::vec3* normals = nullptr;
+    const uint32_t* indices = nullptr;
+    size_t positionCount = 0;
+    size_t indexCount = 0;
+    glm::vec3 boundsMin = glm::vec3(0.0f);
+    glm::vec3 boundsMax = glm::vec3(0.0f);
+    const MeshLod* lods = nullptr;
+    const uint32_t* lodIndices = nullptr;
+    size_t lodCount = 0;
+
+    MeshView() {}
+    MeshView(const Mesh& mesh);
+
+    size_t vertexCount() const { return positionCount; }
+    size_t triangleCount() const { return indexCount / 3; }
+
+    // Level 0 is the mesh itself, the levels after it its simplified versions.
+    // A level shares the vertex arrays and bounds of the full mesh.
+    size_t levelCount() const { return lodCount + 1; }
+    MeshView level(size_t level) const;
+    float levelError(size_t level) const { return level == 0 ? 0.0f : lods[level - 1].error; }
+};
+
+// Builds an indexed mesh from flat triangle-list arrays (three floats per
+// vertex), merging vertices whose position and color are identical
+Mesh createIndexedMesh(const float* vertices, const float* colors, int vertexCount);
+void computeBounds(Mesh& mesh);
+// Vertex normals as the area-weighted average of the adjacent triangles'
+// normals. Vertices are only shared within a smooth surface, so hard edges
+// such as a cube's keep one vertex per face and stay hard.
+void computeNormals(Mesh& mesh);
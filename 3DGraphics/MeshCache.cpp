@@ -0,0 +1,325 @@
+#include "MeshCache.h"
+#include "MeshImport.h"
+#include "MeshSimplify.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <process.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+static const char MESH_CACHE_MAGIC[8] = "3DGMESH";
+
+// Sections start on cache-line boundaries
+static uint64_t alignOffset(uint64_t offset) {
+    return (offset + 63) & ~uint64_t(63);
+}
+
+static bool getFileInfo(const char* path, uint64_t& size, int64_t& time) {
+#ifdef _WIN32
+    struct _stat64 info;
+    if (_stat64(path, &info) != 0)
+        return false;
+#else
+    struct stat info;
+    if (stat(path, &info) != 0)
+        return false;
+#endif
+    size = static_cast<uint64_t>(info.st_size);
+    time = static_cast<int64_t>(info.st_mtime);
+    return true;
+}
+
+// ftell is limited to a long, which is 32 bits on Windows
+static int64_t filePosition(FILE* file) {
+#ifdef _WIN32
+    return _ftelli64(file);
+#else
+    return static_cast<int64_t>(ftello(file));
+#endif
+}
+
+// Whether count elements of elementSize bytes from offset lie inside size
+// bytes, without the sums that a corrupt offset could wrap around
+static bool sectionFits(uint64_t offset, uint64_t count, uint64_t elementSize, uint64_t size) {
+    return offset <= size && count <= (size - offset) / elementSize;
+}
+
+static bool writeBytes(FILE* file, uint64_t offset, const void* bytes, size_t size) {
+    static const char zeros[64] = {};
+    // Pad up to the section start
+    int64_t position = filePosition(file);
+    if (position < 0 || static_cast<uint64_t>(position) > offset)
+        return false;
+    if (std::fwrite(zeros, 1, static_cast<size_t>(offset - position), file) != offset - position)
+        return false;
+    return size == 0 || std::fwrite(bytes, 1, size, file) == size;
+}
+
+bool writeMeshCache(const char* path, const MeshView& mesh, uint64_t sourceSize, int64_t sourceTime, std::string& error) {
+    MeshCacheHeader header = {};
+    std::memcpy(header.magic, MESH_CACHE_MAGIC, sizeof(header.magic));
+    header.version = MESH_CACHE_VERSION;
+    header.headerSize = sizeof(MeshCacheHeader);
+    header.sourceSize = sourceSize;
+    header.sourceTime = sourceTime;
+    header.vertexCount = mesh.vertexCount();
+    header.indexCount = mesh.indexCount;
+    header.positionsOffset = alignOffset(sizeof(MeshCacheHeader));
+    header.colorsOffset = alignOffset(header.positionsOffset + header.vertexCount * sizeof(glm::vec3));
+    header.normalsOffset = alignOffset(header.colorsOffset + header.vertexCount * sizeof(glm::vec3));
+    header.indicesOffset = alignOffset(header.normalsOffset + header.vertexCount * sizeof(glm::vec3));
+    header.lodCount = mesh.lodCount;
+    header.lodsOffset = alignOffset(header.indicesOffset + header.indexCount * sizeof(uint32_t));
+    header.lodIndexCount = 0;
+    for (size_t level = 0; level < mesh.lodCount; ++level)
+        header.lodIndexCount = std::max(header.lodIndexCount, mesh.lods[level].indexOffset + mesh.lods[level].indexCount);
+    header.lodIndicesOffset = alignOffset(header.lodsOffset + header.lodCount * sizeof(MeshLod));
+    for (int i = 0; i < 3; ++i) {
+        header.boundsMin[i] = mesh.boundsMin[i];
+        header.boundsMax[i] = mesh.boundsMax[i];
+    }
+
+    // Unique per writer, so processes loading the same model never share one
+    static std::atomic<unsigned> temporaryCount(0);
+#ifdef _WIN32
+    int processId = _getpid();
+#else
+    int processId = static_cast<int>(getpid());
+#endif
+    std::string temporaryPath = std::string(path) + "." + std::to_string(processId) + "." + std::to_string(temporaryCount++) + ".tmp";
+    FILE* file = std::fopen(temporaryPath.c_str(), "wb");
+    if (!file) {
+        error = "cannot create " + temporaryPath;
+        return false;
+    }
+
+    bool written = writeBytes(file, 0, &header, sizeof(header)) &&
+                   writeBytes(file, header.positionsOffset, mesh.positions, header.vertexCount * sizeof(glm::vec3)) &&
+                   writeBytes(file, header.colorsOffset, mesh.colors, header.vertexCount * sizeof(glm::vec3)) &&
+                   writeBytes(file, header.normalsOffset, mesh.normals, header.vertexCount * sizeof(glm::vec3)) &&
+                   writeBytes(file, header.indicesOffset, mesh.indices, header.indexCount * sizeof(uint32_t)) &&
+                   writeBytes(file, header.lodsOffset, mesh.lods, header.lodCount * sizeof(MeshLod)) &&
+                   writeBytes(file, header.lodIndicesOffset, mesh.lodIndices, header.lodIndexCount * sizeof(uint32_t));
+    written = (std::fclose(file) == 0) && written;
+
+    if (!written) {
+        std::remove(temporaryPath.c_str());
+        error = "cannot write " + temporaryPath;
+        return false;
+    }
+
+    // Fails on Windows while another process has the old cache mapped
+#ifdef _WIN32
+    bool replaced = MoveFileExA(temporaryPath.c_str(), path, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    bool replaced = std::rename(temporaryPath.c_str(), path) == 0;
+#endif
+    if (!replaced) {
+        std::remove(temporaryPath.c_str());
+        error = std::string("cannot replace ") + path;
+        return false;
+    }
+    return true;
+}
+
+MappedMesh::~MappedMesh() {
+    close();
+}
+
+bool MappedMesh::open(const char* path, std::string& error) {
+    close();
+
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        error = std::string("cannot open ") + path;
+        return false;
+    }
+
+    LARGE_INTEGER fileSize;
+    HANDLE mapping = nullptr;
+    if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0)
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    // The mapping keeps the file open on its own
+    CloseHandle(file);
+    if (!mapping) {
+        error = std::string("cannot map ") + path;
+        return false;
+    }
+
+    data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!data) {
+        CloseHandle(mapping);
+        error = std::string("cannot map ") + path;
+        return false;
+    }
+    mappingHandle = mapping;
+    size = static_cast<size_t>(fileSize.QuadPart);
+#else
+    int file = ::open(path, O_RDONLY);
+    if (file < 0) {
+        error = std::string("cannot open ") + path;
+        return false;
+    }
+
+    struct stat info;
+    void* mapped = MAP_FAILED;
+    if (fstat(file, &info) == 0 && info.st_size > 0)
+        mapped = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, file, 0);
+    // The mapping keeps the file open on its own
+    ::close(file);
+    if (mapped == MAP_FAILED) {
+        error = std::string("cannot map ") + path;
+        return false;
+    }
+
+    data = mapped;
+    size = static_cast<size_t>(info.st_size);
+#endif
+
+    // Everything below is read straight from the file, so check it before trusting it
+    const MeshCacheHeader& header = this->header();
+    bool valid = size >= sizeof(MeshCacheHeader) &&
+                 std::memcmp(header.magic, MESH_CACHE_MAGIC, sizeof(header.magic)) == 0 &&
+                 header.version == MESH_CACHE_VERSION &&
+                 header.headerSize == sizeof(MeshCacheHeader) &&
+                 header.vertexCount <= UINT32_MAX &&
+                 header.indexCount % 3 == 0 &&
+                 header.positionsOffset % 64 == 0 && header.colorsOffset % 64 == 0 &&
+                 header.normalsOffset % 64 == 0 && header.indicesOffset % 64 == 0 &&
+                 sectionFits(header.positionsOffset, header.vertexCount, sizeof(glm::vec3), size) &&
+                 sectionFits(header.colorsOffset, header.vertexCount, sizeof(glm::vec3), size) &&
+                 sectionFits(header.normalsOffset, header.vertexCount, sizeof(glm::vec3), size) &&
+                 sectionFits(header.indicesOffset, header.indexCount, sizeof(uint32_t), size) &&
+                 header.lodCount < MAX_MESH_LEVELS &&
+                 header.lodsOffset % 64 == 0 && header.lodIndicesOffset % 64 == 0 &&
+                 sectionFits(header.lodsOffset, header.lodCount, sizeof(MeshLod), size) &&
+                 sectionFits(header.lodIndicesOffset, header.lodIndexCount, sizeof(uint32_t), size);
+    if (!valid) {
+        close();
+        error = std::string("not a valid mesh cache: ") + path;
+        return false;
+    }
+
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    meshView.positions = reinterpret_cast<const glm::vec3*>(bytes + header.positionsOffset);
+    meshView.colors = reinterpret_cast<const glm::vec3*>(bytes + header.colorsOffset);
+    meshView.normals = reinterpret_cast<const glm::vec3*>(bytes + header.normalsOffset);
+    meshView.indices = reinterpret_cast<const uint32_t*>(bytes + header.indicesOffset);
+    meshView.positionCount = static_cast<size_t>(header.vertexCount);
+    meshView.indexCount = static_cast<size_t>(header.indexCount);
+    meshView.boundsMin = glm::vec3(header.boundsMin[0], header.boundsMin[1], header.boundsMin[2]);
+    meshView.boundsMax = glm::vec3(header.boundsMax[0], header.boundsMax[1], header.boundsMax[2]);
+    meshView.lods = reinterpret_cast<const MeshLod*>(bytes + header.lodsOffset);
+    meshView.lodIndices = reinterpret_cast<const uint32_t*>(bytes + header.lodIndicesOffset);
+    meshView.lodCount = static_cast<size_t>(header.lodCount);
+
+    // An index past the vertex arrays would make the vertex stage read outside the mapping
+    for (size_t i = 0; i < meshView.indexCount; ++i) {
+        if (meshView.indices[i] >= meshView.positionCount) {
+            close();
+            error = std::string("mesh cache has an index out of range: ") + path;
+            return false;
+        }
+    }
+    // Same for the levels, which may only use the vertices in front of their count
+    for (size_t level = 0; level < meshView.lodCount; ++level) {
+        const MeshLod& lod = meshView.lods[level];
+        bool levelValid = lod.indexCount % 3 == 0 && lod.vertexCount <= meshView.positionCount &&
+                          lod.indexOffset <= header.lodIndexCount && lod.indexCount <= header.lodIndexCount - lod.indexOffset;
+        for (uint64_t i = 0; levelValid && i < lod.indexCount; ++i)
+            levelValid = meshView.lodIndices[lod.indexOffset + i] < lod.vertexCount;
+        if (!levelValid) {
+            close();
+            error = std::string("mesh cache has an invalid level of detail: ") + path;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void MappedMesh::adopt(Mesh&& mesh) {
+    close();
+    adopted = std::move(mesh);
+    isAdopted = true;
+    meshView = MeshView(adopted);
+}
+
+void MappedMesh::close() {
+    if (isAdopted) {
+        adopted = Mesh();
+        isAdopted = false;
+        meshView = MeshView();
+    }
+    if (!data)
+        return;
+
+#ifdef _WIN32
+    UnmapViewOfFile(data);
+    CloseHandle(static_cast<HANDLE>(mappingHandle));
+#else
+    munmap(const_cast<void*>(data), size);
+#endif
+    data = nullptr;
+    size = 0;
+    mappingHandle = nullptr;
+    meshView = MeshView();
+}
+
+// Opens the cache at cachePath if it was built from this version of the source
+static bool openMatchingCache(const std::string& cachePath, uint64_t sourceSize, int64_t sourceTime, MappedMesh& mesh, std::string& error) {
+    if (!mesh.open(cachePath.c_str(), error))
+        return false;
+    if (mesh.header().sourceSize != sourceSize || mesh.header().sourceTime != sourceTime) {
+        mesh.close();
+        error = "out of date mesh cache " + cachePath;
+        return false;
+    }
+    return true;
+}
+
+bool loadMesh(const char* path, MappedMesh& mesh, std::string& error) {
+    uint64_t sourceSize;
+    int64_t sourceTime;
+    if (!getFileInfo(path, sourceSize, sourceTime)) {
+        error = std::string("cannot find ") + path;
+        return false;
+    }
+
+    // Warm start: the cache matches the source, nothing to parse
+    std::string cachePath = std::string(path) + MESH_CACHE_EXTENSION;
+    std::string cacheError;
+    if (openMatchingCache(cachePath, sourceSize, sourceTime, mesh, cacheError))
+        return true;
+
+    Mesh imported;
+    if (!importMesh(path, imported, error))
+        return false;
+    generateLods(imported);
+    // A write that lost the race to another process loading the same model
+    // still finds that process's cache
+    std::string writeError;
+    bool written = writeMeshCache(cachePath.c_str(), imported, sourceSize, sourceTime, writeError);
+    if (openMatchingCache(cachePath, sourceSize, sourceTime, mesh, cacheError))
+        return true;
+
+    // A read-only directory only costs the next load its import
+    std::fprintf(stderr, "Drawing %s without a mesh cache: %s\n", path, written ? cacheError.c_str() : writeError.c_str());
+    mesh.adopt(std::move(imported));
+    return true;
+}
@@ -0,0 +1,77 @@
+#pragma once
+#include <cstdint>
+#include <string>
+
+#include "Mesh.h"
+
+// Compact binary mesh file: a header followed by the position, color, normal and index
+// arrays exactly as MeshView expects them, each starting on a 64-byte boundary,
+// then the levels of detail and their indices. The file is memory-mapped and
+// drawn in place, so opening it costs little more than mapping the pages. Data
+// is stored in the host's (little-endian) byte order.
+#define MESH_CACHE_VERSION 3
+#define MESH_CACHE_EXTENSION ".meshcache"
+
+struct MeshCacheHeader {
+    char magic[8];            // "3DGMESH" and a zero byte
+    uint32_t version;
+    uint32_t headerSize;
+    // Size and modification time of the file the cache was built from
+    uint64_t sourceSize;
+    int64_t sourceTime;
+    uint64_t vertexCount;
+    uint64_t indexCount;
+    uint64_t positionsOffset;
+    uint64_t colorsOffset;
+    uint64_t normalsOffset;
+    uint64_t indicesOffset;
+    float boundsMin[3];
+    float boundsMax[3];
+    uint64_t lodCount;
+    uint64_t lodIndexCount;
+    uint64_t lodsOffset;
+    uint64_t lodIndicesOffset;
+};
+
+// Writes mesh to path through a temporary file, so a crash never leaves a
+// half-written cache behind. The temporary is unique to the writer, so several
+// processes may write the same cache at once; the last replace wins.
+bool writeMeshCache(const char* path, const MeshView& mesh, uint64_t sourceSize, int64_t sourceTime, std::string& error);
+
+// Read-only memory mapping of a mesh cache file, or the imported mesh itself
+// when no cache could be written for it
+class MappedMesh {
+public:
+    MappedMesh() {}
+    ~MappedMesh();
+
+    MappedMesh(const MappedMesh&) = delete;
+    MappedMesh& operator=(const MappedMesh&) = delete;
+
+    // Maps the file and checks that the header and every index are in range
+    bool open(const char* path, std::string& error);
+    // Takes over a mesh held in memory instead of a mapped file
+    void adopt(Mesh&& mesh);
+    void close();
+
+    bool isOpen() const { return data != nullptr || isAdopted; }
+    const MeshView& view() const { return meshView; }
+    // Only for a mapped file
+    const MeshCacheHeader& header() const { return *static_cast<const MeshCacheHeader*>(data); }
+
+private:
+    const void* data = nullptr;
+    size_t size = 0;
+    // Windows keeps a mapping object open next to the view
+    void* mappingHandle = nullptr;
+    Mesh adopted;
+    bool isAdopted = false;
+    MeshView meshView;
+};
+
+// Loads a model through the cache file next to it (path + MESH_CACHE_EXTENSION).
+// If the cache is missing, unreadable or was built from a different version of
+// the source, the source is imported again, its levels of detail generated and
+// the cache rewritten. The cache only speeds up the next load: if it cannot be
+// written, the problem is logged and the imported mesh is used as it is.
+bool loadMesh(const char* path, MappedMesh& mesh, std::string& error);
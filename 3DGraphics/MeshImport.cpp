@@ -0,0 +1,484 @@
+#include "MeshImport.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+// Bytes read from the file at a time
+static const size_t IMPORT_CHUNK_SIZE = 1 << 20;
+
+// Reads a file through a fixed buffer, as lines or as raw bytes. The buffer
+// only grows if a single line or record does not fit into it.
+class ChunkReader {
+public:
+    explicit ChunkReader(FILE* file) : file(file), buffer(IMPORT_CHUNK_SIZE + 1) {}
+
+    // Points line at the next line, null-terminated and without its line break.
+    // The pointer stays valid until the next read. False at the end of the file.
+    bool readLine(char*& line) {
+        size_t scanned = begin;
+        for (;;) {
+            char* newline = static_cast<char*>(std::memchr(&buffer[scanned], '\n', end - scanned));
+            if (newline) {
+                *newline = '\0';
+                line = &buffer[begin];
+                begin = newline - buffer.data() + 1;
+                break;
+            }
+
+            scanned = end - begin;
+            if (!refill()) {
+                if (begin == end)
+                    return false;
+                // Last line without a line break
+                buffer[end] = '\0';
+                line = &buffer[begin];
+                begin = end;
+                break;
+            }
+            scanned += begin;
+        }
+
+        size_t length = std::strlen(line);
+        if (length > 0 && line[length - 1] == '\r')
+            line[length - 1] = '\0';
+        return true;
+    }
+
+    bool read(void* output, size_t size) {
+        while (end - begin < size)
+            if (!refill())
+                return false;
+
+        std::memcpy(output, &buffer[begin], size);
+        begin += size;
+        return true;
+    }
+
+private:
+    // Moves the unread bytes to the front and reads more after them
+    bool refill() {
+        if (atEnd)
+            return false;
+
+        std::memmove(buffer.data(), &buffer[begin], end - begin);
+        end -= begin;
+        begin = 0;
+        if (end == buffer.size() - 1)
+            buffer.resize((buffer.size() - 1) * 2 + 1);
+
+        size_t count = std::fread(&buffer[end], 1, buffer.size() - 1 - end, file);
+        end += count;
+        if (count == 0)
+            atEnd = true;
+        return count > 0;
+    }
+
+    FILE* file;
+    // One byte more than is ever read, so the last line can be null-terminated
+    std::vector<char> buffer;
+    size_t begin = 0;
+    size_t end = 0;
+    bool atEnd = false;
+};
+
+static const char* skipSpaces(const char* text) {
+    while (*text == ' ' || *text == '\t')
+        ++text;
+    return text;
+}
+
+// Gives meshes without vertex colors a gradient over their bounding box
+static void colorByPosition(Mesh& mesh) {
+    glm::vec3 extent = glm::max(mesh.boundsMax - mesh.boundsMin, glm::vec3(1e-20f));
+    for (size_t i = 0; i < mesh.positions.size(); ++i)
+        mesh.colors[i] = glm::vec3(0.3f) + 0.7f * (mesh.positions[i] - mesh.boundsMin) / extent;
+}
+
+static bool checkIndices(const Mesh& mesh, std::string& error) {
+    for (uint32_t index : mesh.indices) {
+        if (index >= mesh.positions.size()) {
+            error = "face refers to vertex " + std::to_string(index + 1) + " of " + std::to_string(mesh.positions.size());
+            return false;
+        }
+    }
+    return true;
+}
+
+bool importObj(const char* path, Mesh& mesh, std::string& error) {
+    FILE* file = std::fopen(path, "rb");
+    if (!file) {
+        error = std::string("cannot open ") + path;
+        return false;
+    }
+
+    mesh = Mesh();
+    ChunkReader reader(file);
+    bool hasColors = false;
+    std::vector<uint32_t> polygon;
+    size_t lineNumber = 0;
+    char* line;
+
+    while (reader.readLine(line)) {
+        ++lineNumber;
+        const char* cursor = skipSpaces(line);
+
+        if (cursor[0] == 'v' && (cursor[1] == ' ' || cursor[1] == '\t')) {
+            float values[6];
+            int count = 0;
+            char* next;
+            cursor += 1;
+            while (count < 6) {
+                values[count] = std::strtof(cursor, &next);
+                if (next == cursor)
+                    break;
+                cursor = next;
+                ++count;
+            }
+            if (count < 3) {
+                std::fclose(file);
+                error = "line " + std::to_string(lineNumber) + ": vertex needs three coordinates";
+                return false;
+            }
+
+            mesh.positions.emplace_back(values[0], values[1], values[2]);
+            if (count == 6) {
+                mesh.colors.emplace_back(values[3], values[4], values[5]);
+                hasColors = true;
+            } else {
+                mesh.colors.emplace_back(1.0f);
+            }
+        } else if (cursor[0] == 'f' && (cursor[1] == ' ' || cursor[1] == '\t')) {
+            // Each corner is v, v/vt, v//vn or v/vt/vn; only v is used
+            polygon.clear();
+            cursor += 1;
+            for (;;) {
+                cursor = skipSpaces(cursor);
+                char* next;
+                long index = std::strtol(cursor, &next, 10);
+                if (next == cursor)
+                    break;
+                cursor = next;
+                while (*cursor && *cursor != ' ' && *cursor != '\t')
+                    ++cursor;
+
+                // Negative indices count back from the last vertex read so far
+                long resolved = index < 0 ? static_cast<long>(mesh.positions.size()) + index : index - 1;
+                if (index == 0 || resolved < 0) {
+                    std::fclose(file);
+                    error = "line " + std::to_string(lineNumber) + ": invalid vertex index";
+                    return false;
+                }
+                polygon.push_back(static_cast<uint32_t>(resolved));
+            }
+
+            for (size_t k = 1; k + 1 < polygon.size(); ++k) {
+                mesh.indices.push_back(polygon[0]);
+                mesh.indices.push_back(polygon[k]);
+                mesh.indices.push_back(polygon[k + 1]);
+            }
+        }
+    }
+
+    std::fclose(file);
+
+    if (!checkIndices(mesh, error))
+        return false;
+
+    computeBounds(mesh);
+    computeNormals(mesh);
+    if (!hasColors)
+        colorByPosition(mesh);
+    return true;
+}
+
+enum class PlyFormat {
+    Ascii,
+    BinaryLittleEndian,
+    BinaryBigEndian
+};
+
+struct PlyProperty {
+    std::string name;
+    int size = 0;          // bytes of one value, or of one item for lists
+    bool isFloat = false;
+    bool isSigned = false;
+    bool isList = false;
+    int countSize = 0;     // bytes of the list length
+};
+
+struct PlyElement {
+    std::string name;
+    size_t count = 0;
+    std::vector<PlyProperty> properties;
+};
+
+static bool parsePlyType(const std::string& type, int& size, bool& isFloat, bool& isSigned) {
+    static const struct {
+        const char* name;
+        int size;
+        bool isFloat;
+        bool isSigned;
+    } types[] = {
+        { "char", 1, false, true }, { "int8", 1, false, true },
+        { "uchar", 1, false, false }, { "uint8", 1, false, false },
+        { "short", 2, false, true }, { "int16", 2, false, true },
+        { "ushort", 2, false, false }, { "uint16", 2, false, false },
+        { "int", 4, false, true }, { "int32", 4, false, true },
+        { "uint", 4, false, false }, { "uint32", 4, false, false },
+        { "float", 4, true, true }, { "float32", 4, true, true },
+        { "double", 8, true, true }, { "float64", 8, true, true },
+    };
+
+    for (const auto& candidate : types) {
+        if (type == candidate.name) {
+            size = candidate.size;
+            isFloat = candidate.isFloat;
+            isSigned = candidate.isSigned;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Reads values of one element, either from the words of an ascii line or from binary data
+class PlyValueReader {
+public:
+    PlyValueReader(ChunkReader& reader, PlyFormat format) : reader(reader), format(format) {}
+
+    // Ascii elements are one line each; binary ones need no preparation
+    bool beginElement() {
+        if (format != PlyFormat::Ascii)
+            return true;
+        if (!reader.readLine(line))
+            return false;
+        cursor = line;
+        return true;
+    }
+
+    bool read(int size, bool isFloat, bool isSigned, double& value) {
+        if (format == PlyFormat::Ascii) {
+            char* next;
+            value = std::strtod(cursor, &next);
+            if (next == cursor)
+                return false;
+            cursor = next;
+            return true;
+        }
+
+        unsigned char bytes[8];
+        if (!reader.read(bytes, size))
+            return false;
+        if (format == PlyFormat::BinaryBigEndian)
+            std::reverse(bytes, bytes + size);
+
+        // The host is assumed to be little-endian, like every target of this project
+        switch (size) {
+        case 1: value = isSigned ? static_cast<double>(static_cast<int8_t>(bytes[0])) : bytes[0]; break;
+        case 2: {
+            uint16_t raw;
+            std::memcpy(&raw, bytes, 2);
+            value = isSigned ? static_cast<double>(static_cast<int16_t>(raw)) : raw;
+            break;
+        }
+        case 4: {
+            uint32_t raw;
+            std::memcpy(&raw, bytes, 4);
+            if (isFloat) {
+                float real;
+                std::memcpy(&real, &raw, 4);
+                value = real;
+            } else {
+                value = isSigned ? static_cast<double>(static_cast<int32_t>(raw)) : raw;
+            }
+            break;
+        }
+        default:
+            std::memcpy(&value, bytes, 8);
+            break;
+        }
+        return true;
+    }
+
+private:
+    ChunkReader& reader;
+    PlyFormat format;
+    char* line = nullptr;
+    const char* cursor = nullptr;
+};
+
+bool importPly(const char* path, Mesh& mesh, std::string& error) {
+    FILE* file = std::fopen(path, "rb");
+    if (!file) {
+        error = std::string("cannot open ") + path;
+        return false;
+    }
+
+    mesh = Mesh();
+    ChunkReader reader(file);
+    PlyFormat format = PlyFormat::Ascii;
+    std::vector<PlyElement> elements;
+    char* line;
+
+    auto fail = [&](const std::string& message) {
+        std::fclose(file);
+        error = message;
+        return false;
+    };
+
+    if (!reader.readLine(line) || std::strcmp(line, "ply") != 0)
+        return fail("not a PLY file");
+
+    // Header
+    for (;;) {
+        if (!reader.readLine(line))
+            return fail("header has no end_header");
+
+        char word[64] = {}, first[64] = {}, second[64] = {}, third[64] = {}, fourth[64] = {};
+        int count = std::sscanf(line, "%63s %63s %63s %63s %63s", word, first, second, third, fourth);
+        if (count <= 0)
+            continue;
+
+        std::string keyword = word;
+        if (keyword == "end_header") {
+            break;
+        } else if (keyword == "format" && count >= 2) {
+            std::string name = first;
+            if (name == "ascii")
+                format = PlyFormat::Ascii;
+            else if (name == "binary_little_endian")
+                format = PlyFormat::BinaryLittleEndian;
+            else if (name == "binary_big_endian")
+                format = PlyFormat::BinaryBigEndian;
+            else
+                return fail("unknown PLY format " + name);
+        } else if (keyword == "element" && count >= 3) {
+            PlyElement element;
+            element.name = first;
+            element.count = std::strtoull(second, nullptr, 10);
+            elements.push_back(element);
+        } else if (keyword == "property" && count >= 3 && !elements.empty()) {
+            PlyProperty property;
+            bool valid;
+            if (std::string(first) == "list" && count >= 5) {
+                // property list <count type> <item type> <name>
+                bool countFloat, countSigned;
+                property.isList = true;
+                property.name = fourth;
+                valid = parsePlyType(second, property.countSize, countFloat, countSigned) && !countFloat &&
+                        parsePlyType(third, property.size, property.isFloat, property.isSigned);
+            } else {
+                property.name = second;
+                valid = parsePlyType(first, property.size, property.isFloat, property.isSigned);
+            }
+            if (!valid)
+                return fail(std::string("unsupported property in: ") + line);
+            elements.back().properties.push_back(property);
+        }
+    }
+
+    PlyValueReader values(reader, format);
+    bool hasColors = false;
+
+    for (const PlyElement& element : elements) {
+        bool isVertex = element.name == "vertex";
+        bool isFace = element.name == "face";
+        if (isVertex) {
+            mesh.positions.reserve(element.count);
+            mesh.colors.reserve(element.count);
+        }
+
+        for (size_t item = 0; item < element.count; ++item) {
+            if (!values.beginElement())
+                return fail("file ends inside element " + element.name);
+
+            glm::vec3 position(0.0f);
+            glm::vec3 color(1.0f);
+            for (const PlyProperty& property : element.properties) {
+                double value;
+                if (property.isList) {
+                    double length;
+                    if (!values.read(property.countSize, false, false, length))
+                        return fail("file ends inside element " + element.name);
+
+                    size_t first = mesh.indices.size();
+                    uint32_t firstIndex = 0, previousIndex = 0;
+                    bool isIndices = isFace && (property.name == "vertex_indices" || property.name == "vertex_index");
+                    for (size_t k = 0; k < static_cast<size_t>(length); ++k) {
+                        if (!values.read(property.size, property.isFloat, property.isSigned, value))
+                            return fail("file ends inside element " + element.name);
+                        if (!isIndices)
+                            continue;
+                        if (value < 0.0)
+                            return fail("negative vertex index");
+
+                        // Fan-triangulate polygons as they are read
+                        uint32_t index = static_cast<uint32_t>(value);
+                        if (k == 0)
+                            firstIndex = index;
+                        if (k >= 3) {
+                            mesh.indices.push_back(firstIndex);
+                            mesh.indices.push_back(previousIndex);
+                        }
+                        mesh.indices.push_back(index);
+                        previousIndex = index;
+                    }
+                    // Polygons with fewer than three corners have no area
+                    if (isIndices && length < 3)
+                        mesh.indices.resize(first);
+                    continue;
+                }
+
+                if (!values.read(property.size, property.isFloat, property.isSigned, value))
+                    return fail("file ends inside element " + element.name);
+                if (!isVertex)
+                    continue;
+
+                // Integer colors are 0..255, floating-point ones 0..1
+                float channel = static_cast<float>(property.isFloat ? value : value / 255.0);
+                const std::string& name = property.name;
+                if (name == "x") position.x = static_cast<float>(value);
+                else if (name == "y") position.y = static_cast<float>(value);
+                else if (name == "z") position.z = static_cast<float>(value);
+                else if (name == "red" || name == "r" || name == "diffuse_red") { color.x = channel; hasColors = true; }
+                else if (name == "green" || name == "g" || name == "diffuse_green") { color.y = channel; hasColors = true; }
+                else if (name == "blue" || name == "b" || name == "diffuse_blue") { color.z = channel; hasColors = true; }
+            }
+
+            if (isVertex) {
+                mesh.positions.push_back(position);
+                mesh.colors.push_back(color);
+            }
+        }
+    }
+
+    std::fclose(file);
+
+    if (!checkIndices(mesh, error))
+        return false;
+
+    computeBounds(mesh);
+    computeNormals(mesh);
+    if (!hasColors)
+        colorByPosition(mesh);
+    return true;
+}
+
+bool importMesh(const char* path, Mesh& mesh, std::string& error) {
+    std::string name = path;
+    size_t dot = name.find_last_of('.');
+    std::string extension = dot == std::string::npos ? "" : name.substr(dot + 1);
+    std::transform(extension.begin(), extension.end(), extension.begin(), [](char c) {
+        return static_cast<char>(c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c);
+    });
+
+    if (extension == "obj")
+        return importObj(path, mesh, error);
+    if (extension == "ply")
+        return importPly(path, mesh, error);
+
+    error = std::string("unknown mesh format: ") + path;
+    return false;
+}
@@ -0,0 +1,21 @@
+#pragma once
+#include <string>
+
+#include "Mesh.h"
+
+// Streaming importers for OBJ and PLY files. The file is read in fixed-size
+// chunks, so only the mesh being built has to fit in memory, never the whole
+// file. On failure they return false and describe the problem in error.
+//
+// OBJ: "v x y z [r g b]" and "f" records, polygons are fan-triangulated and
+// texture/normal indices are ignored.
+// PLY: ascii, binary_little_endian and binary_big_endian with x/y/z, optional
+// red/green/blue and a vertex_indices list per face.
+//
+// Files without vertex colors are colored by position so their shape stays
+// readable under flat shading. Normals are always computed from the faces.
+bool importObj(const char* path, Mesh& mesh, std::string& error);
+bool importPly(const char* path, Mesh& mesh, std::string& error);
+
+// Picks the importer from the file extension
+bool importMesh(const char* path, Mesh& mesh, std::string& error);
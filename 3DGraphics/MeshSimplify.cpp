@@ -0,0 +1,401 @@
+#include "MeshSimplify.h"
+
+#include <algorithm>
+#include <cmath>
+#include <queue>
+
+// No level is made with fewer triangles than this
+static const size_t MIN_LOD_TRIANGLES = 32;
+// Planes along open borders weigh this much more than those of the triangles
+static const double BORDER_WEIGHT = 10.0;
+// A collapse may not turn any triangle by more than about 75 degrees, which
+// also keeps triangles from folding over
+static const double MIN_NORMAL_COSINE = 0.25;
+
+// Symmetric 4x4 matrix of a sum of planes, the upper triangle only, and the
+// total weight of the planes in it
+struct Quadric {
+    double xx = 0.0, xy = 0.0, xz = 0.0, xw = 0.0;
+    double yy = 0.0, yz = 0.0, yw = 0.0;
+    double zz = 0.0, zw = 0.0;
+    double ww = 0.0;
+    double weight = 0.0;
+
+    void addPlane(const glm::dvec3& normal, double distance, double planeWeight) {
+        xx += planeWeight * normal.x * normal.x;
+        xy += planeWeight * normal.x * normal.y;
+        xz += planeWeight * normal.x * normal.z;
+        xw += planeWeight * normal.x * distance;
+        yy += planeWeight * normal.y * normal.y;
+        yz += planeWeight * normal.y * normal.z;
+        yw += planeWeight * normal.y * distance;
+        zz += planeWeight * normal.z * normal.z;
+        zw += planeWeight * normal.z * distance;
+        ww += planeWeight * distance * distance;
+        weight += planeWeight;
+    }
+
+    Quadric& operator+=(const Quadric& other) {
+        xx += other.xx; xy += other.xy; xz += other.xz; xw += other.xw;
+        yy += other.yy; yz += other.yz; yw += other.yw;
+        zz += other.zz; zw += other.zw;
+        ww += other.ww;
+        weight += other.weight;
+        return *this;
+    }
+
+    // Weighted mean of the squared distances of p to the planes
+    double evaluate(const glm::dvec3& p) const {
+        if (weight <= 0.0)
+            return 0.0;
+        double value = xx * p.x * p.x + yy * p.y * p.y + zz * p.z * p.z + ww +
+                       2.0 * (xy * p.x * p.y + xz * p.x * p.z + yz * p.y * p.z + xw * p.x + yw * p.y + zw * p.z);
+        return std::max(value, 0.0) / weight;
+    }
+};
+
+// One run of edge collapses, from the full mesh down to its coarsest level
+class EdgeCollapser {
+public:
+    explicit EdgeCollapser(const MeshView& mesh);
+
+    // Collapses edges until at most targetTriangles are left. False if no
+    // collapse was possible before that.
+    bool collapseTo(size_t targetTriangles);
+    size_t triangleCount() const { return liveTriangles; }
+    // Largest distance to the original surface any collapse so far introduced
+    float getError() const { return static_cast<float>(std::sqrt(largestCost)); }
+    void getIndices(std::vector<uint32_t>& output) const;
+
+private:
+    // Moving vertex from onto vertex to, as it looked when the entry was made
+    struct Collapse {
+        double cost;
+        uint32_t from, to;
+        uint32_t fromVersion, toVersion;
+
+        // The queue puts the cheapest collapse on top
+        bool operator<(const Collapse& other) const { return cost > other.cost; }
+    };
+
+    glm::dvec3 position(uint32_t vertex) const { return glm::dvec3(positions[vertex]); }
+    bool contains(uint32_t triangle, uint32_t vertex) const;
+    // Unique vertices sharing a live triangle with vertex
+    void gatherNeighbors(uint32_t vertex, std::vector<uint32_t>& neighbors) const;
+    void pushCollapse(uint32_t from, uint32_t to);
+    void pushCollapses(uint32_t vertex);
+    bool canCollapse(uint32_t from, uint32_t to);
+    void collapse(uint32_t from, uint32_t to);
+
+    const glm::vec3* positions;
+    std::vector<uint32_t> triangles;
+    std::vector<uint8_t> triangleRemoved;
+    size_t liveTriangles = 0;
+    // Triangles around each vertex; removed ones are skipped, not erased
+    std::vector<std::vector<uint32_t>> vertexTriangles;
+    std::vector<Quadric> quadrics;
+    std::vector<uint8_t> vertexRemoved;
+    std::vector<uint8_t> locked;
+    std::vector<uint8_t> onBorder;
+    // Bumped whenever a vertex's quadric changes, which outdates its queued collapses
+    std::vector<uint32_t> versions;
+    std::priority_queue<Collapse> queue;
+    double largestCost = 0.0;
+    std::vector<uint32_t> fromNeighbors, toNeighbors;
+};
+
+EdgeCollapser::EdgeCollapser(const MeshView& mesh)
+    : positions(mesh.positions), triangles(mesh.indices, mesh.indices + mesh.indexCount), triangleRemoved(mesh.triangleCount(), 0),
+      vertexTriangles(mesh.vertexCount()), quadrics(mesh.vertexCount()), vertexRemoved(mesh.vertexCount(), 0),
+      locked(mesh.vertexCount(), 0), onBorder(mesh.vertexCount(), 0), versions(mesh.vertexCount(), 0) {
+    size_t vertexCount = mesh.vertexCount();
+    size_t triangleCount = mesh.triangleCount();
+
+    // Each triangle's plane, weighted by its area
+    for (uint32_t t = 0; t < triangleCount; ++t) {
+        uint32_t i0 = triangles[t * 3], i1 = triangles[t * 3 + 1], i2 = triangles[t * 3 + 2];
+        if (i0 == i1 || i1 == i2 || i2 == i0) {
+            triangleRemoved[t] = 1;
+            continue;
+        }
+        ++liveTriangles;
+        for (int k = 0; k < 3; ++k)
+            vertexTriangles[triangles[t * 3 + k]].push_back(t);
+
+        glm::dvec3 normal = glm::cross(position(i1) - position(i0), position(i2) - position(i0));
+        double length = glm::length(normal);
+        if (length <= 0.0)
+            continue;
+        normal /= length;
+        double distance = -glm::dot(normal, position(i0));
+        for (int k = 0; k < 3; ++k)
+            quadrics[triangles[t * 3 + k]].addPlane(normal, distance, length * 0.5);
+    }
+
+    // Edges used by one triangle are open borders and get a plane through them
+    // at right angles to the triangle. Edges used by more than two triangles
+    // are left alone altogether.
+    std::vector<std::pair<uint64_t, uint32_t>> edges;
+    edges.reserve(liveTriangles * 3);
+    for (uint32_t t = 0; t < triangleCount; ++t) {
+        if (triangleRemoved[t])
+            continue;
+        for (int k = 0; k < 3; ++k) {
+            uint32_t a = triangles[t * 3 + k], b = triangles[t * 3 + (k + 1) % 3];
+            edges.emplace_back(uint64_t(std::min(a, b)) << 32 | std::max(a, b), t * 3 + k);
+        }
+    }
+    std::sort(edges.begin(), edges.end());
+    for (size_t begin = 0, end; begin < edges.size(); begin = end) {
+        end = begin + 1;
+        while (end < edges.size() && edges[end].first == edges[begin].first)
+            ++end;
+        uint32_t a = static_cast<uint32_t>(edges[begin].first >> 32);
+        uint32_t b = static_cast<uint32_t>(edges[begin].first);
+        if (end - begin > 2) {
+            locked[a] = locked[b] = 1;
+        } else if (end - begin == 1) {
+            onBorder[a] = onBorder[b] = 1;
+            uint32_t corner = edges[begin].second;
+            uint32_t t = corner / 3;
+            glm::dvec3 p0 = position(triangles[corner]);
+            glm::dvec3 p1 = position(triangles[t * 3 + (corner % 3 + 1) % 3]);
+            glm::dvec3 p2 = position(triangles[t * 3 + (corner % 3 + 2) % 3]);
+            glm::dvec3 edge = p1 - p0;
+            glm::dvec3 normal = glm::normalize(glm::cross(edge, glm::cross(edge, p2 - p0)));
+            if (!std::isfinite(normal.x))
+                continue;
+            double distance = -glm::dot(normal, p0);
+            double weight = BORDER_WEIGHT * glm::dot(edge, edge);
+            quadrics[a].addPlane(normal, distance, weight);
+            quadrics[b].addPlane(normal, distance, weight);
+        }
+    }
+
+    // Vertices at the same position are seams between two sets of attributes;
+    // moving either would tear the surface open
+    std::vector<uint32_t> byPosition(vertexCount);
+    for (uint32_t v = 0; v < vertexCount; ++v)
+        byPosition[v] = v;
+    auto positionLess = [&](uint32_t a, uint32_t b) {
+        const glm::vec3& p = positions[a];
+        const glm::vec3& q = positions[b];
+        return p.x != q.x ? p.x < q.x : (p.y != q.y ? p.y < q.y : p.z < q.z);
+    };
+    std::sort(byPosition.begin(), byPosition.end(), positionLess);
+    for (size_t i = 1; i < vertexCount; ++i) {
+        if (positions[byPosition[i]] == positions[byPosition[i - 1]])
+            locked[byPosition[i]] = locked[byPosition[i - 1]] = 1;
+    }
+
+    std::vector<uint32_t>& neighbors = fromNeighbors;
+    for (uint32_t v = 0; v < vertexCount; ++v) {
+        gatherNeighbors(v, neighbors);
+        for (uint32_t neighbor : neighbors) {
+            if (neighbor > v) {
+                pushCollapse(v, neighbor);
+                pushCollapse(neighbor, v);
+            }
+        }
+    }
+}
+
+bool EdgeCollapser::contains(uint32_t triangle, uint32_t vertex) const {
+    return triangles[triangle * 3] == vertex || triangles[triangle * 3 + 1] == vertex || triangles[triangle * 3 + 2] == vertex;
+}
+
+void EdgeCollapser::gatherNeighbors(uint32_t vertex, std::vector<uint32_t>& neighbors) const {
+    neighbors.clear();
+    for (uint32_t t : vertexTriangles[vertex]) {
+        if (triangleRemoved[t])
+            continue;
+        for (int k = 0; k < 3; ++k)
+            if (triangles[t * 3 + k] != vertex)
+                neighbors.push_back(triangles[t * 3 + k]);
+    }
+    std::sort(neighbors.begin(), neighbors.end());
+    neighbors.erase(std::unique(neighbors.begin(), neighbors.end()), neighbors.end());
+}
+
+void EdgeCollapser::pushCollapse(uint32_t from, uint32_t to) {
+    if (locked[from])
+        return;
+    Quadric merged = quadrics[from];
+    merged += quadrics[to];
+    queue.push(Collapse{ merged.evaluate(position(to)), from, to, versions[from], versions[to] });
+}
+
+void EdgeCollapser::pushCollapses(uint32_t vertex) {
+    gatherNeighbors(vertex, toNeighbors);
+    for (uint32_t neighbor : toNeighbors) {
+        pushCollapse(vertex, neighbor);
+        pushCollapse(neighbor, vertex);
+    }
+}
+
+bool EdgeCollapser::canCollapse(uint32_t from, uint32_t to) {
+    int shared = 0;
+    for (uint32_t t : vertexTriangles[from])
+        if (!triangleRemoved[t] && contains(t, to))
+            ++shared;
+    // Border vertices may only slide along their border
+    if (shared == 0 || (onBorder[from] && shared != 1))
+        return false;
+
+    // The two vertices may have no neighbors in common besides the corners
+    // opposite their edge, or the collapse would pinch the surface
+    gatherNeighbors(from, fromNeighbors);
+    gatherNeighbors(to, toNeighbors);
+    int common = 0;
+    for (size_t i = 0, j = 0; i < fromNeighbors.size() && j < toNeighbors.size();) {
+        if (fromNeighbors[i] < toNeighbors[j]) {
+            ++i;
+        } else if (fromNeighbors[i] > toNeighbors[j]) {
+            ++j;
+        } else {
+            ++common;
+            ++i;
+            ++j;
+        }
+    }
+    if (common != shared)
+        return false;
+
+    glm::dvec3 target = position(to);
+    for (uint32_t t : vertexTriangles[from]) {
+        if (triangleRemoved[t] || contains(t, to))
+            continue;
+        glm::dvec3 corners[3], moved[3];
+        for (int k = 0; k < 3; ++k) {
+            uint32_t vertex = triangles[t * 3 + k];
+            corners[k] = position(vertex);
+            moved[k] = vertex == from ? target : corners[k];
+        }
+        glm::dvec3 before = glm::cross(corners[1] - corners[0], corners[2] - corners[0]);
+        glm::dvec3 after = glm::cross(moved[1] - moved[0], moved[2] - moved[0]);
+        // Triangles without an area to begin with have no direction to keep
+        double beforeLength = glm::length(before);
+        if (beforeLength > 0.0 && glm::dot(before, after) <= MIN_NORMAL_COSINE * beforeLength * glm::length(after))
+            return false;
+    }
+    return true;
+}
+
+void EdgeCollapser::collapse(uint32_t from, uint32_t to) {
+    std::vector<uint32_t>& toTriangles = vertexTriangles[to];
+    for (uint32_t t : vertexTriangles[from]) {
+        if (triangleRemoved[t])
+            continue;
+        if (contains(t, to)) {
+            triangleRemoved[t] = 1;
+            --liveTriangles;
+            continue;
+        }
+        for (int k = 0; k < 3; ++k)
+            if (triangles[t * 3 + k] == from)
+                triangles[t * 3 + k] = to;
+        toTriangles.push_back(t);
+    }
+    toTriangles.erase(std::remove_if(toTriangles.begin(), toTriangles.end(), [&](uint32_t t) { return triangleRemoved[t] != 0; }),
+                      toTriangles.end());
+
+    quadrics[to] += quadrics[from];
+    vertexRemoved[from] = 1;
+    vertexTriangles[from].clear();
+    vertexTriangles[from].shrink_to_fit();
+    ++versions[to];
+    pushCollapses(to);
+}
+
+bool EdgeCollapser::collapseTo(size_t targetTriangles) {
+    while (liveTriangles > targetTriangles) {
+        if (queue.empty())
+            return false;
+        Collapse next = queue.top();
+        queue.pop();
+
+        bool current = !vertexRemoved[next.from] && !vertexRemoved[next.to] &&
+                       versions[next.from] == next.fromVersion && versions[next.to] == next.toVersion;
+        if (!current || !canCollapse(next.from, next.to))
+            continue;
+        collapse(next.from, next.to);
+        largestCost = std::max(largestCost, next.cost);
+    }
+    return true;
+}
+
+void EdgeCollapser::getIndices(std::vector<uint32_t>& output) const {
+    output.clear();
+    output.reserve(liveTriangles * 3);
+    for (size_t t = 0; t < triangleRemoved.size(); ++t)
+        if (!triangleRemoved[t])
+            output.insert(output.end(), &triangles[t * 3], &triangles[t * 3] + 3);
+}
+
+void generateLods(Mesh& mesh) {
+    mesh.lods.clear();
+    mesh.lodIndices.clear();
+
+    std::vector<std::vector<uint32_t>> levels;
+    std::vector<float> errors;
+    {
+        EdgeCollapser collapser{ MeshView(mesh) };
+        size_t previousTriangles = mesh.triangleCount();
+        while (levels.size() + 1 < MAX_MESH_LEVELS && previousTriangles / 2 >= MIN_LOD_TRIANGLES) {
+            bool reached = collapser.collapseTo(previousTriangles / 2);
+            // Stuck short of the target: still a level if it got a good part of the way
+            if (collapser.triangleCount() > previousTriangles * 3 / 4)
+                break;
+            levels.emplace_back();
+            collapser.getIndices(levels.back());
+            errors.push_back(collapser.getError());
+            previousTriangles = collapser.triangleCount();
+            if (!reached)
+                break;
+        }
+    }
+    if (levels.empty())
+        return;
+
+    // The coarsest level each vertex is still used by. Levels only lose
+    // vertices, so ordering by it puts every level's vertices first.
+    size_t vertexCount = mesh.vertexCount();
+    std::vector<uint8_t> lastLevel(vertexCount, 0);
+    for (size_t level = 0; level < levels.size(); ++level)
+        for (uint32_t index : levels[level])
+            lastLevel[index] = static_cast<uint8_t>(level + 1);
+
+    size_t levelStart[MAX_MESH_LEVELS + 1] = {};
+    for (uint8_t level : lastLevel)
+        ++levelStart[levels.size() - level + 1];
+    for (size_t level = 1; level <= levels.size() + 1; ++level)
+        levelStart[level] += levelStart[level - 1];
+
+    std::vector<uint32_t> newIndex(vertexCount);
+    for (size_t v = 0; v < vertexCount; ++v)
+        newIndex[v] = static_cast<uint32_t>(levelStart[levels.size() - lastLevel[v]]++);
+
+    std::vector<glm::vec3> positions(vertexCount), colors(vertexCount), normals(vertexCount);
+    for (size_t v = 0; v < vertexCount; ++v) {
+        positions[newIndex[v]] = mesh.positions[v];
+        colors[newIndex[v]] = mesh.colors[v];
+        normals[newIndex[v]] = mesh.normals[v];
+    }
+    mesh.positions.swap(positions);
+    mesh.colors.swap(colors);
+    mesh.normals.swap(normals);
+    for (uint32_t& index : mesh.indices)
+        index = newIndex[index];
+
+    for (size_t level = 0; level < levels.size(); ++level) {
+        MeshLod lod;
+        lod.indexOffset = mesh.lodIndices.size();
+        lod.indexCount = levels[level].size();
+        lod.vertexCount = static_cast<uint32_t>(std::count_if(lastLevel.begin(), lastLevel.end(),
+                                                              [&](uint8_t last) { return last > level; }));
+        lod.error = errors[level];
+        for (uint32_t index : levels[level])
+            mesh.lodIndices.push_back(newIndex[index]);
+        mesh.lods.push_back(lod);
+    }
+}
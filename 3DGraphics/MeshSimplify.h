@@ -0,0 +1,21 @@
+#pragma once
+#include "Mesh.h"
+
+// Mesh simplification by quadric error metric edge collapse (Garland and
+// Heckbert). Every vertex starts with the planes of the triangles around it,
+// summed into a quadric whose value at a point is the squared distance to those
+// planes. Edges are collapsed cheapest first, each moving one of its vertices
+// onto the other; the vertex that stays takes over both quadrics, so costs keep
+// measuring the distance to the original surface, not to the last level.
+//
+// Collapses only ever remove vertices and never move the ones that stay, so
+// every level indexes into the original vertex arrays. Open borders are kept
+// in place by extra planes along them, and vertices that share their position
+// with another vertex, such as the corners of a cube with a color per face,
+// never move, so no level opens a crack between the two.
+
+// Builds mesh.lods: successive levels with about half the triangles of the one
+// before, from a single run of collapses, until a level would fall below a few
+// dozen triangles or the mesh cannot be simplified any further. Reorders the
+// vertices so that every level uses a prefix of them.
+void generateLods(Mesh& mesh);
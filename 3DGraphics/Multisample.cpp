@@ -0,0 +1,93 @@
+#include "Multisample.h"
+
+#include <algorithm>
+
+static const SamplePattern SINGLE_SAMPLE = { 1, { 0 }, { 0 } };
+static const SamplePattern FOUR_SAMPLES = { 4, { -2, 6, -6, 2 }, { -6, -2, 2, 6 } };
+static const SamplePattern EIGHT_SAMPLES = { 8, { 1, -1, 5, -3, -5, -7, 3, 7 }, { -3, 3, 1, -5, 5, -1, 7, -7 } };
+
+bool isValidSampleCount(int samples) {
+    return samples == 1 || samples == 4 || samples == 8;
+}
+
+const SamplePattern& getSamplePattern(int samples) {
+    switch (samples) {
+    case 8:
+        return EIGHT_SAMPLES;
+    case 4:
+        return FOUR_SAMPLES;
+    default:
+        return SINGLE_SAMPLE;
+    }
+}
+
+template <int SAMPLES>
+static void writePartialSamples(const RenderTarget& target, size_t pixel, unsigned write, uint32_t color) {
+    uint16_t& slot = target.sampleSlots[pixel];
+    std::vector<uint32_t>& tileColors = target.sampleColors[pixel / (TILE_SIZE * TILE_SIZE)];
+    if (!(slot & SAMPLES_IN_USE)) {
+        // All samples hold the pixel's color, so writing the same one changes nothing
+        uint32_t pixelColor = target.pixels[pixel];
+        if (pixelColor == color)
+            return;
+        if (slot == 0) {
+            tileColors.resize(tileColors.size() + SAMPLES);
+            slot = static_cast<uint16_t>(tileColors.size() / SAMPLES);
+        }
+        uint32_t* colors = tileColors.data() + (slot - 1) * SAMPLES;
+        for (int s = 0; s < SAMPLES; ++s)
+            colors[s] = write >> s & 1 ? color : pixelColor;
+        slot |= SAMPLES_IN_USE;
+        return;
+    }
+
+    uint32_t* colors = tileColors.data() + ((slot & SAMPLE_SLOT_MASK) - 1) * SAMPLES;
+    uint32_t differ = 0;
+    for (int s = 0; s < SAMPLES; ++s) {
+        colors[s] = write >> s & 1 ? color : colors[s];
+        differ |= colors[s] ^ color;
+    }
+
+    // Two triangles of one color meeting inside the pixel, as along the
+    // diagonals of a face, leave nothing to average
+    if (!differ) {
+        target.pixels[pixel] = color;
+        slot &= SAMPLE_SLOT_MASK;
+    }
+}
+
+void writePartialSamples(const RenderTarget& target, size_t pixel, unsigned write, uint32_t color) {
+    if (target.samples == 8)
+        writePartialSamples<8>(target, pixel, write, color);
+    else
+        writePartialSamples<4>(target, pixel, write, color);
+}
+
+// Unrolled per sample count: this runs for every triangle in every tile
+template <int SAMPLES>
+static void setupSampleOffsets(const TriangleSetup& setup, const SamplePattern& pattern, SampleOffsets& offsets) {
+    // Edge coefficients are per subpixel, like the pattern
+    for (int e = 0; e < 3; ++e) {
+        int64_t a = setup.edgeA[e];
+        int64_t b = setup.edgeB[e];
+        int64_t low = a * pattern.x[0] + b * pattern.y[0];
+        int64_t high = low;
+        for (int s = 0; s < SAMPLES; ++s) {
+            int64_t offset = a * pattern.x[s] + b * pattern.y[s];
+            offsets.edge[e][s] = offset;
+            low = std::min(low, offset);
+            high = std::max(high, offset);
+        }
+        offsets.edgeMin[e] = low;
+        offsets.edgeMax[e] = high;
+    }
+    for (int s = 0; s < SAMPLES; ++s)
+        offsets.depth[s] = (setup.dzdx * pattern.x[s] + setup.dzdy * pattern.y[s]) / SUBPIXEL_ONE;
+}
+
+void setupSampleOffsets(const TriangleSetup& setup, int samples, SampleOffsets& offsets) {
+    if (samples == 8)
+        setupSampleOffsets<8>(setup, EIGHT_SAMPLES, offsets);
+    else
+        setupSampleOffsets<4>(setup, FOUR_SAMPLES, offsets);
+}
@@ -0,0 +1,118 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+#include "Rasterizer.h"
+
+// Multisample anti-aliasing. With more than one sample per pixel, coverage and
+// depth are evaluated at every sample position, but a triangle still shades a
+// pixel once: the color goes to all samples of the pixel the triangle won.
+//
+// Depth keeps one value per sample, samples of a pixel next to each other.
+// Colors stay one word per pixel as long as all samples of the pixel agree,
+// which is everywhere except along edges. Only pixels whose samples differ get
+// a block of sample colors, appended to their tile's list, so interior pixels
+// cost the memory and resolve bandwidth of a single sample.
+
+#define MAX_SAMPLES 8
+
+// A sampleSlots entry is 0 until the pixel first needs sample colors, then one
+// more than the index of its block in the tile's list. The pixel keeps its
+// block once it has one, and SAMPLES_IN_USE tells whether the block or the
+// pixel's color is current.
+#define SAMPLES_IN_USE 0x8000u
+#define SAMPLE_SLOT_MASK 0x7FFFu
+
+// Sample positions relative to the pixel center in subpixel units: the
+// standard 4x and 8x patterns, which are exact on the 1/16 pixel grid
+struct SamplePattern {
+    int count;
+    int x[MAX_SAMPLES];
+    int y[MAX_SAMPLES];
+};
+
+// 1, 4 and 8 are supported
+bool isValidSampleCount(int samples);
+const SamplePattern& getSamplePattern(int samples);
+
+// Differences between a triangle's values at a pixel center and at each of its
+// samples, which only depend on the triangle's edge and depth slopes
+struct SampleOffsets {
+    int64_t edge[3][MAX_SAMPLES];
+    // Smallest and largest edge offset over the samples: with edge + edgeMin >= 0
+    // all samples are inside the edge, with edge + edgeMax < 0 none are
+    int64_t edgeMin[3];
+    int64_t edgeMax[3];
+    float depth[MAX_SAMPLES];
+};
+
+// For a target with 4 or 8 samples per pixel
+void setupSampleOffsets(const TriangleSetup& setup, int samples, SampleOffsets& offsets);
+
+// Samples of one pixel inside the triangle, from the edge values at its center
+template <int SAMPLES>
+inline unsigned coverSamples(const SampleOffsets& offsets, int64_t edge0, int64_t edge1, int64_t edge2) {
+    const unsigned ALL = (1u << SAMPLES) - 1;
+    if (((edge0 + offsets.edgeMin[0]) | (edge1 + offsets.edgeMin[1]) | (edge2 + offsets.edgeMin[2])) >= 0)
+        return ALL;
+    if (edge0 + offsets.edgeMax[0] < 0 || edge1 + offsets.edgeMax[1] < 0 || edge2 + offsets.edgeMax[2] < 0)
+        return 0;
+
+    unsigned covered = 0;
+    for (int s = 0; s < SAMPLES; ++s)
+        if (((edge0 + offsets.edge[0][s]) | (edge1 + offsets.edge[1][s]) | (edge2 + offsets.edge[2][s])) >= 0)
+            covered |= 1u << s;
+    return covered;
+}
+
+// Depth test of the covered samples against the pixel's SAMPLES depths.
+// Writes the depth of the samples that pass and returns them.
+template <int SAMPLES>
+inline unsigned testSampleDepth(const SampleOffsets& offsets, unsigned covered, float depth, float* sampleDepth) {
+    unsigned write = 0;
+    for (int s = 0; s < SAMPLES; ++s) {
+        float sample = depth + offsets.depth[s];
+        if ((covered >> s & 1) && sample < sampleDepth[s]) {
+            sampleDepth[s] = sample;
+            write |= 1u << s;
+        }
+    }
+    return write;
+}
+
+// Stores color in some samples of a pixel, giving it sample colors if needed
+void writePartialSamples(const RenderTarget& target, size_t pixel, unsigned write, uint32_t color);
+
+// Stores color in the samples of write. Writing all of them, which is what
+// the inside of every triangle does, leaves the pixel with a single color.
+inline void writeSampleColor(const RenderTarget& target, size_t pixel, unsigned write, uint32_t color) {
+    if (write != (1u << target.samples) - 1) {
+        writePartialSamples(target, pixel, write, color);
+        return;
+    }
+    target.pixels[pixel] = color;
+    if (target.sampleSlots[pixel] & SAMPLES_IN_USE)
+        target.sampleSlots[pixel] &= SAMPLE_SLOT_MASK;
+}
+
+// Final color of a pixel: its color, or the rounded average of its samples.
+// Channels are summed in pairs, in the 16-bit halves of two words.
+inline uint32_t resolveSamples(const RenderTarget& target, size_t pixel) {
+    uint16_t slot = target.sampleSlots[pixel];
+    if (!(slot & SAMPLES_IN_USE))
+        return target.pixels[pixel];
+
+    const std::vector<uint32_t>& tileColors = target.sampleColors[pixel / (TILE_SIZE * TILE_SIZE)];
+    const uint32_t* colors = tileColors.data() + ((slot & SAMPLE_SLOT_MASK) - 1) * target.samples;
+    uint32_t redBlue = 0;
+    uint32_t greenAlpha = 0;
+    for (int s = 0; s < target.samples; ++s) {
+        redBlue += colors[s] & 0x00FF00FFu;
+        greenAlpha += (colors[s] >> 8) & 0x00FF00FFu;
+    }
+    int shift = target.samples == 8 ? 3 : 2;
+    uint32_t half = static_cast<uint32_t>(target.samples / 2) * 0x00010001u;
+    redBlue = ((redBlue + half) >> shift) & 0x00FF00FFu;
+    greenAlpha = ((greenAlpha + half) >> shift) & 0x00FF00FFu;
+    return redBlue | (greenAlpha << 8);
+}
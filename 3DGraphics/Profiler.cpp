@@ -0,0 +1,284 @@
+#include "Profiler.h"
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <sstream>
+
+namespace {
+    // Events kept per thread; a long trace stops growing instead of eating memory
+    const size_t MAX_EVENTS_PER_THREAD = 1 << 22;
+
+    struct CounterSample {
+        uint64_t ticks;
+        uint64_t counters[static_cast<int>(ProfileCounter::Count)];
+        int width;
+        int height;
+    };
+
+    struct Registry {
+        std::mutex mutex;
+        std::vector<std::unique_ptr<ProfileThread>> threads;
+        std::vector<CounterSample> samples;
+
+        // Sums over the frames closed since the last summary
+        size_t frameCount = 0;
+        ProfileFrame frameTotals;
+        uint64_t pixelsPerFrame = 0;
+
+        // Reference point for turning ticks into time
+        uint64_t startTicks = profileTicks();
+        std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+    };
+
+    Registry& registry() {
+        static Registry instance;
+        return instance;
+    }
+
+    std::atomic<bool> tracing(false);
+
+    // The TSC rate is measured against the steady clock over the whole run, so
+    // it gets more precise the longer the program has been running
+    double ticksPerMs() {
+        Registry& r = registry();
+        uint64_t ticks = profileTicks() - r.startTicks;
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - r.startTime).count();
+        return ms > 0.0 && ticks > 0 ? ticks / ms : 1e6;
+    }
+
+    const char* counterName(ProfileCounter counter) {
+        switch (counter) {
+        case ProfileCounter::TrianglesIn: return "triangles in";
+        case ProfileCounter::TrianglesOut: return "triangles out";
+        case ProfileCounter::PixelsTested: return "pixels tested";
+        case ProfileCounter::PixelsWritten: return "pixels written";
+        case ProfileCounter::DepthTilesRejected: return "depth tiles rejected";
+        case ProfileCounter::DepthTilesFilled: return "depth tiles filled";
+        case ProfileCounter::CleanTilesSkipped: return "clean tiles skipped";
+        case ProfileCounter::LightTests: return "light tests";
+        case ProfileCounter::RaysCast: return "rays cast";
+        default: return "?";
+        }
+    }
+
+    void writeJsonString(std::ostream& out, const std::string& text) {
+        out << '"';
+        for (char c : text) {
+            if (c == '"' || c == '\\')
+                out << '\\';
+            out << c;
+        }
+        out << '"';
+    }
+}
+
+const char* profileStageName(ProfileStage stage) {
+    switch (stage) {
+    case ProfileStage::None: return "none";
+    case ProfileStage::Cull: return "cull";
+    case ProfileStage::Transform: return "transform";
+    case ProfileStage::ClipCull: return "clip/cull";
+    case ProfileStage::Setup: return "setup";
+    case ProfileStage::Binning: return "binning";
+    case ProfileStage::Clear: return "clear";
+    case ProfileStage::DepthTest: return "depth";
+    case ProfileStage::Shading: return "shading";
+    case ProfileStage::Lighting: return "lighting";
+    case ProfileStage::Bvh: return "bvh";
+    case ProfileStage::RayCast: return "raycast";
+    case ProfileStage::Upload: return "upload";
+    case ProfileStage::Present: return "present";
+    default: return "?";
+    }
+}
+
+void ProfileThread::addEvent(const char* eventName, uint64_t start, uint64_t end) {
+    std::lock_guard<std::mutex> lock(eventMutex);
+    if (events.size() < MAX_EVENTS_PER_THREAD)
+        events.push_back({ eventName, start, end - start });
+}
+
+thread_local ProfileThread* profileThreadRecord = nullptr;
+
+ProfileThread& registerProfileThread() {
+    Registry& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.threads.emplace_back(new ProfileThread());
+    profileThreadRecord = r.threads.back().get();
+    profileThreadRecord->id = static_cast<int>(r.threads.size());
+    profileThreadRecord->name = "thread " + std::to_string(profileThreadRecord->id);
+    return *profileThreadRecord;
+}
+
+void profileSetThreadName(const char* name, int index) {
+    ProfileThread& thread = currentProfileThread();
+    std::lock_guard<std::mutex> lock(registry().mutex);
+    thread.name = index < 0 ? std::string(name) : std::string(name) + " " + std::to_string(index);
+}
+
+void profileSetTracing(bool enabled) {
+    tracing.store(enabled, std::memory_order_relaxed);
+}
+
+bool profileTracing() {
+    return tracing.load(std::memory_order_relaxed);
+}
+
+ProfileFrame profileEndFrame(int width, int height) {
+    const int STAGE_COUNT = static_cast<int>(ProfileStage::Count);
+    const int COUNTER_COUNT = static_cast<int>(ProfileCounter::Count);
+
+    Registry& r = registry();
+    double msPerTick = 1.0 / ticksPerMs();
+    ProfileFrame frame;
+
+    std::lock_guard<std::mutex> lock(r.mutex);
+    for (const std::unique_ptr<ProfileThread>& thread : r.threads) {
+        uint64_t threadTicks = 0;
+        for (int i = 0; i < STAGE_COUNT; ++i) {
+            uint64_t total = thread->stageTicks[i].load(std::memory_order_relaxed);
+            uint64_t delta = total - thread->lastStageTicks[i];
+            thread->lastStageTicks[i] = total;
+            frame.stageMs[i] += delta * msPerTick;
+            threadTicks += delta;
+        }
+        for (int i = 0; i < COUNTER_COUNT; ++i) {
+            uint64_t total = thread->counters[i].load(std::memory_order_relaxed);
+            frame.counters[i] += total - thread->lastCounters[i];
+            thread->lastCounters[i] = total;
+        }
+        thread->summaryMs += threadTicks * msPerTick;
+    }
+
+    if (profileTracing()) {
+        CounterSample sample;
+        sample.ticks = profileTicks();
+        for (int i = 0; i < COUNTER_COUNT; ++i)
+            sample.counters[i] = frame.counters[i];
+        sample.width = width;
+        sample.height = height;
+        r.samples.push_back(sample);
+    }
+
+    ++r.frameCount;
+    for (int i = 0; i < STAGE_COUNT; ++i)
+        r.frameTotals.stageMs[i] += frame.stageMs[i];
+    for (int i = 0; i < COUNTER_COUNT; ++i)
+        r.frameTotals.counters[i] += frame.counters[i];
+    r.pixelsPerFrame = static_cast<uint64_t>(width) * height;
+    return frame;
+}
+
+std::string profileSummary() {
+    const int STAGE_COUNT = static_cast<int>(ProfileStage::Count);
+    const int COUNTER_COUNT = static_cast<int>(ProfileCounter::Count);
+
+    Registry& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    if (r.frameCount == 0)
+        return std::string();
+
+    double frameCount = static_cast<double>(r.frameCount);
+    double stageMs[STAGE_COUNT] = {};
+    double counters[COUNTER_COUNT] = {};
+    for (int i = 0; i < STAGE_COUNT; ++i)
+        stageMs[i] = r.frameTotals.stageMs[i] / frameCount;
+    for (int i = 0; i < COUNTER_COUNT; ++i)
+        counters[i] = r.frameTotals.counters[i] / frameCount;
+
+    std::ostringstream line;
+    line << std::fixed << std::setprecision(2);
+    line << "Stages (ms/frame over " << r.frameCount << " frames):";
+    for (int i = 1; i < STAGE_COUNT; ++i)
+        line << " " << profileStageName(static_cast<ProfileStage>(i)) << " " << stageMs[i];
+
+    line << "\nThreads (busy ms/frame):";
+    for (const std::unique_ptr<ProfileThread>& thread : r.threads) {
+        line << " " << thread->name << " " << thread->summaryMs / frameCount;
+        thread->summaryMs = 0.0;
+    }
+
+    line << std::setprecision(0) << "\nCounts (per frame):";
+    for (int i = 0; i < COUNTER_COUNT; ++i)
+        line << " " << counterName(static_cast<ProfileCounter>(i)) << " " << counters[i];
+
+    // Overdraw: how often each screen pixel was written, and how many depth
+    // tests it took to get there
+    double tested = counters[static_cast<int>(ProfileCounter::PixelsTested)];
+    double written = counters[static_cast<int>(ProfileCounter::PixelsWritten)];
+    line << std::setprecision(2);
+    if (r.pixelsPerFrame > 0)
+        line << "\nOverdraw: " << written / r.pixelsPerFrame << " writes, " << tested / r.pixelsPerFrame << " tests per pixel";
+    if (tested > 0.0)
+        line << ", " << 100.0 * written / tested << "% of tests pass";
+
+    r.frameCount = 0;
+    r.frameTotals = ProfileFrame();
+    return line.str();
+}
+
+bool profileWriteTrace(const char* path) {
+    std::ofstream out(path, std::ios::binary);
+    if (!out) {
+        std::fprintf(stderr, "Could not write %s\n", path);
+        return false;
+    }
+
+    Registry& r = registry();
+    double usPerTick = 1000.0 / ticksPerMs();
+    size_t eventCount = 0;
+    out << std::fixed << std::setprecision(3);
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+
+    std::lock_guard<std::mutex> lock(r.mutex);
+    bool first = true;
+    for (const std::unique_ptr<ProfileThread>& thread : r.threads) {
+        if (!first)
+            out << ",\n";
+        first = false;
+        out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << thread->id << ",\"args\":{\"name\":";
+        writeJsonString(out, thread->name);
+        out << "}}";
+
+        std::lock_guard<std::mutex> eventLock(thread->eventMutex);
+        for (const TraceEvent& event : thread->events) {
+            // Events from before startTicks only happen on TSCs that are not synchronized across cores
+            double start = event.start > r.startTicks ? (event.start - r.startTicks) * usPerTick : 0.0;
+            out << ",\n{\"name\":";
+            writeJsonString(out, event.name);
+            out << ",\"ph\":\"X\",\"pid\":1,\"tid\":" << thread->id << ",\"ts\":" << start
+                << ",\"dur\":" << event.duration * usPerTick << "}";
+        }
+        eventCount += thread->events.size();
+        if (thread->events.size() >= MAX_EVENTS_PER_THREAD)
+            std::fprintf(stderr, "Trace of %s hit the limit of %zu events\n", thread->name.c_str(), MAX_EVENTS_PER_THREAD);
+    }
+
+    // One sample per frame, drawn as counter tracks
+    for (const CounterSample& sample : r.samples) {
+        double ts = sample.ticks > r.startTicks ? (sample.ticks - r.startTicks) * usPerTick : 0.0;
+        uint64_t pixels = static_cast<uint64_t>(sample.width) * sample.height;
+        out << ",\n{\"name\":\"triangles\",\"ph\":\"C\",\"pid\":1,\"ts\":" << ts
+            << ",\"args\":{\"in\":" << sample.counters[static_cast<int>(ProfileCounter::TrianglesIn)]
+            << ",\"out\":" << sample.counters[static_cast<int>(ProfileCounter::TrianglesOut)] << "}}";
+        out << ",\n{\"name\":\"pixels\",\"ph\":\"C\",\"pid\":1,\"ts\":" << ts
+            << ",\"args\":{\"tested\":" << sample.counters[static_cast<int>(ProfileCounter::PixelsTested)]
+            << ",\"written\":" << sample.counters[static_cast<int>(ProfileCounter::PixelsWritten)]
+            << ",\"screen\":" << pixels << "}}";
+        out << ",\n{\"name\":\"tiles\",\"ph\":\"C\",\"pid\":1,\"ts\":" << ts
+            << ",\"args\":{\"depth rejected\":" << sample.counters[static_cast<int>(ProfileCounter::DepthTilesRejected)]
+            << ",\"depth filled\":" << sample.counters[static_cast<int>(ProfileCounter::DepthTilesFilled)]
+            << ",\"clean skipped\":" << sample.counters[static_cast<int>(ProfileCounter::CleanTilesSkipped)] << "}}";
+    }
+    out << "\n]}\n";
+
+    if (!out) {
+        std::fprintf(stderr, "Could not write %s\n", path);
+        return false;
+    }
+    std::printf("Wrote %zu trace events and %zu frames to %s\n", eventCount, r.samples.size(), path);
+    return true;
+}
@@ -0,0 +1,211 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#define PROFILE_USE_TSC 1
+#else
+#include <chrono>
+#endif
+
+// Set to 0 to compile every timer and counter out of the hot paths
+#ifndef PROFILING_ENABLED
+#define PROFILING_ENABLED 1
+#endif
+
+// Where frame time goes. Stages never nest, so per thread they add up to the
+// time the thread spent working.
+enum class ProfileStage {
+    None,         // trace event only, adds to no stage
+    Cull,         // instance frustum and occlusion culling
+    Transform,    // vertex positions and vertex shaders
+    ClipCull,     // triangle assembly, clipping, back-face culling
+    Setup,        // edge equations and depth planes
+    Binning,      // sorting triangles into tiles
+    Clear,
+    DepthTest,    // flat triangles: coverage, depth test and write
+    Shading,      // shaded triangles: coverage, depth test and fragment shader
+    Lighting,     // deferred lighting of the G-buffer
+    Bvh,          // building and refitting the ray caster's hierarchies
+    RayCast,      // tracing and shading camera rays
+    Upload,       // framebuffer to texture
+    Present,      // drawing the quad and swapping buffers
+    Count
+};
+
+enum class ProfileCounter {
+    TrianglesIn,
+    TrianglesOut,
+    PixelsTested,         // covered pixels, depth tested or known to pass
+    PixelsWritten,
+    DepthTilesRejected,   // depth tiles a triangle skipped without touching a pixel
+    DepthTilesFilled,     // depth tiles filled without reading depth
+    CleanTilesSkipped,    // screen tiles kept from the last frame
+    LightTests,           // pixel and light pairs the deferred lighting looked at
+    RaysCast,
+    Count
+};
+
+const char* profileStageName(ProfileStage stage);
+
+// Raw timestamp. The TSC costs a few nanoseconds to read, little enough to time
+// every 8x8 region a triangle touches.
+inline uint64_t profileTicks() {
+#ifdef PROFILE_USE_TSC
+    return __rdtsc();
+#else
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+}
+
+struct TraceEvent {
+    const char* name;
+    uint64_t start;
+    uint64_t duration;
+};
+
+// Timers and counters of one thread. Only the owning thread writes them, the
+// atomics just let the frame summary read them from another thread.
+struct ProfileThread {
+    std::string name;
+    int id = 0;
+    std::atomic<uint64_t> stageTicks[static_cast<int>(ProfileStage::Count)] = {};
+    std::atomic<uint64_t> counters[static_cast<int>(ProfileCounter::Count)] = {};
+
+    std::mutex eventMutex;
+    std::vector<TraceEvent> events;
+
+    // Totals at the last profileEndFrame, touched by its caller only
+    uint64_t lastStageTicks[static_cast<int>(ProfileStage::Count)] = {};
+    uint64_t lastCounters[static_cast<int>(ProfileCounter::Count)] = {};
+    // Time spent in any stage in the frames closed since the last summary
+    double summaryMs = 0.0;
+
+    void addTicks(ProfileStage stage, uint64_t ticks) {
+        std::atomic<uint64_t>& total = stageTicks[static_cast<int>(stage)];
+        total.store(total.load(std::memory_order_relaxed) + ticks, std::memory_order_relaxed);
+    }
+
+    void count(ProfileCounter counter, uint64_t amount) {
+        std::atomic<uint64_t>& total = counters[static_cast<int>(counter)];
+        total.store(total.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+
+    void addEvent(const char* eventName, uint64_t start, uint64_t end);
+};
+
+// Record of the calling thread, created on first use
+ProfileThread& registerProfileThread();
+extern thread_local ProfileThread* profileThreadRecord;
+
+inline ProfileThread& currentProfileThread() {
+    ProfileThread* thread = profileThreadRecord;
+    return thread ? *thread : registerProfileThread();
+}
+// Name shown for the calling thread in traces and summaries; index is appended if not negative
+void profileSetThreadName(const char* name, int index = -1);
+
+// Trace events are only recorded while tracing is on; timers and counters always run
+void profileSetTracing(bool enabled);
+bool profileTracing();
+
+// Times its own lifetime into a stage and, while tracing, records a trace event
+class ProfileScope {
+public:
+    ProfileScope(ProfileStage stage, const char* traceName)
+        : thread(currentProfileThread()), stage(stage), traceName(profileTracing() ? traceName : nullptr), start(profileTicks()) {}
+
+    ~ProfileScope() {
+        uint64_t end = profileTicks();
+        if (stage != ProfileStage::None)
+            thread.addTicks(stage, end - start);
+        if (traceName)
+            thread.addEvent(traceName, start, end);
+    }
+
+    ProfileScope(const ProfileScope&) = delete;
+    ProfileScope& operator=(const ProfileScope&) = delete;
+
+private:
+    ProfileThread& thread;
+    ProfileStage stage;
+    const char* traceName;
+    uint64_t start;
+};
+
+// Times a run of work that moves between stages, such as a tile drawing flat
+// and shaded triangles, reading the clock once per switch instead of twice per item
+class ProfileStageTimer {
+public:
+    explicit ProfileStageTimer(ProfileStage stage) : thread(currentProfileThread()), stage(stage), start(profileTicks()) {}
+
+    ~ProfileStageTimer() {
+        thread.addTicks(stage, profileTicks() - start);
+    }
+
+    void switchTo(ProfileStage next) {
+        if (next == stage)
+            return;
+        uint64_t now = profileTicks();
+        thread.addTicks(stage, now - start);
+        stage = next;
+        start = now;
+    }
+
+    ProfileStageTimer(const ProfileStageTimer&) = delete;
+    ProfileStageTimer& operator=(const ProfileStageTimer&) = delete;
+
+private:
+    ProfileThread& thread;
+    ProfileStage stage;
+    uint64_t start;
+};
+
+// Totals of everything recorded since the previous profileEndFrame
+struct ProfileFrame {
+    double stageMs[static_cast<int>(ProfileStage::Count)] = {};
+    uint64_t counters[static_cast<int>(ProfileCounter::Count)] = {};
+};
+
+// Closes a frame: adds it to the running totals of the summary and, while
+// tracing, writes the frame's counters into the trace. Called by the thread
+// that renders; allocates nothing unless tracing.
+ProfileFrame profileEndFrame(int width, int height);
+// Averages of the frames closed since the last call, as printable lines
+std::string profileSummary();
+// Chrome trace (chrome://tracing or ui.perfetto.dev) of every event recorded so far
+bool profileWriteTrace(const char* path);
+
+#if PROFILING_ENABLED
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+// Times the rest of the enclosing block into stage and shows it as name in traces
+#define PROFILE_SCOPE(stage, name) ProfileScope PROFILE_CONCAT(profileScope, __LINE__)(stage, name)
+// Same without a trace event, for blocks that run too often to trace
+#define PROFILE_ACCUMULATE(stage) ProfileScope PROFILE_CONCAT(profileScope, __LINE__)(stage, nullptr)
+// Named timer for work that switches stages, see ProfileStageTimer
+#define PROFILE_STAGE_TIMER(name, stage) ProfileStageTimer name(stage)
+#define PROFILE_SWITCH_STAGE(name, stage) name.switchTo(stage)
+#define PROFILE_COUNT(counter, amount) currentProfileThread().count(counter, amount)
+#define PROFILE_THREAD_NAME(name, index) profileSetThreadName(name, index)
+// Code that only exists to feed the profiler, such as local pixel counts
+#define PROFILE_ONLY(code) code
+#else
+#define PROFILE_SCOPE(stage, name)
+#define PROFILE_ACCUMULATE(stage)
+#define PROFILE_STAGE_TIMER(name, stage)
+// Statement-like macros stay statements, so they can be the body of an if
+#define PROFILE_SWITCH_STAGE(name, stage) ((void)0)
+#define PROFILE_COUNT(counter, amount) ((void)0)
+#define PROFILE_THREAD_NAME(name, index) ((void)0)
+#define PROFILE_ONLY(code)
+#endif
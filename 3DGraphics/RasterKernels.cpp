@@ -0,0 +1,604 @@
+#include "RasterKernels.h"
+#include "Multisample.h"
+#include "Profiler.h"
+#include "Rasterizer.h"
+
+#include <algorithm>
+#include <bitset>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define RASTER_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+// MSVC accepts any intrinsic anywhere, GCC and Clang need the target spelled out
+#if defined(__GNUC__)
+#define TARGET_SSE41 __attribute__((target("sse4.1")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_SSE41
+#define TARGET_AVX2
+#endif
+
+// Pixels a kernel covered and wrote, only counted when profiling
+struct PixelCounts {
+    uint64_t tested = 0;
+    uint64_t written = 0;
+};
+
+static inline void reportPixels([[maybe_unused]] const PixelCounts& counts) {
+    PROFILE_COUNT(ProfileCounter::PixelsTested, counts.tested);
+    PROFILE_COUNT(ProfileCounter::PixelsWritten, counts.written);
+}
+
+static inline int countLanes(int mask) {
+    return static_cast<int>(std::bitset<8>(static_cast<unsigned>(mask)).count());
+}
+
+// One pixel at a time for count pixels from the start of the rows, used by
+// every kernel for what does not fill a block
+static inline void rasterizeSpan(int count, int64_t edge0, int64_t edge1, int64_t edge2, float depth,
+                                 const RasterRegion& region, float* depthRow, uint32_t* colorRow, [[maybe_unused]] PixelCounts& counts) {
+    for (int x = 0; x < count; ++x) {
+        // Inside when no edge value is negative
+        if ((edge0 | edge1 | edge2) >= 0) {
+            PROFILE_ONLY(++counts.tested);
+            if (depth < depthRow[x]) {
+                depthRow[x] = depth;
+                colorRow[x] = region.color;
+                PROFILE_ONLY(++counts.written);
+            }
+        }
+        edge0 += region.stepX[0];
+        edge1 += region.stepX[1];
+        edge2 += region.stepX[2];
+        depth += region.dzdx;
+    }
+}
+
+static void rasterizeScalar(const RasterRegion& region, const RenderTarget& target) {
+    int64_t rowEdge[3] = { region.edge[0], region.edge[1], region.edge[2] };
+    float rowDepth = region.depth;
+    PixelCounts counts;
+
+    for (int y = region.startY; y < region.endY; ++y) {
+        size_t rowStart = pixelIndex(target, region.startX, y);
+        rasterizeSpan(region.endX - region.startX, rowEdge[0], rowEdge[1], rowEdge[2], rowDepth, region,
+                      target.depth + rowStart, target.pixels + rowStart, counts);
+
+        for (int e = 0; e < 3; ++e)
+            rowEdge[e] += region.stepY[e];
+        rowDepth += region.dzdy;
+    }
+    reportPixels(counts);
+}
+
+// Coverage and depth per sample, writing the depths that pass. Calls
+// visit(index, pixel, write) for every pixel of the region, with index counting
+// pixels row by row from the region's first and write the samples that passed.
+template <int SAMPLES, typename Visit>
+static void testSamples(const RasterRegion& region, const RenderTarget& target, Visit visit) {
+    const SampleOffsets& offsets = *region.samples;
+    int64_t rowEdge[3] = { region.edge[0], region.edge[1], region.edge[2] };
+    float rowDepth = region.depth;
+    int width = region.endX - region.startX;
+    int index = 0;
+    PixelCounts counts;
+
+    for (int y = region.startY; y < region.endY; ++y) {
+        size_t rowStart = pixelIndex(target, region.startX, y);
+        float* depthRow = target.depth + rowStart * SAMPLES;
+        int64_t edge0 = rowEdge[0], edge1 = rowEdge[1], edge2 = rowEdge[2];
+        float depth = rowDepth;
+
+        for (int x = 0; x < width; ++x, ++index) {
+            unsigned covered = coverSamples<SAMPLES>(offsets, edge0, edge1, edge2);
+            unsigned write = 0;
+            if (covered) {
+                write = testSampleDepth<SAMPLES>(offsets, covered, depth, depthRow + x * SAMPLES);
+                PROFILE_ONLY(++counts.tested; counts.written += write != 0);
+            }
+            visit(index, rowStart + x, write);
+
+            edge0 += region.stepX[0];
+            edge1 += region.stepX[1];
+            edge2 += region.stepX[2];
+            depth += region.dzdx;
+        }
+
+        for (int e = 0; e < 3; ++e)
+            rowEdge[e] += region.stepY[e];
+        rowDepth += region.dzdy;
+    }
+    reportPixels(counts);
+}
+
+// One color write per pixel
+template <int SAMPLES>
+static void rasterizeSamples(const RasterRegion& region, const RenderTarget& target) {
+    testSamples<SAMPLES>(region, target, [&](int, size_t pixel, unsigned write) {
+        if (write)
+            writeSampleColor(target, pixel, write, region.color);
+    });
+}
+
+template <int SAMPLES>
+static void testSampleMasks(const RasterRegion& region, const RenderTarget& target, uint8_t* writeMasks) {
+    testSamples<SAMPLES>(region, target, [&](int index, size_t, unsigned write) {
+        writeMasks[index] = static_cast<uint8_t>(write);
+    });
+}
+
+#ifdef RASTER_X86
+
+// Edges of a region as 32-bit lane values, which the block kernels step with
+// plain vector adds instead of clamping 64-bit values for every block
+struct LaneEdges {
+    int32_t edge[3];
+    int32_t stepX[3];
+    int32_t stepY[3];
+};
+
+// Smallest and largest value of an edge over the pixel centers of a region.
+// The function is linear, so they are at the corners the steps' signs point to.
+static void edgeRange(const RasterRegion& region, int e, int64_t& low, int64_t& high) {
+    int64_t right = region.stepX[e] * (region.endX - 1 - region.startX);
+    int64_t up = region.stepY[e] * (region.endY - 1 - region.startY);
+    low = region.edge[e] + std::min<int64_t>(right, 0) + std::min<int64_t>(up, 0);
+    high = region.edge[e] + std::max<int64_t>(right, 0) + std::max<int64_t>(up, 0);
+}
+
+// Edge functions are linear, so an edge whose values at the region's corners
+// fit in 32 bits fits at every pixel, and wrapping vector adds still land on
+// the exact value. An edge that does not fit but is non-negative at every
+// corner is inside everywhere and becomes 0 with no steps; one negative at
+// every corner becomes -1. Returns false when an edge changes sign in the
+// region but does not fit, which is left to the 64-bit scalar loop.
+static bool toLaneEdges(const RasterRegion& region, LaneEdges& lanes) {
+    for (int e = 0; e < 3; ++e) {
+        int64_t low, high;
+        edgeRange(region, e, low, high);
+
+        if (low >= INT32_MIN && high <= INT32_MAX) {
+            lanes.edge[e] = static_cast<int32_t>(region.edge[e]);
+            lanes.stepX[e] = static_cast<int32_t>(region.stepX[e]);
+            lanes.stepY[e] = static_cast<int32_t>(region.stepY[e]);
+        } else if (low >= 0 || high < 0) {
+            lanes.edge[e] = low >= 0 ? 0 : -1;
+            lanes.stepX[e] = 0;
+            lanes.stepY[e] = 0;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Multisample lanes hold an edge at one sample: its pixel's value plus the
+// sample's offset, which stays in 32 bits for pixel values within LANE_LIMIT
+// and offsets within MAX_LANE_STEP
+static const int64_t LANE_LIMIT = int64_t(1) << 30;
+static const int64_t MAX_LANE_STEP = int64_t(1) << 27;
+
+// toLaneEdges for the multisample kernels. An edge within LANE_LIMIT at the
+// corners is exact; one with every sample of the region inside, or every one
+// outside, becomes +-LANE_LIMIT with no steps, which no offset can flip.
+// Returns false for anything else and for offsets beyond MAX_LANE_STEP.
+static bool toSampleLaneEdges(const RasterRegion& region, LaneEdges& lanes) {
+    const SampleOffsets& offsets = *region.samples;
+    for (int e = 0; e < 3; ++e) {
+        if (offsets.edgeMax[e] > MAX_LANE_STEP || offsets.edgeMin[e] < -MAX_LANE_STEP)
+            return false;
+        int64_t low, high;
+        edgeRange(region, e, low, high);
+
+        if (low >= -LANE_LIMIT && high <= LANE_LIMIT) {
+            lanes.edge[e] = static_cast<int32_t>(region.edge[e]);
+            lanes.stepX[e] = static_cast<int32_t>(region.stepX[e]);
+            lanes.stepY[e] = static_cast<int32_t>(region.stepY[e]);
+        } else if (low + offsets.edgeMin[e] >= 0 || high + offsets.edgeMax[e] < 0) {
+            lanes.edge[e] = static_cast<int32_t>(low + offsets.edgeMin[e] >= 0 ? LANE_LIMIT : -LANE_LIMIT);
+            lanes.stepX[e] = 0;
+            lanes.stepY[e] = 0;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+// testSamples with the four samples of one pixel per vector
+template <typename Visit>
+TARGET_SSE41 static void testSamplesSSE41(const RasterRegion& region, const RenderTarget& target, Visit visit) {
+    LaneEdges lanes;
+    if (!toSampleLaneEdges(region, lanes)) {
+        testSamples<4>(region, target, visit);
+        return;
+    }
+
+    const SampleOffsets& offsets = *region.samples;
+    const __m128i allNegative = _mm_set1_epi32(-1);
+    __m128i rowLanes[3], stepX[3], stepY[3];
+    for (int e = 0; e < 3; ++e) {
+        __m128i sampleEdge = _mm_setr_epi32(static_cast<int32_t>(offsets.edge[e][0]), static_cast<int32_t>(offsets.edge[e][1]),
+                                            static_cast<int32_t>(offsets.edge[e][2]), static_cast<int32_t>(offsets.edge[e][3]));
+        rowLanes[e] = _mm_add_epi32(_mm_set1_epi32(lanes.edge[e]), sampleEdge);
+        stepX[e] = _mm_set1_epi32(lanes.stepX[e]);
+        stepY[e] = _mm_set1_epi32(lanes.stepY[e]);
+    }
+    const __m128 sampleDepth = _mm_loadu_ps(offsets.depth);
+
+    float rowDepth = region.depth;
+    int width = region.endX - region.startX;
+    int index = 0;
+    PixelCounts counts;
+
+    for (int y = region.startY; y < region.endY; ++y) {
+        size_t rowStart = pixelIndex(target, region.startX, y);
+        float* depthRow = target.depth + rowStart * 4;
+        __m128i e0 = rowLanes[0], e1 = rowLanes[1], e2 = rowLanes[2];
+        float depth = rowDepth;
+
+        for (int x = 0; x < width; ++x, ++index) {
+            __m128i inside = _mm_cmpgt_epi32(_mm_or_si128(_mm_or_si128(e0, e1), e2), allNegative);
+            int writeMask = 0;
+            if (_mm_movemask_ps(_mm_castsi128_ps(inside))) {
+                float* depths = depthRow + x * 4;
+                __m128 newDepth = _mm_add_ps(_mm_set1_ps(depth), sampleDepth);
+                __m128 oldDepth = _mm_loadu_ps(depths);
+                __m128 write = _mm_and_ps(_mm_cmplt_ps(newDepth, oldDepth), _mm_castsi128_ps(inside));
+                writeMask = _mm_movemask_ps(write);
+                PROFILE_ONLY(++counts.tested; counts.written += writeMask != 0);
+                _mm_storeu_ps(depths, _mm_blendv_ps(oldDepth, newDepth, write));
+            }
+            visit(index, rowStart + x, static_cast<unsigned>(writeMask));
+
+            e0 = _mm_add_epi32(e0, stepX[0]);
+            e1 = _mm_add_epi32(e1, stepX[1]);
+            e2 = _mm_add_epi32(e2, stepX[2]);
+            depth += region.dzdx;
+        }
+
+        for (int e = 0; e < 3; ++e)
+            rowLanes[e] = _mm_add_epi32(rowLanes[e], stepY[e]);
+        rowDepth += region.dzdy;
+    }
+    reportPixels(counts);
+}
+
+TARGET_SSE41 static void rasterizeSamplesSSE41(const RasterRegion& region, const RenderTarget& target) {
+    testSamplesSSE41(region, target, [&](int, size_t pixel, unsigned write) {
+        if (write)
+            writeSampleColor(target, pixel, write, region.color);
+    });
+}
+
+TARGET_SSE41 static void testSampleMasksSSE41(const RasterRegion& region, const RenderTarget& target, uint8_t* writeMasks) {
+    testSamplesSSE41(region, target, [&](int index, size_t, unsigned write) {
+        writeMasks[index] = static_cast<uint8_t>(write);
+    });
+}
+
+// testSamples with the eight samples of one pixel per vector
+template <typename Visit>
+TARGET_AVX2 static void testSamplesAVX2(const RasterRegion& region, const RenderTarget& target, Visit visit) {
+    LaneEdges lanes;
+    if (!toSampleLaneEdges(region, lanes)) {
+        testSamples<8>(region, target, visit);
+        return;
+    }
+
+    const SampleOffsets& offsets = *region.samples;
+    const __m256i allNegative = _mm256_set1_epi32(-1);
+    __m256i rowLanes[3], stepX[3], stepY[3];
+    for (int e = 0; e < 3; ++e) {
+        int32_t sampleEdge[8];
+        for (int s = 0; s < 8; ++s)
+            sampleEdge[s] = static_cast<int32_t>(offsets.edge[e][s]);
+        rowLanes[e] = _mm256_add_epi32(_mm256_set1_epi32(lanes.edge[e]), _mm256_loadu_si256(reinterpret_cast<const __m256i*>(sampleEdge)));
+        stepX[e] = _mm256_set1_epi32(lanes.stepX[e]);
+        stepY[e] = _mm256_set1_epi32(lanes.stepY[e]);
+    }
+    const __m256 sampleDepth = _mm256_loadu_ps(offsets.depth);
+
+    float rowDepth = region.depth;
+    int width = region.endX - region.startX;
+    int index = 0;
+    PixelCounts counts;
+
+    for (int y = region.startY; y < region.endY; ++y) {
+        size_t rowStart = pixelIndex(target, region.startX, y);
+        float* depthRow = target.depth + rowStart * 8;
+        __m256i e0 = rowLanes[0], e1 = rowLanes[1], e2 = rowLanes[2];
+        float depth = rowDepth;
+
+        for (int x = 0; x < width; ++x, ++index) {
+            __m256i inside = _mm256_cmpgt_epi32(_mm256_or_si256(_mm256_or_si256(e0, e1), e2), allNegative);
+            int writeMask = 0;
+            if (_mm256_movemask_ps(_mm256_castsi256_ps(inside))) {
+                float* depths = depthRow + x * 8;
+                __m256 newDepth = _mm256_add_ps(_mm256_set1_ps(depth), sampleDepth);
+                __m256 oldDepth = _mm256_loadu_ps(depths);
+                __m256 write = _mm256_and_ps(_mm256_cmp_ps(newDepth, oldDepth, _CMP_LT_OQ), _mm256_castsi256_ps(inside));
+                writeMask = _mm256_movemask_ps(write);
+                PROFILE_ONLY(++counts.tested; counts.written += writeMask != 0);
+                _mm256_storeu_ps(depths, _mm256_blendv_ps(oldDepth, newDepth, write));
+            }
+            visit(index, rowStart + x, static_cast<unsigned>(writeMask));
+
+            e0 = _mm256_add_epi32(e0, stepX[0]);
+            e1 = _mm256_add_epi32(e1, stepX[1]);
+            e2 = _mm256_add_epi32(e2, stepX[2]);
+            depth += region.dzdx;
+        }
+
+        for (int e = 0; e < 3; ++e)
+            rowLanes[e] = _mm256_add_epi32(rowLanes[e], stepY[e]);
+        rowDepth += region.dzdy;
+    }
+    reportPixels(counts);
+}
+
+TARGET_AVX2 static void rasterizeSamplesAVX2(const RasterRegion& region, const RenderTarget& target) {
+    testSamplesAVX2(region, target, [&](int, size_t pixel, unsigned write) {
+        if (write)
+            writeSampleColor(target, pixel, write, region.color);
+    });
+}
+
+TARGET_AVX2 static void testSampleMasksAVX2(const RasterRegion& region, const RenderTarget& target, uint8_t* writeMasks) {
+    testSamplesAVX2(region, target, [&](int index, size_t, unsigned write) {
+        writeMasks[index] = static_cast<uint8_t>(write);
+    });
+}
+
+// 4x1 pixel blocks
+TARGET_SSE41 static void rasterizeSSE41(const RasterRegion& region, const RenderTarget& target) {
+    LaneEdges lanes;
+    if (!toLaneEdges(region, lanes)) {
+        rasterizeScalar(region, target);
+        return;
+    }
+
+    const __m128i laneIndex = _mm_setr_epi32(0, 1, 2, 3);
+    const __m128i allNegative = _mm_set1_epi32(-1);
+    __m128i rowLanes[3], blockStep[3], rowStep[3];
+    for (int e = 0; e < 3; ++e) {
+        __m128i stepX = _mm_set1_epi32(lanes.stepX[e]);
+        rowLanes[e] = _mm_add_epi32(_mm_set1_epi32(lanes.edge[e]), _mm_mullo_epi32(laneIndex, stepX));
+        blockStep[e] = _mm_slli_epi32(stepX, 2);
+        rowStep[e] = _mm_set1_epi32(lanes.stepY[e]);
+    }
+    const __m128 laneDepth = _mm_mul_ps(_mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f), _mm_set1_ps(region.dzdx));
+    const __m128i color = _mm_set1_epi32(static_cast<int>(region.color));
+    const float blockDepthStep = region.dzdx * 4;
+    const int width = region.endX - region.startX;
+    const int blockWidth = width & ~3;
+
+    // 64-bit edges only for the pixels past the last block
+    int64_t spanEdge[3];
+    for (int e = 0; e < 3; ++e)
+        spanEdge[e] = region.edge[e] + region.stepX[e] * blockWidth;
+    float rowDepth = region.depth;
+    PixelCounts counts;
+
+    for (int y = region.startY; y < region.endY; ++y) {
+        size_t rowStart = pixelIndex(target, region.startX, y);
+        float* depthRow = target.depth + rowStart;
+        uint32_t* colorRow = target.pixels + rowStart;
+        __m128i e0 = rowLanes[0], e1 = rowLanes[1], e2 = rowLanes[2];
+        float depth = rowDepth;
+
+        for (int x = 0; x < blockWidth; x += 4) {
+            __m128i inside = _mm_cmpgt_epi32(_mm_or_si128(_mm_or_si128(e0, e1), e2), allNegative);
+            int insideMask = _mm_movemask_ps(_mm_castsi128_ps(inside));
+
+            if (insideMask) {
+                __m128 newDepth = _mm_add_ps(_mm_set1_ps(depth), laneDepth);
+                __m128 oldDepth = _mm_loadu_ps(depthRow + x);
+                __m128 write = _mm_and_ps(_mm_cmplt_ps(newDepth, oldDepth), _mm_castsi128_ps(inside));
+                int writeMask = _mm_movemask_ps(write);
+                PROFILE_ONLY(counts.tested += countLanes(insideMask); counts.written += countLanes(writeMask));
+
+                if (writeMask) {
+                    // Colors are one 32-bit word per pixel, so they blend with the same mask as depth
+                    __m128i* colors = reinterpret_cast<__m128i*>(colorRow + x);
+                    _mm_storeu_ps(depthRow + x, _mm_blendv_ps(oldDepth, newDepth, write));
+                    _mm_storeu_si128(colors, _mm_blendv_epi8(_mm_loadu_si128(colors), color, _mm_castps_si128(write)));
+                }
+            }
+
+            e0 = _mm_add_epi32(e0, blockStep[0]);
+            e1 = _mm_add_epi32(e1, blockStep[1]);
+            e2 = _mm_add_epi32(e2, blockStep[2]);
+            depth += blockDepthStep;
+        }
+
+        if (blockWidth < width)
+            rasterizeSpan(width - blockWidth, spanEdge[0], spanEdge[1], spanEdge[2], depth, region, depthRow + blockWidth,
+                          colorRow + blockWidth, counts);
+
+        for (int e = 0; e < 3; ++e) {
+            rowLanes[e] = _mm_add_epi32(rowLanes[e], rowStep[e]);
+            spanEdge[e] += region.stepY[e];
+        }
+        rowDepth += region.dzdy;
+    }
+    reportPixels(counts);
+}
+
+// 8x1 pixel blocks
+TARGET_AVX2 static void rasterizeAVX2(const RasterRegion& region, const RenderTarget& target) {
+    LaneEdges lanes;
+    if (!toLaneEdges(region, lanes)) {
+        rasterizeScalar(region, target);
+        return;
+    }
+
+    const __m256i laneIndex = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i allNegative = _mm256_set1_epi32(-1);
+    __m256i rowLanes[3], blockStep[3], rowStep[3];
+    for (int e = 0; e < 3; ++e) {
+        __m256i stepX = _mm256_set1_epi32(lanes.stepX[e]);
+        rowLanes[e] = _mm256_add_epi32(_mm256_set1_epi32(lanes.edge[e]), _mm256_mullo_epi32(laneIndex, stepX));
+        blockStep[e] = _mm256_slli_epi32(stepX, 3);
+        rowStep[e] = _mm256_set1_epi32(lanes.stepY[e]);
+    }
+    const __m256 laneDepth = _mm256_mul_ps(_mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f), _mm256_set1_ps(region.dzdx));
+    const float blockDepthStep = region.dzdx * 8;
+    const __m256i color = _mm256_set1_epi32(static_cast<int>(region.color));
+    const int width = region.endX - region.startX;
+    const int blockWidth = width & ~7;
+
+    int64_t spanEdge[3];
+    for (int e = 0; e < 3; ++e)
+        spanEdge[e] = region.edge[e] + region.stepX[e] * blockWidth;
+    float rowDepth = region.depth;
+    PixelCounts counts;
+
+    for (int y = region.startY; y < region.endY; ++y) {
+        size_t rowStart = pixelIndex(target, region.startX, y);
+        float* depthRow = target.depth + rowStart;
+        uint32_t* colorRow = target.pixels + rowStart;
+        __m256i e0 = rowLanes[0], e1 = rowLanes[1], e2 = rowLanes[2];
+        float depth = rowDepth;
+
+        for (int x = 0; x < blockWidth; x += 8) {
+            __m256i inside = _mm256_cmpgt_epi32(_mm256_or_si256(_mm256_or_si256(e0, e1), e2), allNegative);
+            int insideMask = _mm256_movemask_ps(_mm256_castsi256_ps(inside));
+
+            if (insideMask) {
+                __m256 newDepth = _mm256_add_ps(_mm256_set1_ps(depth), laneDepth);
+                __m256 oldDepth = _mm256_loadu_ps(depthRow + x);
+                __m256 write = _mm256_and_ps(_mm256_cmp_ps(newDepth, oldDepth, _CMP_LT_OQ), _mm256_castsi256_ps(inside));
+                int writeMask = _mm256_movemask_ps(write);
+                PROFILE_ONLY(counts.tested += countLanes(insideMask); counts.written += countLanes(writeMask));
+
+                if (writeMask) {
+                    __m256i* colors = reinterpret_cast<__m256i*>(colorRow + x);
+                    _mm256_storeu_ps(depthRow + x, _mm256_blendv_ps(oldDepth, newDepth, write));
+                    _mm256_storeu_si256(colors, _mm256_blendv_epi8(_mm256_loadu_si256(colors), color, _mm256_castps_si256(write)));
+                }
+            }
+
+            e0 = _mm256_add_epi32(e0, blockStep[0]);
+            e1 = _mm256_add_epi32(e1, blockStep[1]);
+            e2 = _mm256_add_epi32(e2, blockStep[2]);
+            depth += blockDepthStep;
+        }
+
+        if (blockWidth < width)
+            rasterizeSpan(width - blockWidth, spanEdge[0], spanEdge[1], spanEdge[2], depth, region, depthRow + blockWidth,
+                          colorRow + blockWidth, counts);
+
+        for (int e = 0; e < 3; ++e) {
+            rowLanes[e] = _mm256_add_epi32(rowLanes[e], rowStep[e]);
+            spanEdge[e] += region.stepY[e];
+        }
+        rowDepth += region.dzdy;
+    }
+    reportPixels(counts);
+}
+
+static void cpuid(int leaf, int subleaf, unsigned registers[4]) {
+#if defined(_MSC_VER)
+    int values[4];
+    __cpuidex(values, leaf, subleaf);
+    for (int i = 0; i < 4; ++i)
+        registers[i] = static_cast<unsigned>(values[i]);
+#else
+    __cpuid_count(leaf, subleaf, registers[0], registers[1], registers[2], registers[3]);
+#endif
+}
+
+static uint64_t readXCR0() {
+#if defined(_MSC_VER)
+    return _xgetbv(0);
+#else
+    unsigned eax, edx;
+    __asm__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return (uint64_t(edx) << 32) | eax;
+#endif
+}
+
+InstructionSet detectInstructionSet() {
+    unsigned registers[4];
+    cpuid(0, 0, registers);
+    unsigned maxLeaf = registers[0];
+
+    cpuid(1, 0, registers);
+    bool sse41 = (registers[2] & (1u << 19)) != 0;
+    bool osxsave = (registers[2] & (1u << 27)) != 0;
+    bool avx = (registers[2] & (1u << 28)) != 0;
+
+    bool avx2 = false;
+    if (maxLeaf >= 7 && osxsave && avx) {
+        // The OS also has to save the YMM registers on context switches
+        bool ymmEnabled = (readXCR0() & 0x6) == 0x6;
+        cpuid(7, 0, registers);
+        avx2 = ymmEnabled && (registers[1] & (1u << 5)) != 0;
+    }
+
+    if (avx2)
+        return InstructionSet::AVX2;
+    if (sse41)
+        return InstructionSet::SSE41;
+    return InstructionSet::Scalar;
+}
+
+#else
+
+InstructionSet detectInstructionSet() {
+    return InstructionSet::Scalar;
+}
+
+#endif
+
+RasterKernel getRasterKernel(InstructionSet instructionSet) {
+    switch (instructionSet) {
+#ifdef RASTER_X86
+    case InstructionSet::AVX2:
+        return rasterizeAVX2;
+    case InstructionSet::SSE41:
+        return rasterizeSSE41;
+#endif
+    default:
+        return rasterizeScalar;
+    }
+}
+
+RasterKernel getMultisampleKernel(int samples, InstructionSet instructionSet) {
+#ifdef RASTER_X86
+    if (samples == 8 && instructionSet == InstructionSet::AVX2)
+        return rasterizeSamplesAVX2;
+    if (samples == 4 && instructionSet != InstructionSet::Scalar)
+        return rasterizeSamplesSSE41;
+#endif
+    return samples == 8 ? rasterizeSamples<8> : rasterizeSamples<4>;
+}
+
+SampleTestKernel getSampleTestKernel(int samples, InstructionSet instructionSet) {
+#ifdef RASTER_X86
+    if (samples == 8 && instructionSet == InstructionSet::AVX2)
+        return testSampleMasksAVX2;
+    if (samples == 4 && instructionSet != InstructionSet::Scalar)
+        return testSampleMasksSSE41;
+#endif
+    return samples == 8 ? testSampleMasks<8> : testSampleMasks<4>;
+}
+
+const char* instructionSetName(InstructionSet instructionSet) {
+    switch (instructionSet) {
+    case InstructionSet::AVX2:
+        return "AVX2";
+    case InstructionSet::SSE41:
+        return "SSE4.1";
+    default:
+        return "scalar";
+    }
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <cstdint>
+
+struct RenderTarget;
+struct SampleOffsets;
+struct RasterRegion;
+
+// Coverage, depth test and masked color/depth write for one region
+typedef void (*RasterKernel)(const RasterRegion& region, const RenderTarget& target);
+
+// Coverage and depth test per sample for one region of a multisampled target:
+// writes the depths that pass, and for each pixel, row by row from the
+// region's first, the mask of its samples that did into writeMasks
+typedef void (*SampleTestKernel)(const RasterRegion& region, const RenderTarget& target, uint8_t* writeMasks);
+
+// Everything a kernel needs to fill one triangle inside one rectangle of pixels,
+// which never crosses a raster tile, so each of its rows is consecutive in the
+// target. Edge and depth values are taken at the center of pixel (startX, startY).
+struct RasterRegion {
+    int startX, startY, endX, endY;
+    int64_t edge[3];
+    int64_t stepX[3];
+    int64_t stepY[3];
+    float depth, dzdx, dzdy;
+    uint32_t color;           // packed RGBA8
+    const SampleOffsets* samples;   // on multisampled targets, the same for the whole triangle
+    SampleTestKernel sampleTest;    // on multisampled targets, for shaded triangles
+};
+
+enum class InstructionSet {
+    Scalar,
+    SSE41,
+    AVX2
+};
+
+// Best instruction set this CPU and OS support
+InstructionSet detectInstructionSet();
+RasterKernel getRasterKernel(InstructionSet instructionSet);
+// Kernel for targets with 4 or 8 samples per pixel, see Multisample.h
+RasterKernel getMultisampleKernel(int samples, InstructionSet instructionSet);
+SampleTestKernel getSampleTestKernel(int samples, InstructionSet instructionSet);
+const char* instructionSetName(InstructionSet instructionSet);
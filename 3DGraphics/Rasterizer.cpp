@@ -0,0 +1,590 @@
+#include "Rasterizer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define RASTERIZER_SSE 1
+#include <xmmintrin.h>
+#endif
+
+#include "Multisample.h"
+#include "Profiler.h"
+
+// Triangles set up per job while binning
+static const int SETUP_BATCH_SIZE = 1024;
+
+Rasterizer::Rasterizer(ThreadPool& pool) : pool(pool), target() {
+    setInstructionSet(detectInstructionSet());
+}
+
+void Rasterizer::setInstructionSet(InstructionSet instructionSet) {
+    this->instructionSet = instructionSet;
+    kernel = getRasterKernel(instructionSet);
+}
+
+void Rasterizer::beginFrame(const RenderTarget& target, const PixelRect* dirtyRects, size_t dirtyRectCount) {
+    this->target = target;
+    frameKernel = target.samples > 1 ? getMultisampleKernel(target.samples, instructionSet) : kernel;
+    sampleTest = target.samples > 1 ? getSampleTestKernel(target.samples, instructionSet) : nullptr;
+    tilesX = (target.width + TILE_SIZE - 1) / TILE_SIZE;
+    tilesY = (target.height + TILE_SIZE - 1) / TILE_SIZE;
+    tilesCleared = false;
+
+    if (!dirtyRects) {
+        tileDirty.assign(tilesX * tilesY, 1);
+        dirtyBounds = PixelRect{ 0, 0, target.width, target.height };
+    } else {
+        tileDirty.assign(tilesX * tilesY, 0);
+        dirtyBounds = PixelRect{ target.width, target.height, 0, 0 };
+        for (size_t i = 0; i < dirtyRectCount; ++i) {
+            const PixelRect& rect = dirtyRects[i];
+            int startX = std::max(rect.minX, 0) / TILE_SIZE;
+            int startY = std::max(rect.minY, 0) / TILE_SIZE;
+            int endX = (std::min(rect.maxX, target.width) + TILE_SIZE - 1) / TILE_SIZE;
+            int endY = (std::min(rect.maxY, target.height) + TILE_SIZE - 1) / TILE_SIZE;
+            if (startX >= endX || startY >= endY)
+                continue;
+
+            for (int y = startY; y < endY; ++y)
+                for (int x = startX; x < endX; ++x)
+                    tileDirty[y * tilesX + x] = 1;
+
+            // Whole tiles are redrawn, so the bounds snap to them
+            dirtyBounds.minX = std::min(dirtyBounds.minX, startX * TILE_SIZE);
+            dirtyBounds.minY = std::min(dirtyBounds.minY, startY * TILE_SIZE);
+            dirtyBounds.maxX = std::max(dirtyBounds.maxX, std::min(endX * TILE_SIZE, target.width));
+            dirtyBounds.maxY = std::max(dirtyBounds.maxY, std::min(endY * TILE_SIZE, target.height));
+        }
+    }
+
+    depthTilesX = (target.width + DEPTH_TILE_SIZE - 1) / DEPTH_TILE_SIZE;
+    depthTilesY = (target.height + DEPTH_TILE_SIZE - 1) / DEPTH_TILE_SIZE;
+    depthTiles.resize(depthTilesX * depthTilesY);
+
+    triangles.clear();
+    vertexData.clear();
+    programs.clear();
+    viewports.assign(1, PixelRect{ 0, 0, target.width, target.height });
+    arena.reset();
+}
+
+void Rasterizer::submitTriangle(const RasterTriangle& triangle) {
+    triangles.push_back(triangle);
+}
+
+void Rasterizer::submitTriangles(const RasterTriangle* first, size_t count) {
+    triangles.insert(triangles.end(), first, first + count);
+}
+
+void Rasterizer::submitTriangles(const RasterTriangle* first, size_t count, const float* data, size_t dataSize) {
+    // The offsets were relative to the caller's data, which now starts further in
+    uint32_t base = static_cast<uint32_t>(vertexData.size());
+    vertexData.insert(vertexData.end(), data, data + dataSize);
+
+    size_t start = triangles.size();
+    triangles.insert(triangles.end(), first, first + count);
+    for (size_t i = start; i < triangles.size(); ++i)
+        if (triangles[i].program)
+            triangles[i].varyings += base;
+}
+
+uint32_t Rasterizer::bindProgram(const ShaderProgram& program) {
+    programs.push_back(program);
+    return static_cast<uint32_t>(programs.size());
+}
+
+uint32_t Rasterizer::addViewport(const PixelRect& viewport) {
+    viewports.push_back(viewport);
+    return static_cast<uint32_t>(viewports.size() - 1);
+}
+
+void Rasterizer::flush() {
+    binTriangles();
+
+    bool clear = !tilesCleared;
+    pool.parallelFor(tilesX * tilesY, [this, clear](int tileIndex, unsigned) {
+        rasterizeTile(tileIndex, clear);
+    });
+
+    tilesCleared = true;
+    triangles.clear();
+    vertexData.clear();
+}
+
+void Rasterizer::endFrame() {
+    flush();
+}
+
+bool Rasterizer::isOccluded(const PixelRect& rect, float minZ) const {
+    if (!tilesCleared)
+        return false;
+
+    int startX = std::max(rect.minX, 0) / DEPTH_TILE_SIZE;
+    int startY = std::max(rect.minY, 0) / DEPTH_TILE_SIZE;
+    int endX = (std::min(rect.maxX, target.width) + DEPTH_TILE_SIZE - 1) / DEPTH_TILE_SIZE;
+    int endY = (std::min(rect.maxY, target.height) + DEPTH_TILE_SIZE - 1) / DEPTH_TILE_SIZE;
+
+    for (int y = startY; y < endY; ++y)
+        for (int x = startX; x < endX; ++x)
+            if (minZ < depthTiles[y * depthTilesX + x].maxZ)
+                return false;
+
+    return true;
+}
+
+bool Rasterizer::isBoxOccluded(const glm::mat4& modelViewProjection, const glm::vec3& boxMin, const glm::vec3& boxMax) const {
+    // Nothing rasterized yet, skip projecting the box
+    if (!tilesCleared)
+        return false;
+
+    PixelRect rect;
+    float minZ;
+    return projectBox(modelViewProjection, boxMin, boxMax, target.width, target.height, rect, minZ) && isOccluded(rect, minZ);
+}
+
+bool Rasterizer::isRectDirty(const PixelRect& rect) const {
+    int startX = std::max(rect.minX, 0) / TILE_SIZE;
+    int startY = std::max(rect.minY, 0) / TILE_SIZE;
+    int endX = (std::min(rect.maxX, target.width) + TILE_SIZE - 1) / TILE_SIZE;
+    int endY = (std::min(rect.maxY, target.height) + TILE_SIZE - 1) / TILE_SIZE;
+
+    for (int y = startY; y < endY; ++y)
+        for (int x = startX; x < endX; ++x)
+            if (tileDirty[y * tilesX + x])
+                return true;
+
+    return false;
+}
+
+bool projectBox(const glm::mat4& modelViewProjection, const glm::vec3& boxMin, const glm::vec3& boxMax, int width, int height, PixelRect& rect, float& minZ) {
+    glm::vec3 ndcMin(std::numeric_limits<float>::infinity());
+    glm::vec3 ndcMax(-std::numeric_limits<float>::infinity());
+
+    for (int corner = 0; corner < 8; ++corner) {
+        glm::vec4 position((corner & 1) ? boxMax.x : boxMin.x, (corner & 2) ? boxMax.y : boxMin.y, (corner & 4) ? boxMax.z : boxMin.z, 1.0f);
+        glm::vec4 clip = modelViewProjection * position;
+
+        if (clip.w <= 0.0f || clip.z < -clip.w)
+            return false;
+
+        glm::vec3 ndc = glm::vec3(clip) / clip.w;
+        ndcMin = glm::min(ndcMin, ndc);
+        ndcMax = glm::max(ndcMax, ndc);
+    }
+
+    // Far outside boxes are clamped so the conversion to int cannot overflow
+    ndcMin = glm::clamp(ndcMin, -2.0f, 2.0f);
+    ndcMax = glm::clamp(ndcMax, -2.0f, 2.0f);
+    rect.minX = static_cast<int>(std::floor((ndcMin.x + 1.0f) * 0.5f * width));
+    rect.minY = static_cast<int>(std::floor((ndcMin.y + 1.0f) * 0.5f * height));
+    rect.maxX = static_cast<int>(std::ceil((ndcMax.x + 1.0f) * 0.5f * width)) + 1;
+    rect.maxY = static_cast<int>(std::ceil((ndcMax.y + 1.0f) * 0.5f * height)) + 1;
+    minZ = ndcMin.z;
+    return true;
+}
+
+void Rasterizer::binTriangles() {
+    int triangleCount = static_cast<int>(triangles.size());
+    int tileCount = tilesX * tilesY;
+
+    setups = arena.allocate<TriangleSetup>(triangleCount);
+    binStart = arena.allocate<uint32_t>(tileCount + 1);
+    std::fill_n(binStart, tileCount + 1, 0u);
+
+    // Triangle setup is independent per triangle, so it runs in batches on the pool
+    int batchCount = (triangleCount + SETUP_BATCH_SIZE - 1) / SETUP_BATCH_SIZE;
+    pool.parallelFor(batchCount, [this, triangleCount](int batch, unsigned) {
+        PROFILE_SCOPE(ProfileStage::Setup, "Setup");
+        int end = std::min((batch + 1) * SETUP_BATCH_SIZE, triangleCount);
+        for (int i = batch * SETUP_BATCH_SIZE; i < end; ++i) {
+            TriangleSetup& setup = setups[i];
+            if (!setupTriangle(triangles[i], viewports[triangles[i].viewport], setup))
+                setup.bounds = PixelRect{ 0, 0, 0, 0 };
+        }
+    });
+
+    PROFILE_SCOPE(ProfileStage::Binning, "Binning");
+
+    // First pass: count how many triangles land in each tile
+    size_t binnedCount = 0;
+    for (int i = 0; i < triangleCount; ++i) {
+        const PixelRect& bounds = setups[i].bounds;
+        if (bounds.minX >= bounds.maxX || bounds.minY >= bounds.maxY)
+            continue;
+
+        for (int ty = bounds.minY / TILE_SIZE; ty <= (bounds.maxY - 1) / TILE_SIZE; ++ty) {
+            for (int tx = bounds.minX / TILE_SIZE; tx <= (bounds.maxX - 1) / TILE_SIZE; ++tx) {
+                // Tiles kept from the last frame take no triangles
+                if (!tileDirty[ty * tilesX + tx])
+                    continue;
+                ++binStart[ty * tilesX + tx + 1];
+                ++binnedCount;
+            }
+        }
+    }
+
+    for (int tile = 0; tile < tileCount; ++tile)
+        binStart[tile + 1] += binStart[tile];
+
+    // Second pass: scatter triangle indices, which keeps submission order inside each bin
+    binIndices = arena.allocate<uint32_t>(binnedCount);
+    uint32_t* binCursor = arena.allocate<uint32_t>(tileCount);
+    std::copy_n(binStart, tileCount, binCursor);
+
+    for (int i = 0; i < triangleCount; ++i) {
+        const PixelRect& bounds = setups[i].bounds;
+        if (bounds.minX >= bounds.maxX || bounds.minY >= bounds.maxY)
+            continue;
+
+        for (int ty = bounds.minY / TILE_SIZE; ty <= (bounds.maxY - 1) / TILE_SIZE; ++ty)
+            for (int tx = bounds.minX / TILE_SIZE; tx <= (bounds.maxX - 1) / TILE_SIZE; ++tx)
+                if (tileDirty[ty * tilesX + tx])
+                    binIndices[binCursor[ty * tilesX + tx]++] = static_cast<uint32_t>(i);
+    }
+}
+
+void Rasterizer::rasterizeTile(int tileIndex, bool clear) {
+    if (!tileDirty[tileIndex]) {
+        if (clear)
+            PROFILE_COUNT(ProfileCounter::CleanTilesSkipped, 1);
+        return;
+    }
+    if (!clear && binStart[tileIndex] == binStart[tileIndex + 1])
+        return;
+
+    PROFILE_SCOPE(ProfileStage::None, "Tile");
+    // One timer for the whole tile: timing each triangle would cost about as much as drawing a small one
+    PROFILE_STAGE_TIMER(tileTimer, ProfileStage::Clear);
+
+    int tileX = (tileIndex % tilesX) * TILE_SIZE;
+    int tileY = (tileIndex / tilesX) * TILE_SIZE;
+    int tileEndX = std::min(tileX + TILE_SIZE, target.width);
+    int tileEndY = std::min(tileY + TILE_SIZE, target.height);
+
+    // The tile owns this memory, so it clears it itself, padding and all in one go
+    if (clear) {
+        size_t tileStart = static_cast<size_t>(tileIndex) * TILE_SIZE * TILE_SIZE;
+        std::fill_n(target.pixels + tileStart, TILE_SIZE * TILE_SIZE, packColor(glm::vec3(0.0f)));
+        std::fill_n(target.depth + tileStart * target.samples, TILE_SIZE * TILE_SIZE * target.samples, std::numeric_limits<float>::infinity());
+        if (target.samples > 1) {
+            std::fill_n(target.sampleSlots + tileStart, TILE_SIZE * TILE_SIZE, 0);
+            target.sampleColors[tileIndex].clear();
+        }
+
+        DepthTile empty = { std::numeric_limits<float>::infinity(), std::numeric_limits<float>::infinity() };
+        for (int y = tileY / DEPTH_TILE_SIZE; y < (tileEndY + DEPTH_TILE_SIZE - 1) / DEPTH_TILE_SIZE; ++y)
+            for (int x = tileX / DEPTH_TILE_SIZE; x < (tileEndX + DEPTH_TILE_SIZE - 1) / DEPTH_TILE_SIZE; ++x)
+                depthTiles[y * depthTilesX + x] = empty;
+    }
+
+    for (uint32_t i = binStart[tileIndex]; i < binStart[tileIndex + 1]; ++i) {
+        const TriangleSetup& setup = setups[binIndices[i]];
+        PROFILE_SWITCH_STAGE(tileTimer, setup.program ? ProfileStage::Shading : ProfileStage::DepthTest);
+        rasterizeTriangle(setup, tileX, tileY, tileEndX, tileEndY);
+    }
+}
+
+void Rasterizer::rasterizeTriangle(const TriangleSetup& setup, int tileX, int tileY, int tileEndX, int tileEndY) {
+    int startX = std::max(setup.bounds.minX, tileX);
+    int startY = std::max(setup.bounds.minY, tileY);
+    int endX = std::min(setup.bounds.maxX, tileEndX);
+    int endY = std::min(setup.bounds.maxY, tileEndY);
+    PROFILE_ONLY(uint64_t depthTilesRejected = 0; uint64_t depthTilesFilled = 0);
+
+    // Samples lie around the pixel centers, so they widen the corner tests below
+    SampleOffsets sampleOffsets;
+    if (target.samples > 1) {
+        setupSampleOffsets(setup, target.samples, sampleOffsets);
+    } else {
+        std::fill_n(sampleOffsets.edgeMin, 3, 0);
+        std::fill_n(sampleOffsets.edgeMax, 3, 0);
+    }
+
+    // Decide per depth tile before any per-pixel work
+    for (int blockY = startY - startY % DEPTH_TILE_SIZE; blockY < endY; blockY += DEPTH_TILE_SIZE) {
+        for (int blockX = startX - startX % DEPTH_TILE_SIZE; blockX < endX; blockX += DEPTH_TILE_SIZE) {
+            DepthTile& depthTile = depthTiles[(blockY / DEPTH_TILE_SIZE) * depthTilesX + blockX / DEPTH_TILE_SIZE];
+
+            // Everything already drawn here is in front of the triangle
+            if (setup.zMin >= depthTile.maxZ) {
+                PROFILE_ONLY(++depthTilesRejected);
+                continue;
+            }
+
+            RasterRegion region = makeRegion(setup, std::max(blockX, startX), std::max(blockY, startY),
+                                             std::min(blockX + DEPTH_TILE_SIZE, endX), std::min(blockY + DEPTH_TILE_SIZE, endY));
+            region.samples = &sampleOffsets;
+            region.sampleTest = sampleTest;
+
+            // Edges are linear, so the corner pixels tell whether the region is fully inside or outside
+            bool covered = true;
+            bool outside = false;
+            for (int e = 0; e < 3; ++e) {
+                int64_t right = region.stepX[e] * (region.endX - 1 - region.startX);
+                int64_t up = region.stepY[e] * (region.endY - 1 - region.startY);
+                int64_t corners[4] = { region.edge[e], region.edge[e] + right, region.edge[e] + up, region.edge[e] + right + up };
+                int64_t lowest = std::min(std::min(corners[0], corners[1]), std::min(corners[2], corners[3]));
+                int64_t highest = std::max(std::max(corners[0], corners[1]), std::max(corners[2], corners[3]));
+                covered = covered && lowest + sampleOffsets.edgeMin[e] >= 0;
+                outside = outside || highest + sampleOffsets.edgeMax[e] < 0;
+            }
+            if (outside)
+                continue;
+
+            bool wholeDepthTile = covered && region.startX == blockX && region.startY == blockY &&
+                                  region.endX == std::min(blockX + DEPTH_TILE_SIZE, target.width) &&
+                                  region.endY == std::min(blockY + DEPTH_TILE_SIZE, target.height);
+
+            if (setup.program) {
+                const ShaderProgram& program = programs[setup.program - 1];
+                program.kernel(region, setup, vertexData.data() + setup.varyings, program.shader, target);
+            }
+            // In front of everything drawn here and covering it all: no depth reads needed
+            else if (wholeDepthTile && setup.zMax < depthTile.minZ) {
+                fillRegion(region);
+                PROFILE_ONLY(++depthTilesFilled);
+            } else {
+                frameKernel(region, target);
+            }
+
+            depthTile.minZ = std::min(depthTile.minZ, setup.zMin);
+            if (wholeDepthTile)
+                depthTile.maxZ = std::min(depthTile.maxZ, setup.zMax);
+            else
+                depthTile.maxZ = farthestDepth(blockX, blockY);
+        }
+    }
+
+    PROFILE_COUNT(ProfileCounter::DepthTilesRejected, depthTilesRejected);
+    PROFILE_COUNT(ProfileCounter::DepthTilesFilled, depthTilesFilled);
+}
+
+float Rasterizer::farthestDepth(int blockX, int blockY) const {
+    // Tiles shared between several triangles only get a finite max from the pixels themselves
+    int endX = std::min(blockX + DEPTH_TILE_SIZE, target.width);
+    int endY = std::min(blockY + DEPTH_TILE_SIZE, target.height);
+
+    int rowLength = (endX - blockX) * target.samples;
+
+    // Nothing is farther than the clear depth, so a tile with pixels left
+    // uncovered is known as soon as one turns up
+    const float clearDepth = std::numeric_limits<float>::infinity();
+    float farthest = -std::numeric_limits<float>::infinity();
+#ifdef RASTERIZER_SSE
+    // Four depths at a time, and the lanes combined once at the end
+    __m128 farthestLanes = _mm_set1_ps(farthest);
+    const __m128 clearLanes = _mm_set1_ps(clearDepth);
+#endif
+    for (int y = blockY; y < endY; ++y) {
+        const float* depthRow = target.depth + pixelIndex(target, blockX, y) * target.samples;
+        int x = 0;
+#ifdef RASTERIZER_SSE
+        for (; x + 4 <= rowLength; x += 4)
+            farthestLanes = _mm_max_ps(farthestLanes, _mm_loadu_ps(depthRow + x));
+        if (_mm_movemask_ps(_mm_cmpeq_ps(farthestLanes, clearLanes)))
+            return clearDepth;
+#endif
+        for (; x < rowLength; ++x)
+            farthest = std::max(farthest, depthRow[x]);
+        if (farthest == clearDepth)
+            return clearDepth;
+    }
+#ifdef RASTERIZER_SSE
+    farthestLanes = _mm_max_ps(farthestLanes, _mm_movehl_ps(farthestLanes, farthestLanes));
+    farthestLanes = _mm_max_ss(farthestLanes, _mm_shuffle_ps(farthestLanes, farthestLanes, 1));
+    farthest = std::max(farthest, _mm_cvtss_f32(farthestLanes));
+#endif
+    return farthest;
+}
+
+void Rasterizer::fillRegion(const RasterRegion& region) {
+    float rowDepth = region.depth;
+    int width = region.endX - region.startX;
+    PROFILE_ONLY(uint64_t pixels = uint64_t(width) * (region.endY - region.startY));
+    PROFILE_COUNT(ProfileCounter::PixelsTested, pixels);
+    PROFILE_COUNT(ProfileCounter::PixelsWritten, pixels);
+
+    if (target.samples > 1) {
+        fillSamples(region);
+        return;
+    }
+
+    for (int y = region.startY; y < region.endY; ++y) {
+        size_t rowStart = pixelIndex(target, region.startX, y);
+        float* depthRow = target.depth + rowStart;
+        uint32_t* colorRow = target.pixels + rowStart;
+        float depth = rowDepth;
+
+        for (int x = 0; x < width; ++x) {
+            depthRow[x] = depth;
+            colorRow[x] = region.color;
+            depth += region.dzdx;
+        }
+
+        rowDepth += region.dzdy;
+    }
+}
+
+// Pixels in front of everything drawn and covered at every sample: each
+// sample gets its own depth, the pixel a single color
+void Rasterizer::fillSamples(const RasterRegion& region) {
+    const SampleOffsets& offsets = *region.samples;
+    float rowDepth = region.depth;
+    int width = region.endX - region.startX;
+
+    for (int y = region.startY; y < region.endY; ++y) {
+        size_t rowStart = pixelIndex(target, region.startX, y);
+        float* depthRow = target.depth + rowStart * target.samples;
+        float depth = rowDepth;
+
+        for (int x = 0; x < width; ++x) {
+            for (int s = 0; s < target.samples; ++s)
+                depthRow[x * target.samples + s] = depth + offsets.depth[s];
+            target.pixels[rowStart + x] = region.color;
+            target.sampleSlots[rowStart + x] &= SAMPLE_SLOT_MASK;
+            depth += region.dzdx;
+        }
+
+        rowDepth += region.dzdy;
+    }
+}
+
+void resolvePixels(const RenderTarget& target, const PixelRect& rect, uint32_t* destination, size_t destinationStride) {
+    // One pass per row and tile, each at most a tile wide. Multisampled pixels
+    // are averaged on the way, so the resolve costs no extra pass over memory.
+    for (int y = rect.minY; y < rect.maxY; ++y) {
+        uint32_t* destinationRow = destination + (y - rect.minY) * destinationStride;
+        for (int x = rect.minX; x < rect.maxX; x = (x / TILE_SIZE + 1) * TILE_SIZE) {
+            int spanEnd = std::min((x / TILE_SIZE + 1) * TILE_SIZE, rect.maxX);
+            size_t spanStart = pixelIndex(target, x, y);
+            if (target.samples == 1) {
+                std::copy_n(target.pixels + spanStart, spanEnd - x, destinationRow + (x - rect.minX));
+                continue;
+            }
+            for (int i = 0; i < spanEnd - x; ++i)
+                destinationRow[x - rect.minX + i] = resolveSamples(target, spanStart + i);
+        }
+    }
+}
+
+RasterRegion makeRegion(const TriangleSetup& setup, int startX, int startY, int endX, int endY) {
+    RasterRegion region;
+    region.startX = startX;
+    region.startY = startY;
+    region.endX = endX;
+    region.endY = endY;
+
+    // Evaluate everything once at the center of the first pixel, the kernel only adds
+    int64_t sampleX = (int64_t(startX) << SUBPIXEL_BITS) + SUBPIXEL_ONE / 2;
+    int64_t sampleY = (int64_t(startY) << SUBPIXEL_BITS) + SUBPIXEL_ONE / 2;
+    for (int e = 0; e < 3; ++e) {
+        region.edge[e] = setup.edgeA[e] * sampleX + setup.edgeB[e] * sampleY + setup.edgeC[e];
+        region.stepX[e] = setup.edgeA[e] * SUBPIXEL_ONE;
+        region.stepY[e] = setup.edgeB[e] * SUBPIXEL_ONE;
+    }
+    region.depth = setup.z0 + setup.dzdx * (startX + 0.5f - setup.x0) + setup.dzdy * (startY + 0.5f - setup.y0);
+    region.dzdx = setup.dzdx;
+    region.dzdy = setup.dzdy;
+    region.color = setup.color;
+    region.samples = nullptr;
+    region.sampleTest = nullptr;
+    return region;
+}
+
+// Beyond this many pixels from the origin the edge equations could overflow
+static const float MAX_SCREEN_COORDINATE = float(1 << 24);
+
+bool setupTriangle(const RasterTriangle& triangle, const PixelRect& viewport, TriangleSetup& setup) {
+    const glm::vec3* vertices[3] = { &triangle.v0, &triangle.v1, &triangle.v2 };
+    int width = viewport.maxX - viewport.minX;
+    int height = viewport.maxY - viewport.minY;
+
+    // Viewport transform and snap to the subpixel grid
+    int64_t fixedX[3], fixedY[3];
+    for (int i = 0; i < 3; ++i) {
+        float screenX = (vertices[i]->x + 1.0f) * 0.5f * width + viewport.minX;
+        float screenY = (vertices[i]->y + 1.0f) * 0.5f * height + viewport.minY;
+
+        // Also rejects the NaNs produced by vertices behind the camera
+        if (!(std::fabs(screenX) < MAX_SCREEN_COORDINATE && std::fabs(screenY) < MAX_SCREEN_COORDINATE))
+            return false;
+
+        fixedX[i] = std::llround(screenX * SUBPIXEL_ONE);
+        fixedY[i] = std::llround(screenY * SUBPIXEL_ONE);
+    }
+
+    int64_t area = (fixedX[1] - fixedX[0]) * (fixedY[2] - fixedY[0]) - (fixedX[2] - fixedX[0]) * (fixedY[1] - fixedY[0]);
+    if (area == 0)
+        return false;
+
+    // Both windings are drawn, so walk clockwise triangles the other way round
+    int order[3] = { 0, 1, 2 };
+    if (area < 0)
+        std::swap(order[1], order[2]);
+
+    for (int e = 0; e < 3; ++e) {
+        int a = order[e];
+        int b = order[(e + 1) % 3];
+
+        setup.edgeA[e] = fixedY[a] - fixedY[b];
+        setup.edgeB[e] = fixedX[b] - fixedX[a];
+        setup.edgeC[e] = fixedX[a] * fixedY[b] - fixedY[a] * fixedX[b];
+
+        // Top-left rule (y points up): pixels exactly on a left or top edge are
+        // drawn, pixels on any other edge belong to the neighbouring triangle
+        bool isLeft = setup.edgeA[e] > 0;
+        bool isTop = setup.edgeA[e] == 0 && setup.edgeB[e] < 0;
+        if (!isLeft && !isTop)
+            setup.edgeC[e] -= 1;
+    }
+
+    // Depth plane through the snapped positions, in pixel units
+    int v0 = order[0], v1 = order[1], v2 = order[2];
+    float x1 = float(fixedX[v1] - fixedX[v0]) / SUBPIXEL_ONE;
+    float y1 = float(fixedY[v1] - fixedY[v0]) / SUBPIXEL_ONE;
+    float x2 = float(fixedX[v2] - fixedX[v0]) / SUBPIXEL_ONE;
+    float y2 = float(fixedY[v2] - fixedY[v0]) / SUBPIXEL_ONE;
+    float z1 = vertices[v1]->z - vertices[v0]->z;
+    float z2 = vertices[v2]->z - vertices[v0]->z;
+    float inverseArea = 1.0f / (x1 * y2 - x2 * y1);
+
+    setup.x0 = float(fixedX[v0]) / SUBPIXEL_ONE;
+    setup.y0 = float(fixedY[v0]) / SUBPIXEL_ONE;
+    setup.z0 = vertices[v0]->z;
+    setup.dzdx = (z1 * y2 - z2 * y1) * inverseArea;
+    setup.dzdy = (z2 * x1 - z1 * x2) * inverseArea;
+    setup.zMin = std::min(triangle.v0.z, std::min(triangle.v1.z, triangle.v2.z));
+    setup.zMax = std::max(triangle.v0.z, std::max(triangle.v1.z, triangle.v2.z));
+
+    // Pixels whose centers can fall inside the triangle, clamped to the viewport
+    int64_t minX = std::min(fixedX[0], std::min(fixedX[1], fixedX[2]));
+    int64_t minY = std::min(fixedY[0], std::min(fixedY[1], fixedY[2]));
+    int64_t maxX = std::max(fixedX[0], std::max(fixedX[1], fixedX[2]));
+    int64_t maxY = std::max(fixedY[0], std::max(fixedY[1], fixedY[2]));
+
+    setup.bounds.minX = static_cast<int>(std::max<int64_t>(viewport.minX, minX >> SUBPIXEL_BITS));
+    setup.bounds.minY = static_cast<int>(std::max<int64_t>(viewport.minY, minY >> SUBPIXEL_BITS));
+    setup.bounds.maxX = static_cast<int>(std::min<int64_t>(viewport.maxX, (maxX >> SUBPIXEL_BITS) + 1));
+    setup.bounds.maxY = static_cast<int>(std::min<int64_t>(viewport.maxY, (maxY >> SUBPIXEL_BITS) + 1));
+    setup.color = triangle.color;
+    setup.program = triangle.program;
+    setup.varyings = triangle.varyings;
+
+    // The plane through three points does not depend on their order, so the
+    // gradients use the vertices as submitted, matching the vertex data
+    if (triangle.program) {
+        float deltaX1 = float(fixedX[1] - fixedX[0]) / SUBPIXEL_ONE;
+        float deltaY1 = float(fixedY[1] - fixedY[0]) / SUBPIXEL_ONE;
+        float deltaX2 = float(fixedX[2] - fixedX[0]) / SUBPIXEL_ONE;
+        float deltaY2 = float(fixedY[2] - fixedY[0]) / SUBPIXEL_ONE;
+        float inverseDeterminant = 1.0f / (deltaX1 * deltaY2 - deltaX2 * deltaY1);
+        setup.gradient[0] = deltaY2 * inverseDeterminant;
+        setup.gradient[1] = -deltaY1 * inverseDeterminant;
+        setup.gradient[2] = -deltaX2 * inverseDeterminant;
+        setup.gradient[3] = deltaX1 * inverseDeterminant;
+    }
+
+    return setup.bounds.minX < setup.bounds.maxX && setup.bounds.minY < setup.bounds.maxY;
+}
@@ -0,0 +1,236 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <vector>
+
+#include "FrameArena.h"
+#include "RasterKernels.h"
+#include "ThreadPool.h"
+
+#define TILE_SIZE 64
+
+// Side of the coarse depth tiles; TILE_SIZE must be a multiple of it
+#define DEPTH_TILE_SIZE 8
+
+// Vertex positions are snapped to 1/16 of a pixel before edge setup
+#define SUBPIXEL_BITS 4
+#define SUBPIXEL_ONE (1 << SUBPIXEL_BITS)
+
+// Triangle after perspective division, ready to be binned. Flat triangles
+// carry a single color; shaded ones name the program they were drawn with and
+// where their vertices start in the frame's vertex data (see ShaderKernels.h).
+// Its normalized device coordinates span the viewport it names.
+struct RasterTriangle {
+    glm::vec3 v0, v1, v2;
+    uint32_t color;           // packed RGBA8, flat triangles only
+    uint32_t program = 0;     // 0 for flat, otherwise an id from bindProgram
+    uint32_t varyings = 0;    // offset into the vertex data, in floats
+    uint32_t viewport = 0;    // 0 for the whole target, otherwise an id from addViewport
+};
+
+// Color and depth memory the rasterizer draws into. Colors are packed 8-bit
+// RGBA words, see packColor.
+//
+// Every plane is stored tile by tile, in the rasterizer's TILE_SIZE squares:
+// each tile is one contiguous block, row-major inside, and the tiles follow
+// each other row-major across the target. A tile's color and depth then span a
+// few pages instead of TILE_SIZE rows of the whole image. Tiles on the right
+// and bottom edges are padded to full size, so a plane holds
+// renderTargetSize(width, height) entries; resolvePixels turns the colors back
+// into linear rows for upload and images.
+struct RenderTarget {
+    uint32_t* pixels;
+    float* depth;           // samples entries per pixel
+    int width;
+    int height;
+    // G-buffer planes, only written by deferred shaders (see DeferredLighting.h)
+    uint32_t* normals = nullptr;
+    uint32_t* surfaces = nullptr;
+    // Multisampling, see Multisample.h: one slot per pixel, one list of
+    // sample colors per tile. Both are only used with more than one sample.
+    int samples = 1;
+    uint16_t* sampleSlots = nullptr;
+    std::vector<uint32_t>* sampleColors = nullptr;
+};
+
+// Entries in each plane of a width x height target, padding included
+inline size_t renderTargetSize(int width, int height) {
+    size_t tilesX = (static_cast<size_t>(width) + TILE_SIZE - 1) / TILE_SIZE;
+    size_t tilesY = (static_cast<size_t>(height) + TILE_SIZE - 1) / TILE_SIZE;
+    return tilesX * tilesY * TILE_SIZE * TILE_SIZE;
+}
+
+// Where pixel (x, y) is in every plane of target. Pixels of a row stay
+// consecutive up to the end of their tile.
+inline size_t pixelIndex(const RenderTarget& target, int x, int y) {
+    size_t tilesX = (static_cast<size_t>(target.width) + TILE_SIZE - 1) / TILE_SIZE;
+    unsigned column = static_cast<unsigned>(x);
+    unsigned row = static_cast<unsigned>(y);
+    size_t tile = (row / TILE_SIZE) * tilesX + column / TILE_SIZE;
+    return tile * (TILE_SIZE * TILE_SIZE) + (row % TILE_SIZE) * TILE_SIZE + column % TILE_SIZE;
+}
+
+// Packs a 0..1 color into RGBA8 with opaque alpha. Red is the lowest byte, so in
+// memory the channels are in R, G, B, A order on little-endian hosts.
+inline uint32_t packColor(const glm::vec3& color) {
+    glm::vec3 scaled = glm::clamp(color, 0.0f, 1.0f) * 255.0f + 0.5f;
+    return static_cast<uint32_t>(scaled.x) | (static_cast<uint32_t>(scaled.y) << 8) |
+           (static_cast<uint32_t>(scaled.z) << 16) | 0xFF000000u;
+}
+
+// Screen-space rectangle in pixels, max exclusive
+struct PixelRect {
+    int minX, minY, maxX, maxY;
+};
+
+// Edge equations and depth plane of a triangle, computed once during binning.
+// Edge i is E(x, y) = A * x + B * y + C in subpixel units and is >= 0 inside the
+// triangle; the top-left fill rule is folded into C so pixels exactly on a shared
+// edge belong to exactly one of the two triangles.
+struct TriangleSetup {
+    int64_t edgeA[3];
+    int64_t edgeB[3];
+    int64_t edgeC[3];
+    // Depth at the first vertex and its change per pixel step
+    float z0, dzdx, dzdy;
+    float x0, y0;
+    // Depth range covered by the triangle
+    float zMin, zMax;
+    PixelRect bounds;
+    uint32_t color;
+    uint32_t program;
+    uint32_t varyings;
+    // Screen-space gradient of anything linear over the triangle, from its
+    // differences between vertex 1 and 0 and vertex 2 and 0:
+    // d/dx = delta1 * gradient[0] + delta2 * gradient[1], d/dy likewise with [2] and [3]
+    float gradient[4];
+};
+
+// Fills one region of a shaded triangle: coverage, depth test and one fragment
+// shader call per visible pixel. vertexData points at the triangle's vertices.
+typedef void (*ShadeKernel)(const RasterRegion& region, const TriangleSetup& setup, const float* vertexData,
+                            const void* shader, const RenderTarget& target);
+
+// A shader bound for one frame, see makeShaderProgram
+struct ShaderProgram {
+    ShadeKernel kernel;
+    const void* shader;       // has to stay alive until the frame ends
+};
+
+// Conservative depth range of one DEPTH_TILE_SIZE square of the depth buffer
+struct DepthTile {
+    float minZ;
+    float maxZ;
+};
+
+// Sorts the triangles of a frame into TILE_SIZE x TILE_SIZE screen tiles and
+// rasterizes the tiles on the thread pool. Each tile is owned by exactly one
+// worker for the whole frame, so color and depth writes never race.
+//
+// Next to the per-pixel depth it keeps a coarse level with the min/max depth
+// of every DEPTH_TILE_SIZE square. Triangles behind a depth tile's max skip it
+// without touching a pixel, triangles in front of its min that cover it fully
+// are filled without reading depth, and the same level answers occlusion
+// queries for whole objects.
+class Rasterizer {
+public:
+    // Picks the widest pixel kernel the CPU supports
+    explicit Rasterizer(ThreadPool& pool);
+
+    void setInstructionSet(InstructionSet instructionSet);
+    InstructionSet getInstructionSet() const { return instructionSet; }
+    const RenderTarget& getTarget() const { return target; }
+
+    // With dirty rectangles only the tiles they touch are cleared and redrawn,
+    // everything else keeps the previous frame, which must have had the same size
+    void beginFrame(const RenderTarget& target, const PixelRect* dirtyRects = nullptr, size_t dirtyRectCount = 0);
+    void submitTriangle(const RasterTriangle& triangle);
+    void submitTriangles(const RasterTriangle* first, size_t count);
+    // Shaded triangles, whose varyings offsets point into vertexData
+    void submitTriangles(const RasterTriangle* first, size_t count, const float* vertexData, size_t vertexDataSize);
+    // Makes a shader available to the triangles of this frame and returns the id they refer to it by
+    uint32_t bindProgram(const ShaderProgram& program);
+    // Adds a region of the target for the triangles of this frame to be mapped
+    // into and returns the id they refer to it by. The region has to lie inside
+    // the target. Triangles never draw outside their viewport, so several views
+    // can share one target side by side.
+    uint32_t addViewport(const PixelRect& viewport);
+    // Rasterizes everything submitted so far, so occlusion queries can see it.
+    // The first flush of a frame also clears every tile.
+    void flush();
+    void endFrame();
+
+    // True if nothing inside rect can be closer than minZ, i.e. everything drawn
+    // there so far is in front. Only sees triangles that have been flushed.
+    bool isOccluded(const PixelRect& rect, float minZ) const;
+    // Projects an object-space box with the given model-view-projection and
+    // tests its screen bounds. Boxes crossing the near plane are never occluded.
+    bool isBoxOccluded(const glm::mat4& modelViewProjection, const glm::vec3& boxMin, const glm::vec3& boxMax) const;
+
+    // Whether rect touches a tile that is redrawn this frame
+    bool isRectDirty(const PixelRect& rect) const;
+    // Pixels redrawn this frame, the whole target unless the frame is partial
+    const PixelRect& getDirtyBounds() const { return dirtyBounds; }
+
+private:
+    void binTriangles();
+    void rasterizeTile(int tileIndex, bool clear);
+    void rasterizeTriangle(const TriangleSetup& setup, int tileX, int tileY, int tileEndX, int tileEndY);
+    void fillRegion(const RasterRegion& region);
+    void fillSamples(const RasterRegion& region);
+    float farthestDepth(int blockX, int blockY) const;
+
+    ThreadPool& pool;
+    InstructionSet instructionSet;
+    RasterKernel kernel;
+    // The kernel for the current target's sample count
+    RasterKernel frameKernel;
+    // Per-sample test for shaded triangles, on multisampled targets
+    SampleTestKernel sampleTest = nullptr;
+    FrameArena arena;
+    RenderTarget target;
+    int tilesX = 0;
+    int tilesY = 0;
+    bool tilesCleared = false;
+
+    // One flag per tile: redrawn this frame or kept from the last one
+    std::vector<uint8_t> tileDirty;
+    PixelRect dirtyBounds = {};
+
+    // Coarse depth level, depthTilesX * depthTilesY entries
+    std::vector<DepthTile> depthTiles;
+    int depthTilesX = 0;
+    int depthTilesY = 0;
+
+    // Kept across frames so submitting never allocates once the capacity settles
+    std::vector<RasterTriangle> triangles;
+    std::vector<float> vertexData;
+    std::vector<ShaderProgram> programs;
+    // The whole target first, then the ones from addViewport
+    std::vector<PixelRect> viewports;
+
+    // Binning results of the current flush, allocated from the arena
+    TriangleSetup* setups = nullptr;
+    uint32_t* binStart = nullptr;     // tilesX * tilesY + 1 offsets into binIndices
+    uint32_t* binIndices = nullptr;   // triangle indices grouped by tile
+};
+
+// Copies the colors of rect into linear rows, destinationStride pixels apart,
+// with the rect's first pixel at destination[0]. Multisampled pixels are
+// resolved to the average of their samples.
+void resolvePixels(const RenderTarget& target, const PixelRect& rect, uint32_t* destination, size_t destinationStride);
+
+// Screen rectangle and nearest depth of an object-space box. Returns false if
+// part of the box is behind the near plane, where it could cover anything.
+bool projectBox(const glm::mat4& modelViewProjection, const glm::vec3& boxMin, const glm::vec3& boxMax, int width, int height, PixelRect& rect, float& minZ);
+
+// Computes the edge equations, depth plane and pixel bounds of a triangle
+// mapped into viewport, and clamps the bounds to it. Returns false if it has no
+// area there or cannot be represented in fixed point.
+bool setupTriangle(const RasterTriangle& triangle, const PixelRect& viewport, TriangleSetup& setup);
+// Same for a viewport covering a whole width x height target
+inline bool setupTriangle(const RasterTriangle& triangle, int width, int height, TriangleSetup& setup) {
+    return setupTriangle(triangle, PixelRect{ 0, 0, width, height }, setup);
+}
+// The part of a set-up triangle inside [startX, endX) x [startY, endY), ready for a kernel
+RasterRegion makeRegion(const TriangleSetup& setup, int startX, int startY, int endX, int endY);
@@ -0,0 +1,314 @@
+#include "RayKernels.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define RAY_X86 1
+#include <immintrin.h>
+#endif
+
+// MSVC accepts any intrinsic anywhere, GCC and Clang need the target spelled out
+#if defined(__GNUC__)
+#define TARGET_SSE41 __attribute__((target("sse4.1")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_SSE41
+#define TARGET_AVX2
+#endif
+
+// Stands in for zero direction components, whose inverse would be infinite
+static const float TINY_DIRECTION = 1e-20f;
+
+void setInverseDirections(RayPacket& packet) {
+    auto invert = [](float value) {
+        return 1.0f / (std::fabs(value) > TINY_DIRECTION ? value : std::copysign(TINY_DIRECTION, value));
+    };
+    for (int lane = 0; lane < RAY_PACKET_SIZE; ++lane) {
+        packet.inverseX[lane] = invert(packet.directionX[lane]);
+        packet.inverseY[lane] = invert(packet.directionY[lane]);
+        packet.inverseZ[lane] = invert(packet.directionZ[lane]);
+    }
+}
+
+// Slab test: the ray is inside the box between the largest entry and the
+// smallest exit over the three axes
+static void intersectChildrenScalar(const RayPacket& packet, unsigned active, const BvhNode* children, unsigned hit[2], float entry[2]) {
+    for (int child = 0; child < 2; ++child) {
+        const BvhNode& node = children[child];
+        unsigned lanes = 0;
+        float nearest = std::numeric_limits<float>::infinity();
+        for (int lane = 0; lane < RAY_PACKET_SIZE; ++lane) {
+            if (!(active >> lane & 1))
+                continue;
+            float x1 = (node.boundsMin.x - packet.originX[lane]) * packet.inverseX[lane];
+            float x2 = (node.boundsMax.x - packet.originX[lane]) * packet.inverseX[lane];
+            float y1 = (node.boundsMin.y - packet.originY[lane]) * packet.inverseY[lane];
+            float y2 = (node.boundsMax.y - packet.originY[lane]) * packet.inverseY[lane];
+            float z1 = (node.boundsMin.z - packet.originZ[lane]) * packet.inverseZ[lane];
+            float z2 = (node.boundsMax.z - packet.originZ[lane]) * packet.inverseZ[lane];
+            float enter = std::max(std::max(std::min(x1, x2), std::min(y1, y2)), std::max(std::min(z1, z2), 0.0f));
+            float leave = std::min(std::min(std::max(x1, x2), std::max(y1, y2)), std::min(std::max(z1, z2), packet.distance[lane]));
+            if (enter <= leave) {
+                lanes |= 1u << lane;
+                nearest = std::min(nearest, enter);
+            }
+        }
+        hit[child] = lanes;
+        entry[child] = nearest;
+    }
+}
+
+// Moeller-Trumbore: barycentrics and distance from three triple products
+static unsigned intersectTrianglesScalar(RayPacket& packet, unsigned active, const RayTriangle* triangles, uint32_t first, uint32_t count,
+                                         uint32_t instance, PacketHits& hits) {
+    unsigned anyHit = 0;
+    for (uint32_t i = first; i < first + count; ++i) {
+        const RayTriangle& triangle = triangles[i];
+        for (int lane = 0; lane < RAY_PACKET_SIZE; ++lane) {
+            if (!(active >> lane & 1))
+                continue;
+            glm::vec3 direction(packet.directionX[lane], packet.directionY[lane], packet.directionZ[lane]);
+            glm::vec3 p = glm::cross(direction, triangle.edge2);
+            float determinant = glm::dot(triangle.edge1, p);
+            if (determinant == 0.0f)
+                continue;
+            float inverse = 1.0f / determinant;
+            glm::vec3 s = glm::vec3(packet.originX[lane], packet.originY[lane], packet.originZ[lane]) - triangle.v0;
+            float u = glm::dot(s, p) * inverse;
+            glm::vec3 q = glm::cross(s, triangle.edge1);
+            float v = glm::dot(direction, q) * inverse;
+            float t = glm::dot(triangle.edge2, q) * inverse;
+            if (u >= 0.0f && v >= 0.0f && u + v <= 1.0f && t > 0.0f && t < packet.distance[lane]) {
+                packet.distance[lane] = t;
+                hits.instance[lane] = instance;
+                hits.triangle[lane] = i;
+                anyHit |= 1u << lane;
+            }
+        }
+    }
+    return anyHit;
+}
+
+#ifdef RAY_X86
+
+// The lanes of active as an all-ones / all-zeros mask, four lanes starting at lane
+TARGET_SSE41 static inline __m128 laneMask4(unsigned active, int lane) {
+    const __m128i bits = _mm_setr_epi32(1, 2, 4, 8);
+    __m128i selected = _mm_and_si128(_mm_set1_epi32(static_cast<int>(active >> lane)), bits);
+    return _mm_castsi128_ps(_mm_cmpeq_epi32(selected, bits));
+}
+
+TARGET_SSE41 static void intersectChildrenSSE41(const RayPacket& packet, unsigned active, const BvhNode* children, unsigned hit[2], float entry[2]) {
+    const __m128 zero = _mm_setzero_ps();
+    alignas(16) float nears[RAY_PACKET_SIZE];
+    for (int child = 0; child < 2; ++child) {
+        const BvhNode& node = children[child];
+        unsigned lanes = 0;
+        for (int lane = 0; lane < RAY_PACKET_SIZE; lane += 4) {
+            __m128 ox = _mm_load_ps(packet.originX + lane);
+            __m128 oy = _mm_load_ps(packet.originY + lane);
+            __m128 oz = _mm_load_ps(packet.originZ + lane);
+            __m128 ix = _mm_load_ps(packet.inverseX + lane);
+            __m128 iy = _mm_load_ps(packet.inverseY + lane);
+            __m128 iz = _mm_load_ps(packet.inverseZ + lane);
+            __m128 x1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.boundsMin.x), ox), ix);
+            __m128 x2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.boundsMax.x), ox), ix);
+            __m128 y1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.boundsMin.y), oy), iy);
+            __m128 y2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.boundsMax.y), oy), iy);
+            __m128 z1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.boundsMin.z), oz), iz);
+            __m128 z2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.boundsMax.z), oz), iz);
+            __m128 enter = _mm_max_ps(_mm_max_ps(_mm_min_ps(x1, x2), _mm_min_ps(y1, y2)), _mm_max_ps(_mm_min_ps(z1, z2), zero));
+            __m128 leave = _mm_min_ps(_mm_min_ps(_mm_max_ps(x1, x2), _mm_max_ps(y1, y2)),
+                                    _mm_min_ps(_mm_max_ps(z1, z2), _mm_load_ps(packet.distance + lane)));
+            lanes |= static_cast<unsigned>(_mm_movemask_ps(_mm_cmple_ps(enter, leave))) << lane;
+            _mm_store_ps(nears + lane, enter);
+        }
+        lanes &= active;
+
+        float nearest = std::numeric_limits<float>::infinity();
+        for (int lane = 0; lane < RAY_PACKET_SIZE; ++lane)
+            if (lanes >> lane & 1)
+                nearest = std::min(nearest, nears[lane]);
+        hit[child] = lanes;
+        entry[child] = nearest;
+    }
+}
+
+TARGET_SSE41 static unsigned intersectTrianglesSSE41(RayPacket& packet, unsigned active, const RayTriangle* triangles, uint32_t first, uint32_t count,
+                                                     uint32_t instance, PacketHits& hits) {
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    unsigned anyHit = 0;
+    for (int lane = 0; lane < RAY_PACKET_SIZE; lane += 4) {
+        if (!(active >> lane & 0xF))
+            continue;
+        __m128 activeLanes = laneMask4(active, lane);
+        __m128 ox = _mm_load_ps(packet.originX + lane);
+        __m128 oy = _mm_load_ps(packet.originY + lane);
+        __m128 oz = _mm_load_ps(packet.originZ + lane);
+        __m128 dx = _mm_load_ps(packet.directionX + lane);
+        __m128 dy = _mm_load_ps(packet.directionY + lane);
+        __m128 dz = _mm_load_ps(packet.directionZ + lane);
+        __m128 distance = _mm_load_ps(packet.distance + lane);
+        __m128 hitTriangle = _mm_castsi128_ps(_mm_load_si128(reinterpret_cast<const __m128i*>(hits.triangle + lane)));
+        __m128 hitAny = zero;
+
+        for (uint32_t i = first; i < first + count; ++i) {
+            const RayTriangle& triangle = triangles[i];
+            __m128 e1x = _mm_set1_ps(triangle.edge1.x), e1y = _mm_set1_ps(triangle.edge1.y), e1z = _mm_set1_ps(triangle.edge1.z);
+            __m128 e2x = _mm_set1_ps(triangle.edge2.x), e2y = _mm_set1_ps(triangle.edge2.y), e2z = _mm_set1_ps(triangle.edge2.z);
+            __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+            __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+            __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+            __m128 determinant = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+            __m128 inverse = _mm_div_ps(one, determinant);
+            __m128 sx = _mm_sub_ps(ox, _mm_set1_ps(triangle.v0.x));
+            __m128 sy = _mm_sub_ps(oy, _mm_set1_ps(triangle.v0.y));
+            __m128 sz = _mm_sub_ps(oz, _mm_set1_ps(triangle.v0.z));
+            __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), inverse);
+            __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+            __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+            __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+            __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inverse);
+            __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inverse);
+
+            __m128 hit = _mm_and_ps(_mm_cmpneq_ps(determinant, zero), activeLanes);
+            hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmpge_ps(v, zero)));
+            hit = _mm_and_ps(hit, _mm_cmple_ps(_mm_add_ps(u, v), one));
+            hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpgt_ps(t, zero), _mm_cmplt_ps(t, distance)));
+            if (_mm_movemask_ps(hit) == 0)
+                continue;
+            distance = _mm_blendv_ps(distance, t, hit);
+            hitTriangle = _mm_blendv_ps(hitTriangle, _mm_castsi128_ps(_mm_set1_epi32(static_cast<int>(i))), hit);
+            hitAny = _mm_or_ps(hitAny, hit);
+        }
+
+        unsigned lanes = static_cast<unsigned>(_mm_movemask_ps(hitAny));
+        if (!lanes)
+            continue;
+        _mm_store_ps(packet.distance + lane, distance);
+        _mm_store_si128(reinterpret_cast<__m128i*>(hits.triangle + lane), _mm_castps_si128(hitTriangle));
+        for (int i = 0; i < 4; ++i)
+            if (lanes >> i & 1)
+                hits.instance[lane + i] = instance;
+        anyHit |= lanes << lane;
+    }
+    return anyHit;
+}
+
+TARGET_AVX2 static void intersectChildrenAVX2(const RayPacket& packet, unsigned active, const BvhNode* children, unsigned hit[2], float entry[2]) {
+    __m256 ox = _mm256_load_ps(packet.originX);
+    __m256 oy = _mm256_load_ps(packet.originY);
+    __m256 oz = _mm256_load_ps(packet.originZ);
+    __m256 ix = _mm256_load_ps(packet.inverseX);
+    __m256 iy = _mm256_load_ps(packet.inverseY);
+    __m256 iz = _mm256_load_ps(packet.inverseZ);
+    __m256 distance = _mm256_load_ps(packet.distance);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 infinity = _mm256_set1_ps(std::numeric_limits<float>::infinity());
+
+    for (int child = 0; child < 2; ++child) {
+        const BvhNode& node = children[child];
+        __m256 x1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(node.boundsMin.x), ox), ix);
+        __m256 x2 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(node.boundsMax.x), ox), ix);
+        __m256 y1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(node.boundsMin.y), oy), iy);
+        __m256 y2 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(node.boundsMax.y), oy), iy);
+        __m256 z1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(node.boundsMin.z), oz), iz);
+        __m256 z2 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(node.boundsMax.z), oz), iz);
+        __m256 enter = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(x1, x2), _mm256_min_ps(y1, y2)), _mm256_max_ps(_mm256_min_ps(z1, z2), zero));
+        __m256 leave = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(x1, x2), _mm256_max_ps(y1, y2)), _mm256_min_ps(_mm256_max_ps(z1, z2), distance));
+        __m256 inside = _mm256_cmp_ps(enter, leave, _CMP_LE_OQ);
+        unsigned lanes = static_cast<unsigned>(_mm256_movemask_ps(inside)) & active;
+        hit[child] = lanes;
+        if (!lanes) {
+            entry[child] = std::numeric_limits<float>::infinity();
+            continue;
+        }
+
+        // Smallest entry of the lanes that hit, by halving the register three times
+        __m256i bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+        __m256 selected = _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(static_cast<int>(lanes)), bits), bits));
+        __m256 nearest = _mm256_blendv_ps(infinity, enter, selected);
+        __m128 half = _mm_min_ps(_mm256_castps256_ps128(nearest), _mm256_extractf128_ps(nearest, 1));
+        half = _mm_min_ps(half, _mm_movehl_ps(half, half));
+        half = _mm_min_ss(half, _mm_shuffle_ps(half, half, 1));
+        entry[child] = _mm_cvtss_f32(half);
+    }
+}
+
+TARGET_AVX2 static unsigned intersectTrianglesAVX2(RayPacket& packet, unsigned active, const RayTriangle* triangles, uint32_t first, uint32_t count,
+                                                   uint32_t instance, PacketHits& hits) {
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256i bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+    __m256 activeLanes = _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(static_cast<int>(active)), bits), bits));
+    __m256 ox = _mm256_load_ps(packet.originX);
+    __m256 oy = _mm256_load_ps(packet.originY);
+    __m256 oz = _mm256_load_ps(packet.originZ);
+    __m256 dx = _mm256_load_ps(packet.directionX);
+    __m256 dy = _mm256_load_ps(packet.directionY);
+    __m256 dz = _mm256_load_ps(packet.directionZ);
+    __m256 distance = _mm256_load_ps(packet.distance);
+    __m256 hitTriangle = _mm256_castsi256_ps(_mm256_load_si256(reinterpret_cast<const __m256i*>(hits.triangle)));
+    __m256 hitAny = zero;
+
+    for (uint32_t i = first; i < first + count; ++i) {
+        const RayTriangle& triangle = triangles[i];
+        __m256 e1x = _mm256_set1_ps(triangle.edge1.x), e1y = _mm256_set1_ps(triangle.edge1.y), e1z = _mm256_set1_ps(triangle.edge1.z);
+        __m256 e2x = _mm256_set1_ps(triangle.edge2.x), e2y = _mm256_set1_ps(triangle.edge2.y), e2z = _mm256_set1_ps(triangle.edge2.z);
+        __m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+        __m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+        __m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+        __m256 determinant = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)), _mm256_mul_ps(e1z, pz));
+        __m256 inverse = _mm256_div_ps(one, determinant);
+        __m256 sx = _mm256_sub_ps(ox, _mm256_set1_ps(triangle.v0.x));
+        __m256 sy = _mm256_sub_ps(oy, _mm256_set1_ps(triangle.v0.y));
+        __m256 sz = _mm256_sub_ps(oz, _mm256_set1_ps(triangle.v0.z));
+        __m256 u = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sx, px), _mm256_mul_ps(sy, py)), _mm256_mul_ps(sz, pz)), inverse);
+        __m256 qx = _mm256_sub_ps(_mm256_mul_ps(sy, e1z), _mm256_mul_ps(sz, e1y));
+        __m256 qy = _mm256_sub_ps(_mm256_mul_ps(sz, e1x), _mm256_mul_ps(sx, e1z));
+        __m256 qz = _mm256_sub_ps(_mm256_mul_ps(sx, e1y), _mm256_mul_ps(sy, e1x));
+        __m256 v = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz)), inverse);
+        __m256 t = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)), _mm256_mul_ps(e2z, qz)), inverse);
+
+        __m256 hit = _mm256_and_ps(_mm256_cmp_ps(determinant, zero, _CMP_NEQ_OQ), activeLanes);
+        hit = _mm256_and_ps(hit, _mm256_and_ps(_mm256_cmp_ps(u, zero, _CMP_GE_OQ), _mm256_cmp_ps(v, zero, _CMP_GE_OQ)));
+        hit = _mm256_and_ps(hit, _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ));
+        hit = _mm256_and_ps(hit, _mm256_and_ps(_mm256_cmp_ps(t, zero, _CMP_GT_OQ), _mm256_cmp_ps(t, distance, _CMP_LT_OQ)));
+        if (_mm256_movemask_ps(hit) == 0)
+            continue;
+        distance = _mm256_blendv_ps(distance, t, hit);
+        hitTriangle = _mm256_blendv_ps(hitTriangle, _mm256_castsi256_ps(_mm256_set1_epi32(static_cast<int>(i))), hit);
+        hitAny = _mm256_or_ps(hitAny, hit);
+    }
+
+    unsigned lanes = static_cast<unsigned>(_mm256_movemask_ps(hitAny));
+    if (!lanes)
+        return 0;
+    _mm256_store_ps(packet.distance, distance);
+    _mm256_store_si256(reinterpret_cast<__m256i*>(hits.triangle), _mm256_castps_si256(hitTriangle));
+    __m256i instances = _mm256_load_si256(reinterpret_cast<const __m256i*>(hits.instance));
+    instances = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(instances), _mm256_castsi256_ps(_mm256_set1_epi32(static_cast<int>(instance))), hitAny));
+    _mm256_store_si256(reinterpret_cast<__m256i*>(hits.instance), instances);
+    return lanes;
+}
+
+#endif
+
+RayKernels getRayKernels(InstructionSet instructionSet) {
+    RayKernels kernels = { intersectChildrenScalar, intersectTrianglesScalar };
+#ifdef RAY_X86
+    if (instructionSet == InstructionSet::AVX2) {
+        kernels.intersectChildren = intersectChildrenAVX2;
+        kernels.intersectTriangles = intersectTrianglesAVX2;
+    } else if (instructionSet == InstructionSet::SSE41) {
+        kernels.intersectChildren = intersectChildrenSSE41;
+        kernels.intersectTriangles = intersectTrianglesSSE41;
+    }
+#else
+    (void)instructionSet;
+#endif
+    return kernels;
+}
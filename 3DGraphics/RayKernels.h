@@ -0,0 +1,63 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <cstdint>
+
+#include "Bvh.h"
+#include "RasterKernels.h"
+
+// Rays traced together; each lane of an AVX2 register holds one
+#define RAY_PACKET_SIZE 8
+
+// Up to RAY_PACKET_SIZE rays in structure-of-arrays form, one lane per ray.
+// The ray in lane i reaches origin + t * direction for t in [0, distance[i]],
+// and distance shrinks to the nearest hit found so far. Which lanes take part
+// is a bit mask passed next to the packet.
+struct alignas(32) RayPacket {
+    float originX[RAY_PACKET_SIZE];
+    float originY[RAY_PACKET_SIZE];
+    float originZ[RAY_PACKET_SIZE];
+    float directionX[RAY_PACKET_SIZE];
+    float directionY[RAY_PACKET_SIZE];
+    float directionZ[RAY_PACKET_SIZE];
+    // 1 / direction, for the box tests; see setInverseDirections
+    float inverseX[RAY_PACKET_SIZE];
+    float inverseY[RAY_PACKET_SIZE];
+    float inverseZ[RAY_PACKET_SIZE];
+    float distance[RAY_PACKET_SIZE];
+};
+
+// What the lanes of a packet hit
+struct alignas(32) PacketHits {
+    uint32_t instance[RAY_PACKET_SIZE];
+    uint32_t triangle[RAY_PACKET_SIZE];   // position in the triangle array the kernel was given
+};
+
+// A triangle as the ray test wants it
+struct RayTriangle {
+    glm::vec3 v0;
+    glm::vec3 edge1;    // v1 - v0
+    glm::vec3 edge2;    // v2 - v0
+};
+
+// Tests the lanes of active against both children of an inner node. hit[i] is
+// set to the lanes that enter child i before their distance, entry[i] to the
+// nearest entry among them, for visiting the nearer child first.
+typedef void (*PacketBoxKernel)(const RayPacket& packet, unsigned active, const BvhNode* children, unsigned hit[2], float entry[2]);
+
+// Tests the lanes of active against triangles [first, first + count), both
+// sides. A lane that hits one before its distance moves its distance there and
+// records instance and the triangle's index in hits. Returns the lanes that
+// hit anything.
+typedef unsigned (*PacketTriangleKernel)(RayPacket& packet, unsigned active, const RayTriangle* triangles, uint32_t first, uint32_t count,
+                                         uint32_t instance, PacketHits& hits);
+
+struct RayKernels {
+    PacketBoxKernel intersectChildren;
+    PacketTriangleKernel intersectTriangles;
+};
+
+RayKernels getRayKernels(InstructionSet instructionSet);
+
+// Fills the inverse directions from the directions of every lane. Zero
+// components become tiny instead, so the box tests never see 0 * infinity.
+void setInverseDirections(RayPacket& packet);
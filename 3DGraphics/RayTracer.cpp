@@ -0,0 +1,338 @@
+#include "RayTracer.h"
+
+#include <algorithm>
+
+#include "Profiler.h"
+#include "Rasterizer.h"
+
+// Leaves of the triangle hierarchy hold up to this many triangles, the
+// instance hierarchy one instance each
+#define MESH_LEAF_SIZE 4
+#define INSTANCE_LEAF_SIZE 1
+
+// Triangles and instances prepared per job
+#define PREPARE_CHUNK_SIZE 4096
+
+// The instance hierarchy is rebuilt once refitting has grown its summed area
+// past this factor of the area it had when built
+#define REBUILD_GROWTH 2.0f
+
+// Packets cover 4 x 2 pixels
+#define PACKET_WIDTH 4
+
+static void setLane(RayPacket& packet, int lane, const Ray& ray) {
+    packet.originX[lane] = ray.origin.x;
+    packet.originY[lane] = ray.origin.y;
+    packet.originZ[lane] = ray.origin.z;
+    packet.directionX[lane] = ray.direction.x;
+    packet.directionY[lane] = ray.direction.y;
+    packet.directionZ[lane] = ray.direction.z;
+    packet.distance[lane] = ray.maxDistance;
+}
+
+[[maybe_unused]] static int laneCount(unsigned lanes) {
+    int count = 0;
+    for (; lanes; lanes &= lanes - 1)
+        ++count;
+    return count;
+}
+
+// A packet of copies of ray, so lanes outside the mask hold sane values too
+static void fillPacket(RayPacket& packet, const Ray& ray) {
+    for (int lane = 0; lane < RAY_PACKET_SIZE; ++lane)
+        setLane(packet, lane, ray);
+    setInverseDirections(packet);
+}
+
+Ray cameraRay(const glm::mat4& inverseViewProjection, float ndcX, float ndcY) {
+    glm::vec4 nearPoint = inverseViewProjection * glm::vec4(ndcX, ndcY, -1.0f, 1.0f);
+    glm::vec4 farPoint = inverseViewProjection * glm::vec4(ndcX, ndcY, 1.0f, 1.0f);
+    Ray ray;
+    ray.origin = glm::vec3(nearPoint) / nearPoint.w;
+    ray.direction = glm::vec3(farPoint) / farPoint.w - ray.origin;
+    ray.maxDistance = 1.0f;
+    return ray;
+}
+
+RayTracer::RayTracer(ThreadPool& pool) : pool(pool) {
+    setInstructionSet(detectInstructionSet());
+}
+
+void RayTracer::setInstructionSet(InstructionSet instructionSet) {
+    this->instructionSet = instructionSet;
+    kernels = getRayKernels(instructionSet);
+}
+
+void RayTracer::update(const MeshView& mesh, const InstanceBuffer& instances) {
+    PROFILE_SCOPE(ProfileStage::Bvh, "Bvh");
+    bool meshChanged = mesh.positions != this->mesh.positions || mesh.indices != this->mesh.indices ||
+                       mesh.indexCount != this->mesh.indexCount;
+    this->mesh = mesh;
+    if (meshChanged)
+        buildMesh();
+
+    bool rebuild = meshChanged || &instances != this->instances || instances.size() != instanceCount;
+    if (!rebuild && instances.version == instanceVersion)
+        return;
+    this->instances = &instances;
+    instanceCount = instances.size();
+    instanceVersion = instances.version;
+    updateInstances();
+
+    if (!rebuild && !instanceBvh.isEmpty()) {
+        instanceBvh.refit(instanceBoxes);
+        rebuild = instanceBvh.getArea() > REBUILD_GROWTH * instanceBvh.getBuiltArea();
+    }
+    if (rebuild)
+        instanceBvh.build(pool, instanceBoxes, INSTANCE_LEAF_SIZE);
+}
+
+void RayTracer::buildMesh() {
+    size_t count = mesh.triangleCount();
+    int chunkCount = static_cast<int>((count + PREPARE_CHUNK_SIZE - 1) / PREPARE_CHUNK_SIZE);
+    std::vector<BvhBox> boxes(count);
+    pool.parallelFor(chunkCount, [&](int chunk, unsigned) {
+        size_t end = std::min(count, static_cast<size_t>(chunk + 1) * PREPARE_CHUNK_SIZE);
+        for (size_t i = static_cast<size_t>(chunk) * PREPARE_CHUNK_SIZE; i < end; ++i) {
+            const glm::vec3& p0 = mesh.positions[mesh.indices[i * 3]];
+            const glm::vec3& p1 = mesh.positions[mesh.indices[i * 3 + 1]];
+            const glm::vec3& p2 = mesh.positions[mesh.indices[i * 3 + 2]];
+            boxes[i].boundsMin = glm::min(glm::min(p0, p1), p2);
+            boxes[i].boundsMax = glm::max(glm::max(p0, p1), p2);
+        }
+    });
+    meshBvh.build(pool, boxes, MESH_LEAF_SIZE);
+
+    // Triangles are stored in leaf order, so a leaf's are consecutive
+    const std::vector<uint32_t>& order = meshBvh.getPrimitives();
+    triangles.resize(count);
+    triangleColors.resize(count);
+    pool.parallelFor(chunkCount, [&](int chunk, unsigned) {
+        size_t end = std::min(count, static_cast<size_t>(chunk + 1) * PREPARE_CHUNK_SIZE);
+        for (size_t i = static_cast<size_t>(chunk) * PREPARE_CHUNK_SIZE; i < end; ++i) {
+            const uint32_t* indices = mesh.indices + static_cast<size_t>(order[i]) * 3;
+            const glm::vec3& p0 = mesh.positions[indices[0]];
+            triangles[i].v0 = p0;
+            triangles[i].edge1 = mesh.positions[indices[1]] - p0;
+            triangles[i].edge2 = mesh.positions[indices[2]] - p0;
+            // The same flat color the vertex stage gives the triangle
+            triangleColors[i] = mesh.colors ? (mesh.colors[indices[0]] + mesh.colors[indices[1]] + mesh.colors[indices[2]]) / 3.0f
+                                            : glm::vec3(1.0f);
+        }
+    });
+}
+
+// World boxes of the instances from the mesh's bounds, and the transforms that
+// take rays into model space
+void RayTracer::updateInstances() {
+    instanceBoxes.resize(instanceCount);
+    inverseTransforms.resize(instanceCount);
+    glm::vec3 center = (mesh.boundsMin + mesh.boundsMax) * 0.5f;
+    glm::vec3 halfExtent = (mesh.boundsMax - mesh.boundsMin) * 0.5f;
+    int chunkCount = static_cast<int>((instanceCount + PREPARE_CHUNK_SIZE - 1) / PREPARE_CHUNK_SIZE);
+    pool.parallelFor(chunkCount, [&](int chunk, unsigned) {
+        size_t end = std::min(instanceCount, static_cast<size_t>(chunk + 1) * PREPARE_CHUNK_SIZE);
+        for (size_t i = static_cast<size_t>(chunk) * PREPARE_CHUNK_SIZE; i < end; ++i) {
+            const glm::mat4& model = instances->transforms[i];
+            glm::vec3 worldCenter = glm::vec3(model * glm::vec4(center, 1.0f));
+            glm::vec3 worldExtent = glm::abs(glm::vec3(model[0])) * halfExtent.x + glm::abs(glm::vec3(model[1])) * halfExtent.y +
+                                    glm::abs(glm::vec3(model[2])) * halfExtent.z;
+            instanceBoxes[i].boundsMin = worldCenter - worldExtent;
+            instanceBoxes[i].boundsMax = worldCenter + worldExtent;
+            inverseTransforms[i] = glm::inverse(model);
+        }
+    });
+}
+
+// Depth-first, nearer child first. Each stack entry remembers which lanes
+// entered it; with anyHit lanes drop out as soon as they hit something.
+template <typename Leaf>
+unsigned RayTracer::traverse(const Bvh& bvh, RayPacket& packet, unsigned active, bool anyHit, const Leaf& leaf) const {
+    struct StackEntry {
+        uint32_t node;
+        unsigned lanes;
+    };
+    StackEntry stack[BVH_MAX_DEPTH];
+    int stackSize = 0;
+
+    const BvhNode* nodes = bvh.getNodes().data();
+    uint32_t node = 0;
+    unsigned lanes = active;
+    unsigned hit = 0;
+    for (;;) {
+        const BvhNode& current = nodes[node];
+        if (current.count == 0) {
+            unsigned childLanes[2];
+            float entry[2];
+            kernels.intersectChildren(packet, lanes, nodes + current.first, childLanes, entry);
+            if (childLanes[0] && childLanes[1]) {
+                int nearer = entry[1] < entry[0] ? 1 : 0;
+                stack[stackSize++] = { current.first + 1 - nearer, childLanes[1 - nearer] };
+                node = current.first + nearer;
+                lanes = childLanes[nearer];
+                continue;
+            }
+            if (childLanes[0] || childLanes[1]) {
+                int child = childLanes[0] ? 0 : 1;
+                node = current.first + child;
+                lanes = childLanes[child];
+                continue;
+            }
+        } else {
+            unsigned leafHit = leaf(current, lanes);
+            hit |= leafHit;
+            if (anyHit) {
+                active &= ~leafHit;
+                if (!active)
+                    return hit;
+            }
+        }
+
+        do {
+            if (stackSize == 0)
+                return hit;
+            --stackSize;
+            node = stack[stackSize].node;
+            lanes = stack[stackSize].lanes & active;
+        } while (!lanes);
+    }
+}
+
+unsigned RayTracer::trace(RayPacket& packet, unsigned active, bool anyHit, PacketHits& hits) const {
+    if (!active || instanceBvh.isEmpty() || meshBvh.isEmpty())
+        return 0;
+
+    const uint32_t* order = instanceBvh.getPrimitives().data();
+    return traverse(instanceBvh, packet, active, anyHit, [&](const BvhNode& leaf, unsigned lanes) {
+        unsigned hit = 0;
+        for (uint32_t i = leaf.first; i < leaf.first + leaf.count && lanes; ++i) {
+            unsigned instanceHit = traceInstance(packet, lanes, anyHit, order[i], hits);
+            hit |= instanceHit;
+            if (anyHit)
+                lanes &= ~instanceHit;
+        }
+        return hit;
+    });
+}
+
+// The packet moves into the instance's model space. Directions are not
+// normalized there, so distances mean the same in both spaces.
+unsigned RayTracer::traceInstance(RayPacket& packet, unsigned active, bool anyHit, uint32_t instance, PacketHits& hits) const {
+    const glm::mat4& inverse = inverseTransforms[instance];
+    RayPacket local;
+    for (int lane = 0; lane < RAY_PACKET_SIZE; ++lane) {
+        glm::vec3 origin = glm::vec3(inverse * glm::vec4(packet.originX[lane], packet.originY[lane], packet.originZ[lane], 1.0f));
+        glm::vec3 direction = glm::vec3(inverse * glm::vec4(packet.directionX[lane], packet.directionY[lane], packet.directionZ[lane], 0.0f));
+        local.originX[lane] = origin.x;
+        local.originY[lane] = origin.y;
+        local.originZ[lane] = origin.z;
+        local.directionX[lane] = direction.x;
+        local.directionY[lane] = direction.y;
+        local.directionZ[lane] = direction.z;
+        local.distance[lane] = packet.distance[lane];
+    }
+    setInverseDirections(local);
+
+    const RayTriangle* meshTriangles = triangles.data();
+    unsigned hit = traverse(meshBvh, local, active, anyHit, [&](const BvhNode& leaf, unsigned lanes) {
+        return kernels.intersectTriangles(local, lanes, meshTriangles, leaf.first, leaf.count, instance, hits);
+    });
+    for (int lane = 0; lane < RAY_PACKET_SIZE; ++lane)
+        if (hit >> lane & 1)
+            packet.distance[lane] = local.distance[lane];
+    return hit;
+}
+
+unsigned RayTracer::intersect(RayPacket& packet, unsigned active, PacketHits& hits) const {
+    for (int lane = 0; lane < RAY_PACKET_SIZE; ++lane)
+        hits.instance[lane] = RAY_MISS;
+    unsigned hit = trace(packet, active, false, hits);
+
+    const uint32_t* order = meshBvh.getPrimitives().data();
+    for (int lane = 0; lane < RAY_PACKET_SIZE; ++lane)
+        if (hit >> lane & 1)
+            hits.triangle[lane] = order[hits.triangle[lane]];
+    return hit;
+}
+
+unsigned RayTracer::occluded(RayPacket& packet, unsigned active) const {
+    PacketHits hits;
+    return trace(packet, active, true, hits);
+}
+
+RayHit RayTracer::intersect(const Ray& ray) const {
+    RayPacket packet;
+    fillPacket(packet, ray);
+    PacketHits hits;
+    RayHit hit = { ray.maxDistance, RAY_MISS, 0 };
+    if (intersect(packet, 1, hits)) {
+        hit.distance = packet.distance[0];
+        hit.instance = hits.instance[0];
+        hit.triangle = hits.triangle[0];
+    }
+    return hit;
+}
+
+bool RayTracer::isOccluded(const Ray& ray) const {
+    RayPacket packet;
+    fillPacket(packet, ray);
+    return occluded(packet, 1) != 0;
+}
+
+void RayTracer::render(const Rasterizer& rasterizer, const glm::mat4& viewProjection) {
+    PROFILE_SCOPE(ProfileStage::RayCast, "RayCast");
+    const RenderTarget& target = rasterizer.getTarget();
+    glm::mat4 inverseViewProjection = glm::inverse(viewProjection);
+    // Rows of the projection that give the depth of a hit
+    glm::vec4 depthRow(viewProjection[0][2], viewProjection[1][2], viewProjection[2][2], viewProjection[3][2]);
+    glm::vec4 wRow(viewProjection[0][3], viewProjection[1][3], viewProjection[2][3], viewProjection[3][3]);
+
+    int tilesX = (target.width + TILE_SIZE - 1) / TILE_SIZE;
+    int tilesY = (target.height + TILE_SIZE - 1) / TILE_SIZE;
+    pool.parallelFor(tilesX * tilesY, [&](int tile, unsigned) {
+        PixelRect rect;
+        rect.minX = (tile % tilesX) * TILE_SIZE;
+        rect.minY = (tile / tilesX) * TILE_SIZE;
+        rect.maxX = std::min(rect.minX + TILE_SIZE, target.width);
+        rect.maxY = std::min(rect.minY + TILE_SIZE, target.height);
+        if (!rasterizer.isRectDirty(rect))
+            return;
+
+        PROFILE_ONLY(uint64_t rays = 0);
+        RayPacket packet;
+        PacketHits hits;
+        const int packetHeight = RAY_PACKET_SIZE / PACKET_WIDTH;
+        for (int y = rect.minY; y < rect.maxY; y += packetHeight) {
+            for (int x = rect.minX; x < rect.maxX; x += PACKET_WIDTH) {
+                unsigned active = 0;
+                for (int lane = 0; lane < RAY_PACKET_SIZE; ++lane) {
+                    int pixelX = x + lane % PACKET_WIDTH;
+                    int pixelY = y + lane / PACKET_WIDTH;
+                    if (pixelX < rect.maxX && pixelY < rect.maxY)
+                        active |= 1u << lane;
+                    float ndcX = (pixelX + 0.5f) * 2.0f / target.width - 1.0f;
+                    float ndcY = (pixelY + 0.5f) * 2.0f / target.height - 1.0f;
+                    setLane(packet, lane, cameraRay(inverseViewProjection, ndcX, ndcY));
+                }
+                setInverseDirections(packet);
+                unsigned hit = trace(packet, active, false, hits);
+                PROFILE_ONLY(rays += laneCount(active));
+
+                for (int lane = 0; lane < RAY_PACKET_SIZE; ++lane) {
+                    if (!(hit >> lane & 1))
+                        continue;
+                    float t = packet.distance[lane];
+                    glm::vec4 point(packet.originX[lane] + packet.directionX[lane] * t, packet.originY[lane] + packet.directionY[lane] * t,
+                                    packet.originZ[lane] + packet.directionZ[lane] * t, 1.0f);
+                    float depth = glm::dot(depthRow, point) / glm::dot(wRow, point);
+
+                    size_t pixel = pixelIndex(target, x + lane % PACKET_WIDTH, y + lane / PACKET_WIDTH);
+                    target.pixels[pixel] = packColor(triangleColors[hits.triangle[lane]] * instances->colors[hits.instance[lane]]);
+                    for (int sample = 0; sample < target.samples; ++sample)
+                        target.depth[pixel * target.samples + sample] = depth;
+                }
+            }
+        }
+        PROFILE_COUNT(ProfileCounter::RaysCast, rays);
+    });
+}
@@ -0,0 +1,98 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <vector>
+
+#include "Bvh.h"
+#include "Instancing.h"
+#include "Mesh.h"
+#include "RayKernels.h"
+#include "ThreadPool.h"
+
+class Rasterizer;
+
+// Instance of a ray that hit nothing
+#define RAY_MISS 0xFFFFFFFFu
+
+// Reaches origin + t * direction for t in [0, maxDistance]. Distances are in
+// units of the direction's length, which does not have to be one.
+struct Ray {
+    glm::vec3 origin;
+    glm::vec3 direction;
+    float maxDistance;
+};
+
+struct RayHit {
+    float distance;
+    uint32_t instance;    // RAY_MISS if nothing was hit
+    uint32_t triangle;    // index of the mesh triangle, i.e. of its first index / 3
+};
+
+// The ray through a point of the screen in normalized device coordinates, from
+// the near plane at distance 0 to the far plane at distance 1
+Ray cameraRay(const glm::mat4& inverseViewProjection, float ndcX, float ndcY);
+
+// Casts rays against the mesh and instances the rasterizer draws.
+//
+// There are two hierarchies: one over the mesh's triangles in model space,
+// built once per mesh, and one over the instances' world-space boxes, refit
+// when instances move and rebuilt once refitting has loosened it too much. A
+// ray reaching an instance continues into the triangle hierarchy in that
+// instance's model space, so the mesh is stored once however many instances
+// there are.
+//
+// Rays go through the hierarchies in packets of RAY_PACKET_SIZE. Coherent rays
+// such as a camera's visit mostly the same nodes, so each node is tested once
+// for the whole packet with the widest kernels the CPU supports.
+class RayTracer {
+public:
+    explicit RayTracer(ThreadPool& pool);
+
+    void setInstructionSet(InstructionSet instructionSet);
+    InstructionSet getInstructionSet() const { return instructionSet; }
+
+    // Brings the hierarchies up to date with mesh and instances, which have to
+    // stay alive until the next update. Rays always see level 0 of the mesh.
+    void update(const MeshView& mesh, const InstanceBuffer& instances);
+
+    // Nearest hits of the lanes of active, whose distances shrink to them.
+    // Lanes that hit nothing get RAY_MISS. Returns the lanes that hit.
+    unsigned intersect(RayPacket& packet, unsigned active, PacketHits& hits) const;
+    // The lanes of active that hit anything; stops at the first hit found
+    unsigned occluded(RayPacket& packet, unsigned active) const;
+    RayHit intersect(const Ray& ray) const;
+    bool isOccluded(const Ray& ray) const;
+
+    // Casts one ray per pixel through the tiles the rasterizer redraws this
+    // frame and writes flat colors and depths into its target, in place of
+    // rasterizing. Call after the rasterizer's endFrame, which clears those
+    // tiles, in a frame nothing was submitted to.
+    void render(const Rasterizer& rasterizer, const glm::mat4& viewProjection);
+
+private:
+    void buildMesh();
+    void updateInstances();
+    template <typename Leaf>
+    unsigned traverse(const Bvh& bvh, RayPacket& packet, unsigned active, bool anyHit, const Leaf& leaf) const;
+    // Hits record the triangle's position in leaf order
+    unsigned trace(RayPacket& packet, unsigned active, bool anyHit, PacketHits& hits) const;
+    unsigned traceInstance(RayPacket& packet, unsigned active, bool anyHit, uint32_t instance, PacketHits& hits) const;
+
+    ThreadPool& pool;
+    InstructionSet instructionSet;
+    RayKernels kernels;
+
+    MeshView mesh;
+    const InstanceBuffer* instances = nullptr;
+    size_t instanceCount = 0;
+    uint64_t instanceVersion = 0;
+
+    Bvh meshBvh;
+    // Triangles and their flat colors in the triangle hierarchy's leaf order
+    std::vector<RayTriangle> triangles;
+    std::vector<glm::vec3> triangleColors;
+
+    Bvh instanceBvh;
+    std::vector<BvhBox> instanceBoxes;
+    std::vector<glm::mat4> inverseTransforms;
+};
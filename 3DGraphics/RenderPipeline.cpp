@@ -0,0 +1,65 @@
+#include "RenderPipeline.h"
+
+#include <algorithm>
+
+RenderPipeline::RenderPipeline(int depth) : frames(std::max(1, depth)) {
+    for (PipelineFrame& frame : frames)
+        freeFrames.push_back(&frame);
+}
+
+void RenderPipeline::submit(const FrameInput& input) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pendingInput = input;
+        pendingInput.number = ++submittedFrames;
+        hasPendingInput = true;
+    }
+    renderCondition.notify_one();
+}
+
+PipelineFrame* RenderPipeline::acquirePresent() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (finishedFrames.empty())
+        return nullptr;
+
+    PipelineFrame* frame = finishedFrames.front();
+    finishedFrames.pop_front();
+    return frame;
+}
+
+void RenderPipeline::releasePresent(PipelineFrame* frame) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        freeFrames.push_back(frame);
+    }
+    renderCondition.notify_one();
+}
+
+void RenderPipeline::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    renderCondition.notify_all();
+}
+
+PipelineFrame* RenderPipeline::acquireRender() {
+    std::unique_lock<std::mutex> lock(mutex);
+    renderCondition.wait(lock, [this] { return stopping || (hasPendingInput && !freeFrames.empty()); });
+    if (stopping)
+        return nullptr;
+
+    PipelineFrame* frame = freeFrames.back();
+    freeFrames.pop_back();
+    frame->input = pendingInput;
+    hasPendingInput = false;
+    return frame;
+}
+
+void RenderPipeline::finishRender(PipelineFrame* frame, bool produced) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (produced)
+        finishedFrames.push_back(frame);
+    else
+        freeFrames.push_back(frame);
+}
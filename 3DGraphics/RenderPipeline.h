@@ -0,0 +1,93 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#include "Framebuffer.h"
+#include "Rasterizer.h"
+#include "Shaders.h"
+
+// Default number of frames in flight: one being presented, one being
+// rasterized and one finished frame waiting in between
+#define DEFAULT_PIPELINE_DEPTH 3
+
+// Everything the render thread needs from the main thread for one frame. It is
+// copied into the frame, so the two threads never share the input state.
+struct FrameInput {
+    uint64_t number = 0;    // assigned by submit, counts up from 1
+    std::chrono::steady_clock::time_point sampledAt;
+    double time = 0.0;      // animation time in seconds
+    int width = 0;
+    int height = 0;
+    glm::mat4 viewProjection = glm::mat4(1.0f);
+    bool showCubeField = false;
+    bool animateCube = false;
+    ShadingModel shading = ShadingModel::Flat;
+    int samples = 1;        // per pixel, see Multisample.h
+    float lodPixelScale = 0.0f;     // see LodSelection, 0 draws full detail
+    float lodPixelError = 1.0f;
+    bool rayCast = false;   // cast rays instead of rasterizing, see RayTracer
+    // Cameras around the scene drawn side by side, see VertexStage::drawViews
+    int views = 1;
+    // Report what is under a point of the screen, in normalized device coordinates
+    bool pick = false;
+    glm::vec2 pickPoint = glm::vec2(0.0f);
+};
+
+// A color target moving through the pipeline together with the input it was
+// rendered from and the part of it that changed
+struct PipelineFrame {
+    FrameInput input;
+    Framebuffer framebuffer;
+    PixelRect dirtyBounds;
+};
+
+// Bounded queue between a render thread and the thread that presents. Frames
+// cycle free -> rendering -> finished -> presenting -> free, so the render
+// thread can work on frame N + 1 while frame N is uploaded and presented, and
+// blocks once depth frames are in flight. A larger depth keeps the render
+// thread busy through longer present stalls, at the cost of latency.
+//
+// Finished frames are presented in order and never dropped: with partial
+// redraws each frame only carries the pixels that changed since the one before.
+class RenderPipeline {
+public:
+    explicit RenderPipeline(int depth = DEFAULT_PIPELINE_DEPTH);
+
+    RenderPipeline(const RenderPipeline&) = delete;
+    RenderPipeline& operator=(const RenderPipeline&) = delete;
+
+    int getDepth() const { return static_cast<int>(frames.size()); }
+
+    // Presenting thread. Hands over the newest input; input the render thread
+    // has not started on yet is replaced, so it always renders the latest state.
+    void submit(const FrameInput& input);
+    // Oldest finished frame, or nullptr if none is ready yet. Does not block.
+    PipelineFrame* acquirePresent();
+    void releasePresent(PipelineFrame* frame);
+    // Makes acquireRender return nullptr, so the render thread can exit
+    void stop();
+
+    // Render thread. Blocks until there is new input and a free frame, then
+    // returns that frame with the input copied in; nullptr once stopped.
+    PipelineFrame* acquireRender();
+    // Passes the frame on for presenting, or straight back to the free list
+    // when rendering found nothing to draw
+    void finishRender(PipelineFrame* frame, bool produced);
+
+private:
+    std::vector<PipelineFrame> frames;
+    std::vector<PipelineFrame*> freeFrames;
+    std::deque<PipelineFrame*> finishedFrames;
+
+    std::mutex mutex;
+    std::condition_variable renderCondition;
+    FrameInput pendingInput;
+    bool hasPendingInput = false;
+    uint64_t submittedFrames = 0;
+    bool stopping = false;
+};
@@ -0,0 +1,312 @@
+#include "SceneGraph.h"
+
+#include <algorithm>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define SCENE_GRAPH_SSE 1
+#include <xmmintrin.h>
+#endif
+
+NodeId SceneGraph::createNode(NodeId parent, const NodeTransform& local, uint32_t instance) {
+    // The node goes to the end for now; update() moves it behind its parent
+    NodeId node = static_cast<NodeId>(slotOfNode.size());
+    uint32_t slot = static_cast<uint32_t>(nodeAtSlot.size());
+    slotOfNode.push_back(slot);
+    parentOfNode.push_back(parent);
+    instanceOfNode.push_back(instance);
+    nodeAtSlot.push_back(node);
+
+    parentSlot.push_back(NO_NODE);
+    subtreeEnd.push_back(slot + 1);
+    translationX.push_back(local.translation.x);
+    translationY.push_back(local.translation.y);
+    translationZ.push_back(local.translation.z);
+    rotationX.push_back(local.rotation.x);
+    rotationY.push_back(local.rotation.y);
+    rotationZ.push_back(local.rotation.z);
+    rotationW.push_back(local.rotation.w);
+    scaleX.push_back(local.scale.x);
+    scaleY.push_back(local.scale.y);
+    scaleZ.push_back(local.scale.z);
+    worldMatrices.push_back(glm::mat4(1.0f));
+    dirtyFlags.push_back(0);
+
+    needsReorder = true;
+    return node;
+}
+
+void SceneGraph::clear() {
+    *this = SceneGraph();
+}
+
+NodeTransform SceneGraph::getLocal(NodeId node) const {
+    uint32_t slot = slotOfNode[node];
+    NodeTransform local;
+    local.translation = glm::vec3(translationX[slot], translationY[slot], translationZ[slot]);
+    local.rotation = glm::quat(rotationW[slot], rotationX[slot], rotationY[slot], rotationZ[slot]);
+    local.scale = glm::vec3(scaleX[slot], scaleY[slot], scaleZ[slot]);
+    return local;
+}
+
+void SceneGraph::setLocal(NodeId node, const NodeTransform& local) {
+    setTranslation(node, local.translation);
+    setRotation(node, local.rotation);
+    setScale(node, local.scale);
+}
+
+void SceneGraph::setTranslation(NodeId node, const glm::vec3& translation) {
+    uint32_t slot = slotOfNode[node];
+    translationX[slot] = translation.x;
+    translationY[slot] = translation.y;
+    translationZ[slot] = translation.z;
+    markDirty(slot);
+}
+
+void SceneGraph::setRotation(NodeId node, const glm::quat& rotation) {
+    uint32_t slot = slotOfNode[node];
+    rotationX[slot] = rotation.x;
+    rotationY[slot] = rotation.y;
+    rotationZ[slot] = rotation.z;
+    rotationW[slot] = rotation.w;
+    markDirty(slot);
+}
+
+void SceneGraph::setScale(NodeId node, const glm::vec3& scale) {
+    uint32_t slot = slotOfNode[node];
+    scaleX[slot] = scale.x;
+    scaleY[slot] = scale.y;
+    scaleZ[slot] = scale.z;
+    markDirty(slot);
+}
+
+void SceneGraph::markDirty(uint32_t slot) {
+    if (dirtyFlags[slot])
+        return;
+    dirtyFlags[slot] = 1;
+    dirtySlots.push_back(slot);
+}
+
+void SceneGraph::update() {
+    updatedNodes.clear();
+    uint32_t count = static_cast<uint32_t>(nodeAtSlot.size());
+
+    if (needsReorder) {
+        reorder();
+        std::fill(dirtyFlags.begin(), dirtyFlags.end(), 0);
+        dirtySlots.clear();
+        needsReorder = false;
+        updateRange(0, count);
+        return;
+    }
+    if (dirtySlots.empty())
+        return;
+
+    // Ranges have to be visited in slot order, so parents are done before their
+    // children. Sorting a few changed nodes is cheap; when many changed, reading
+    // the flags in order is cheaper than sorting.
+    if (dirtySlots.size() > count / 64) {
+        dirtySlots.clear();
+        for (uint32_t slot = 0; slot < count; ++slot) {
+            if (dirtyFlags[slot])
+                dirtySlots.push_back(slot);
+        }
+    } else {
+        std::sort(dirtySlots.begin(), dirtySlots.end());
+    }
+
+    // Subtrees either nest or do not touch, so a dirty node inside the range
+    // just updated needs nothing more
+    uint32_t updatedEnd = 0;
+    for (uint32_t slot : dirtySlots) {
+        dirtyFlags[slot] = 0;
+        if (slot < updatedEnd)
+            continue;
+        updatedEnd = subtreeEnd[slot];
+        updateRange(slot, updatedEnd);
+    }
+    dirtySlots.clear();
+}
+
+void SceneGraph::reorder() {
+    uint32_t count = static_cast<uint32_t>(nodeAtSlot.size());
+
+    // Children of every node in creation order, as ranges of one array
+    std::vector<uint32_t> childStart(count + 1, 0);
+    for (NodeId node = 0; node < count; ++node) {
+        if (parentOfNode[node] != NO_NODE)
+            ++childStart[parentOfNode[node] + 1];
+    }
+    for (uint32_t i = 0; i < count; ++i)
+        childStart[i + 1] += childStart[i];
+    std::vector<NodeId> children(childStart[count]);
+    std::vector<uint32_t> childCount(count, 0);
+    for (NodeId node = 0; node < count; ++node) {
+        NodeId parent = parentOfNode[node];
+        if (parent != NO_NODE)
+            children[childStart[parent] + childCount[parent]++] = node;
+    }
+
+    // Depth-first order, roots and siblings in creation order
+    std::vector<NodeId> order;
+    order.reserve(count);
+    std::vector<NodeId> stack;
+    for (NodeId root = 0; root < count; ++root) {
+        if (parentOfNode[root] != NO_NODE)
+            continue;
+        stack.push_back(root);
+        while (!stack.empty()) {
+            NodeId node = stack.back();
+            stack.pop_back();
+            order.push_back(node);
+            for (uint32_t i = childStart[node + 1]; i > childStart[node]; --i)
+                stack.push_back(children[i - 1]);
+        }
+    }
+
+    // Move the local transforms into the new order; the matrices are all
+    // recomputed after this anyway
+    std::vector<uint32_t> oldSlots(count);
+    for (uint32_t slot = 0; slot < count; ++slot)
+        oldSlots[slot] = slotOfNode[order[slot]];
+    auto permute = [&](auto& values) {
+        auto previous = values;
+        for (uint32_t slot = 0; slot < count; ++slot)
+            values[slot] = previous[oldSlots[slot]];
+    };
+    permute(translationX);
+    permute(translationY);
+    permute(translationZ);
+    permute(rotationX);
+    permute(rotationY);
+    permute(rotationZ);
+    permute(rotationW);
+    permute(scaleX);
+    permute(scaleY);
+    permute(scaleZ);
+
+    nodeAtSlot = order;
+    for (uint32_t slot = 0; slot < count; ++slot)
+        slotOfNode[order[slot]] = slot;
+    for (uint32_t slot = 0; slot < count; ++slot) {
+        NodeId parent = parentOfNode[order[slot]];
+        parentSlot[slot] = parent == NO_NODE ? NO_NODE : slotOfNode[parent];
+        subtreeEnd[slot] = slot + 1;
+    }
+    // Children come after their parent, so walking backwards finishes every
+    // subtree before its root is visited
+    for (uint32_t slot = count; slot-- > 0;) {
+        if (parentSlot[slot] != NO_NODE)
+            subtreeEnd[parentSlot[slot]] = std::max(subtreeEnd[parentSlot[slot]], subtreeEnd[slot]);
+    }
+}
+
+void SceneGraph::updateRange(uint32_t begin, uint32_t end) {
+    // Local matrices only live for one block, so they stay in cache between the
+    // two kernels instead of going out to memory and coming back
+    const uint32_t BLOCK_SIZE = 64;
+    glm::mat4 localMatrices[BLOCK_SIZE];
+
+    for (uint32_t blockStart = begin; blockStart < end; blockStart += BLOCK_SIZE) {
+        uint32_t blockEnd = std::min(end, blockStart + BLOCK_SIZE);
+        composeTransforms(&translationX[blockStart], &translationY[blockStart], &translationZ[blockStart],
+                          &rotationX[blockStart], &rotationY[blockStart], &rotationZ[blockStart], &rotationW[blockStart],
+                          &scaleX[blockStart], &scaleY[blockStart], &scaleZ[blockStart], blockEnd - blockStart, localMatrices);
+        for (uint32_t slot = blockStart; slot < blockEnd; ++slot) {
+            uint32_t parent = parentSlot[slot];
+            if (parent == NO_NODE)
+                worldMatrices[slot] = localMatrices[slot - blockStart];
+            else
+                multiplyMatrices(worldMatrices[parent], localMatrices[slot - blockStart], worldMatrices[slot]);
+            updatedNodes.push_back(nodeAtSlot[slot]);
+        }
+    }
+}
+
+// One node at a time, for the nodes left over after the groups of four. Same
+// operations in the same order as the vector loop, so both give the same bits.
+static void composeTransform(float tx, float ty, float tz, float x, float y, float z, float w,
+                             float sx, float sy, float sz, glm::mat4& matrix) {
+    float xx = x * x, xy = x * y, xz = x * z, xw = x * w;
+    float yy = y * y, yz = y * z, yw = y * w;
+    float zz = z * z, zw = z * w;
+
+    matrix[0] = glm::vec4((1.0f - 2.0f * (yy + zz)) * sx, (2.0f * (xy - zw)) * sx, (2.0f * (xz + yw)) * sx, 0.0f);
+    matrix[1] = glm::vec4((2.0f * (xy + zw)) * sy, (1.0f - 2.0f * (xx + zz)) * sy, (2.0f * (yz - xw)) * sy, 0.0f);
+    matrix[2] = glm::vec4((2.0f * (xz - yw)) * sz, (2.0f * (yz + xw)) * sz, (1.0f - 2.0f * (xx + yy)) * sz, 0.0f);
+    matrix[3] = glm::vec4(tx, ty, tz, 1.0f);
+}
+
+void composeTransforms(const float* translationX, const float* translationY, const float* translationZ,
+                       const float* rotationX, const float* rotationY, const float* rotationZ, const float* rotationW,
+                       const float* scaleX, const float* scaleY, const float* scaleZ, size_t count, glm::mat4* matrices) {
+    size_t i = 0;
+#ifdef SCENE_GRAPH_SSE
+    // Four nodes per step: every matrix entry is computed for all four at once,
+    // then each column is transposed from one-entry-per-node into one-column-per-node
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 two = _mm_set1_ps(2.0f);
+    for (; i + 4 <= count; i += 4) {
+        __m128 x = _mm_loadu_ps(rotationX + i);
+        __m128 y = _mm_loadu_ps(rotationY + i);
+        __m128 z = _mm_loadu_ps(rotationZ + i);
+        __m128 w = _mm_loadu_ps(rotationW + i);
+        __m128 xx = _mm_mul_ps(x, x), xy = _mm_mul_ps(x, y), xz = _mm_mul_ps(x, z), xw = _mm_mul_ps(x, w);
+        __m128 yy = _mm_mul_ps(y, y), yz = _mm_mul_ps(y, z), yw = _mm_mul_ps(y, w);
+        __m128 zz = _mm_mul_ps(z, z), zw = _mm_mul_ps(z, w);
+        __m128 sx = _mm_loadu_ps(scaleX + i);
+        __m128 sy = _mm_loadu_ps(scaleY + i);
+        __m128 sz = _mm_loadu_ps(scaleZ + i);
+
+        __m128 columns[4][4] = {
+            { _mm_mul_ps(_mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(yy, zz))), sx),
+              _mm_mul_ps(_mm_mul_ps(two, _mm_sub_ps(xy, zw)), sx),
+              _mm_mul_ps(_mm_mul_ps(two, _mm_add_ps(xz, yw)), sx),
+              _mm_setzero_ps() },
+            { _mm_mul_ps(_mm_mul_ps(two, _mm_add_ps(xy, zw)), sy),
+              _mm_mul_ps(_mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, zz))), sy),
+              _mm_mul_ps(_mm_mul_ps(two, _mm_sub_ps(yz, xw)), sy),
+              _mm_setzero_ps() },
+            { _mm_mul_ps(_mm_mul_ps(two, _mm_sub_ps(xz, yw)), sz),
+              _mm_mul_ps(_mm_mul_ps(two, _mm_add_ps(yz, xw)), sz),
+              _mm_mul_ps(_mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, yy))), sz),
+              _mm_setzero_ps() },
+            { _mm_loadu_ps(translationX + i), _mm_loadu_ps(translationY + i), _mm_loadu_ps(translationZ + i), one }
+        };
+        for (int c = 0; c < 4; ++c) {
+            _MM_TRANSPOSE4_PS(columns[c][0], columns[c][1], columns[c][2], columns[c][3]);
+            for (int node = 0; node < 4; ++node)
+                _mm_storeu_ps(&matrices[i + node][c][0], columns[c][node]);
+        }
+    }
+#endif
+    for (; i < count; ++i)
+        composeTransform(translationX[i], translationY[i], translationZ[i], rotationX[i], rotationY[i], rotationZ[i], rotationW[i],
+                         scaleX[i], scaleY[i], scaleZ[i], matrices[i]);
+}
+
+void multiplyMatrices(const glm::mat4& left, const glm::mat4& right, glm::mat4& result) {
+#ifdef SCENE_GRAPH_SSE
+    // Column c of the result is left's columns weighted by column c of right
+    __m128 l0 = _mm_loadu_ps(&left[0][0]);
+    __m128 l1 = _mm_loadu_ps(&left[1][0]);
+    __m128 l2 = _mm_loadu_ps(&left[2][0]);
+    __m128 l3 = _mm_loadu_ps(&left[3][0]);
+    // Summed as two pairs: in a chain of joints every product waits for the
+    // one before, so the shorter dependency matters more than the add count
+    for (int c = 0; c < 4; ++c) {
+        __m128 first = _mm_add_ps(_mm_mul_ps(l0, _mm_set1_ps(right[c][0])), _mm_mul_ps(l1, _mm_set1_ps(right[c][1])));
+        __m128 second = _mm_add_ps(_mm_mul_ps(l2, _mm_set1_ps(right[c][2])), _mm_mul_ps(l3, _mm_set1_ps(right[c][3])));
+        _mm_storeu_ps(&result[c][0], _mm_add_ps(first, second));
+    }
+#else
+    result = left * right;
+#endif
+}
+
+void writeInstanceTransforms(const SceneGraph& graph, InstanceBuffer& instances) {
+    for (NodeId node : graph.getUpdatedNodes()) {
+        uint32_t instance = graph.getInstance(node);
+        if (instance != NO_INSTANCE)
+            instances.set(instance, graph.getWorld(node), instances.colors[instance]);
+    }
+}
@@ -0,0 +1,95 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+#include <cstdint>
+#include <vector>
+
+#include "Instancing.h"
+
+typedef uint32_t NodeId;
+#define NO_NODE 0xFFFFFFFFu
+#define NO_INSTANCE 0xFFFFFFFFu
+
+// Position of a node relative to its parent: scale, then rotate, then translate.
+// The rotation is turned into a matrix the way quaternionToMatrix does it.
+struct NodeTransform {
+    glm::vec3 translation = glm::vec3(0.0f);
+    glm::quat rotation = glm::quat(1.0f, 0.0f, 0.0f, 0.0f);
+    glm::vec3 scale = glm::vec3(1.0f);
+};
+
+// Hierarchy of transforms with cached world matrices.
+//
+// Nodes are stored in flat arrays in depth-first order, so every subtree is one
+// contiguous range behind its root. Changing a node marks its subtree dirty;
+// update() turns the local transforms of each dirty range into matrices four
+// nodes at a time and multiplies them with their parents' world matrices, which
+// the order guarantees are already up to date. Clean subtrees cost nothing.
+//
+// NodeIds stay valid for the lifetime of the graph. Adding nodes reorders the
+// arrays on the next update, which then recomputes everything once.
+class SceneGraph {
+public:
+    // instance is handed back by getInstance, for copying the node's world
+    // matrix into an InstanceBuffer
+    NodeId createNode(NodeId parent = NO_NODE, const NodeTransform& local = NodeTransform(), uint32_t instance = NO_INSTANCE);
+    void clear();
+    size_t size() const { return slotOfNode.size(); }
+
+    NodeId getParent(NodeId node) const { return parentOfNode[node]; }
+    uint32_t getInstance(NodeId node) const { return instanceOfNode[node]; }
+    NodeTransform getLocal(NodeId node) const;
+
+    void setLocal(NodeId node, const NodeTransform& local);
+    void setTranslation(NodeId node, const glm::vec3& translation);
+    void setRotation(NodeId node, const glm::quat& rotation);
+    void setScale(NodeId node, const glm::vec3& scale);
+
+    // Recomputes the world matrices of every dirty subtree and lists the nodes
+    // whose world matrix was recomputed in getUpdatedNodes
+    void update();
+    bool isDirty() const { return needsReorder || !dirtySlots.empty(); }
+    // Valid after update; until then the matrix from the last update
+    const glm::mat4& getWorld(NodeId node) const { return worldMatrices[slotOfNode[node]]; }
+    const std::vector<NodeId>& getUpdatedNodes() const { return updatedNodes; }
+
+private:
+    void markDirty(uint32_t slot);
+    void reorder();
+    void updateRange(uint32_t begin, uint32_t end);
+
+    // Per NodeId
+    std::vector<uint32_t> slotOfNode;
+    std::vector<NodeId> parentOfNode;
+    std::vector<uint32_t> instanceOfNode;
+    std::vector<NodeId> nodeAtSlot;
+
+    // Per slot. A parent's slot is always below its children's, and the
+    // subtree of slot s is [s, subtreeEnd[s]).
+    std::vector<uint32_t> parentSlot;
+    std::vector<uint32_t> subtreeEnd;
+    // Local transforms, one array per component so the kernel loads four nodes
+    // with one instruction each
+    std::vector<float> translationX, translationY, translationZ;
+    std::vector<float> rotationX, rotationY, rotationZ, rotationW;
+    std::vector<float> scaleX, scaleY, scaleZ;
+    std::vector<glm::mat4> worldMatrices;
+
+    // Roots of the subtrees changed since the last update, each listed once
+    std::vector<uint32_t> dirtySlots;
+    std::vector<uint8_t> dirtyFlags;
+    std::vector<NodeId> updatedNodes;
+    bool needsReorder = false;
+};
+
+// Local matrices of count nodes from their transform components, as the
+// matrix of translation * rotation * scale
+void composeTransforms(const float* translationX, const float* translationY, const float* translationZ,
+                       const float* rotationX, const float* rotationY, const float* rotationZ, const float* rotationW,
+                       const float* scaleX, const float* scaleY, const float* scaleZ, size_t count, glm::mat4* matrices);
+// result = left * right, for one matrix pair
+void multiplyMatrices(const glm::mat4& left, const glm::mat4& right, glm::mat4& result);
+
+// Copies the world matrices recomputed by the last update into the instances
+// the nodes were created with, keeping each instance's color
+void writeInstanceTransforms(const SceneGraph& graph, InstanceBuffer& instances);
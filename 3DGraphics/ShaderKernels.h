@@ -0,0 +1,190 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <cstring>
+
+#include "DeferredLighting.h"
+#include "Mesh.h"
+#include "Multisample.h"
+#include "Profiler.h"
+#include "Rasterizer.h"
+
+// Programmable shading. A shader is a plain functor type:
+//
+//   struct MyShader {
+//       struct Varyings { ... };   // floats only, interpolated across triangles
+//       Varyings vertex(const MeshView& mesh, uint32_t index, const ShaderInstance& instance) const;
+//       glm::vec3 fragment(const Varyings& varyings) const;
+//   };
+//
+// A fragment() returning a SurfaceSample instead of a color makes a deferred
+// shader: it fills the G-buffer, and DeferredLighting colors the pixel later.
+//
+// The vertex stage and the pixel loop below are instantiated per shader type,
+// so both calls are inlined where they run and every shader gets a pixel loop
+// of its own, with nothing generic left per pixel. Positions are always the
+// mesh positions times the model-view-projection matrix; vertex() only
+// produces the varyings, which are interpolated perspective-correctly.
+//
+// On multisampled targets the fragment shader still runs once per pixel, at
+// its center, and its result goes to the samples the triangle covers.
+
+// What a vertex shader knows about the instance being drawn
+struct ShaderInstance {
+    glm::mat4 model;
+    glm::vec3 tint;
+};
+
+// Where a fragment shader's result goes: colors to the color buffer, surfaces to the G-buffer
+inline void writeFragment(const glm::vec3& color, const RenderTarget& target, size_t pixel) {
+    target.pixels[pixel] = packColor(color);
+}
+
+inline void writeFragment(const SurfaceSample& surface, const RenderTarget& target, size_t pixel) {
+    target.normals[pixel] = encodeNormal(surface.normal);
+    target.surfaces[pixel] = packSurface(surface.albedo, surface.material);
+}
+
+inline void writeFragmentSamples(const glm::vec3& color, const RenderTarget& target, size_t pixel, unsigned samples) {
+    writeSampleColor(target, pixel, samples, packColor(color));
+}
+
+// The G-buffer has one surface per pixel, whichever samples it covers
+inline void writeFragmentSamples(const SurfaceSample& surface, const RenderTarget& target, size_t pixel, unsigned) {
+    writeFragment(surface, target, pixel);
+}
+
+template <typename Shader>
+struct ShaderTraits {
+    typedef typename Shader::Varyings Varyings;
+    static_assert(sizeof(Varyings) % sizeof(float) == 0, "varyings must consist of floats");
+
+    static const int VARYING_COUNT = static_cast<int>(sizeof(Varyings) / sizeof(float));
+    // Floats per vertex in the rasterizer's vertex data: 1/w, then each varying divided by w
+    static const int VERTEX_SIZE = VARYING_COUNT + 1;
+};
+
+// Varyings over w at the center of the region's first pixel and their change
+// per pixel step
+template <int VERTEX_SIZE>
+inline void setupVaryings(const RasterRegion& region, const TriangleSetup& setup, const float* vertexData,
+                          float* rowValue, float* stepX, float* stepY) {
+    float offsetX = region.startX + 0.5f - setup.x0;
+    float offsetY = region.startY + 0.5f - setup.y0;
+    for (int i = 0; i < VERTEX_SIZE; ++i) {
+        float base = vertexData[i];
+        float delta1 = vertexData[VERTEX_SIZE + i] - base;
+        float delta2 = vertexData[2 * VERTEX_SIZE + i] - base;
+        stepX[i] = delta1 * setup.gradient[0] + delta2 * setup.gradient[1];
+        stepY[i] = delta1 * setup.gradient[2] + delta2 * setup.gradient[3];
+        rowValue[i] = base + stepX[i] * offsetX + stepY[i] * offsetY;
+    }
+}
+
+template <typename Shader>
+inline typename Shader::Varyings interpolateVaryings(const float* value) {
+    const int VARYING_COUNT = ShaderTraits<Shader>::VARYING_COUNT;
+    float w = 1.0f / value[0];
+    float interpolated[VARYING_COUNT];
+    for (int i = 0; i < VARYING_COUNT; ++i)
+        interpolated[i] = value[i + 1] * w;
+
+    typename Shader::Varyings varyings;
+    std::memcpy(&varyings, interpolated, sizeof(varyings));
+    return varyings;
+}
+
+// The multisampled pixel loop: the rasterizer's sample test, vectorized where
+// the CPU allows, takes coverage and depth per sample first, then the shader
+// runs once per pixel that won any sample. Regions never span more than a
+// depth tile, so their masks fit on the stack.
+template <typename Shader>
+void shadeSamples(const RasterRegion& region, const TriangleSetup& setup, const float* vertexData, const Shader& shader, const RenderTarget& target) {
+    uint8_t writeMasks[DEPTH_TILE_SIZE * DEPTH_TILE_SIZE];
+    region.sampleTest(region, target, writeMasks);
+
+    const int VERTEX_SIZE = ShaderTraits<Shader>::VERTEX_SIZE;
+    float rowValue[VERTEX_SIZE], stepX[VERTEX_SIZE], stepY[VERTEX_SIZE];
+    setupVaryings<VERTEX_SIZE>(region, setup, vertexData, rowValue, stepX, stepY);
+    int width = region.endX - region.startX;
+    const uint8_t* writeRow = writeMasks;
+
+    for (int y = region.startY; y < region.endY; ++y) {
+        size_t rowStart = pixelIndex(target, region.startX, y);
+        float value[VERTEX_SIZE];
+        for (int i = 0; i < VERTEX_SIZE; ++i)
+            value[i] = rowValue[i];
+
+        for (int x = 0; x < width; ++x) {
+            if (writeRow[x])
+                writeFragmentSamples(shader.fragment(interpolateVaryings<Shader>(value)), target, rowStart + x, writeRow[x]);
+            for (int i = 0; i < VERTEX_SIZE; ++i)
+                value[i] += stepX[i];
+        }
+
+        writeRow += width;
+        for (int i = 0; i < VERTEX_SIZE; ++i)
+            rowValue[i] += stepY[i];
+    }
+}
+
+// Values divided by w are linear in screen space, so they are stepped like
+// depth and only divided back per covered pixel
+template <typename Shader>
+void shadeRegion(const RasterRegion& region, const TriangleSetup& setup, const float* vertexData, const void* shaderPointer, const RenderTarget& target) {
+    const int VERTEX_SIZE = ShaderTraits<Shader>::VERTEX_SIZE;
+    const Shader& shader = *static_cast<const Shader*>(shaderPointer);
+    if (target.samples > 1) {
+        shadeSamples<Shader>(region, setup, vertexData, shader, target);
+        return;
+    }
+
+    float rowValue[VERTEX_SIZE], stepX[VERTEX_SIZE], stepY[VERTEX_SIZE];
+    setupVaryings<VERTEX_SIZE>(region, setup, vertexData, rowValue, stepX, stepY);
+
+    int64_t rowEdge[3] = { region.edge[0], region.edge[1], region.edge[2] };
+    float rowDepth = region.depth;
+    int width = region.endX - region.startX;
+    PROFILE_ONLY(uint64_t tested = 0; uint64_t written = 0);
+
+    for (int y = region.startY; y < region.endY; ++y) {
+        size_t rowStart = pixelIndex(target, region.startX, y);
+        float* depthRow = target.depth + rowStart;
+        int64_t edge0 = rowEdge[0], edge1 = rowEdge[1], edge2 = rowEdge[2];
+        float depth = rowDepth;
+        float value[VERTEX_SIZE];
+        for (int i = 0; i < VERTEX_SIZE; ++i)
+            value[i] = rowValue[i];
+
+        for (int x = 0; x < width; ++x) {
+            PROFILE_ONLY(tested += (edge0 | edge1 | edge2) >= 0);
+            if ((edge0 | edge1 | edge2) >= 0 && depth < depthRow[x]) {
+                PROFILE_ONLY(++written);
+                depthRow[x] = depth;
+                writeFragment(shader.fragment(interpolateVaryings<Shader>(value)), target, rowStart + x);
+            }
+
+            edge0 += region.stepX[0];
+            edge1 += region.stepX[1];
+            edge2 += region.stepX[2];
+            depth += region.dzdx;
+            for (int i = 0; i < VERTEX_SIZE; ++i)
+                value[i] += stepX[i];
+        }
+
+        for (int e = 0; e < 3; ++e)
+            rowEdge[e] += region.stepY[e];
+        rowDepth += region.dzdy;
+        for (int i = 0; i < VERTEX_SIZE; ++i)
+            rowValue[i] += stepY[i];
+    }
+
+    PROFILE_COUNT(ProfileCounter::PixelsTested, tested);
+    PROFILE_COUNT(ProfileCounter::PixelsWritten, written);
+}
+
+template <typename Shader>
+ShaderProgram makeShaderProgram(const Shader& shader) {
+    ShaderProgram program = { shadeRegion<Shader>, &shader };
+    return program;
+}
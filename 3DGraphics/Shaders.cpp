@@ -0,0 +1,33 @@
+#include "Shaders.h"
+
+#include <cstring>
+
+static const char* SHADING_MODEL_NAMES[] = { "flat", "gouraud", "textured", "lit", "deferred" };
+
+const char* shadingModelName(ShadingModel model) {
+    return SHADING_MODEL_NAMES[static_cast<int>(model)];
+}
+
+bool parseShadingModel(const char* name, ShadingModel& model) {
+    for (int i = 0; i < 5; ++i) {
+        if (std::strcmp(name, SHADING_MODEL_NAMES[i]) == 0) {
+            model = static_cast<ShadingModel>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+Texture createCheckerTexture(int size, int cellSize) {
+    Texture texture;
+    texture.width = size;
+    texture.height = size;
+    texture.texels.resize(static_cast<size_t>(size) * size);
+
+    uint32_t light = packColor(glm::vec3(1.0f));
+    uint32_t dark = packColor(glm::vec3(0.35f));
+    for (int y = 0; y < size; ++y)
+        for (int x = 0; x < size; ++x)
+            texture.texels[y * size + x] = ((x / cellSize + y / cellSize) & 1) ? dark : light;
+    return texture;
+}
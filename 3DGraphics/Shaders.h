@@ -0,0 +1,147 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "Mesh.h"
+#include "ShaderKernels.h"
+
+enum class ShadingModel {
+    Flat,       // one color per triangle, drawn by the SIMD kernels
+    Gouraud,
+    Textured,
+    Lit,
+    Deferred    // G-buffer, then many point lights per pixel, see DeferredLighting.h
+};
+
+const char* shadingModelName(ShadingModel model);
+// Accepts the names shadingModelName returns
+bool parseShadingModel(const char* name, ShadingModel& model);
+
+// RGBA8 texels, sampled with wrap-around. Sides are powers of two so wrapping is a mask.
+struct Texture {
+    int width = 0;
+    int height = 0;
+    std::vector<uint32_t> texels;
+
+    glm::vec3 sample(float u, float v) const {
+        int x = static_cast<int>(std::floor(u * width)) & (width - 1);
+        int y = static_cast<int>(std::floor(v * height)) & (height - 1);
+        uint32_t texel = texels[y * width + x];
+        return glm::vec3(static_cast<float>(texel & 0xFF), static_cast<float>((texel >> 8) & 0xFF),
+                         static_cast<float>((texel >> 16) & 0xFF)) * (1.0f / 255.0f);
+    }
+};
+
+// size x size checkerboard with squares of cellSize texels; size must be a power of two
+Texture createCheckerTexture(int size, int cellSize);
+
+// Vertex colors interpolated across the triangle
+struct GouraudShader {
+    struct Varyings {
+        glm::vec3 color;
+    };
+
+    Varyings vertex(const MeshView& mesh, uint32_t index, const ShaderInstance& instance) const {
+        Varyings out;
+        out.color = mesh.colors[index] * instance.tint;
+        return out;
+    }
+
+    glm::vec3 fragment(const Varyings& in) const {
+        return in.color;
+    }
+};
+
+// Texture times vertex color. Meshes have no texture coordinates, so the vertex
+// shader projects the object-space position along the normal's main axis
+// (box mapping), with repeat texture tiles across the mesh's bounds.
+struct TexturedShader {
+    const Texture* texture;
+    float repeat;
+
+    struct Varyings {
+        glm::vec2 uv;
+        glm::vec3 color;
+    };
+
+    Varyings vertex(const MeshView& mesh, uint32_t index, const ShaderInstance& instance) const {
+        glm::vec3 extent = glm::max(mesh.boundsMax - mesh.boundsMin, glm::vec3(1e-6f));
+        glm::vec3 position = (mesh.positions[index] - mesh.boundsMin) / extent * repeat;
+        glm::vec3 axis = glm::abs(mesh.normals[index]);
+
+        Varyings out;
+        if (axis.x >= axis.y && axis.x >= axis.z)
+            out.uv = glm::vec2(position.z, position.y);
+        else if (axis.y >= axis.z)
+            out.uv = glm::vec2(position.x, position.z);
+        else
+            out.uv = glm::vec2(position.x, position.y);
+        out.color = mesh.colors[index] * instance.tint;
+        return out;
+    }
+
+    glm::vec3 fragment(const Varyings& in) const {
+        return texture->sample(in.uv.x, in.uv.y) * in.color;
+    }
+};
+
+// Per-pixel Lambert lighting from one directional light plus ambient
+struct LitShader {
+    glm::vec3 lightDirection;   // world space, unit length, pointing towards the light
+    float ambient;
+
+    struct Varyings {
+        glm::vec3 normal;
+        glm::vec3 color;
+    };
+
+    Varyings vertex(const MeshView& mesh, uint32_t index, const ShaderInstance& instance) const {
+        // Fine for rotations and uniform scales, the fragment shader renormalizes
+        const glm::mat4& model = instance.model;
+        const glm::vec3& normal = mesh.normals[index];
+
+        Varyings out;
+        out.normal = glm::vec3(model[0]) * normal.x + glm::vec3(model[1]) * normal.y + glm::vec3(model[2]) * normal.z;
+        out.color = mesh.colors[index] * instance.tint;
+        return out;
+    }
+
+    glm::vec3 fragment(const Varyings& in) const {
+        float length = std::sqrt(glm::dot(in.normal, in.normal));
+        float diffuse = length > 0.0f ? std::max(glm::dot(in.normal, lightDirection), 0.0f) / length : 0.0f;
+        return in.color * (ambient + (1.0f - ambient) * diffuse);
+    }
+};
+
+// Writes the surface to the G-buffer for DeferredLighting to light. Every
+// triangle drawn with it gets the same material.
+struct DeferredShader {
+    uint8_t material;
+
+    struct Varyings {
+        glm::vec3 normal;
+        glm::vec3 color;
+    };
+
+    Varyings vertex(const MeshView& mesh, uint32_t index, const ShaderInstance& instance) const {
+        const glm::mat4& model = instance.model;
+        const glm::vec3& normal = mesh.normals[index];
+
+        Varyings out;
+        out.normal = glm::vec3(model[0]) * normal.x + glm::vec3(model[1]) * normal.y + glm::vec3(model[2]) * normal.z;
+        out.color = mesh.colors[index] * instance.tint;
+        return out;
+    }
+
+    SurfaceSample fragment(const Varyings& in) const {
+        SurfaceSample surface;
+        float length = std::sqrt(glm::dot(in.normal, in.normal));
+        surface.normal = length > 0.0f ? in.normal / length : glm::vec3(0.0f, 0.0f, 1.0f);
+        surface.albedo = in.color;
+        surface.material = material;
+        return surface;
+    }
+};
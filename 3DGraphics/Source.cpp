@@ -1,47 +1,196 @@
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
 #include <glm/glm.hpp>
-#include <glm/gtc/quaternion.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
 #include <iostream>
-
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include "stb_image_write.h"
+#include <sstream>
+#include <string>
+#include <thread>
 #include <vector>
 
-#define TEXTURE_WIDTH 600
-#define TEXTURE_HEIGHT 600
+#include "AnimationScript.h"
+#include "ChangeTracker.h"
+#include "DeferredLighting.h"
+#include "FrameEncoder.h"
+#include "Framebuffer.h"
+#include "Image.h"
+#include "Instancing.h"
+#include "Mesh.h"
+#include "MeshCache.h"
+#include "Multisample.h"
+#include "Profiler.h"
+#include "Rasterizer.h"
+#include "RayTracer.h"
+#include "RenderPipeline.h"
+#include "SceneGraph.h"
+#include "Shaders.h"
+#include "ThreadPool.h"
+#include "Transforms.h"
+#include "VertexStage.h"
+
+// Size of the window when it opens; the framebuffer follows it when resized
+#define INITIAL_WIDTH 600
+#define INITIAL_HEIGHT 600
+
+// Materials of the deferred shading model
+#define MATERIAL_MATTE 0
+#define MATERIAL_GLOSSY 1
 
 // The texture parameters
 GLuint textureId;
-glm::vec3 pixels[TEXTURE_WIDTH * TEXTURE_HEIGHT];
+int textureWidth = 0;
+int textureHeight = 0;
+// Frames are uploaded through two pixel buffers in turn, so copying frame N
+// never waits for the transfer of frame N - 1 to finish
+GLuint pixelBuffers[2];
+int pixelBufferIndex = 0;
 GLuint VAO, VBO, EBO;
 GLuint shaderProgram;
 float rotationAngleX = 0.0f;
 float rotationAngleY = 0.0f;
 float rotationSpeed = 150.0f;
 float cameraDistance = -5.0f;
+bool showCubeField = false;
+bool fieldKeyWasPressed = false;
+bool animateCube = false;
+bool animateKeyWasPressed = false;
+ShadingModel shadingModel = ShadingModel::Flat;
+bool shadingKeyWasPressed = false;
+int sampleCount = 1;
+bool samplesKeyWasPressed = false;
+bool levelOfDetail = true;
+bool lodKeyWasPressed = false;
+float lodPixelError = 1.0f;
+bool rayCast = false;
+bool rayCastKeyWasPressed = false;
+int viewCount = 1;
+// A click waiting for the next frame to find what is under it
+bool pickRequested = false;
+glm::vec2 pickPoint = glm::vec2(0.0f);
+bool mouseWasPressed = false;
+// Set when the window system asks for the window contents to be drawn again
+bool windowNeedsRefresh = false;
+
+// Everything that can be drawn: the cube pair, the cube field, or a model
+// loaded from the command line, which replaces the cubes
+struct Scene {
+    Mesh cubeMesh;
+    InstanceBuffer cubePair;
+    // Both cubes of the pair hang off one root node; animation moves the nodes
+    // and copies the world matrices that changed into cubePair
+    SceneGraph cubePairNodes;
+    NodeId spinningCube = NO_NODE;
+    InstanceBuffer cubeField;
+    MappedMesh model;
+    InstanceBuffer modelInstance;
+    // The loaded model in place of each cube of the field
+    InstanceBuffer modelField;
+    Texture checkerTexture;
+    // Point lights of the deferred shading model
+    std::vector<PointLight> lights;
+    // Shading, samples and renderer of the last frame; switching redraws everything
+    ShadingModel shading = ShadingModel::Flat;
+    int samples = 1;
+    bool rayCast = false;
+    // Levels of detail of the instances drawn last, and which buffer they belong to
+    LodSelection lods;
+    const InstanceBuffer* lodInstances = nullptr;
+    // The same per camera when several are drawn, with the cameras themselves
+    std::vector<LodSelection> viewLods;
+    std::vector<RenderView> views;
+    // Decides per frame whether anything has to be drawn at all
+    ChangeTracker changes;
+    std::vector<PixelRect> dirtyRects;
+};
+
+// Command-line options. Headless runs render without a window or an OpenGL
+// context, which is what build servers without a GPU need.
+struct AppOptions {
+    const char* modelPath = nullptr;
+    bool headless = false;
+    int frames = 1;
+    int width = INITIAL_WIDTH;
+    int height = INITIAL_HEIGHT;
+    const char* outputPath = nullptr;
+    const char* goldenPath = nullptr;
+    int tolerance = 2;          // per channel, in 1/255 steps
+    size_t maxDiffering = 0;    // pixels allowed to exceed the tolerance
+    int pipelineDepth = DEFAULT_PIPELINE_DEPTH;
+    const char* tracePath = nullptr;
+    // Pixel to pick in the last frame, from the top left corner of the image
+    bool pick = false;
+    double pickX = 0.0;
+    double pickY = 0.0;
+    // Batch rendering of an animation script: frames [rangeFirst, rangeLast]
+    // of it, -1 for its last one, written by background encoder threads
+    const char* scriptPath = nullptr;
+    int rangeFirst = 0;
+    int rangeLast = -1;
+    int encoderThreads = 1;
+    int encoderQueueDepth = DEFAULT_ENCODER_QUEUE_DEPTH;
+};
 
 void initializeGLFW(GLFWwindow*& window);
 void initializeOpenGL(GLFWwindow* window);
 void createTexture();
-void setPixelColor(int x, int y, const glm::vec3& color);
+void resizeTexture(int width, int height);
+void updateTexture(const Framebuffer& framebuffer, const PixelRect& region);
 void createShaders();
 void createQuad();
 void generateVertices(float* vertices);
 void generateColors(float* colors);
-glm::mat4 calculateProjectionMatrix(float aspectRatio, float fovRadians, float nearPlane, float farPlane);
-glm::mat4 calculateViewMatrix(float cameraDistance, float rotationAngleX, float rotationAngleY);
-glm::mat4 translateMatrix(const glm::mat4& matrix, const glm::vec3& translation);
-glm::mat4 rotateMatrix(const glm::mat4& matrix, float rotationAngle, const glm::vec3& axis);
-glm::quat axisAngleToQuaternion(float angle, const glm::vec3& axis);
-glm::mat4 quaternionToMatrix(const glm::quat& quaternion);
-void drawCubes(GLFWwindow* window, const float* vertices, const float* colors);
-void drawScene(GLFWwindow* window);
+void createCubePair(Scene& scene);
+void createCubeField(InstanceBuffer& instances, int countX, int countZ, float spacing);
+glm::mat4 fitModelMatrix(const MeshView& mesh, float size);
+void createModelInstance(InstanceBuffer& instances, const MeshView& mesh);
+void createModelField(InstanceBuffer& instances, const InstanceBuffer& cubeField, const MeshView& mesh);
+void createLights(std::vector<PointLight>& lights);
+void setupMaterials(DeferredLighting& lighting);
+bool loadScene(Scene& scene, const char* modelPath);
+InstanceBuffer& sceneInstances(Scene& scene, bool showCubeField);
+FrameInput sampleInput(double time, int width, int height);
+void animateScene(Scene& scene, const FrameInput& input);
+RedrawKind renderFrame(Scene& scene, const FrameInput& input, VertexStage& vertexStage, Rasterizer& rasterizer, DeferredLighting& lighting,
+                       RayTracer& tracer, Framebuffer& framebuffer, bool redrawWholeBounds);
+void drawViews(Scene& scene, const MeshView& mesh, const InstanceBuffer& instances, VertexStage& vertexStage, Rasterizer& rasterizer);
+void layoutViews(Scene& scene, const FrameInput& input);
+void pickInstance(const FrameInput& input, const std::vector<RenderView>& views, RayTracer& tracer, const MeshView& mesh,
+                  const InstanceBuffer& instances);
+void renderLoop(Scene& scene, RenderPipeline& pipeline, VertexStage& vertexStage, Rasterizer& rasterizer, DeferredLighting& lighting,
+                RayTracer& tracer);
+void presentTexture(GLFWwindow* window);
+void printStats(VertexStage& vertexStage);
+void printLatency(std::vector<double>& latencies);
+void drawScene(GLFWwindow* window, const AppOptions& options);
+bool parseArguments(int argc, char** argv, AppOptions& options);
+void printUsage();
+int runHeadless(const AppOptions& options);
+int runBatch(const AppOptions& options);
 void processInput(GLFWwindow* window, double deltaTime);
+glm::vec2 pixelToNdc(double x, double y, int width, int height);
 void cleanup();
 
 
-int main() {
+int main(int argc, char** argv) {
+    AppOptions options;
+    if (!parseArguments(argc, argv, options)) {
+        printUsage();
+        return -1;
+    }
+
+    // Stage timers always run; recording every scope for a trace only on request
+    PROFILE_THREAD_NAME("main", -1);
+    profileSetTracing(options.tracePath != nullptr);
+
+    if (options.scriptPath)
+        return runBatch(options);
+    if (options.headless)
+        return runHeadless(options);
+
     GLFWwindow* window;
 
     // Initialize GLFW
@@ -60,7 +209,7 @@ int main() {
     createQuad();
 
     // Draw Scene
-    drawScene(window);
+    drawScene(window, options);
 
     // Cleanup
     cleanup();
@@ -73,7 +222,7 @@ void initializeGLFW(GLFWwindow*& window) {
         std::cerr << "Failed to initialize GLFW" << std::endl;
         exit(-1);
     }
-    window = glfwCreateWindow(TEXTURE_WIDTH, TEXTURE_HEIGHT, "Cube Demo", NULL, NULL);
+    window = glfwCreateWindow(INITIAL_WIDTH, INITIAL_HEIGHT, "Cube Demo", NULL, NULL);
     if (!window) {
         std::cerr << "Failed to create GLFW window" << std::endl;
         glfwTerminate();
@@ -100,22 +249,56 @@ void createTexture() {
     // Set texture parameters
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glGenBuffers(2, pixelBuffers);
 
     // Allocate texture
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, TEXTURE_WIDTH, TEXTURE_HEIGHT, 0, GL_RGB, GL_FLOAT, nullptr);
+    resizeTexture(INITIAL_WIDTH, INITIAL_HEIGHT);
 }
 
-void updateTexture() {
+void resizeTexture(int width, int height) {
+    textureWidth = width;
+    textureHeight = height;
+
     glBindTexture(GL_TEXTURE_2D, textureId);
-    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, TEXTURE_WIDTH, TEXTURE_HEIGHT, GL_RGB, GL_FLOAT, pixels);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
     glBindTexture(GL_TEXTURE_2D, 0);
+
+    for (GLuint pixelBuffer : pixelBuffers) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pixelBuffer);
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, static_cast<GLsizeiptr>(width) * height * 4, nullptr, GL_STREAM_DRAW);
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
 }
 
-void setPixelColor(int x, int y, const glm::vec3& color) {
-    // Calculate the pixel index
-    int index = y * TEXTURE_WIDTH + x;
+void updateTexture(const Framebuffer& framebuffer, const PixelRect& region) {
+    int regionWidth = region.maxX - region.minX;
+    int regionHeight = region.maxY - region.minY;
+    if (regionWidth <= 0 || regionHeight <= 0)
+        return;
+    PROFILE_SCOPE(ProfileStage::Upload, "Upload");
+
+    // Invalidating the buffer lets the driver hand out fresh memory instead of
+    // waiting for a transfer that may still read the old contents
+    size_t rowBytes = static_cast<size_t>(regionWidth) * sizeof(uint32_t);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pixelBuffers[pixelBufferIndex]);
+    void* mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, rowBytes * regionHeight, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    if (mapped) {
+        // Only the redrawn region is resolved, straight into the upload buffer;
+        // the texture keeps the rest from earlier frames
+        framebuffer.resolve(region, static_cast<uint32_t*>(mapped), regionWidth);
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+        // Sourced from the bound pixel buffer, so this only queues the transfer
+        // and returns while the next frame is rasterized
+        glBindTexture(GL_TEXTURE_2D, textureId);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, region.minX, region.minY, regionWidth, regionHeight, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
 
-    pixels[index] = color;
+    pixelBufferIndex = 1 - pixelBufferIndex;
 }
 
 void createShaders() {
@@ -202,11 +385,11 @@ void generateVertices(float* vertices) {
     // Cube 1
     // Back face
     vertices[0] = -0.5f; vertices[1] = -0.5f; vertices[2] = -0.5f; // Vertex 0
-    vertices[3] = 0.5f; vertices[4] = -0.5f; vertices[5] = -0.5f; // Vertex 1
-    vertices[6] = 0.5f; vertices[7] = 0.5f; vertices[8] = -0.5f;  // Vertex 2
+    vertices[3] = 0.5f; vertices[4] = 0.5f; vertices[5] = -0.5f; // Vertex 1
+    vertices[6] = 0.5f; vertices[7] = -0.5f; vertices[8] = -0.5f;  // Vertex 2
     vertices[9] = 0.5f; vertices[10] = 0.5f; vertices[11] = -0.5f; // Vertex 3
-    vertices[12] = -0.5f; vertices[13] = 0.5f; vertices[14] = -0.5f; // Vertex 4
-    vertices[15] = -0.5f; vertices[16] = -0.5f; vertices[17] = -0.5f; // Vertex 5
+    vertices[12] = -0.5f; vertices[13] = -0.5f; vertices[14] = -0.5f; // Vertex 4
+    vertices[15] = -0.5f; vertices[16] = 0.5f; vertices[17] = -0.5f; // Vertex 5
 
     // Front face
     vertices[18] = -0.5f; vertices[19] = -0.5f; vertices[20] = 0.5f; // Vertex 6
@@ -226,11 +409,11 @@ void generateVertices(float* vertices) {
 
     // Right face
     vertices[54] = 0.5f; vertices[55] = 0.5f; vertices[56] = 0.5f; // Vertex 18
-    vertices[57] = 0.5f; vertices[58] = 0.5f; vertices[59] = -0.5f; // Vertex 19
-    vertices[60] = 0.5f; vertices[61] = -0.5f; vertices[62] = -0.5f; // Vertex 20
+    vertices[57] = 0.5f; vertices[58] = -0.5f; vertices[59] = -0.5f; // Vertex 19
+    vertices[60] = 0.5f; vertices[61] = 0.5f; vertices[62] = -0.5f; // Vertex 20
     vertices[63] = 0.5f; vertices[64] = -0.5f; vertices[65] = -0.5f; // Vertex 21
-    vertices[66] = 0.5f; vertices[67] = -0.5f; vertices[68] = 0.5f; // Vertex 22
-    vertices[69] = 0.5f; vertices[70] = 0.5f; vertices[71] = 0.5f; // Vertex 23
+    vertices[66] = 0.5f; vertices[67] = 0.5f; vertices[68] = 0.5f; // Vertex 22
+    vertices[69] = 0.5f; vertices[70] = -0.5f; vertices[71] = 0.5f; // Vertex 23
 
     // Bottom face
     vertices[72] = -0.5f; vertices[73] = -0.5f; vertices[74] = -0.5f; // Vertex 24
@@ -242,11 +425,11 @@ void generateVertices(float* vertices) {
 
     // Top face
     vertices[90] = -0.5f; vertices[91] = 0.5f; vertices[92] = -0.5f; // Vertex 30
-    vertices[93] = 0.5f; vertices[94] = 0.5f; vertices[95] = -0.5f; // Vertex 31
-    vertices[96] = 0.5f; vertices[97] = 0.5f; vertices[98] = 0.5f; // Vertex 32
+    vertices[93] = 0.5f; vertices[94] = 0.5f; vertices[95] = 0.5f; // Vertex 31
+    vertices[96] = 0.5f; vertices[97] = 0.5f; vertices[98] = -0.5f; // Vertex 32
     vertices[99] = 0.5f; vertices[100] = 0.5f; vertices[101] = 0.5f; // Vertex 33
-    vertices[102] = -0.5f; vertices[103] = 0.5f; vertices[104] = 0.5f; // Vertex 34
-    vertices[105] = -0.5f; vertices[106] = 0.5f; vertices[107] = -0.5f; // Vertex 35
+    vertices[102] = -0.5f; vertices[103] = 0.5f; vertices[104] = -0.5f; // Vertex 34
+    vertices[105] = -0.5f; vertices[106] = 0.5f; vertices[107] = 0.5f; // Vertex 35
 }
 
 void generateColors(float* colors) {
@@ -299,253 +482,518 @@ void generateColors(float* colors) {
     colors[105] = 1.0f; colors[106] = 0.0f; colors[107] = 1.0f;   // Vertex 35 color (magenta)
 }
 
-glm::mat4 calculateProjectionMatrix(float aspectRatio, float fovRadians, float nearPlane, float farPlane) {
-    // from: https://ogldev.org/www/tutorial12/tutorial12.html
-    float tanHalfFov = tanf(fovRadians / 2.0f);
-
-    glm::mat4 projectionMatrix(0.0f);
-    projectionMatrix[0][0] = 1 / (tanHalfFov * aspectRatio); //1row [.. 0 0 0]
-    projectionMatrix[1][1] = 1 / (tanHalfFov); // 2row [0 .. 0 0]
-    projectionMatrix[2][2] = -(farPlane + nearPlane) / (farPlane - nearPlane); // 3row [0 0 .. ..]
-    projectionMatrix[3][2] = -(2.0f * farPlane * nearPlane) / (farPlane - nearPlane);
-    projectionMatrix[2][3] = -1.0f; // 4row [0 0 -1 0]
+void createCubePair(Scene& scene) {
+    SceneGraph& graph = scene.cubePairNodes;
+    graph.clear();
+    NodeId pair = graph.createNode();
+    NodeTransform left, right;
+    left.translation = glm::vec3(-0.7f, 0.0f, 0.0f);
+    right.translation = glm::vec3(0.7f, 0.0f, 0.0f);
+    NodeId leftCube = graph.createNode(pair, left, 0);
+    scene.spinningCube = graph.createNode(pair, right, 1);
+    graph.update();
+
+    scene.cubePair.clear();
+    scene.cubePair.add(graph.getWorld(leftCube));
+    scene.cubePair.add(graph.getWorld(scene.spinningCube));
+}
 
-    return projectionMatrix;
+void createCubeField(InstanceBuffer& instances, int countX, int countZ, float spacing) {
+    instances.clear();
+    for (int z = 0; z < countZ; ++z) {
+        for (int x = 0; x < countX; ++x) {
+            glm::vec3 position((x - countX * 0.5f) * spacing, -1.0f, (z - countZ * 0.5f) * spacing);
+            glm::mat4 model = translateMatrix(glm::mat4(1.0f), position);
+            // Shrink the cubes so the gaps between them stay visible
+            model[0] *= 0.1f;
+            model[1] *= 0.1f;
+            model[2] *= 0.1f;
+            glm::vec3 tint(static_cast<float>(x) / countX, 0.5f, static_cast<float>(z) / countZ);
+            instances.add(model, tint);
+        }
+    }
 }
 
-glm::mat4 calculateViewMatrix(float cameraDistance, float rotationAngleX, float rotationAngleY) {
-    // Calculate the view matrix manually
-    glm::mat4 viewMatrix(1.0f);
-    viewMatrix = translateMatrix(viewMatrix, glm::vec3(0.0f, 0.0f, cameraDistance));
-    viewMatrix = rotateMatrix(viewMatrix, glm::radians(rotationAngleX), glm::vec3(1.0f, 0.0f, 0.0f));
-    viewMatrix = rotateMatrix(viewMatrix, glm::radians(rotationAngleY), glm::vec3(0.0f, 1.0f, 0.0f));
+FrameInput sampleInput(double time, int width, int height) {
+    FrameInput input;
+    input.sampledAt = std::chrono::steady_clock::now();
+    input.time = time;
+    input.width = width;
+    input.height = height;
 
-    return viewMatrix;
+    // Calculate aspect ratio
+    float aspectRatio = static_cast<float>(width) / static_cast<float>(height);
+    // Calculate projection matrix
+    glm::mat4 projection = calculateProjectionMatrix(aspectRatio, glm::radians(45.0f), 0.1f, 100.0f);
+    // Calculate the view matrix
+    glm::mat4 view = calculateViewMatrix(cameraDistance, rotationAngleX, rotationAngleY);
+    input.viewProjection = projection * view;
+
+    input.showCubeField = showCubeField;
+    input.animateCube = animateCube;
+    input.shading = shadingModel;
+    input.samples = sampleCount;
+    input.lodPixelScale = levelOfDetail ? lodPixelScale(projection, height) : 0.0f;
+    input.lodPixelError = lodPixelError;
+    input.rayCast = rayCast;
+    input.views = viewCount;
+    input.pick = pickRequested;
+    input.pickPoint = pickPoint;
+    pickRequested = false;
+    return input;
 }
 
-glm::mat4 translateMatrix(const glm::mat4& matrix, const glm::vec3& translation) {
-    glm::mat4 result = matrix;
-
-    result[3][0] = matrix[0][0] * translation.x + matrix[1][0] * translation.y + matrix[2][0] * translation.z + matrix[3][0];
-    result[3][1] = matrix[0][1] * translation.x + matrix[1][1] * translation.y + matrix[2][1] * translation.z + matrix[3][1];
-    result[3][2] = matrix[0][2] * translation.x + matrix[1][2] * translation.y + matrix[2][2] * translation.z + matrix[3][2];
-    result[3][3] = matrix[0][3] * translation.x + matrix[1][3] * translation.y + matrix[2][3] * translation.z + matrix[3][3];
+void animateScene(Scene& scene, const FrameInput& input) {
+    if (!input.animateCube)
+        return;
 
-    return result;
+    // Spin the right cube of the pair, everything else stays where it is
+    float angle = static_cast<float>(input.time) * glm::radians(90.0f);
+    scene.cubePairNodes.setRotation(scene.spinningCube, axisAngleToQuaternion(angle, glm::vec3(0.0f, 1.0f, 0.0f)));
+    scene.cubePairNodes.update();
+    writeInstanceTransforms(scene.cubePairNodes, scene.cubePair);
 }
 
-glm::mat4 rotateMatrix(const glm::mat4& matrix, float rotationAngle, const glm::vec3& axis) {
-    glm::quat rotationQuat = axisAngleToQuaternion(rotationAngle, axis);
-    glm::mat4 rotationMatrix = quaternionToMatrix(rotationQuat);
-    return matrix * rotationMatrix;
-}
+RedrawKind renderFrame(Scene& scene, const FrameInput& input, VertexStage& vertexStage, Rasterizer& rasterizer, DeferredLighting& lighting,
+                       RayTracer& tracer, Framebuffer& framebuffer, bool redrawWholeBounds) {
+    PROFILE_SCOPE(ProfileStage::None, "Frame");
+    // Deferred lighting reads one depth and surface per pixel, so it always renders single-sampled
+    int samples = input.shading == ShadingModel::Deferred ? 1 : input.samples;
+    framebuffer.resize(input.width, input.height, samples);
+
+    MeshView mesh = scene.model.isOpen() ? scene.model.view() : MeshView(scene.cubeMesh);
+    InstanceBuffer& instances = sceneInstances(scene, input.showCubeField);
+
+    bool lodChanged = input.lodPixelScale != scene.lods.pixelScale || input.lodPixelError != scene.lods.pixelError;
+    if (input.shading != scene.shading || samples != scene.samples || input.rayCast != scene.rayCast || lodChanged) {
+        scene.changes.invalidate();
+        scene.shading = input.shading;
+        scene.samples = samples;
+        scene.rayCast = input.rayCast;
+        scene.lods.pixelScale = input.lodPixelScale;
+        scene.lods.pixelError = input.lodPixelError;
+    }
+    // Levels chosen for other instances are no starting point for these
+    if (&instances != scene.lodInstances) {
+        scene.lods.levels.clear();
+        for (LodSelection& lods : scene.viewLods)
+            lods.levels.clear();
+        scene.lodInstances = &instances;
+    }
+    if (input.views > 1)
+        layoutViews(scene, input);
+    if (input.pick)
+        pickInstance(input, scene.views, tracer, mesh, instances);
+
+    // Several cameras are always redrawn in full; the next single-camera frame
+    // has nothing to compare with, so it is redrawn in full too
+    if (input.views > 1) {
+        scene.changes.invalidate();
+        rasterizer.beginFrame(framebuffer.getRenderTarget());
+        drawViews(scene, mesh, instances, vertexStage, rasterizer);
+        rasterizer.endFrame();
+        return RedrawKind::Full;
+    }
 
-glm::quat axisAngleToQuaternion(float angle, const glm::vec3& axis) {
-    float halfAngle = angle * 0.5f;
-    float sinHalfAngle = sin(halfAngle);
+    // Unchanged frames are not drawn at all, frames where only a few instances
+    // moved redraw just the tiles those instances cover now or covered before
+    RedrawKind redraw = scene.changes.update(mesh, instances, input.viewProjection, input.width, input.height, scene.dirtyRects);
+    if (redraw == RedrawKind::None)
+        return redraw;
+
+    // A framebuffer that did not hold the previous frame has older pixels in
+    // the clean tiles between the dirty rects, so redraw all of their bounds
+    if (redraw == RedrawKind::Partial && redrawWholeBounds && scene.dirtyRects.size() > 1) {
+        PixelRect bounds = scene.dirtyRects[0];
+        for (const PixelRect& rect : scene.dirtyRects) {
+            bounds.minX = std::min(bounds.minX, rect.minX);
+            bounds.minY = std::min(bounds.minY, rect.minY);
+            bounds.maxX = std::max(bounds.maxX, rect.maxX);
+            bounds.maxY = std::max(bounds.maxY, rect.maxY);
+        }
+        scene.dirtyRects.assign(1, bounds);
+    }
 
-    glm::quat quaternion;
-    quaternion.w = cos(halfAngle);
-    quaternion.x = axis.x * sinHalfAngle;
-    quaternion.y = axis.y * sinHalfAngle;
-    quaternion.z = axis.z * sinHalfAngle;
+    // Tiles clear their own color and depth, so there is nothing to reset here.
+    // The G-buffer needs no clearing either: lighting skips pixels left at the cleared depth.
+    RenderTarget target = framebuffer.getRenderTarget();
+    if (input.shading == ShadingModel::Deferred && !input.rayCast)
+        lighting.bindGBuffer(target);
+    if (redraw == RedrawKind::Partial)
+        rasterizer.beginFrame(target, scene.dirtyRects.data(), scene.dirtyRects.size());
+    else
+        rasterizer.beginFrame(target);
+
+    // Ray casting draws the flat shading model into the same tiles: ending the
+    // empty frame clears them, then one ray per pixel fills them again
+    if (input.rayCast) {
+        rasterizer.endFrame();
+        tracer.update(mesh, instances);
+        tracer.render(rasterizer, input.viewProjection);
+        return redraw;
+    }
 
-    return quaternion;
-}
+    // Culls the instances against the frustum, then transforms the survivors in batches across all cores.
+    // Each shader is its own instantiation of the vertex stage and pixel loop.
+    // The shaders are only read while the frame is rasterized, so they live until endFrame.
+    GouraudShader gouraudShader;
+    TexturedShader texturedShader = { &scene.checkerTexture, 2.0f };
+    LitShader litShader = { glm::normalize(glm::vec3(0.4f, 0.8f, 0.6f)), 0.25f };
+    DeferredShader deferredShader = { static_cast<uint8_t>(input.showCubeField && !scene.model.isOpen() ? MATERIAL_MATTE : MATERIAL_GLOSSY) };
+    switch (input.shading) {
+    case ShadingModel::Flat:
+        vertexStage.drawInstances(mesh, instances, input.viewProjection, rasterizer, &scene.lods);
+        break;
+    case ShadingModel::Gouraud:
+        vertexStage.drawInstances(mesh, instances, input.viewProjection, gouraudShader, rasterizer, &scene.lods);
+        break;
+    case ShadingModel::Textured:
+        vertexStage.drawInstances(mesh, instances, input.viewProjection, texturedShader, rasterizer, &scene.lods);
+        break;
+    case ShadingModel::Lit:
+        vertexStage.drawInstances(mesh, instances, input.viewProjection, litShader, rasterizer, &scene.lods);
+        break;
+    case ShadingModel::Deferred:
+        vertexStage.drawInstances(mesh, instances, input.viewProjection, deferredShader, rasterizer, &scene.lods);
+        break;
+    }
 
-glm::mat4 quaternionToMatrix(const glm::quat& quaternion) {
-    float xx = quaternion.x * quaternion.x;
-    float xy = quaternion.x * quaternion.y;
-    float xz = quaternion.x * quaternion.z;
-    float xw = quaternion.x * quaternion.w;
+    // Bin the triangles into tiles and rasterize the tiles across all cores
+    rasterizer.endFrame();
+    // Deferred shading lights the visible pixels of the redrawn tiles only now
+    if (input.shading == ShadingModel::Deferred)
+        lighting.shade(rasterizer, input.viewProjection, scene.lights);
+    return redraw;
+}
 
-    float yy = quaternion.y * quaternion.y;
-    float yz = quaternion.y * quaternion.z;
-    float yw = quaternion.y * quaternion.w;
+// Places input.views cameras, each turned a little further around the
+// vertical axis than the last, in a grid of viewports
+void layoutViews(Scene& scene, const FrameInput& input) {
+    size_t count = static_cast<size_t>(input.views);
+    std::vector<RenderView>& views = scene.views;
+    views.resize(count);
+    scene.viewLods.resize(count);
+    for (size_t i = 0; i < count; ++i) {
+        PixelRect viewport = gridViewport(i, count, input.width, input.height);
+        int cellWidth = viewport.maxX - viewport.minX;
+        int cellHeight = viewport.maxY - viewport.minY;
+
+        // The projection only divides x by the aspect ratio, so correcting x
+        // fits the input's camera to the cell
+        float aspectCorrection = (static_cast<float>(input.width) / input.height) / (static_cast<float>(cellWidth) / cellHeight);
+        glm::mat4 correction(1.0f);
+        correction[0][0] = aspectCorrection;
+        float angle = glm::radians(360.0f) * i / count;
+        views[i].viewProjection = rotateMatrix(correction * input.viewProjection, angle, glm::vec3(0.0f, 1.0f, 0.0f));
+        views[i].viewport = viewport;
+
+        scene.viewLods[i].pixelScale = input.lodPixelScale * cellHeight / input.height;
+        scene.viewLods[i].pixelError = input.lodPixelError;
+    }
+}
 
-    float zz = quaternion.z * quaternion.z;
-    float zw = quaternion.z * quaternion.w;
+// Draws the scene flat shaded from the cameras of layoutViews. They go through
+// the vertex stage and rasterizer together, in one frame.
+void drawViews(Scene& scene, const MeshView& mesh, const InstanceBuffer& instances, VertexStage& vertexStage, Rasterizer& rasterizer) {
+    vertexStage.drawViews(mesh, instances, scene.views.data(), scene.views.size(), rasterizer, scene.viewLods.data());
+}
 
-    glm::mat4 rotationMatrix;
-    rotationMatrix[0][0] = 1.0f - 2.0f * (yy + zz);
-    rotationMatrix[0][1] = 2.0f * (xy - zw);
-    rotationMatrix[0][2] = 2.0f * (xz + yw);
-    rotationMatrix[0][3] = 0.0f;
+// Casts a ray from the camera through the picked point and reports the nearest
+// instance on it. The ray sees full detail, not the level drawn. With several
+// cameras, the point is picked in the view whose viewport it falls in.
+void pickInstance(const FrameInput& input, const std::vector<RenderView>& views, RayTracer& tracer, const MeshView& mesh,
+                  const InstanceBuffer& instances) {
+    glm::mat4 viewProjection = input.viewProjection;
+    glm::vec2 point = input.pickPoint;
+    if (input.views > 1) {
+        // Target pixels, with y up like the viewports
+        float x = (point.x + 1.0f) * 0.5f * input.width;
+        float y = (point.y + 1.0f) * 0.5f * input.height;
+        auto view = std::find_if(views.begin(), views.end(), [&](const RenderView& v) {
+            return x >= v.viewport.minX && x < v.viewport.maxX && y >= v.viewport.minY && y < v.viewport.maxY;
+        });
+        if (view == views.end()) {
+            std::cout << "Picked nothing" << std::endl;
+            return;
+        }
+        const PixelRect& viewport = view->viewport;
+        viewProjection = view->viewProjection;
+        point = glm::vec2((x - viewport.minX) / (viewport.maxX - viewport.minX) * 2.0f - 1.0f,
+                          (y - viewport.minY) / (viewport.maxY - viewport.minY) * 2.0f - 1.0f);
+    }
 
-    rotationMatrix[1][0] = 2.0f * (xy + zw);
-    rotationMatrix[1][1] = 1.0f - 2.0f * (xx + zz);
-    rotationMatrix[1][2] = 2.0f * (yz - xw);
-    rotationMatrix[1][3] = 0.0f;
+    tracer.update(mesh, instances);
+    Ray ray = cameraRay(glm::inverse(viewProjection), point.x, point.y);
+    RayHit hit = tracer.intersect(ray);
+    if (hit.instance == RAY_MISS) {
+        std::cout << "Picked nothing" << std::endl;
+        return;
+    }
+    std::cout << "Picked instance " << hit.instance << ", triangle " << hit.triangle << " at distance "
+              << hit.distance * glm::length(ray.direction) << std::endl;
+}
 
-    rotationMatrix[2][0] = 2.0f * (xz - yw);
-    rotationMatrix[2][1] = 2.0f * (yz + xw);
-    rotationMatrix[2][2] = 1.0f - 2.0f * (xx + yy);
-    rotationMatrix[2][3] = 0.0f;
+// Centers the model and scales its largest side to size
+glm::mat4 fitModelMatrix(const MeshView& mesh, float size) {
+    glm::vec3 extent = mesh.boundsMax - mesh.boundsMin;
+    float scale = size / std::max(std::max(extent.x, extent.y), std::max(extent.z, 1e-6f));
+    glm::mat4 model = glm::mat4(scale);
+    model[3] = glm::vec4(-(mesh.boundsMin + mesh.boundsMax) * 0.5f * scale, 1.0f);
+    return model;
+}
 
-    rotationMatrix[3][0] = 0.0f;
-    rotationMatrix[3][1] = 0.0f;
-    rotationMatrix[3][2] = 0.0f;
-    rotationMatrix[3][3] = 1.0f;
+void createModelInstance(InstanceBuffer& instances, const MeshView& mesh) {
+    // 2 units, the size of the cube pair
+    instances.clear();
+    instances.add(fitModelMatrix(mesh, 2.0f));
+}
 
-    return rotationMatrix;
+void createModelField(InstanceBuffer& instances, const InstanceBuffer& cubeField, const MeshView& mesh) {
+    // Each model as large as the unit cube it replaces
+    glm::mat4 fit = fitModelMatrix(mesh, 1.0f);
+    instances.clear();
+    for (size_t i = 0; i < cubeField.size(); ++i)
+        instances.add(cubeField.transforms[i] * fit, cubeField.colors[i]);
 }
 
-bool pointInTriangle(const glm::vec2& p, const glm::vec3& v0, const glm::vec3& v1, const glm::vec3& v2) {
-    auto det = [](const glm::vec2& u, const glm::vec2& v) { return u.x * v.y - u.y * v.x; };
+// A grid of colored point lights just above the cube field, which also
+// reaches the underside of the cube pair and models
+void createLights(std::vector<PointLight>& lights) {
+    const int COUNT = 16;
+    const float SPACING = 0.75f;
+    lights.clear();
+    for (int z = 0; z < COUNT; ++z) {
+        for (int x = 0; x < COUNT; ++x) {
+            PointLight light;
+            light.position = glm::vec3((x - (COUNT - 1) * 0.5f) * SPACING, -0.6f, (z - (COUNT - 1) * 0.5f) * SPACING);
+            // Hues around the color wheel, alternating along both axes
+            float hue = ((x * 5 + z * 3) % 12) / 12.0f * 6.2831853f;
+            light.color = glm::vec3(1.0f + 0.6f * std::cos(hue), 1.0f + 0.6f * std::cos(hue - 2.0943951f), 1.0f + 0.6f * std::cos(hue + 2.0943951f));
+            light.radius = 1.0f;
+            lights.push_back(light);
+        }
+    }
+}
 
-    glm::vec2 a = glm::vec2(v0.x, v0.y) - p;
-    glm::vec2 b = glm::vec2(v1.x, v1.y) - p;
-    glm::vec2 c = glm::vec2(v2.x, v2.y) - p;
-    
-    float alpha = det(b, c) / 2.0f;
-    float beta = det(c, a) / 2.0f;
-    float gamma = det(a, b) / 2.0f;
+void setupMaterials(DeferredLighting& lighting) {
+    Material matte;
+    matte.ambient = 0.1f;
+    lighting.setMaterial(MATERIAL_MATTE, matte);
 
-    float sum = alpha + beta + gamma;
+    Material glossy;
+    glossy.ambient = 0.1f;
+    glossy.specular = 0.5f;
+    glossy.shininess = 32.0f;
+    lighting.setMaterial(MATERIAL_GLOSSY, glossy);
+}
 
-    alpha /= sum;
-    beta /= sum;
-    gamma /= sum;
+// The instances renderFrame draws
+InstanceBuffer& sceneInstances(Scene& scene, bool showCubeField) {
+    if (scene.model.isOpen())
+        return showCubeField ? scene.modelField : scene.modelInstance;
+    return showCubeField ? scene.cubeField : scene.cubePair;
+}
 
-    return alpha > 0 && beta > 0 && gamma > 0;
+bool loadScene(Scene& scene, const char* modelPath) {
+    float vertices[36 * 3];
+    float colors[36 * 3];
+    generateVertices(vertices);
+    generateColors(colors);
+    scene.cubeMesh = createIndexedMesh(vertices, colors, 36);
+    createCubePair(scene);
+    // 320 x 320 small cubes, toggled with F
+    createCubeField(scene.cubeField, 320, 320, 0.3f);
+    scene.checkerTexture = createCheckerTexture(256, 32);
+    createLights(scene.lights);
+
+    if (modelPath) {
+        std::string error;
+        auto loadStart = std::chrono::steady_clock::now();
+        if (!loadMesh(modelPath, scene.model, error)) {
+            std::cerr << "Failed to load " << modelPath << ": " << error << std::endl;
+            return false;
+        }
+        std::chrono::duration<double, std::milli> loadTime = std::chrono::steady_clock::now() - loadStart;
+        const MeshView& mesh = scene.model.view();
+        std::ostringstream levels;
+        for (size_t level = 1; level < mesh.levelCount(); ++level)
+            levels << (level > 1 ? ", " : "") << mesh.level(level).triangleCount();
+        std::cout << "Loaded " << modelPath << ": " << mesh.triangleCount() << " triangles in " << loadTime.count() << " ms"
+                  << (mesh.levelCount() > 1 ? ", levels of detail " + levels.str() : std::string()) << std::endl;
+        createModelInstance(scene.modelInstance, mesh);
+        createModelField(scene.modelField, scene.cubeField, mesh);
+    }
+    return true;
 }
 
-void barycentric(const glm::vec2& p, const glm::vec2& a, const glm::vec2& b, const glm::vec2& c, float& u, float& v, float& w) {
-    glm::vec2 v0 = b - a, v1 = c - a, v2 = p - a;
-    float d00 = glm::dot(v0, v0);
-    float d01 = glm::dot(v0, v1);
-    float d11 = glm::dot(v1, v1);
-    float d20 = glm::dot(v2, v0);
-    float d21 = glm::dot(v2, v1);
-    float denom = d00 * d11 - d01 * d01;
-    v = (d11 * d20 - d01 * d21) / denom;
-    w = (d00 * d21 - d01 * d20) / denom;
-    u = 1.0f - v - w;
+void printStats(VertexStage& vertexStage) {
+    const ClipCullStats& stats = vertexStage.getStats();
+    // Built as one string, the render thread and the main thread both print
+    std::ostringstream line;
+    line << "Triangles in " << stats.trianglesIn << ", frustum rejected " << stats.frustumRejected
+         << ", clipped " << stats.clipped << " (" << stats.clippedAway << " away), back faces " << stats.backFacesCulled
+         << ", degenerate " << stats.degenerate << ", out " << stats.trianglesOut
+         << "; instances in " << stats.instancesIn << ", culled " << stats.instancesCulled
+         << ", simplified " << stats.instancesSimplified << "\n";
+    // Where the frames since the last report spent their time
+    std::string summary = profileSummary();
+    if (!summary.empty())
+        line << summary << "\n";
+    std::cout << line.str() << std::flush;
+    vertexStage.resetStats();
 }
 
-float interpolateDepth(const glm::vec2& point, const glm::vec3& vertex0, const glm::vec3& vertex1, const glm::vec3& vertex2) {
-    // Compute barycentric coordinates (u, v, w) for point with respect to triangle (vertex0, vertex1, vertex2)
-    float u, v, w;
-    barycentric(point, glm::vec2(vertex0.x, vertex0.y), glm::vec2(vertex1.x, vertex1.y), glm::vec2(vertex2.x, vertex2.y), u, v, w);
+void printLatency(std::vector<double>& latencies) {
+    if (latencies.empty())
+        return;
+
+    std::sort(latencies.begin(), latencies.end());
+    double total = 0.0;
+    for (double latency : latencies)
+        total += latency;
+    std::ostringstream line;
+    line << "Presented " << latencies.size() << " frames, input to present latency min " << latencies.front()
+         << " ms, median " << latencies[latencies.size() / 2] << " ms, mean " << total / latencies.size()
+         << " ms, max " << latencies.back() << " ms\n";
+    std::cout << line.str() << std::flush;
+    latencies.clear();
+}
 
-    // Interpolate the depth using the barycentric coordinates
-    return u * vertex0.z + v * vertex1.z + w * vertex2.z;
+void renderLoop(Scene& scene, RenderPipeline& pipeline, VertexStage& vertexStage, Rasterizer& rasterizer, DeferredLighting& lighting,
+                RayTracer& tracer) {
+    // With a single framebuffer every frame draws over the one before it
+    bool redrawWholeBounds = pipeline.getDepth() > 1;
+    std::chrono::steady_clock::time_point lastStatsTime = std::chrono::steady_clock::now();
+    PROFILE_THREAD_NAME("render", -1);
+
+    while (PipelineFrame* frame = pipeline.acquireRender()) {
+        animateScene(scene, frame->input);
+        RedrawKind redraw = renderFrame(scene, frame->input, vertexStage, rasterizer, lighting, tracer, frame->framebuffer, redrawWholeBounds);
+        frame->dirtyBounds = rasterizer.getDirtyBounds();
+        if (redraw != RedrawKind::None)
+            profileEndFrame(frame->input.width, frame->input.height);
+        pipeline.finishRender(frame, redraw != RedrawKind::None);
+        // Wakes the main thread if it is waiting for events
+        if (redraw != RedrawKind::None)
+            glfwPostEmptyEvent();
+
+        // Report what the clip/cull stage did about once per second
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        if (now - lastStatsTime >= std::chrono::seconds(1)) {
+            printStats(vertexStage);
+            lastStatsTime = now;
+        }
+    }
 }
 
-void drawCubes(GLFWwindow* window, const float* vertices, const float* colors, std::vector<float>& depthBuffer) {
-    std::fill_n(pixels, TEXTURE_WIDTH * TEXTURE_HEIGHT, glm::vec3(0.0f));
+void presentTexture(GLFWwindow* window) {
+    PROFILE_SCOPE(ProfileStage::Present, "Present");
 
-    // Calculate aspect ratio
-    float aspectRatio = static_cast<float>(TEXTURE_WIDTH) / static_cast<float>(TEXTURE_HEIGHT);
-    // Calculate projection matrix
-    glm::mat4 projection = calculateProjectionMatrix(glm::radians(45.0f), aspectRatio, 0.1f, 100.0f);
-    // Calculate the view matrix
-    glm::mat4 view = calculateViewMatrix(cameraDistance, rotationAngleX, rotationAngleY);
+    // Clear the screen
+    glClear(GL_COLOR_BUFFER_BIT);
 
-    for (int i = 0; i < 2; ++i) {
-        // Calculate the model matrix for the current cube
-        glm::mat4 model;
-        if (i == 0)
-            model = translateMatrix(glm::mat4(1.0f), glm::vec3(-0.7f, 0.0f, 0.0f));
-        else if (i == 1)
-            model = translateMatrix(glm::mat4(1.0f), glm::vec3(0.7f, 0.0f, 0.0f));
-
-        // Render the cube using manual vertex and color data
-        for (int j = 0; j < 36; j += 3) {
-            // Retrieve the vertex position and color for the current triangle
-            glm::vec3 vertex0(vertices[(j) * 3], vertices[(j) * 3 + 1], vertices[(j) * 3 + 2]);
-            glm::vec3 vertex1(vertices[(j + 1) * 3], vertices[(j + 1) * 3 + 1], vertices[(j + 1) * 3 + 2]);
-            glm::vec3 vertex2(vertices[(j + 2) * 3], vertices[(j + 2) * 3 + 1], vertices[(j + 2) * 3 + 2]);
-
-            glm::vec3 color0(colors[(j) * 3], colors[(j) * 3 + 1], colors[(j) * 3 + 2]);
-            glm::vec3 color1(colors[(j + 1) * 3], colors[(j + 1) * 3 + 1], colors[(j + 1) * 3 + 2]);
-            glm::vec3 color2(colors[(j + 2) * 3], colors[(j + 2) * 3 + 1], colors[(j + 2) * 3 + 2]);
-
-            glm::vec4 vertex0_4d = projection * view * model * glm::vec4(vertex0, 1.0f);
-            glm::vec4 vertex1_4d = projection * view * model * glm::vec4(vertex1, 1.0f);
-            glm::vec4 vertex2_4d = projection * view * model * glm::vec4(vertex2, 1.0f);
-
-            // Perspective division
-            glm::vec3 vertex0_2d = glm::vec3(vertex0_4d) / vertex0_4d.w;
-            glm::vec3 vertex1_2d = glm::vec3(vertex1_4d) / vertex1_4d.w;
-            glm::vec3 vertex2_2d = glm::vec3(vertex2_4d) / vertex2_4d.w;
-
-            // Rasterize the triangle
-            float minX = std::min(vertex0_2d.x, std::min(vertex1_2d.x, vertex2_2d.x));
-            float minY = std::min(vertex0_2d.y, std::min(vertex1_2d.y, vertex2_2d.y));
-            float maxX = std::max(vertex0_2d.x, std::max(vertex1_2d.x, vertex2_2d.x));
-            float maxY = std::max(vertex0_2d.y, std::max(vertex1_2d.y, vertex2_2d.y));
-
-            // Convert to pixel coordinates
-            int start_x = static_cast<int>((minX + 1.0f) * 0.5f * TEXTURE_WIDTH - 1);
-            int start_y = static_cast<int>((minY + 1.0f) * 0.5f * TEXTURE_HEIGHT - 1);
-            int end_x = static_cast<int>((maxX + 1.0f) * 0.5f * TEXTURE_WIDTH + 1);
-            int end_y = static_cast<int>((maxY + 1.0f) * 0.5f * TEXTURE_HEIGHT + 1);
-
-            // Clamp
-            start_x = std::max(0, start_x);
-            start_y = std::max(0, start_y);
-            end_x = std::min(TEXTURE_WIDTH, end_x);
-            end_y = std::min(TEXTURE_HEIGHT, end_y);
-
-            // Only iterate over pixels within the bounding box of the triangle
-            #pragma omp parallel for collapse(2)
-            for (int y = start_y; y < end_y; ++y) {
-                for (int x = start_x; x < end_x; ++x) {
-                    glm::vec2 pixelPosNDC = glm::vec2(2.0f * x / TEXTURE_WIDTH - 1.0f, 2.0f * y / TEXTURE_HEIGHT - 1.0f);
-                    if (pointInTriangle(pixelPosNDC, vertex0_2d, vertex1_2d, vertex2_2d)) {
-                        float newDepth = interpolateDepth(pixelPosNDC, vertex0_2d, vertex1_2d, vertex2_2d);
-                        float& currentDepth = depthBuffer[y * TEXTURE_WIDTH + x];
-                        if (newDepth < currentDepth) {
-                            // If the new depth is smaller, update the color and depth
-                            glm::vec3 color = (color0 + color1 + color2) / 3.0f;
-                            setPixelColor(x, y, color);
-                            currentDepth = newDepth;
-                        }
-                    }
-                }
-            }
-        }
-    }
+    // Use the shader program and bind the VAO
+    glUseProgram(shaderProgram);
+    glBindVertexArray(VAO);
+
+    // Bind the texture
+    glBindTexture(GL_TEXTURE_2D, textureId);
+
+    // Draw the quad
+    glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
 
-    updateTexture();
+    // Swap front and back buffers
+    glfwSwapBuffers(window);
 }
 
-void drawScene(GLFWwindow* window) {
+void drawScene(GLFWwindow* window, const AppOptions& options) {
+    ThreadPool threadPool;
+    Rasterizer rasterizer(threadPool);
+    VertexStage vertexStage(threadPool);
+    DeferredLighting lighting(threadPool);
+    setupMaterials(lighting);
+    RayTracer tracer(threadPool);
+    Scene scene;
+    if (!loadScene(scene, options.modelPath))
+        return;
+
+    // Rasterization runs on its own thread; this one only handles input,
+    // uploads finished frames and presents them, so vsync waits and driver
+    // stalls overlap with rasterizing the next frame
+    RenderPipeline pipeline(options.pipelineDepth);
+    std::cout << "Rasterizing on " << threadPool.size() << " threads with the "
+              << instructionSetName(rasterizer.getInstructionSet()) << " kernel, "
+              << pipeline.getDepth() << " frames in flight" << std::endl;
+    std::thread renderThread(renderLoop, std::ref(scene), std::ref(pipeline), std::ref(vertexStage), std::ref(rasterizer), std::ref(lighting),
+                             std::ref(tracer));
+
+    glfwSetWindowRefreshCallback(window, [](GLFWwindow*) { windowNeedsRefresh = true; });
+
     double lastFrameTime = glfwGetTime();
-    std::vector<float> depthBuffer(TEXTURE_WIDTH * TEXTURE_HEIGHT, std::numeric_limits<float>::infinity());
-    float vertices[36 * 3];
-    float colors[36 * 3];
-    generateVertices(vertices);
-    generateColors(colors);
+    double lastStatsTime = lastFrameTime;
+    int viewportWidth = 0;
+    int viewportHeight = 0;
+    std::vector<double> latencies;
 
     // Main loop
     while (!glfwWindowShouldClose(window)) {
         double currentFrameTime = glfwGetTime();
-        processInput(window, currentFrameTime - lastFrameTime);
+        // Time spent waiting for events must not turn into a jump of a held key
+        processInput(window, std::min(currentFrameTime - lastFrameTime, 0.1));
         lastFrameTime = currentFrameTime;
-        // Clear the screen
-        glClear(GL_COLOR_BUFFER_BIT);
-        std::fill(depthBuffer.begin(), depthBuffer.end(), std::numeric_limits<float>::infinity());
 
-        // Use the shader program and bind the VAO
-        glUseProgram(shaderProgram);
-        glBindVertexArray(VAO);
+        // Follow the window size; a minimized window has nothing to draw into
+        int width, height;
+        glfwGetFramebufferSize(window, &width, &height);
+        if (width == 0 || height == 0) {
+            glfwWaitEventsTimeout(0.25);
+            continue;
+        }
+        if (width != viewportWidth || height != viewportHeight) {
+            glViewport(0, 0, width, height);
+            viewportWidth = width;
+            viewportHeight = height;
+        }
 
-        drawCubes(window, vertices, colors, depthBuffer);
+        pipeline.submit(sampleInput(currentFrameTime, width, height));
+
+        // Upload the oldest finished frame. The texture keeps every pixel a
+        // frame did not redraw, which is why no finished frame may be skipped.
+        PipelineFrame* frame = pipeline.acquirePresent();
+        if (frame) {
+            const Framebuffer& framebuffer = frame->framebuffer;
+            if (framebuffer.getWidth() != textureWidth || framebuffer.getHeight() != textureHeight)
+                resizeTexture(framebuffer.getWidth(), framebuffer.getHeight());
+            updateTexture(framebuffer, frame->dirtyBounds);
+            std::chrono::steady_clock::time_point sampledAt = frame->input.sampledAt;
+            pipeline.releasePresent(frame);
+
+            presentTexture(window);
+            std::chrono::duration<double, std::milli> latency = std::chrono::steady_clock::now() - sampledAt;
+            latencies.push_back(latency.count());
+        } else if (windowNeedsRefresh) {
+            presentTexture(window);
+        }
+        windowNeedsRefresh = false;
 
-        // Bind the texture
-        glBindTexture(GL_TEXTURE_2D, textureId);
+        if (currentFrameTime - lastStatsTime >= 1.0) {
+            printLatency(latencies);
+            lastStatsTime = currentFrameTime;
+        }
 
-        // Draw the quad
-        glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+        // Poll for and process events. Without a new frame, sleep until input
+        // arrives or the render thread finishes one
+        if (frame)
+            glfwPollEvents();
+        else
+            glfwWaitEventsTimeout(0.25);
+    }
 
-        // Swap front and back buffers
-        glfwSwapBuffers(window);
+    pipeline.stop();
+    renderThread.join();
 
-        // Poll for and process events
-        glfwPollEvents();
-    }
+    if (options.tracePath)
+        profileWriteTrace(options.tracePath);
 }
 
 void processInput(GLFWwindow* window, double deltaTime) {
@@ -569,6 +1017,59 @@ void processInput(GLFWwindow* window, double deltaTime) {
 
     if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS)
         cameraDistance += 0.2f;
+
+    // Toggle once per key press, not once per frame
+    bool fieldKeyPressed = glfwGetKey(window, GLFW_KEY_F) == GLFW_PRESS;
+    if (fieldKeyPressed && !fieldKeyWasPressed)
+        showCubeField = !showCubeField;
+    fieldKeyWasPressed = fieldKeyPressed;
+
+    bool animateKeyPressed = glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS;
+    if (animateKeyPressed && !animateKeyWasPressed)
+        animateCube = !animateCube;
+    animateKeyWasPressed = animateKeyPressed;
+
+    // M cycles through the shading models
+    bool shadingKeyPressed = glfwGetKey(window, GLFW_KEY_M) == GLFW_PRESS;
+    if (shadingKeyPressed && !shadingKeyWasPressed)
+        shadingModel = static_cast<ShadingModel>((static_cast<int>(shadingModel) + 1) % 5);
+    shadingKeyWasPressed = shadingKeyPressed;
+
+    // Q cycles through 1, 4 and 8 samples per pixel
+    bool samplesKeyPressed = glfwGetKey(window, GLFW_KEY_Q) == GLFW_PRESS;
+    if (samplesKeyPressed && !samplesKeyWasPressed)
+        sampleCount = sampleCount == 1 ? 4 : (sampleCount == 4 ? 8 : 1);
+    samplesKeyWasPressed = samplesKeyPressed;
+
+    bool lodKeyPressed = glfwGetKey(window, GLFW_KEY_L) == GLFW_PRESS;
+    if (lodKeyPressed && !lodKeyWasPressed)
+        levelOfDetail = !levelOfDetail;
+    lodKeyWasPressed = lodKeyPressed;
+
+    bool rayCastKeyPressed = glfwGetKey(window, GLFW_KEY_R) == GLFW_PRESS;
+    if (rayCastKeyPressed && !rayCastKeyWasPressed)
+        rayCast = !rayCast;
+    rayCastKeyWasPressed = rayCastKeyPressed;
+
+    // A left click picks what is under the cursor with the camera of the next frame
+    bool mousePressed = glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS;
+    if (mousePressed && !mouseWasPressed) {
+        double cursorX, cursorY;
+        int windowWidth, windowHeight;
+        glfwGetCursorPos(window, &cursorX, &cursorY);
+        glfwGetWindowSize(window, &windowWidth, &windowHeight);
+        if (windowWidth > 0 && windowHeight > 0) {
+            pickPoint = pixelToNdc(cursorX, cursorY, windowWidth, windowHeight);
+            pickRequested = true;
+        }
+    }
+    mouseWasPressed = mousePressed;
+}
+
+// Window and image coordinates start at the top left, normalized device
+// coordinates at the bottom left
+glm::vec2 pixelToNdc(double x, double y, int width, int height) {
+    return glm::vec2(static_cast<float>(x / width * 2.0 - 1.0), static_cast<float>(1.0 - y / height * 2.0));
 }
 
 void cleanup() {
@@ -579,4 +1080,298 @@ void cleanup() {
     glDeleteProgram(shaderProgram);
     glDeleteTextures(1, &textureId);
     glfwTerminate();
-}
\ No newline at end of file
+}
+
+bool parseArguments(int argc, char** argv, AppOptions& options) {
+    for (int i = 1; i < argc; ++i) {
+        std::string argument = argv[i];
+        bool hasValue = i + 1 < argc;
+
+        if (argument == "--headless") {
+            options.headless = true;
+        } else if (argument == "--field") {
+            showCubeField = true;
+        } else if (argument == "--animate") {
+            animateCube = true;
+        } else if (argument == "--shading" && hasValue) {
+            if (!parseShadingModel(argv[++i], shadingModel))
+                return false;
+        } else if (argument == "--msaa" && hasValue) {
+            sampleCount = std::atoi(argv[++i]);
+            if (!isValidSampleCount(sampleCount))
+                return false;
+        } else if (argument == "--lod-error" && hasValue) {
+            // 0 turns levels of detail off
+            lodPixelError = static_cast<float>(std::atof(argv[++i]));
+            if (lodPixelError < 0.0f)
+                return false;
+            levelOfDetail = lodPixelError > 0.0f;
+        } else if (argument == "--raycast") {
+            rayCast = true;
+        } else if (argument == "--views" && hasValue) {
+            viewCount = std::atoi(argv[++i]);
+            if (viewCount < 1)
+                return false;
+        } else if (argument == "--pick" && hasValue) {
+            if (std::sscanf(argv[++i], "%lf,%lf", &options.pickX, &options.pickY) != 2)
+                return false;
+            options.pick = true;
+        } else if (argument == "--frames" && hasValue) {
+            options.frames = std::max(1, std::atoi(argv[++i]));
+        } else if (argument == "--size" && hasValue) {
+            if (std::sscanf(argv[++i], "%dx%d", &options.width, &options.height) != 2 || options.width <= 0 || options.height <= 0)
+                return false;
+        } else if (argument == "--camera" && hasValue) {
+            // Same values the arrow keys and W/S change in the window
+            if (std::sscanf(argv[++i], "%f,%f,%f", &cameraDistance, &rotationAngleX, &rotationAngleY) != 3)
+                return false;
+        } else if (argument == "--output" && hasValue) {
+            options.outputPath = argv[++i];
+        } else if (argument == "--golden" && hasValue) {
+            options.goldenPath = argv[++i];
+        } else if (argument == "--tolerance" && hasValue) {
+            options.tolerance = std::atoi(argv[++i]);
+        } else if (argument == "--max-differing" && hasValue) {
+            options.maxDiffering = static_cast<size_t>(std::atoll(argv[++i]));
+        } else if (argument == "--pipeline-depth" && hasValue) {
+            options.pipelineDepth = std::atoi(argv[++i]);
+            if (options.pipelineDepth < 1)
+                return false;
+        } else if (argument == "--script" && hasValue) {
+            options.scriptPath = argv[++i];
+        } else if (argument == "--range" && hasValue) {
+            if (std::sscanf(argv[++i], "%d-%d", &options.rangeFirst, &options.rangeLast) != 2 || options.rangeFirst < 0 ||
+                options.rangeLast < options.rangeFirst)
+                return false;
+        } else if (argument == "--encoders" && hasValue) {
+            options.encoderThreads = std::atoi(argv[++i]);
+            if (options.encoderThreads < 1)
+                return false;
+        } else if (argument == "--encoder-queue" && hasValue) {
+            options.encoderQueueDepth = std::atoi(argv[++i]);
+            if (options.encoderQueueDepth < 1)
+                return false;
+        } else if (argument == "--trace" && hasValue) {
+            options.tracePath = argv[++i];
+        } else if (argument[0] != '-' && !options.modelPath) {
+            // An OBJ or PLY file replaces the cubes
+            options.modelPath = argv[i];
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+void printUsage() {
+    std::cout << "Usage: 3DGraphics [model.obj|model.ply] [options]\n"
+              << "  --field                 draw the cube field instead of the cube pair, or a field of the model\n"
+              << "  --animate               spin one cube of the pair (A toggles it in the window)\n"
+              << "  --shading MODEL         flat, gouraud, textured, lit or deferred (M cycles them in the window)\n"
+              << "  --msaa N                samples per pixel, 1, 4 or 8 (Q cycles them in the window)\n"
+              << "  --lod-error P           largest simplification error on screen in pixels, 0 for full detail\n"
+              << "                          (default 1, L toggles levels of detail in the window)\n"
+              << "  --raycast               cast a ray per pixel instead of rasterizing, always flat shaded\n"
+              << "                          (R toggles it in the window)\n"
+              << "  --views N               draw the scene flat shaded from N cameras around it, side by side\n"
+              << "  --pick X,Y              report what is under a pixel of the last frame, from the top left\n"
+              << "                          (a left click picks in the window)\n"
+              << "  --camera D,AX,AY        camera distance and rotation angles in degrees\n"
+              << "  --headless              render without a window, then exit\n"
+              << "  --frames N              frames to render headless (default 1)\n"
+              << "  --size WxH              headless resolution (default 600x600)\n"
+              << "  --output FILE           write the last frame as .png or .ppm\n"
+              << "  --golden FILE           compare the last frame with a .ppm, exit code 1 on mismatch\n"
+              << "  --tolerance T           per-channel difference still counted as equal (default 2)\n"
+              << "  --max-differing N       pixels allowed beyond the tolerance (default 0)\n"
+              << "  --pipeline-depth N      frames in flight between rasterizing and presenting (default "
+              << DEFAULT_PIPELINE_DEPTH << ")\n"
+              << "  --trace FILE            write a Chrome trace (chrome://tracing) of every frame at exit\n"
+              << "  --script FILE           render a keyframed animation script without a window, as fast as\n"
+              << "                          possible; --output names the frames: a .png or .ppm per frame with\n"
+              << "                          # for the frame number (frame_####.png), or one .y4m video\n"
+              << "  --range FIRST-LAST      render only these frames of the script, so separate processes\n"
+              << "                          can split a sequence; each writes its own .y4m\n"
+              << "  --encoders N            threads writing frames in the background (default 1, .y4m uses 1)\n"
+              << "  --encoder-queue N       rendered frames that may wait for the encoders (default "
+              << DEFAULT_ENCODER_QUEUE_DEPTH << ")" << std::endl;
+}
+
+int runHeadless(const AppOptions& options) {
+    Framebuffer framebuffer;
+    ThreadPool threadPool;
+    Rasterizer rasterizer(threadPool);
+    std::cout << "Rasterizing " << options.width << "x" << options.height << " on " << threadPool.size()
+              << " threads with the " << instructionSetName(rasterizer.getInstructionSet()) << " kernel" << std::endl;
+    VertexStage vertexStage(threadPool);
+    DeferredLighting lighting(threadPool);
+    setupMaterials(lighting);
+    RayTracer tracer(threadPool);
+    Scene scene;
+    if (!loadScene(scene, options.modelPath))
+        return -1;
+
+    std::vector<double> frameTimes;
+    int redrawCounts[3] = {};
+    for (int frame = 0; frame < options.frames; ++frame) {
+        auto frameStart = std::chrono::steady_clock::now();
+        // Fixed 60 Hz steps, so runs are repeatable. Headless frames are
+        // rendered one after another on this thread, nothing waits for a present.
+        if (options.pick && frame == options.frames - 1) {
+            // Pixel centers, like the rays of the ray-cast mode
+            pickPoint = pixelToNdc(options.pickX + 0.5, options.pickY + 0.5, options.width, options.height);
+            pickRequested = true;
+        }
+        FrameInput input = sampleInput(frame / 60.0, options.width, options.height);
+        animateScene(scene, input);
+        RedrawKind redraw = renderFrame(scene, input, vertexStage, rasterizer, lighting, tracer, framebuffer, false);
+        if (redraw != RedrawKind::None)
+            profileEndFrame(options.width, options.height);
+        std::chrono::duration<double, std::milli> frameTime = std::chrono::steady_clock::now() - frameStart;
+        frameTimes.push_back(frameTime.count());
+        ++redrawCounts[static_cast<int>(redraw)];
+    }
+    printStats(vertexStage);
+    std::cout << "Frames redrawn fully " << redrawCounts[static_cast<int>(RedrawKind::Full)] << ", partially "
+              << redrawCounts[static_cast<int>(RedrawKind::Partial)] << ", skipped " << redrawCounts[static_cast<int>(RedrawKind::None)] << std::endl;
+
+    // The first frame also pays for warming up caches and allocations, so it is reported on its own
+    std::vector<double> sorted(frameTimes.begin() + (frameTimes.size() > 1 ? 1 : 0), frameTimes.end());
+    std::sort(sorted.begin(), sorted.end());
+    double total = 0.0;
+    for (double time : sorted)
+        total += time;
+    std::cout << "First frame " << frameTimes[0] << " ms; " << sorted.size() << " frames: min " << sorted.front()
+              << " ms, median " << sorted[sorted.size() / 2] << " ms, mean " << total / sorted.size()
+              << " ms, p95 " << sorted[std::min(sorted.size() - 1, sorted.size() * 95 / 100)] << " ms, max " << sorted.back()
+              << " ms" << std::endl;
+
+    if (options.tracePath && !profileWriteTrace(options.tracePath))
+        return -1;
+
+    std::vector<uint32_t> image;
+    framebuffer.resolve(image);
+    if (options.outputPath) {
+        if (!writeImage(options.outputPath, framebuffer.getWidth(), framebuffer.getHeight(), image.data())) {
+            std::cerr << "Failed to write " << options.outputPath << std::endl;
+            return -1;
+        }
+        std::cout << "Wrote " << options.outputPath << std::endl;
+    }
+
+    if (options.goldenPath) {
+        int width, height;
+        std::vector<uint32_t> golden;
+        if (!readPpm(options.goldenPath, width, height, golden)) {
+            std::cerr << "Failed to read golden image " << options.goldenPath << std::endl;
+            return -1;
+        }
+        if (width != framebuffer.getWidth() || height != framebuffer.getHeight()) {
+            std::cerr << "Golden image is " << width << "x" << height << ", rendered "
+                      << framebuffer.getWidth() << "x" << framebuffer.getHeight() << std::endl;
+            return 1;
+        }
+
+        ImageComparison comparison = compareImages(image.data(), golden.data(), golden.size(), options.tolerance);
+        bool passed = comparison.differingPixels <= options.maxDiffering;
+        std::cout << (passed ? "PASS " : "FAIL ") << options.goldenPath << ": " << comparison.differingPixels
+                  << " pixels differ by more than " << options.tolerance << ", largest difference " << comparison.maxDifference << std::endl;
+        if (!passed)
+            return 1;
+    }
+
+    return 0;
+}
+
+// Renders frames of an animation script one after another as fast as the CPU
+// allows and streams them to the encoder threads, which only hold rendering
+// up once every queued buffer is still waiting to be written. Every frame
+// depends on its time alone, so ranges rendered by separate processes add up
+// to the same sequence as one run.
+int runBatch(const AppOptions& options) {
+    AnimationScript script;
+    std::string error;
+    if (!loadAnimationScript(options.scriptPath, script, error)) {
+        std::cerr << "Failed to load " << options.scriptPath << ": " << error << std::endl;
+        return -1;
+    }
+    int first = options.rangeFirst;
+    int last = options.rangeLast < 0 ? script.frameCount - 1 : std::min(options.rangeLast, script.frameCount - 1);
+    if (first > last) {
+        std::cerr << "The script has " << script.frameCount << " frames, none in the range" << std::endl;
+        return -1;
+    }
+
+    FrameEncoder encoder;
+    if (options.outputPath &&
+        !encoder.start(options.outputPath, options.width, options.height, script.fps, options.encoderQueueDepth, options.encoderThreads, error)) {
+        std::cerr << "Cannot write frames: " << error << std::endl;
+        return -1;
+    }
+
+    Framebuffer framebuffer;
+    ThreadPool threadPool;
+    Rasterizer rasterizer(threadPool);
+    VertexStage vertexStage(threadPool);
+    DeferredLighting lighting(threadPool);
+    setupMaterials(lighting);
+    RayTracer tracer(threadPool);
+    Scene scene;
+    if (!loadScene(scene, options.modelPath))
+        return -1;
+    std::cout << "Rendering frames " << first << "-" << last << " of " << options.scriptPath << " at " << options.width << "x"
+              << options.height << " on " << threadPool.size() << " threads" << std::endl;
+
+    auto runStart = std::chrono::steady_clock::now();
+    for (int frame = first; frame <= last; ++frame) {
+        double time = script.frameTime(frame);
+        if (!script.camera.empty()) {
+            CameraKey pose = evaluateCamera(script, time);
+            cameraDistance = pose.distance;
+            rotationAngleX = pose.angleX;
+            rotationAngleY = pose.angleY;
+        }
+        FrameInput input = sampleInput(time, options.width, options.height);
+        animateScene(scene, input);
+        applyInstanceTracks(script, time, sceneInstances(scene, input.showCubeField));
+        // Levels of detail are picked afresh, without the hysteresis of earlier frames
+        scene.lods.levels.clear();
+        for (LodSelection& lods : scene.viewLods)
+            lods.levels.clear();
+
+        // Skipped frames still have the previous one in the framebuffer, which is written again
+        RedrawKind redraw = renderFrame(scene, input, vertexStage, rasterizer, lighting, tracer, framebuffer, false);
+        if (redraw != RedrawKind::None)
+            profileEndFrame(options.width, options.height);
+        if (options.outputPath) {
+            framebuffer.resolve(encoder.acquire());
+            encoder.submit(frame);
+        }
+    }
+    std::chrono::duration<double> renderTime = std::chrono::steady_clock::now() - runStart;
+    bool written = encoder.finish();
+    // Stage times and counts averaged over the whole range
+    printStats(vertexStage);
+    std::chrono::duration<double> totalTime = std::chrono::steady_clock::now() - runStart;
+
+    // Rendering speed leaves out the waits for the encoder, which the backpressure line accounts for
+    int frames = last - first + 1;
+    EncoderStats stats = encoder.getStats();
+    std::cout << "Rendered " << frames << " frames in " << totalTime.count() << " s: " << frames / totalTime.count() << " fps overall, "
+              << frames / std::max(renderTime.count() - stats.stallSeconds, 1e-9) << " fps rendering" << std::endl;
+    if (options.outputPath) {
+        std::cout << "Encoder wrote " << stats.framesWritten << " frames, " << stats.encodeSeconds * 1000.0 / std::max<uint64_t>(stats.framesWritten, 1)
+                  << " ms each; backpressure stalled " << stats.stalls << " frames for " << stats.stallSeconds * 1000.0 << " ms ("
+                  << 100.0 * stats.stallSeconds / renderTime.count() << "% of rendering), at most " << stats.maxQueued << " of "
+                  << options.encoderQueueDepth << " frames queued, " << (totalTime - renderTime).count() * 1000.0 << " ms draining at the end"
+                  << std::endl;
+    }
+    if (!written) {
+        std::cerr << "Failed to write " << stats.writeFailures << " frames to " << options.outputPath << std::endl;
+        return -1;
+    }
+
+    if (options.tracePath && !profileWriteTrace(options.tracePath))
+        return -1;
+    return 0;
+}
@@ -0,0 +1,78 @@
+#include "ThreadPool.h"
+#include "Profiler.h"
+
+ThreadPool::ThreadPool(unsigned threadCount) {
+    if (threadCount == 0)
+        threadCount = 1;
+
+    workers.reserve(threadCount - 1);
+    for (unsigned i = 1; i < threadCount; ++i)
+        workers.emplace_back(&ThreadPool::workerLoop, this, i);
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wakeCondition.notify_all();
+
+    for (std::thread& worker : workers)
+        worker.join();
+}
+
+void ThreadPool::dispatch(int count, JobFunction function, const void* context) {
+    if (count <= 0)
+        return;
+
+    // Not worth waking anyone up for
+    if (workers.empty() || count == 1) {
+        for (int i = 0; i < count; ++i)
+            function(context, i, 0);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        jobFunction = function;
+        jobContext = context;
+        jobCount = count;
+        nextJob.store(0, std::memory_order_relaxed);
+        activeWorkers = static_cast<unsigned>(workers.size());
+        ++generation;
+    }
+    wakeCondition.notify_all();
+
+    runJobs(0);
+
+    // Wait for the workers to drain their last job
+    std::unique_lock<std::mutex> lock(mutex);
+    doneCondition.wait(lock, [this] { return activeWorkers == 0; });
+}
+
+void ThreadPool::runJobs(unsigned worker) {
+    int index;
+    while ((index = nextJob.fetch_add(1, std::memory_order_relaxed)) < jobCount)
+        jobFunction(jobContext, index, worker);
+}
+
+void ThreadPool::workerLoop(unsigned worker) {
+    uint64_t seenGeneration = 0;
+    PROFILE_THREAD_NAME("worker", static_cast<int>(worker));
+
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wakeCondition.wait(lock, [&] { return stopping || generation != seenGeneration; });
+            if (stopping)
+                return;
+            seenGeneration = generation;
+        }
+
+        runJobs(worker);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--activeWorkers == 0)
+            doneCondition.notify_one();
+    }
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Persistent pool of worker threads. The calling thread takes part in every
+// dispatch as worker 0, so a pool of N threads spawns N - 1 workers.
+class ThreadPool {
+public:
+    explicit ThreadPool(unsigned threadCount = std::thread::hardware_concurrency());
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Number of threads that run jobs, including the caller
+    unsigned size() const { return static_cast<unsigned>(workers.size()) + 1; }
+
+    // Calls func(index, worker) for every index in [0, count) and blocks until all
+    // calls have returned. Jobs are handed out one index at a time, so uneven jobs
+    // balance themselves. Not reentrant: func must not call parallelFor again.
+    template <typename Func>
+    void parallelFor(int count, const Func& func) {
+        dispatch(count, [](const void* context, int index, unsigned worker) {
+            (*static_cast<const Func*>(context))(index, worker);
+        }, &func);
+    }
+
+private:
+    typedef void (*JobFunction)(const void* context, int index, unsigned worker);
+
+    void dispatch(int count, JobFunction function, const void* context);
+    void runJobs(unsigned worker);
+    void workerLoop(unsigned worker);
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wakeCondition;
+    std::condition_variable doneCondition;
+    uint64_t generation = 0;
+    unsigned activeWorkers = 0;
+    bool stopping = false;
+
+    JobFunction jobFunction = nullptr;
+    const void* jobContext = nullptr;
+    int jobCount = 0;
+    std::atomic<int> nextJob{ 0 };
+};
@@ -0,0 +1,94 @@
+#include "Transforms.h"
+
+#include <cmath>
+
+glm::mat4 calculateProjectionMatrix(float aspectRatio, float fovRadians, float nearPlane, float farPlane) {
+    // from: https://ogldev.org/www/tutorial12/tutorial12.html
+    float tanHalfFov = tanf(fovRadians / 2.0f);
+
+    glm::mat4 projectionMatrix(0.0f);
+    projectionMatrix[0][0] = 1 / (tanHalfFov * aspectRatio); //1row [.. 0 0 0]
+    projectionMatrix[1][1] = 1 / (tanHalfFov); // 2row [0 .. 0 0]
+    projectionMatrix[2][2] = -(farPlane + nearPlane) / (farPlane - nearPlane); // 3row [0 0 .. ..]
+    projectionMatrix[3][2] = -(2.0f * farPlane * nearPlane) / (farPlane - nearPlane);
+    projectionMatrix[2][3] = -1.0f; // 4row [0 0 -1 0]
+
+    return projectionMatrix;
+}
+
+glm::mat4 calculateViewMatrix(float cameraDistance, float rotationAngleX, float rotationAngleY) {
+    // Calculate the view matrix manually
+    glm::mat4 viewMatrix(1.0f);
+    viewMatrix = translateMatrix(viewMatrix, glm::vec3(0.0f, 0.0f, cameraDistance));
+    viewMatrix = rotateMatrix(viewMatrix, glm::radians(rotationAngleX), glm::vec3(1.0f, 0.0f, 0.0f));
+    viewMatrix = rotateMatrix(viewMatrix, glm::radians(rotationAngleY), glm::vec3(0.0f, 1.0f, 0.0f));
+
+    return viewMatrix;
+}
+
+glm::mat4 translateMatrix(const glm::mat4& matrix, const glm::vec3& translation) {
+    glm::mat4 result = matrix;
+
+    result[3][0] = matrix[0][0] * translation.x + matrix[1][0] * translation.y + matrix[2][0] * translation.z + matrix[3][0];
+    result[3][1] = matrix[0][1] * translation.x + matrix[1][1] * translation.y + matrix[2][1] * translation.z + matrix[3][1];
+    result[3][2] = matrix[0][2] * translation.x + matrix[1][2] * translation.y + matrix[2][2] * translation.z + matrix[3][2];
+    result[3][3] = matrix[0][3] * translation.x + matrix[1][3] * translation.y + matrix[2][3] * translation.z + matrix[3][3];
+
+    return result;
+}
+
+glm::mat4 rotateMatrix(const glm::mat4& matrix, float rotationAngle, const glm::vec3& axis) {
+    glm::quat rotationQuat = axisAngleToQuaternion(rotationAngle, axis);
+    glm::mat4 rotationMatrix = quaternionToMatrix(rotationQuat);
+    return matrix * rotationMatrix;
+}
+
+glm::quat axisAngleToQuaternion(float angle, const glm::vec3& axis) {
+    float halfAngle = angle * 0.5f;
+    float sinHalfAngle = sin(halfAngle);
+
+    glm::quat quaternion;
+    quaternion.w = cos(halfAngle);
+    quaternion.x = axis.x * sinHalfAngle;
+    quaternion.y = axis.y * sinHalfAngle;
+    quaternion.z = axis.z * sinHalfAngle;
+
+    return quaternion;
+}
+
+glm::mat4 quaternionToMatrix(const glm::quat& quaternion) {
+    float xx = quaternion.x * quaternion.x;
+    float xy = quaternion.x * quaternion.y;
+    float xz = quaternion.x * quaternion.z;
+    float xw = quaternion.x * quaternion.w;
+
+    float yy = quaternion.y * quaternion.y;
+    float yz = quaternion.y * quaternion.z;
+    float yw = quaternion.y * quaternion.w;
+
+    float zz = quaternion.z * quaternion.z;
+    float zw = quaternion.z * quaternion.w;
+
+    glm::mat4 rotationMatrix;
+    rotationMatrix[0][0] = 1.0f - 2.0f * (yy + zz);
+    rotationMatrix[0][1] = 2.0f * (xy - zw);
+    rotationMatrix[0][2] = 2.0f * (xz + yw);
+    rotationMatrix[0][3] = 0.0f;
+
+    rotationMatrix[1][0] = 2.0f * (xy + zw);
+    rotationMatrix[1][1] = 1.0f - 2.0f * (xx + zz);
+    rotationMatrix[1][2] = 2.0f * (yz - xw);
+    rotationMatrix[1][3] = 0.0f;
+
+    rotationMatrix[2][0] = 2.0f * (xz - yw);
+    rotationMatrix[2][1] = 2.0f * (yz + xw);
+    rotationMatrix[2][2] = 1.0f - 2.0f * (xx + yy);
+    rotationMatrix[2][3] = 0.0f;
+
+    rotationMatrix[3][0] = 0.0f;
+    rotationMatrix[3][1] = 0.0f;
+    rotationMatrix[3][2] = 0.0f;
+    rotationMatrix[3][3] = 1.0f;
+
+    return rotationMatrix;
+}
@@ -0,0 +1,15 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+// Hand-written matrix helpers for the camera and the instances
+
+// OpenGL-style perspective projection, looking down -z
+glm::mat4 calculateProjectionMatrix(float aspectRatio, float fovRadians, float nearPlane, float farPlane);
+// Camera at cameraDistance along z, rotated about x and then y by the angles in degrees
+glm::mat4 calculateViewMatrix(float cameraDistance, float rotationAngleX, float rotationAngleY);
+glm::mat4 translateMatrix(const glm::mat4& matrix, const glm::vec3& translation);
+// matrix times a rotation of rotationAngle radians about a unit axis
+glm::mat4 rotateMatrix(const glm::mat4& matrix, float rotationAngle, const glm::vec3& axis);
+glm::quat axisAngleToQuaternion(float angle, const glm::vec3& axis);
+glm::mat4 quaternionToMatrix(const glm::quat& quaternion);
@@ -0,0 +1,286 @@
+#include "VertexStage.h"
+
+#include <cmath>
+
+// Meshes smaller than this are transformed on the calling thread
+static const size_t VERTEX_BATCH_SIZE = 4096;
+
+ClipCullStats& ClipCullStats::operator+=(const ClipCullStats& other) {
+    trianglesIn += other.trianglesIn;
+    frustumRejected += other.frustumRejected;
+    clipped += other.clipped;
+    clippedAway += other.clippedAway;
+    backFacesCulled += other.backFacesCulled;
+    degenerate += other.degenerate;
+    trianglesOut += other.trianglesOut;
+    instancesIn += other.instancesIn;
+    instancesCulled += other.instancesCulled;
+    instancesSimplified += other.instancesSimplified;
+    return *this;
+}
+
+void ClipSpaceVertices::resize(size_t count) {
+    x.resize(count);
+    y.resize(count);
+    z.resize(count);
+    w.resize(count);
+    outcode.resize(count);
+}
+
+VertexStage::VertexStage(ThreadPool& pool) : pool(pool), workerSpaces(pool.size()) {
+}
+
+void VertexStage::drawMesh(const MeshView& mesh, const glm::mat4& modelViewProjection, Rasterizer& rasterizer) {
+    transformVertices(mesh, modelViewProjection);
+
+    triangles.clear();
+    {
+        PROFILE_SCOPE(ProfileStage::ClipCull, "Assemble");
+        assembleFlatTriangles(mesh, glm::vec3(1.0f), workspace, triangles);
+    }
+    rasterizer.submitTriangles(triangles.data(), triangles.size());
+
+    PROFILE_COUNT(ProfileCounter::TrianglesIn, workspace.stats.trianglesIn);
+    PROFILE_COUNT(ProfileCounter::TrianglesOut, workspace.stats.trianglesOut);
+    stats += workspace.stats;
+    workspace.stats = ClipCullStats();
+}
+
+void VertexStage::drawInstances(const MeshView& mesh, const InstanceBuffer& instances, const glm::mat4& viewProjection, Rasterizer& rasterizer,
+                                LodSelection* lods) {
+    int batchCount = prepareInstanceBatches(mesh, instances, viewProjection, rasterizer, lods);
+
+    // Every instance is small, so one thread transforms all vertices of an
+    // instance itself instead of splitting the mesh across the pool
+    pool.parallelFor(batchCount, [&](int batch, unsigned worker) {
+        drawInstanceBatch(mesh, instances, batch, worker, viewProjection, 0);
+    });
+
+    submitInstanceBatches(batchCount, rasterizer);
+}
+
+void VertexStage::drawViews(const MeshView& mesh, const InstanceBuffer& instances, const RenderView* views, size_t viewCount, Rasterizer& rasterizer,
+                            LodSelection* lods) {
+    size_t groupSize = pool.size() * VIEWS_PER_WORKER;
+    for (size_t first = 0; first < viewCount; first += groupSize) {
+        if (first > 0)
+            rasterizer.flush();
+        size_t count = std::min(groupSize, viewCount - first);
+        drawViewGroup(mesh, instances, views + first, count, rasterizer, lods ? lods + first : nullptr);
+    }
+}
+
+void VertexStage::drawViewGroup(const MeshView& mesh, const InstanceBuffer& instances, const RenderView* views, size_t viewCount, Rasterizer& rasterizer,
+                                LodSelection* lods) {
+    viewProjections.resize(viewCount);
+    viewportIds.resize(viewCount);
+    if (viewInstances.size() < viewCount)
+        viewInstances.resize(viewCount);
+    for (size_t v = 0; v < viewCount; ++v) {
+        viewProjections[v] = views[v].viewProjection;
+        viewportIds[v] = rasterizer.addViewport(views[v].viewport);
+    }
+
+    cullInstances(pool, mesh, instances, viewProjections.data(), viewCount, lods, viewInstances.data(), cullScratch);
+
+    // The batches of all views go into one list, so the pool works through
+    // the whole group at once instead of one small draw at a time
+    visibleInstances.clear();
+    instanceBatches.clear();
+    for (size_t v = 0; v < viewCount; ++v) {
+        size_t begin = visibleInstances.size();
+        visibleInstances.insert(visibleInstances.end(), viewInstances[v].begin(), viewInstances[v].end());
+        stats.instancesIn += instances.size();
+        stats.instancesCulled += instances.size() - viewInstances[v].size();
+        addInstanceBatches(mesh, begin, lods ? &lods[v] : nullptr, static_cast<uint32_t>(v));
+    }
+    int batchCount = reserveBatchOutputs();
+
+    pool.parallelFor(batchCount, [&](int batch, unsigned worker) {
+        uint32_t view = instanceBatches[batch].view;
+        drawInstanceBatch(mesh, instances, batch, worker, viewProjections[view], viewportIds[view]);
+    });
+
+    submitInstanceBatches(batchCount, rasterizer);
+}
+
+int VertexStage::prepareInstanceBatches(const MeshView& mesh, const InstanceBuffer& instances, const glm::mat4& viewProjection, Rasterizer& rasterizer,
+                                        LodSelection* lods) {
+    cullInstances(pool, mesh, instances, viewProjection, &rasterizer, lods, visibleInstances);
+    stats.instancesIn += instances.size();
+    stats.instancesCulled += instances.size() - visibleInstances.size();
+
+    instanceBatches.clear();
+    addInstanceBatches(mesh, 0, lods, 0);
+    return reserveBatchOutputs();
+}
+
+void VertexStage::addInstanceBatches(const MeshView& mesh, size_t begin, const LodSelection* lods, uint32_t view) {
+    uint32_t* instances = visibleInstances.data() + begin;
+    size_t count = visibleInstances.size() - begin;
+
+    // Sort the instances by level, keeping buffer order within each, so every
+    // batch draws a single level
+    size_t levelStart[MAX_MESH_LEVELS + 1] = {};
+    size_t levelCount = lods ? mesh.levelCount() : 1;
+    if (levelCount > 1) {
+        for (size_t i = 0; i < count; ++i)
+            ++levelStart[lods->levels[instances[i]] + 1];
+        for (size_t level = 1; level <= levelCount; ++level)
+            levelStart[level] += levelStart[level - 1];
+        stats.instancesSimplified += count - levelStart[1];
+
+        size_t next[MAX_MESH_LEVELS];
+        std::copy(levelStart, levelStart + levelCount, next);
+        sortedInstances.resize(count);
+        for (size_t i = 0; i < count; ++i)
+            sortedInstances[next[lods->levels[instances[i]]]++] = instances[i];
+        std::copy(sortedInstances.begin(), sortedInstances.end(), instances);
+    } else {
+        levelStart[1] = count;
+    }
+
+    for (size_t level = 0; level < levelCount; ++level) {
+        for (size_t first = levelStart[level]; first < levelStart[level + 1]; first += INSTANCE_BATCH_SIZE) {
+            size_t last = std::min(first + INSTANCE_BATCH_SIZE, levelStart[level + 1]);
+            instanceBatches.push_back(InstanceBatch{ static_cast<uint32_t>(begin + first), static_cast<uint32_t>(begin + last),
+                                                     static_cast<uint32_t>(level), view });
+        }
+    }
+}
+
+int VertexStage::reserveBatchOutputs() {
+    int batchCount = static_cast<int>(instanceBatches.size());
+    if (batchTriangles.size() < static_cast<size_t>(batchCount)) {
+        batchTriangles.resize(batchCount);
+        batchVertexData.resize(batchCount);
+    }
+    return batchCount;
+}
+
+void VertexStage::drawInstanceBatch(const MeshView& mesh, const InstanceBuffer& instances, int batch, unsigned worker, const glm::mat4& viewProjection,
+                                    uint32_t viewport) {
+    PROFILE_SCOPE(ProfileStage::None, "Vertex batch");
+    Workspace& space = workerSpaces[worker];
+    if (space.clip.x.size() < mesh.vertexCount())
+        space.clip.resize(mesh.vertexCount());
+
+    std::vector<RasterTriangle>& output = batchTriangles[batch];
+    output.clear();
+    batchVertexData[batch].clear();
+
+    const InstanceBatch& range = instanceBatches[batch];
+    MeshView levelMesh = mesh.level(range.level);
+    for (size_t i = range.begin; i < range.end; ++i) {
+        uint32_t instance = visibleInstances[i];
+        {
+            PROFILE_ACCUMULATE(ProfileStage::Transform);
+            transformPositions(levelMesh.positions, 0, levelMesh.vertexCount(), viewProjection * instances.transforms[instance], space.clip);
+        }
+        PROFILE_ACCUMULATE(ProfileStage::ClipCull);
+        assembleFlatTriangles(levelMesh, instances.colors[instance], space, output);
+    }
+
+    if (viewport)
+        for (RasterTriangle& triangle : output)
+            triangle.viewport = viewport;
+}
+
+void VertexStage::submitInstanceBatches(int batchCount, Rasterizer& rasterizer) {
+    // Submit in batch order so the result does not depend on scheduling
+    for (int batch = 0; batch < batchCount; ++batch) {
+        const std::vector<RasterTriangle>& output = batchTriangles[batch];
+        const std::vector<float>& vertexData = batchVertexData[batch];
+        if (vertexData.empty())
+            rasterizer.submitTriangles(output.data(), output.size());
+        else
+            rasterizer.submitTriangles(output.data(), output.size(), vertexData.data(), vertexData.size());
+    }
+
+    for (Workspace& space : workerSpaces) {
+        PROFILE_COUNT(ProfileCounter::TrianglesIn, space.stats.trianglesIn);
+        PROFILE_COUNT(ProfileCounter::TrianglesOut, space.stats.trianglesOut);
+        stats += space.stats;
+        space.stats = ClipCullStats();
+    }
+}
+
+void VertexStage::transformVertices(const MeshView& mesh, const glm::mat4& modelViewProjection) {
+    size_t vertexCount = mesh.vertexCount();
+    ClipSpaceVertices& clip = workspace.clip;
+    if (clip.x.size() < vertexCount)
+        clip.resize(vertexCount);
+
+    int batchCount = static_cast<int>((vertexCount + VERTEX_BATCH_SIZE - 1) / VERTEX_BATCH_SIZE);
+    pool.parallelFor(batchCount, [&](int batch, unsigned) {
+        PROFILE_SCOPE(ProfileStage::Transform, "Transform");
+        size_t begin = batch * VERTEX_BATCH_SIZE;
+        size_t end = std::min(begin + VERTEX_BATCH_SIZE, vertexCount);
+        transformPositions(mesh.positions, begin, end, modelViewProjection, clip);
+    });
+}
+
+void VertexStage::assembleFlatTriangles(const MeshView& mesh, const glm::vec3& tint, Workspace& workspace, std::vector<RasterTriangle>& output) const {
+    ClipCullStats& stats = workspace.stats;
+    assembleTriangles(mesh, workspace, [&](uint32_t i0, uint32_t i1, uint32_t i2, const glm::vec4* corners, const glm::vec3*) {
+        RasterTriangle triangle;
+        if (!projectTriangle(corners[0], corners[1], corners[2], stats, triangle))
+            return;
+        triangle.color = packColor((mesh.colors[i0] + mesh.colors[i1] + mesh.colors[i2]) / 3.0f * tint);
+        output.push_back(triangle);
+    });
+}
+
+bool VertexStage::projectTriangle(const glm::vec4& p0, const glm::vec4& p1, const glm::vec4& p2, ClipCullStats& stats, RasterTriangle& triangle) const {
+    // Perspective division
+    triangle.v0 = glm::vec3(p0) / p0.w;
+    triangle.v1 = glm::vec3(p1) / p1.w;
+    triangle.v2 = glm::vec3(p2) / p2.w;
+
+    float area = (triangle.v1.x - triangle.v0.x) * (triangle.v2.y - triangle.v0.y) - (triangle.v2.x - triangle.v0.x) * (triangle.v1.y - triangle.v0.y);
+    if (area == 0.0f) {
+        ++stats.degenerate;
+        return false;
+    }
+
+    bool frontFacing = (area > 0.0f) == (frontFace == FrontFace::CounterClockwise);
+    if ((cullMode == CullMode::Back && !frontFacing) || (cullMode == CullMode::Front && frontFacing)) {
+        ++stats.backFacesCulled;
+        return false;
+    }
+
+    ++stats.trianglesOut;
+    return true;
+}
+
+PixelRect gridViewport(size_t index, size_t count, int width, int height) {
+    size_t columns = static_cast<size_t>(std::ceil(std::sqrt(static_cast<double>(count))));
+    size_t rows = (count + columns - 1) / columns;
+    int cellWidth = static_cast<int>(width / columns);
+    int cellHeight = static_cast<int>(height / rows);
+
+    // Images are written with the last row of the target at the top
+    int x = static_cast<int>(index % columns) * cellWidth;
+    int y = height - static_cast<int>(index / columns + 1) * cellHeight;
+    return PixelRect{ x, y, x + cellWidth, y + cellHeight };
+}
+
+void transformPositions(const glm::vec3* positions, size_t begin, size_t end, const glm::mat4& matrix, ClipSpaceVertices& clip) {
+    float* outX = clip.x.data();
+    float* outY = clip.y.data();
+    float* outZ = clip.z.data();
+    float* outW = clip.w.data();
+    uint8_t* outcode = clip.outcode.data();
+
+    // Written out per component so the compiler can keep the matrix in registers and vectorize
+    for (size_t i = begin; i < end; ++i) {
+        float x = positions[i].x, y = positions[i].y, z = positions[i].z;
+        outX[i] = matrix[0][0] * x + matrix[1][0] * y + matrix[2][0] * z + matrix[3][0];
+        outY[i] = matrix[0][1] * x + matrix[1][1] * y + matrix[2][1] * z + matrix[3][1];
+        outZ[i] = matrix[0][2] * x + matrix[1][2] * y + matrix[2][2] * z + matrix[3][2];
+        outW[i] = matrix[0][3] * x + matrix[1][3] * y + matrix[2][3] * z + matrix[3][3];
+    }
+
+    for (size_t i = begin; i < end; ++i)
+        outcode[i] = computeOutcode(outX[i], outY[i], outZ[i], outW[i]);
+}
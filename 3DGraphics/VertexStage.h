@@ -0,0 +1,287 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "Clipper.h"
+#include "Instancing.h"
+#include "Mesh.h"
+#include "Profiler.h"
+#include "Rasterizer.h"
+#include "ShaderKernels.h"
+#include "ThreadPool.h"
+
+// Instances transformed and assembled per job
+#define INSTANCE_BATCH_SIZE 256
+
+// Views of a multi-view draw handled per worker between two flushes
+#define VIEWS_PER_WORKER 4
+
+// Clip-space positions of a mesh's unique vertices, one array per component,
+// plus the frustum outcode of each vertex
+struct ClipSpaceVertices {
+    std::vector<float> x, y, z, w;
+    std::vector<uint8_t> outcode;
+
+    void resize(size_t count);
+};
+
+enum class CullMode {
+    None,
+    Back,
+    Front
+};
+
+enum class FrontFace {
+    CounterClockwise,
+    Clockwise
+};
+
+// How many triangles each step of the clip/cull stage let through or dropped
+struct ClipCullStats {
+    uint64_t trianglesIn = 0;
+    uint64_t frustumRejected = 0; // all three vertices outside the same frustum plane
+    uint64_t clipped = 0;         // crossed the near/far plane or the guard band
+    uint64_t clippedAway = 0;     // nothing left after clipping
+    uint64_t backFacesCulled = 0;
+    uint64_t degenerate = 0;      // no area after projection
+    uint64_t trianglesOut = 0;    // handed to the rasterizer, clipped triangles may become several
+    uint64_t instancesIn = 0;
+    uint64_t instancesCulled = 0; // outside the frustum or hidden, never transformed
+    uint64_t instancesSimplified = 0; // drawn at a coarser level of detail
+
+    ClipCullStats& operator+=(const ClipCullStats& other);
+};
+
+// One camera of a multi-view draw and the region of the target it renders
+// into, which has to lie inside the target
+struct RenderView {
+    glm::mat4 viewProjection;
+    PixelRect viewport;
+};
+
+// Front end of the pipeline: transforms each unique vertex of a mesh exactly
+// once with a single model-view-projection matrix, assembles triangles by
+// reading the transformed vertices through the index buffer, and clips and
+// culls them before they reach the rasterizer
+class VertexStage {
+public:
+    explicit VertexStage(ThreadPool& pool);
+
+    void drawMesh(const MeshView& mesh, const glm::mat4& modelViewProjection, Rasterizer& rasterizer);
+    // Draws the mesh once per instance. Instances are culled against the frustum
+    // and what the rasterizer has already flushed, then the survivors are
+    // transformed and assembled in batches across the pool. With lods, each
+    // instance is drawn at the level of detail its size on screen calls for.
+    void drawInstances(const MeshView& mesh, const InstanceBuffer& instances, const glm::mat4& viewProjection, Rasterizer& rasterizer,
+                       LodSelection* lods = nullptr);
+    // Same with a shader instead of flat colors, see ShaderKernels.h. The
+    // shader has to stay alive until the rasterizer's frame ends.
+    template <typename Shader>
+    void drawInstances(const MeshView& mesh, const InstanceBuffer& instances, const glm::mat4& viewProjection, const Shader& shader, Rasterizer& rasterizer,
+                       LodSelection* lods = nullptr);
+    // Draws the instances once per view, each into its own viewport of the
+    // rasterizer's target, with flat colors. Views go through in groups of
+    // VIEWS_PER_WORKER per worker: a group is culled in one pass and its
+    // batches transformed in one, so many small views keep the whole pool busy
+    // where drawing them one frame at a time would not. Every group but the
+    // last is flushed before the next starts, which keeps its triangles in
+    // cache. Instances are only culled against each view's frustum. lods is
+    // null or holds one selection per view.
+    void drawViews(const MeshView& mesh, const InstanceBuffer& instances, const RenderView* views, size_t viewCount, Rasterizer& rasterizer,
+                   LodSelection* lods = nullptr);
+
+    void setCullMode(CullMode mode) { cullMode = mode; }
+    void setFrontFace(FrontFace face) { frontFace = face; }
+
+    const ClipCullStats& getStats() const { return stats; }
+    void resetStats() { stats = ClipCullStats(); }
+
+private:
+    // Visible instances [begin, end), all drawn at one level of detail in one view
+    struct InstanceBatch {
+        uint32_t begin, end;
+        uint32_t level;
+        uint32_t view;
+    };
+
+    // Scratch space of one thread; batches never share it, so they need no locking
+    struct Workspace {
+        ClipSpaceVertices clip;
+        ClipCullStats stats;
+        // Output of the vertex shader, VARYING_COUNT floats per vertex
+        std::vector<float> varyings;
+    };
+
+    void transformVertices(const MeshView& mesh, const glm::mat4& modelViewProjection);
+    // Culls the instances, groups them into batches and sizes the per-batch
+    // outputs, returns the batch count
+    int prepareInstanceBatches(const MeshView& mesh, const InstanceBuffer& instances, const glm::mat4& viewProjection, Rasterizer& rasterizer,
+                               LodSelection* lods);
+    void drawViewGroup(const MeshView& mesh, const InstanceBuffer& instances, const RenderView* views, size_t viewCount, Rasterizer& rasterizer,
+                       LodSelection* lods);
+    // Sorts the visible instances from begin on by level and adds their batches for view
+    void addInstanceBatches(const MeshView& mesh, size_t begin, const LodSelection* lods, uint32_t view);
+    // Sizes the per-batch outputs, returns the batch count
+    int reserveBatchOutputs();
+    // Transforms and assembles the instances of one batch into its output
+    void drawInstanceBatch(const MeshView& mesh, const InstanceBuffer& instances, int batch, unsigned worker, const glm::mat4& viewProjection,
+                           uint32_t viewport);
+    void submitInstanceBatches(int batchCount, Rasterizer& rasterizer);
+    void assembleFlatTriangles(const MeshView& mesh, const glm::vec3& tint, Workspace& workspace, std::vector<RasterTriangle>& output) const;
+    // Rejects and clips the mesh's triangles and calls
+    // emit(i0, i1, i2, positions, weights) for every triangle that remains, where
+    // weights[k] says how much of each of the vertices i0, i1, i2 corner k is made of
+    template <typename Emit>
+    void assembleTriangles(const MeshView& mesh, Workspace& workspace, const Emit& emit) const;
+    // Perspective division, degenerate and back-face culling. Returns false if the triangle is dropped.
+    bool projectTriangle(const glm::vec4& p0, const glm::vec4& p1, const glm::vec4& p2, ClipCullStats& stats, RasterTriangle& triangle) const;
+
+    ThreadPool& pool;
+    CullMode cullMode = CullMode::Back;
+    FrontFace frontFace = FrontFace::CounterClockwise;
+    ClipCullStats stats;
+
+    // Everything below is reused between draws, so it only grows to the largest draw seen
+    Workspace workspace;
+    std::vector<RasterTriangle> triangles;
+    std::vector<Workspace> workerSpaces;
+    std::vector<std::vector<RasterTriangle>> batchTriangles;
+    std::vector<std::vector<float>> batchVertexData;
+    std::vector<uint32_t> visibleInstances;
+    std::vector<uint32_t> sortedInstances;
+    std::vector<InstanceBatch> instanceBatches;
+    // Per view of a multi-view draw
+    std::vector<std::vector<uint32_t>> viewInstances;
+    std::vector<glm::mat4> viewProjections;
+    std::vector<uint32_t> viewportIds;
+    std::vector<CullView> cullScratch;
+};
+
+// Viewport of view index when count views share a width x height target in a
+// grid of equal cells, filled row by row from the top left of the image
+PixelRect gridViewport(size_t index, size_t count, int width, int height);
+
+// Transforms positions [begin, end) into clip space and computes their outcodes
+void transformPositions(const glm::vec3* positions, size_t begin, size_t end, const glm::mat4& matrix, ClipSpaceVertices& clip);
+
+template <typename Emit>
+void VertexStage::assembleTriangles(const MeshView& mesh, Workspace& workspace, const Emit& emit) const {
+    const ClipSpaceVertices& clip = workspace.clip;
+    ClipCullStats& stats = workspace.stats;
+    const uint32_t* indices = mesh.indices;
+    size_t triangleCount = mesh.triangleCount();
+    stats.trianglesIn += triangleCount;
+
+    const glm::vec3 cornerWeights[3] = { glm::vec3(1.0f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f) };
+
+    for (size_t i = 0; i < triangleCount; ++i) {
+        uint32_t i0 = indices[i * 3];
+        uint32_t i1 = indices[i * 3 + 1];
+        uint32_t i2 = indices[i * 3 + 2];
+
+        // Trivial reject: all three vertices outside the same plane
+        uint8_t code0 = clip.outcode[i0], code1 = clip.outcode[i1], code2 = clip.outcode[i2];
+        if (code0 & code1 & code2 & CLIP_FRUSTUM) {
+            ++stats.frustumRejected;
+            continue;
+        }
+
+        glm::vec4 corners[3] = {
+            glm::vec4(clip.x[i0], clip.y[i0], clip.z[i0], clip.w[i0]),
+            glm::vec4(clip.x[i1], clip.y[i1], clip.z[i1], clip.w[i1]),
+            glm::vec4(clip.x[i2], clip.y[i2], clip.z[i2], clip.w[i2])
+        };
+
+        uint8_t clipPlanes = (code0 | code1 | code2) & CLIP_NEEDS_CLIPPING;
+        if (!clipPlanes) {
+            emit(i0, i1, i2, corners, cornerWeights);
+            continue;
+        }
+
+        ++stats.clipped;
+        ClipVertex polygon[MAX_CLIP_VERTICES];
+        int count = clipTriangle(corners[0], corners[1], corners[2], clipPlanes, polygon);
+        if (count == 0) {
+            ++stats.clippedAway;
+            continue;
+        }
+
+        // The clipped polygon is convex, so a fan keeps the winding
+        for (int k = 1; k + 1 < count; ++k) {
+            glm::vec4 fan[3] = { polygon[0].position, polygon[k].position, polygon[k + 1].position };
+            glm::vec3 weights[3] = { polygon[0].weights, polygon[k].weights, polygon[k + 1].weights };
+            emit(i0, i1, i2, fan, weights);
+        }
+    }
+}
+
+template <typename Shader>
+void VertexStage::drawInstances(const MeshView& mesh, const InstanceBuffer& instances, const glm::mat4& viewProjection, const Shader& shader, Rasterizer& rasterizer,
+                                LodSelection* lods) {
+    const int VARYING_COUNT = ShaderTraits<Shader>::VARYING_COUNT;
+    uint32_t program = rasterizer.bindProgram(makeShaderProgram(shader));
+    int batchCount = prepareInstanceBatches(mesh, instances, viewProjection, rasterizer, lods);
+    size_t vertexCount = mesh.vertexCount();
+
+    pool.parallelFor(batchCount, [&](int batch, unsigned worker) {
+        PROFILE_SCOPE(ProfileStage::None, "Vertex batch");
+        Workspace& space = workerSpaces[worker];
+        if (space.clip.x.size() < vertexCount)
+            space.clip.resize(vertexCount);
+        if (space.varyings.size() < vertexCount * VARYING_COUNT)
+            space.varyings.resize(vertexCount * VARYING_COUNT);
+
+        std::vector<RasterTriangle>& output = batchTriangles[batch];
+        std::vector<float>& vertexData = batchVertexData[batch];
+        output.clear();
+        vertexData.clear();
+
+        // A level only uses the vertices in front of its vertex count
+        const InstanceBatch& range = instanceBatches[batch];
+        MeshView levelMesh = mesh.level(range.level);
+        size_t levelVertexCount = levelMesh.vertexCount();
+        for (size_t i = range.begin; i < range.end; ++i) {
+            uint32_t instance = visibleInstances[i];
+            ShaderInstance shaderInstance = { instances.transforms[instance], instances.colors[instance] };
+            float* varyings = space.varyings.data();
+            {
+                PROFILE_ACCUMULATE(ProfileStage::Transform);
+                transformPositions(mesh.positions, 0, levelVertexCount, viewProjection * shaderInstance.model, space.clip);
+
+                // Vertex shader, once per unique vertex like the position transform
+                for (size_t v = 0; v < levelVertexCount; ++v) {
+                    typename Shader::Varyings out = shader.vertex(mesh, static_cast<uint32_t>(v), shaderInstance);
+                    std::memcpy(varyings + v * VARYING_COUNT, &out, sizeof(out));
+                }
+            }
+
+            PROFILE_ACCUMULATE(ProfileStage::ClipCull);
+
+            assembleTriangles(levelMesh, space, [&](uint32_t i0, uint32_t i1, uint32_t i2, const glm::vec4* corners, const glm::vec3* weights) {
+                RasterTriangle triangle;
+                if (!projectTriangle(corners[0], corners[1], corners[2], space.stats, triangle))
+                    return;
+                triangle.program = program;
+                triangle.varyings = static_cast<uint32_t>(vertexData.size());
+
+                // Clipped corners blend the varyings of the original vertices with
+                // their weights; clip space is before the division, so that is exact
+                const float* source0 = varyings + i0 * VARYING_COUNT;
+                const float* source1 = varyings + i1 * VARYING_COUNT;
+                const float* source2 = varyings + i2 * VARYING_COUNT;
+                for (int k = 0; k < 3; ++k) {
+                    float inverseW = 1.0f / corners[k].w;
+                    vertexData.push_back(inverseW);
+                    for (int n = 0; n < VARYING_COUNT; ++n)
+                        vertexData.push_back((weights[k].x * source0[n] + weights[k].y * source1[n] + weights[k].z * source2[n]) * inverseW);
+                }
+                output.push_back(triangle);
+            });
+        }
+    });
+
+    submitInstanceBatches(batchCount, rasterizer);
+}